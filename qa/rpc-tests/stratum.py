@@ -0,0 +1,194 @@
+#!/usr/bin/env python
+# Copyright (c) 2014 The Gapcoin developers
+# Distributed under the MIT/X11 software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+# Exercise the work server (-stratum) with a stand-in miner
+
+# Add python-gapcoinrpc to module search path:
+import os
+import sys
+sys.path.append(os.path.join(os.path.dirname(os.path.abspath(__file__)), "python-gapcoinrpc"))
+
+import binascii
+import hashlib
+import json
+import shutil
+import socket
+import struct
+import subprocess
+import tempfile
+import traceback
+
+from gapcoinrpc.authproxy import AuthServiceProxy, JSONRPCException
+from util import *
+
+START_STRATUM_PORT=11200
+
+def sha256d(data):
+    return hashlib.sha256(hashlib.sha256(data).digest()).digest()
+
+class StratumClient(object):
+    """Just enough of a miner to talk to the work server"""
+
+    def __init__(self, port):
+        self.sock = socket.create_connection(("127.0.0.1", port), 30)
+        self.reader = self.sock.makefile("r")
+        self.next_id = 1
+        self.notifications = []
+
+    def read(self):
+        line = self.reader.readline()
+        if not line:
+            raise AssertionError("work server closed the connection")
+        return json.loads(line)
+
+    def request(self, method, params):
+        request_id = self.next_id
+        self.next_id += 1
+        self.sock.sendall((json.dumps({"id": request_id, "method": method, "params": params})+"\n").encode())
+        while True:
+            message = self.read()
+            if message.get("id") == request_id:
+                return message
+            self.notifications.append(message)
+
+    def wait_notification(self, method):
+        while True:
+            for message in self.notifications:
+                if message["method"] == method:
+                    self.notifications.remove(message)
+                    return message["params"]
+            self.notifications.append(self.read())
+
+    def close(self):
+        self.sock.close()
+
+def build_header(job, extranonce1, extranonce2, nonce):
+    """The 84 header bytes the block hash is taken over, see CBlockHeader::GetHash"""
+    (job_id, prevhash, coinbase1, coinbase2, branch, version, difficulty, ntime, clean) = job
+    coinbase = binascii.unhexlify(coinbase1 + extranonce1 + extranonce2 + coinbase2)
+    merkle_root = sha256d(coinbase)
+    for h in branch:
+        merkle_root = sha256d(merkle_root + binascii.unhexlify(h))
+    return (struct.pack("<i", int(version, 16)) + binascii.unhexlify(prevhash) + merkle_root +
+            struct.pack("<IQI", int(ntime, 16), int(difficulty, 16), nonce))
+
+def find_nonce(job, extranonce1, extranonce2):
+    """A nonce whose header hash is above 2^255 - 1, as the proof of work requires"""
+    nonce = 0
+    while not ord(sha256d(build_header(job, extranonce1, extranonce2, nonce))[31:32]) & 0x80:
+        nonce += 1
+    return nonce
+
+def assert_error(reply, code):
+    if reply["error"] is None or reply["error"][0] != code:
+        raise AssertionError("expected error %d, got %s"%(code, str(reply)))
+
+def run_test(nodes):
+    node = nodes[0]
+    client = StratumClient(START_STRATUM_PORT)
+
+    reply = client.request("mining.subscribe", [])
+    assert_equal(reply["error"], None)
+    (subscriptions, extranonce1, extranonce2_size) = reply["result"]
+    assert_equal(extranonce2_size, 4)
+    assert_equal(len(extranonce1), 8)
+
+    # the share difficulty and the current job are pushed right away
+    client.wait_notification("mining.set_difficulty")
+    job = client.wait_notification("mining.notify")
+    assert_equal(job[8], True)
+    assert_equal(binascii.hexlify(binascii.unhexlify(job[1])[::-1]).decode(), node.getbestblockhash())
+
+    # shares need an authorized worker
+    extranonce2 = "00000000"
+    nonce = find_nonce(job, extranonce1, extranonce2)
+    share = [job[0], extranonce2, job[7], "%08x"%nonce, 25, "00"]
+    assert_error(client.request("mining.submit", ["nobody"] + share), 24)
+    assert_equal(client.request("mining.authorize", ["worker1", "x"])["result"], True)
+
+    # hash * 2^25 is even, far from a prime gap; then the same share again
+    assert_error(client.request("mining.submit", ["worker1"] + share), 23)
+    assert_error(client.request("mining.submit", ["worker1"] + share), 22)
+    assert_error(client.request("mining.submit", ["worker1", "nosuchjob"] + share[1:]), 21)
+
+    # a new tip is pushed without asking, and drops the old jobs
+    node.setgenerate(True, 1)
+    job = client.wait_notification("mining.notify")
+    assert_equal(job[8], True)
+    assert_equal(binascii.hexlify(binascii.unhexlify(job[1])[::-1]).decode(), node.getbestblockhash())
+    assert_error(client.request("mining.submit", ["worker1"] + share), 21)
+
+    info = node.getstratuminfo()
+    assert_equal(info["port"], START_STRATUM_PORT)
+    assert_equal(info["connections"], 1)
+    assert_equal(info["height"], node.getblockcount() + 1)
+    assert_equal(len(info["workers"]), 1)
+    worker = info["workers"][0]
+    assert_equal(worker["name"], "worker1")
+    assert_equal(worker["accepted"], 0)
+    assert_equal(worker["rejected"], 2)
+    assert_equal(worker["stale"], 2)
+    assert_equal(worker["blocks"], 0)
+
+    client.close()
+
+def main():
+    import optparse
+
+    parser = optparse.OptionParser(usage="%prog [options]")
+    parser.add_option("--nocleanup", dest="nocleanup", default=False, action="store_true",
+                      help="Leave gapcoinds and test.* datadir on exit or error")
+    parser.add_option("--srcdir", dest="srcdir", default="../../src",
+                      help="Source directory containing gapcoind/gapcoin-cli (default: %default%)")
+    parser.add_option("--tmpdir", dest="tmpdir", default=tempfile.mkdtemp(prefix="test"),
+                      help="Root directory for datadirs")
+    (options, args) = parser.parse_args()
+
+    os.environ['PATH'] = options.srcdir+":"+os.environ['PATH']
+
+    check_json_precision()
+
+    success = False
+    nodes = []
+    try:
+        print("Initializing test directory "+options.tmpdir)
+        if not os.path.isdir(options.tmpdir):
+            os.makedirs(options.tmpdir)
+        initialize_chain(options.tmpdir)
+
+        # the work server needs an address to pay to before it starts
+        nodes = start_nodes(1, options.tmpdir)
+        address = nodes[0].getnewaddress()
+        stop_nodes(nodes)
+        wait_gapcoinds()
+
+        nodes = start_nodes(1, options.tmpdir, [[ "-stratum", "-stratumport="+str(START_STRATUM_PORT),
+                                                  "-stratumaddress="+address, "-stratumdifficulty=1" ]])
+
+        run_test(nodes)
+
+        success = True
+
+    except AssertionError as e:
+        print("Assertion failed: "+str(e))
+    except Exception as e:
+        print("Unexpected exception caught during testing: "+str(e))
+        traceback.print_tb(sys.exc_info()[2])
+
+    if not options.nocleanup:
+        print("Cleaning up")
+        stop_nodes(nodes)
+        wait_gapcoinds()
+        shutil.rmtree(options.tmpdir)
+
+    if success:
+        print("Tests successful")
+        sys.exit(0)
+    else:
+        print("Failed")
+        sys.exit(1)
+
+if __name__ == '__main__':
+    main()
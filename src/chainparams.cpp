@@ -47,6 +47,7 @@ public:
         vAlertPubKey = ParseHex("04a6395c1468b52d9fd79a1092f0fe223ae8e0704bd440630ccac26b05c8d4f7f7836c4d811f915ad8000c1c171619850608e03b93ddfe4a324494c9c5b68f0993"); 
         nDefaultPort = 31469;
         nRPCPort = 31397;
+        nStratumPort = 31398;
         nSubsidyHalvingInterval = 420000;
 
         const char* pszTimestamp = "The Times 15/Oct/2014 US data sends global stocks into tail-spin";
@@ -123,6 +124,7 @@ public:
         vAlertPubKey = ParseHex("04f122609fbdbf62e4cb5392845b7a60d22b74d075e5bb1bcc296814f720e41ad44486b57aa9c4cb758d6ac6f0c703407dcc64ed000bb7367d8c6c5bbe8b582f0f");
         nDefaultPort = 19661;
         nRPCPort = 19609;
+        nStratumPort = 19610;
         strDataDir = "testnet3";
 
         // Modify the testnet genesis block so the timestamp is valid for a later start.
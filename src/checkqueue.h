@@ -6,6 +6,7 @@
 #define CHECKQUEUE_H
 
 #include <algorithm>
+#include <deque>
 #include <vector>
 
 #include <boost/foreach.hpp>
@@ -15,6 +16,15 @@
 
 template<typename T> class CCheckQueueControl;
 
+/** Run a worker's batch of checks, false if any fails. Check types can
+  * overload this to do work for the batch as a whole. */
+template<typename T> bool RunChecks(std::vector<T> &vChecks) {
+    BOOST_FOREACH(T &check, vChecks)
+        if (!check())
+            return false;
+    return true;
+}
+
 /** Queue for verifications that have to be performed.
   * The verifications are represented by a type T, which must provide an
   * operator(), returning a bool.
@@ -23,9 +33,21 @@ template<typename T> class CCheckQueueControl;
   * onto the queue, where they are processed by N-1 worker threads. When
   * the master is done adding work, it temporarily joins the worker pool
   * as an N'th worker, until all jobs are done.
+  *
+  * Every thread has a deque of its own, which Add() deals the checks out
+  * to. A thread works from the back of its deque and, once that is empty,
+  * steals from the front of the others, so the shared lock is only taken
+  * once per batch to count the work done, never to hand work out.
   */
 template<typename T> class CCheckQueue {
 private:
+    // A thread's share of the checks, with its own lock so that owner and
+    // thieves only contend with each other
+    struct CWorkerQueue {
+        boost::mutex mutex;
+        std::deque<T> queue;
+    };
+
     // Mutex to protect the inner state
     boost::mutex mutex;
 
@@ -35,120 +57,162 @@ private:
     // Master thread blocks on this when out of work
     boost::condition_variable condMaster;
 
-    // The queue of elements to be processed.
-    // As the order of booleans doesn't matter, it is used as a LIFO (stack)
-    std::vector<T> queue;
+    // Slot 0 is the master's, the workers take the others as they start.
+    // The vector itself never changes after construction.
+    std::vector<CWorkerQueue*> vQueues;
 
-    // The number of workers (including the master) that are idle.
-    int nIdle;
-
-    // The total number of workers (including the master).
-    int nTotal;
+    // The number of workers (excluding the master) that have started.
+    int nWorkers;
 
     // The temporary evaluation result.
     bool fAllOk;
 
     // Number of verifications that haven't completed yet.
-    // This includes elements that are not anymore in queue, but still in
-    // worker's own batches.
+    // This includes elements that are not anymore in a queue, but still in
+    // a thread's own batch.
     unsigned int nTodo;
 
-    // Whether we're shutting down.
-    bool fQuit;
+    // Bumped by every Add(), so a thread that found no work can tell
+    // whether some arrived while it was looking
+    unsigned int nAdded;
+
+    // The slot the next Add() starts dealing to
+    unsigned int nNextSlot;
 
     // The maximum number of elements to be processed in one batch
     unsigned int nBatchSize;
 
+    // Move up to nBatchSize checks into vChecks: half of what is left in
+    // our own deque, or else half of the first other deque that has any.
+    // Leaving half behind gives idle threads something to steal.
+    bool Take(unsigned int nSlot, std::vector<T> &vChecks) {
+        for (unsigned int i = 0; i < vQueues.size(); i++) {
+            bool fOwn = (i == 0);
+            CWorkerQueue &wq = *vQueues[(nSlot + i) % vQueues.size()];
+            boost::unique_lock<boost::mutex> lock(wq.mutex);
+            if (wq.queue.empty())
+                continue;
+            unsigned int nNow = std::min(nBatchSize, ((unsigned int)wq.queue.size() + 1) / 2);
+            vChecks.resize(nNow);
+            for (unsigned int j = 0; j < nNow; j++) {
+                // swap rather than copy, to keep the lock short
+                if (fOwn) {
+                    vChecks[j].swap(wq.queue.back());
+                    wq.queue.pop_back();
+                } else {
+                    vChecks[j].swap(wq.queue.front());
+                    wq.queue.pop_front();
+                }
+            }
+            return true;
+        }
+        return false;
+    }
+
     // Internal function that does bulk of the verification work.
-    bool Loop(bool fMaster = false) {
+    bool Loop(unsigned int nSlot, bool fMaster) {
         boost::condition_variable &cond = fMaster ? condMaster : condWorker;
         std::vector<T> vChecks;
         vChecks.reserve(nBatchSize);
         unsigned int nNow = 0;
+        unsigned int nAddedSeen;
         bool fOk = true;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            nAddedSeen = nAdded;
+        }
         do {
-            {
+            if (nNow) {
                 boost::unique_lock<boost::mutex> lock(mutex);
-                // first do the clean-up of the previous loop run (allowing us to do it in the same critsect)
-                if (nNow) {
-                    fAllOk &= fOk;
-                    nTodo -= nNow;
-                    if (nTodo == 0 && !fMaster)
-                        // We processed the last element; inform the master he can exit and return the result
-                        condMaster.notify_one();
-                } else {
-                    // first iteration
-                    nTotal++;
-                }
-                // logically, the do loop starts here
-                while (queue.empty()) {
-                    if ((fMaster || fQuit) && nTodo == 0) {
-                        nTotal--;
+                fAllOk &= fOk;
+                nTodo -= nNow;
+                if (nTodo == 0 && !fMaster)
+                    // We processed the last element; inform the master he can exit and return the result
+                    condMaster.notify_one();
+                nAddedSeen = nAdded;
+                // Check whether we need to do work at all
+                fOk = fAllOk;
+                nNow = 0;
+            }
+            if (!Take(nSlot, vChecks)) {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                // Nothing left in any deque, and nothing added since we
+                // started looking: wait for more
+                while (nAdded == nAddedSeen) {
+                    if (fMaster && nTodo == 0) {
                         bool fRet = fAllOk;
                         // reset the status for new work later
-                        if (fMaster)
-                            fAllOk = true;
+                        fAllOk = true;
                         // return the current status
                         return fRet;
                     }
-                    nIdle++;
                     cond.wait(lock); // wait
-                    nIdle--;
-                }
-                // Decide how many work units to process now.
-                // * Do not try to do everything at once, but aim for increasingly smaller batches so
-                //   all workers finish approximately simultaneously.
-                // * Try to account for idle jobs which will instantly start helping.
-                // * Don't do batches smaller than 1 (duh), or larger than nBatchSize.
-                nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.size() / (nTotal + nIdle + 1)));
-                vChecks.resize(nNow);
-                for (unsigned int i = 0; i < nNow; i++) {
-                     // We want the lock on the mutex to be as short as possible, so swap jobs from the global
-                     // queue to the local batch vector instead of copying.
-                     vChecks[i].swap(queue.back());
-                     queue.pop_back();
                 }
-                // Check whether we need to do work at all
+                nAddedSeen = nAdded;
                 fOk = fAllOk;
+                continue;
             }
+            nNow = vChecks.size();
             // execute work
-            BOOST_FOREACH(T &check, vChecks)
-                if (fOk)
-                    fOk = check();
+            if (fOk)
+                fOk = RunChecks(vChecks);
             vChecks.clear();
         } while(true);
     }
 
 public:
-    // Create a new check queue
-    CCheckQueue(unsigned int nBatchSizeIn) :
-        nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn) {}
+    // Create a new check queue, with room for nMaxWorkers threads of their own
+    CCheckQueue(unsigned int nBatchSizeIn, unsigned int nMaxWorkers = 64) :
+        nWorkers(0), fAllOk(true), nTodo(0), nAdded(0), nNextSlot(0), nBatchSize(nBatchSizeIn) {
+        for (unsigned int i = 0; i <= nMaxWorkers; i++)
+            vQueues.push_back(new CWorkerQueue());
+    }
 
     // Worker thread
     void Thread() {
-        Loop();
+        unsigned int nSlot;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            // Workers beyond nMaxWorkers share a slot, which is still correct
+            nSlot = 1 + nWorkers++ % (vQueues.size() - 1);
+        }
+        Loop(nSlot, false);
     }
 
     // Wait until execution finishes, and return whether all evaluations where succesful.
     bool Wait() {
-        return Loop(true);
+        return Loop(0, true);
     }
 
     // Add a batch of checks to the queue
     void Add(std::vector<T> &vChecks) {
+        if (vChecks.empty())
+            return;
         boost::unique_lock<boost::mutex> lock(mutex);
-        BOOST_FOREACH(T &check, vChecks) {
-            queue.push_back(T());
-            check.swap(queue.back());
+        // Deal the checks out in even runs over the slots of the threads
+        // that are running, starting where the last Add() stopped so that a
+        // block's many small Add()s spread out too
+        unsigned int nSlots = std::min((unsigned int)nWorkers + 1, (unsigned int)vQueues.size());
+        unsigned int nRun = ((unsigned int)vChecks.size() + nSlots - 1) / nSlots;
+        for (unsigned int i = 0; i < vChecks.size(); i += nRun) {
+            CWorkerQueue &wq = *vQueues[nNextSlot++ % nSlots];
+            boost::unique_lock<boost::mutex> lockQueue(wq.mutex);
+            for (unsigned int j = i; j < std::min(i + nRun, (unsigned int)vChecks.size()); j++) {
+                wq.queue.push_back(T());
+                vChecks[j].swap(wq.queue.back());
+            }
         }
         nTodo += vChecks.size();
+        nAdded++;
         if (vChecks.size() == 1)
             condWorker.notify_one();
-        else if (vChecks.size() > 1)
+        else
             condWorker.notify_all();
     }
 
     ~CCheckQueue() {
+        BOOST_FOREACH(CWorkerQueue *pwq, vQueues)
+            delete pwq;
     }
 
     friend class CCheckQueueControl<T>;
@@ -166,7 +230,6 @@ public:
     CCheckQueueControl(CCheckQueue<T> *pqueueIn) : pqueue(pqueueIn), fDone(false) {
         // passed queue is supposed to be unused, or NULL
         if (pqueue != NULL) {
-            assert(pqueue->nTotal == pqueue->nIdle);
             assert(pqueue->nTodo == 0);
             assert(pqueue->fAllOk == true);
         }
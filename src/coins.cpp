@@ -179,8 +179,10 @@ bool CCoinsViewCache::HaveInputs(const CTransaction& tx)
     return true;
 }
 
-double CCoinsViewCache::GetPriority(const CTransaction &tx, int nHeight)
+double CCoinsViewCache::GetPriority(const CTransaction &tx, int nHeight, int64_t* pnInChainValue)
 {
+    if (pnInChainValue)
+        *pnInChainValue = 0;
     if (tx.IsCoinBase())
         return 0.0;
     double dResult = 0.0;
@@ -191,6 +193,8 @@ double CCoinsViewCache::GetPriority(const CTransaction &tx, int nHeight)
         if (coins.nHeight < nHeight) {
             dResult += coins.vout[txin.prevout.n].nValue * (nHeight-coins.nHeight);
         }
+        if (pnInChainValue && coins.nHeight <= nHeight)
+            *pnInChainValue += coins.vout[txin.prevout.n].nValue;
     }
     return tx.ComputePriority(dResult);
 }
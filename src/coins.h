@@ -346,8 +346,9 @@ public:
     // Check whether all prevouts of the transaction are present in the UTXO set represented by this view
     bool HaveInputs(const CTransaction& tx);
 
-    // Return priority of tx at height nHeight
-    double GetPriority(const CTransaction &tx, int nHeight);
+    // Return priority of tx at height nHeight; pnInChainValue, if given, is set
+    // to the value of the inputs that are in the chain rather than the mempool
+    double GetPriority(const CTransaction &tx, int nHeight, int64_t* pnInChainValue = NULL);
 
     const CTxOut &GetOutputFor(const CTxIn& input);
 
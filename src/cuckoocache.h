@@ -0,0 +1,106 @@
+// Copyright (c) 2014 The Gapcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef GAPCOIN_CUCKOOCACHE_H
+#define GAPCOIN_CUCKOOCACHE_H
+
+#include "uint256.h"
+
+#include <algorithm>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+/**
+ * Fixed size set of 256-bit digests, for caches that may forget an element
+ * now and then. A digest can be stored in one of eight slots picked by its
+ * eight 32-bit words, so digests must be uniformly distributed already,
+ * e.g. salted hashes. When all eight are taken, the digest displaces one
+ * and the displaced digest moves on to another of its own slots; after a
+ * few moves the one left over is dropped.
+ *
+ * Contains() doesn't modify the table, so readers can share a lock while
+ * Insert() needs it to themselves. The null digest stands for an empty slot
+ * and is never stored.
+ */
+class CCuckooCache
+{
+private:
+    std::vector<uint256> vTable;
+    unsigned int nMaxDepth;
+
+    void GetSlots(const uint256& digest, uint32_t pnSlots[8]) const
+    {
+        uint32_t pnWords[8];
+        memcpy(pnWords, digest.begin(), sizeof(pnWords));
+        // Maps a word to [0, size) without a division
+        for (int i = 0; i < 8; i++)
+            pnSlots[i] = (uint32_t)(((uint64_t)pnWords[i] * vTable.size()) >> 32);
+    }
+
+public:
+    CCuckooCache() : nMaxDepth(0) {}
+
+    /** Empty the cache and size it to as many digests as fit in nBytes; returns that number */
+    size_t Setup(size_t nBytes)
+    {
+        size_t nSlots = std::max(nBytes / sizeof(uint256), (size_t)1);
+        nSlots = std::min(nSlots, (size_t)0xffffffff);
+        vTable.assign(nSlots, uint256());
+        // Moves grow more useless as the table fills; stop after about log2(slots)
+        nMaxDepth = 1;
+        while ((nSlots >> nMaxDepth) > 0)
+            nMaxDepth++;
+        return nSlots;
+    }
+
+    size_t Size() const { return vTable.size(); }
+
+    bool Contains(const uint256& digest) const
+    {
+        if (vTable.empty() || digest == 0)
+            return false;
+        uint32_t pnSlots[8];
+        GetSlots(digest, pnSlots);
+        for (int i = 0; i < 8; i++)
+            if (vTable[pnSlots[i]] == digest)
+                return true;
+        return false;
+    }
+
+    /** Add digest; returns false if that dropped another digest */
+    bool Insert(const uint256& digest)
+    {
+        if (vTable.empty() || digest == 0 || Contains(digest))
+            return true;
+
+        uint256 element = digest;
+        uint32_t nLastSlot = 0xffffffff;
+        for (unsigned int nDepth = 0; nDepth < nMaxDepth; nDepth++)
+        {
+            uint32_t pnSlots[8];
+            GetSlots(element, pnSlots);
+            for (int i = 0; i < 8; i++)
+            {
+                if (vTable[pnSlots[i]] == 0)
+                {
+                    vTable[pnSlots[i]] = element;
+                    return true;
+                }
+            }
+
+            // All taken: displace the digest in the slot after the one this
+            // element was displaced from, so it doesn't just swap back
+            int nNext = 0;
+            for (int i = 0; i < 8; i++)
+                if (pnSlots[i] == nLastSlot)
+                    nNext = (i + 1) % 8;
+            nLastSlot = pnSlots[nNext];
+            std::swap(vTable[nLastSlot], element);
+        }
+        return false;
+    }
+};
+
+#endif // GAPCOIN_CUCKOOCACHE_H
@@ -0,0 +1,502 @@
+// Copyright (c) 2014 The Gapcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "gapsieve.h"
+
+#include "miningstats.h"
+#include "util.h"
+#include "PoWCore/src/PoW.h"
+#include "PoWCore/src/PoWProcessor.h"
+
+#include <math.h>
+#include <string.h>
+
+using namespace std;
+
+/** mpz_t which is cleared when it goes out of scope */
+class CAutoMpz
+{
+public:
+    mpz_t z;
+
+    CAutoMpz() { mpz_init(z); }
+    ~CAutoMpz() { mpz_clear(z); }
+};
+
+// rop = op + n, also for adders that do not fit an unsigned long
+static void mpz_add_u64(mpz_t rop, const mpz_t op, uint64_t n)
+{
+    mpz_set_ui(rop, (unsigned long)(n >> 32));
+    mpz_mul_2exp(rop, rop, 32);
+    mpz_add_ui(rop, rop, (unsigned long)(n & 0xffffffff));
+    mpz_add(rop, rop, op);
+}
+
+// Fermat test to base 2
+static bool FermatTest(const mpz_t mpzCandidate, mpz_t mpzExp, mpz_t mpzResult)
+{
+    mpz_sub_ui(mpzExp, mpzCandidate, 1);
+    mpz_set_ui(mpzResult, 2);
+    mpz_powm(mpzResult, mpzResult, mpzExp, mpzCandidate);
+    return (mpz_cmp_ui(mpzResult, 1) == 0);
+}
+
+// Indexes of up to nMax clear bits of vSieve from i on and below nBits,
+// a word at a time; i is moved behind the last one
+static size_t ExtractCandidates(const vector<uint32_t>& vSieve, uint64_t& i, uint64_t nBits,
+                                uint32_t* vIndexes, size_t nMax)
+{
+    size_t n = 0;
+    while (n < nMax && i < nBits)
+    {
+        const uint64_t nWordStart = i & ~((uint64_t) 31);
+        uint32_t nWord = ~vSieve[i >> 5] & (0xffffffffU << (i & 31));
+        if (nBits - nWordStart < 32)
+            nWord &= (1U << (nBits - nWordStart)) - 1;
+
+        while (nWord != 0 && n < nMax)
+        {
+            vIndexes[n++] = (uint32_t) (nWordStart + __builtin_ctz(nWord));
+            nWord &= nWord - 1;
+        }
+
+        i = (nWord != 0) ? nWordStart + __builtin_ctz(nWord) : nWordStart + 32;
+    }
+    i = min(i, nBits);
+    return n;
+}
+
+// Move i down to the highest clear bit of vSieve in [nLow, i), if there is one
+static bool PrevCandidate(const vector<uint32_t>& vSieve, uint64_t nLow, uint64_t& i)
+{
+    while (i > nLow)
+    {
+        const uint64_t nWordStart = (i - 1) & ~((uint64_t) 31);
+        const unsigned int nTop   = (unsigned int) ((i - 1) & 31);
+        uint32_t nWord = ~vSieve[(i - 1) >> 5] & ((nTop == 31) ? 0xffffffffU : (2U << nTop) - 1);
+        if (nWordStart < nLow)
+            nWord &= ~((1U << (nLow - nWordStart)) - 1);
+
+        if (nWord != 0)
+        {
+            i = nWordStart + 31 - __builtin_clz(nWord);
+            return true;
+        }
+        i = nWordStart;
+    }
+    return false;
+}
+
+static unsigned int CountCandidates(const vector<uint32_t>& vSieve, uint64_t nBits)
+{
+    unsigned int n = 0;
+    for (uint64_t i = 0; i < nBits / 32; i++)
+        n += __builtin_popcount(~vSieve[i]);
+    if (nBits % 32)
+        n += __builtin_popcount(~vSieve[nBits / 32] & ((1U << (nBits % 32)) - 1));
+    return n;
+}
+
+CSievePrimes::CSievePrimes(uint64_t nPrimes)
+{
+    // p_n < n (ln n + ln ln n) for n >= 6
+    double n = max((double) nPrimes, 6.0);
+    uint64_t nLimit = (uint64_t) (n * (log(n) + log(log(n)))) + 1;
+
+    vector<bool> vComposite(nLimit + 1, false);
+    vPrimes.reserve(nPrimes);
+    for (uint64_t i = 2; i <= nLimit && vPrimes.size() < nPrimes; i++)
+    {
+        if (vComposite[i])
+            continue;
+
+        vPrimes.push_back((uint32_t) i);
+        for (uint64_t j = i * i; j <= nLimit; j += i)
+            vComposite[j] = true;
+    }
+
+    nWheelPrimes = 0;
+    nWheelPeriod = 1;
+    while (nWheelPrimes + 1 < vPrimes.size() && vPrimes[nWheelPrimes + 1] <= SIEVE_WHEEL_MAX_PRIME)
+        nWheelPeriod *= vPrimes[++nWheelPrimes];
+
+    vWheel.assign(nWheelPeriod, 0);
+    for (uint32_t j = 0; j < 32 * nWheelPeriod; j++)
+        for (size_t k = 1; k <= nWheelPrimes; k++)
+            if (j % vPrimes[k] == 0)
+            {
+                vWheel[j >> 5] |= 1U << (j & 31);
+                break;
+            }
+}
+
+void CSievePrimes::ApplyWheel(const vector<uint32_t>& vResidues, uint64_t nStart, uint64_t nBits,
+                              vector<uint32_t>& vSieve) const
+{
+    const size_t nWords = (nBits + 31) / 32;
+    vSieve.resize(nWords);
+
+    // Find c with bit i composite iff a wheel prime divides i + c, that is
+    // c = -(first multiple of p in the window) mod p for each wheel prime p
+    uint64_t c = 0, m = 1;
+    for (size_t k = 1; k <= nWheelPrimes; k++)
+    {
+        const uint64_t p = vPrimes[k];
+        const uint64_t x = (vResidues[k] + nStart % p + 1) % p;
+        const uint64_t nFirst = ((p - x) % p) * ((p + 1) / 2) % p;
+        while ((c + nFirst) % p != 0)
+            c += m;
+        m *= p;
+    }
+
+    // the one of the 32 periods where the phase is word aligned
+    while (c % 32 != 0)
+        c += nWheelPeriod;
+
+    size_t nWord = (size_t) (c / 32), n = 0;
+    while (n < nWords)
+    {
+        size_t nCopy = min(nWords - n, (size_t) nWheelPeriod - nWord);
+        memcpy(&vSieve[n], &vWheel[nWord], nCopy * sizeof(uint32_t));
+        n += nCopy;
+        nWord = 0;
+    }
+}
+
+void SieveWindow(const CSievePrimes& primes, const vector<uint32_t>& vResidues,
+                 uint64_t nStart, uint64_t nBits, vector<uint32_t>& vSieve,
+                 size_t nPrimesEnd)
+{
+    primes.ApplyWheel(vResidues, nStart, nBits, vSieve);
+
+    // only odd numbers are in the sieve, so skip 2 and the wheel
+    nPrimesEnd = min(nPrimesEnd, primes.size());
+    for (size_t k = 1 + primes.GetWheelPrimes(); k < nPrimesEnd; k++)
+    {
+        const uint64_t p = primes[k];
+
+        // first i with nBase + nStart + 2 * i + 1 = 0 (mod p)
+        const uint64_t x = (vResidues[k] + nStart % p + 1) % p;
+        uint64_t i = ((p - x) % p) * ((p + 1) / 2) % p;
+
+        for (; i < nBits; i += p)
+            vSieve[i >> 5] |= 1U << (i & 31);
+    }
+}
+
+uint64_t GetTargetGapSize(const mpz_t mpzStart, uint64_t nDifficulty)
+{
+    long nExp;
+    double d = mpz_get_d_2exp(&nExp, mpzStart);
+    double dLog = log(d) + nExp * log(2.0);
+
+    // nDifficulty is the merit as fixed point number with 48 fraction bits
+    double dMerit = (double) nDifficulty / (double) (((uint64_t) 1) << 48);
+
+    return (uint64_t) ceil(dMerit * dLog);
+}
+
+CSharedSieve::CSharedSieve(uint64_t nPrimes, uint64_t nSegmentSizeIn) :
+    primes(nPrimes), nShift(0), nDifficulty(0), nSieveSize(0), nTargetGap(0), dPrimeDensity(0.0), pprocessor(NULL),
+    nSegments(0), nResidueChunks(0), nResidueDone(0), nItems(0), nNextItem(0), nPending(0), fAbort(false),
+    nRoundTests(0), nRoundPrimes(0), nRoundStart(0), dPrimesPerSec(0.0), dTestsPerSec(0.0)
+{
+    // segments start at even adders
+    nSegmentSize = max((uint64_t) 2, nSegmentSizeIn & ~((uint64_t) 1));
+    vResidues.resize(primes.size());
+
+    nBucketPrime = 1 + primes.GetWheelPrimes();
+    while (nBucketPrime < primes.size() && primes[nBucketPrime] < nSegmentSize / 2)
+        nBucketPrime++;
+    mpz_init(mpzBase);
+}
+
+CSharedSieve::~CSharedSieve()
+{
+    mpz_clear(mpzBase);
+}
+
+void CSharedSieve::Start(const uint256& hashIn, uint16_t nShiftIn, uint64_t nDifficultyIn,
+                         uint64_t nSieveSizeIn, PoWProcessor *pprocessorIn)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    assert(nPending == 0);
+
+    hash        = hashIn;
+    nShift      = nShiftIn;
+    nDifficulty = nDifficultyIn;
+    pprocessor  = pprocessorIn;
+
+    // start = hash * 2^shift + adder, with adder < 2^shift
+    mpz_import(mpzBase, hash.size(), -1, sizeof(uint8_t), 0, 0, hash.begin());
+    mpz_mul_2exp(mpzBase, mpzBase, nShift);
+
+    nSieveSize = nSieveSizeIn;
+    if (nShift < 64 && nSieveSize > (((uint64_t) 1) << nShift))
+        nSieveSize = (((uint64_t) 1) << nShift);
+    nSieveSize &= ~((uint64_t) 1);
+
+    nTargetGap = max((uint64_t) 2, GetTargetGapSize(mpzBase, nDifficulty));
+
+    // about one in ln(start) numbers is prime
+    long nExp;
+    double d = mpz_get_d_2exp(&nExp, mpzBase);
+    dPrimeDensity = 1.0 / (log(d) + nExp * log(2.0));
+
+    nSegments      = (unsigned int) ((nSieveSize + nSegmentSize - 1) / nSegmentSize);
+    nResidueChunks = (primes.size() + SIEVE_RESIDUE_CHUNK - 1) / SIEVE_RESIDUE_CHUNK;
+    vBuckets.resize((size_t) nResidueChunks * nSegments);
+    nResidueDone   = 0;
+    nItems         = nResidueChunks + nSegments;
+    nNextItem      = 0;
+    nPending       = nItems;
+    fAbort         = false;
+
+    nRoundTests  = 0;
+    nRoundPrimes = 0;
+    nRoundStart  = GetTimeMicros();
+
+    condWorker.notify_all();
+}
+
+void CSharedSieve::Wait()
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (nPending > 0)
+        condMaster.wait(lock);
+
+    int64_t nElapsed = GetTimeMicros() - nRoundStart;
+    if (!fAbort && nElapsed > 0)
+    {
+        dPrimesPerSec = nRoundPrimes * 1000000.0 / nElapsed;
+        dTestsPerSec  = nRoundTests  * 1000000.0 / nElapsed;
+    }
+}
+
+void CSharedSieve::Abort()
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    fAbort = true;
+
+    // drop the work items nobody claimed yet
+    nPending -= nItems - nNextItem;
+    nNextItem = nItems;
+
+    condWorker.notify_all();
+    if (nPending == 0)
+        condMaster.notify_all();
+}
+
+// Bits of the window of a segment, gaps starting in it may end up to nTargetGap behind it
+uint64_t CSharedSieve::GetWindowBits(unsigned int nSegment) const
+{
+    const uint64_t nStart = (uint64_t) nSegment * nSegmentSize;
+    const uint64_t nEnd   = min(nStart + nSegmentSize, nSieveSize);
+    return (nEnd - nStart + nTargetGap + 1) / 2;
+}
+
+void CSharedSieve::ComputeResidues(unsigned int nChunk)
+{
+    const size_t nBegin = (size_t) nChunk * SIEVE_RESIDUE_CHUNK;
+    const size_t nEnd   = min(primes.size(), nBegin + SIEVE_RESIDUE_CHUNK);
+    for (size_t k = nBegin; k < nEnd; k++)
+        vResidues[k] = mpz_fdiv_ui(mpzBase, primes[k]);
+
+    std::vector<uint32_t>* pBuckets = &vBuckets[(size_t) nChunk * nSegments];
+    for (unsigned int nSegment = 0; nSegment < nSegments; nSegment++)
+        pBuckets[nSegment].clear();
+
+    // bit g of the whole sieve is bit g - t * nSegmentBits of segment t
+    const uint64_t nSegmentBits = nSegmentSize / 2;
+    const uint64_t nTotalBits   = (nSegments - 1) * nSegmentBits + GetWindowBits(nSegments - 1);
+    for (size_t k = max(nBegin, nBucketPrime); k < nEnd; k++)
+    {
+        const uint64_t p = primes[k];
+        const uint64_t x = (vResidues[k] + 1) % p;
+        for (uint64_t g = ((p - x) % p) * ((p + 1) / 2) % p; g < nTotalBits; g += p)
+        {
+            // windows reach into the segments behind them
+            for (unsigned int t = (unsigned int) min(g / nSegmentBits, (uint64_t) nSegments - 1); ; t--)
+            {
+                const uint64_t nOffset = g - t * nSegmentBits;
+                if (nOffset >= GetWindowBits(t))
+                    break;
+                pBuckets[t].push_back((uint32_t) nOffset);
+                if (t == 0)
+                    break;
+            }
+        }
+    }
+}
+
+void CSharedSieve::Submit(uint64_t nAdder, CMiningThreadStats* pstats)
+{
+    vector<uint8_t> vHash(hash.begin(), hash.end());
+
+    // little endian, like CBlockHeader::nAdd
+    vector<uint8_t> vAdder;
+    for (uint64_t n = nAdder; n > 0; n >>= 8)
+        vAdder.push_back((uint8_t) (n & 0xff));
+    if (vAdder.empty())
+        vAdder.push_back(0);
+
+    boost::unique_lock<boost::mutex> lock(mutexProcess);
+    if (fAbort)
+        return;
+
+    PoW pow(&vHash, nShift, &vAdder, nDifficulty);
+    if (pstats)
+        pstats->AddGap(pow.merit());
+    if (!pprocessor->process(&pow))
+        Abort();
+}
+
+bool CSharedSieve::NextPrime(const vector<uint32_t>& vSieve, uint64_t nStart, uint64_t nBits, uint64_t& i,
+                             uint64_t& nPrime, mpz_t mpzCandidate, mpz_t mpzExp, mpz_t mpzResult, uint64_t& nTests)
+{
+    uint32_t nIndex;
+    while (!fAbort && ExtractCandidates(vSieve, i, nBits, &nIndex, 1) == 1)
+    {
+        nTests++;
+        mpz_add_u64(mpzCandidate, mpzBase, nStart + 2 * (uint64_t) nIndex + 1);
+        if (FermatTest(mpzCandidate, mpzExp, mpzResult))
+        {
+            nPrime = nIndex;
+            return true;
+        }
+    }
+    return false;
+}
+
+void CSharedSieve::ScanSegment(unsigned int nSegment, vector<uint32_t>& vSieve,
+                               mpz_t mpzCandidate, mpz_t mpzExp, mpz_t mpzResult,
+                               uint64_t& nTests, uint64_t& nPrimes, CMiningThreadStats* pstats)
+{
+    const uint64_t nStart = (uint64_t) nSegment * nSegmentSize;
+    const uint64_t nEnd   = min(nStart + nSegmentSize, nSieveSize);
+    const uint64_t nBits  = GetWindowBits(nSegment);
+
+    int64_t nTimeStart = GetTimeMicros();
+    SieveWindow(primes, vResidues, nStart, nBits, vSieve, nBucketPrime);
+    for (unsigned int nChunk = 0; nChunk < nResidueChunks; nChunk++)
+    {
+        const vector<uint32_t>& vBucket = vBuckets[(size_t) nChunk * nSegments + nSegment];
+        for (size_t j = 0; j < vBucket.size(); j++)
+            vSieve[vBucket[j] >> 5] |= 1U << (vBucket[j] & 31);
+    }
+    int64_t nTimeSieved = GetTimeMicros();
+
+    // Gaps are only ours if they start below nEnd, the window behind it
+    // is there to close them. Only prime gaps of at least nTargetGap
+    // matter, so from every prime p the candidates below p + nTargetGap
+    // are probed downwards: the first prime there rules out the gap of
+    // p and of every prime between them, without testing those.
+    const uint64_t nMainBits = (nEnd - nStart) / 2;
+    const uint64_t nGapBits  = (nTargetGap + 1) / 2;
+    const unsigned int nCandidates = CountCandidates(vSieve, nMainBits);
+    uint64_t nMainTests = 0;
+
+    uint64_t i = 0, nPrime = 0;
+    bool fHavePrime = NextPrime(vSieve, nStart, nMainBits, i, nPrime, mpzCandidate, mpzExp, mpzResult, nMainTests);
+    while (fHavePrime && !fAbort)
+    {
+        uint64_t j = min(nPrime + nGapBits, nBits);
+        bool fClosed = false;
+        while (!fClosed && !fAbort && PrevCandidate(vSieve, nPrime + 1, j))
+        {
+            (j < nMainBits ? nMainTests : nTests)++;
+            mpz_add_u64(mpzCandidate, mpzBase, nStart + 2 * j + 1);
+            fClosed = FermatTest(mpzCandidate, mpzExp, mpzResult);
+        }
+        if (fAbort)
+            break;
+
+        if (fClosed)
+        {
+            // too short, continue from the prime that closed it
+            if (j >= nMainBits)
+                break;
+            nPrime = j;
+            continue;
+        }
+
+        // no prime behind nPrime for nTargetGap
+        Submit(nStart + 2 * nPrime + 1, pstats);
+
+        i = nPrime + nGapBits;
+        fHavePrime = NextPrime(vSieve, nStart, nMainBits, i, nPrime, mpzCandidate, mpzExp, mpzResult, nMainTests);
+    }
+    nTests += nMainTests;
+
+    // most primes are never tested, count the ones the segment covered
+    if (!fAbort)
+        nPrimes += (uint64_t) ((nEnd - nStart) * dPrimeDensity);
+
+    if (pstats)
+    {
+        pstats->nSieveMicros += nTimeSieved - nTimeStart;
+        pstats->nSieveRounds++;
+        pstats->nCandidates  += nCandidates;
+        pstats->nTestMicros  += GetTimeMicros() - nTimeSieved;
+
+        // a forward scan tests every candidate below nEnd
+        if (!fAbort && nCandidates > nMainTests)
+            pstats->nTestsSaved += nCandidates - nMainTests;
+    }
+}
+
+void CSharedSieve::Thread(CMiningThreadStats* pstats)
+{
+    vector<uint32_t> vSieve;
+    CAutoMpz candidate, exponent, result;
+
+    while (true)
+    {
+        unsigned int nItem;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (nNextItem >= nItems)
+                condWorker.wait(lock);
+            nItem = nNextItem++;
+
+            // segments need all residues of the round
+            try {
+                while (nItem >= nResidueChunks && nResidueDone < nResidueChunks && !fAbort)
+                    condWorker.wait(lock);
+            }
+            catch (boost::thread_interrupted)
+            {
+                if (--nPending == 0)
+                    condMaster.notify_all();
+                throw;
+            }
+        }
+
+        uint64_t nTests = 0, nPrimes = 0;
+        if (!fAbort)
+        {
+            if (nItem < nResidueChunks)
+            {
+                int64_t nTimeStart = GetTimeMicros();
+                ComputeResidues(nItem);
+                if (pstats)
+                    pstats->nSieveMicros += GetTimeMicros() - nTimeStart;
+            }
+            else
+                ScanSegment(nItem - nResidueChunks, vSieve, candidate.z, exponent.z, result.z, nTests, nPrimes, pstats);
+        }
+        if (pstats)
+            pstats->nTests += nTests;
+
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            nRoundTests  += nTests;
+            nRoundPrimes += nPrimes;
+            if (nItem < nResidueChunks && ++nResidueDone == nResidueChunks)
+                condWorker.notify_all();
+            if (--nPending == 0)
+                condMaster.notify_all();
+        }
+    }
+}
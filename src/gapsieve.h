@@ -0,0 +1,185 @@
+// Copyright (c) 2014 The Gapcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef GAPCOIN_GAPSIEVE_H
+#define GAPCOIN_GAPSIEVE_H
+
+#include "uint256.h"
+
+#include <stdint.h>
+#include <vector>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <gmp.h>
+
+class CMiningThreadStats;
+class PoWProcessor;
+
+/** Default number of adders sieved by one shared sieve work item.
+ *  Only odd adders are in the bitmap, so it takes 16 KB and stays in L1. */
+static const uint64_t DEFAULT_SIEVE_SEGMENT_SIZE = 1 << 18;
+/** Number of sieving primes whose residues are computed per work item */
+static const unsigned int SIEVE_RESIDUE_CHUNK = 1 << 16;
+
+/** Largest prime of the sieve wheel, see CSievePrimes */
+static const uint32_t SIEVE_WHEEL_MAX_PRIME = 13;
+
+/** The sieving primes (2, 3, 5, ...) used by the shared sieve.
+ *  The table is built once and only read afterwards, so all miner
+ *  threads can use the same instance.
+ *
+ *  The odd primes up to SIEVE_WHEEL_MAX_PRIME form a wheel: their
+ *  multiples repeat every 3*5*7*11*13 odd numbers, so instead of being
+ *  sieved they are copied into a window from a precomputed bitmap.
+ */
+class CSievePrimes
+{
+private:
+    std::vector<uint32_t> vPrimes;
+
+    // primes[1] .. primes[nWheelPrimes] are in the wheel
+    size_t nWheelPrimes;
+    uint32_t nWheelPeriod;
+
+    // Bit j is set if a wheel prime divides j. It covers 32 periods, so
+    // a window of any phase starts at a word boundary.
+    std::vector<uint32_t> vWheel;
+
+public:
+    CSievePrimes(uint64_t nPrimes);
+
+    size_t size() const { return vPrimes.size(); }
+    uint32_t operator[](size_t i) const { return vPrimes[i]; }
+
+    size_t GetWheelPrimes() const { return nWheelPrimes; }
+
+    /** Initialize vSieve for SieveWindow with the composites of the wheel primes */
+    void ApplyWheel(const std::vector<uint32_t>& vResidues, uint64_t nStart, uint64_t nBits,
+                    std::vector<uint32_t>& vSieve) const;
+};
+
+/** Mark the composites of the odd numbers nBase + nStart + 2 * i + 1,
+ *  0 <= i < nBits, given vResidues[k] = nBase mod primes[k].
+ *  A set bit in vSieve means the number has a factor among the first
+ *  nPrimesEnd primes of the table. Bits from nBits on are undefined.
+ */
+void SieveWindow(const CSievePrimes& primes, const std::vector<uint32_t>& vResidues,
+                 uint64_t nStart, uint64_t nBits, std::vector<uint32_t>& vSieve,
+                 size_t nPrimesEnd = (size_t) -1);
+
+/** Minimum gap length whose merit reaches nDifficulty above mpzStart */
+uint64_t GetTargetGapSize(const mpz_t mpzStart, uint64_t nDifficulty);
+
+/** Sieve of one header hash that all miner threads work on together.
+ *
+ *  A master thread starts a round for a hash; worker threads then claim
+ *  work items: first the residues of the sieving primes modulo
+ *  hash * 2^nShift (in chunks of SIEVE_RESIDUE_CHUNK primes), then
+ *  segments of the adder range. Each segment is sieved with the shared
+ *  residues into a small per-thread bitmap and scanned for prime gaps,
+ *  so the working set of every thread stays cache sized.
+ *
+ *  Primes of at least half a segment hit a segment about once or not at
+ *  all, so the segments do not look at them: the residue work items
+ *  collect their hits into a bucket per segment, which the segment then
+ *  applies in one sequential pass.
+ *
+ *  The scan only looks for gaps of at least the target size: from each
+ *  prime it tests the candidates of the target range backwards, and a
+ *  prime found there lets it skip everything in front of it.
+ */
+class CSharedSieve
+{
+private:
+    // Read-only table shared by all workers
+    const CSievePrimes primes;
+
+    // Mutex to protect the round state below
+    boost::mutex mutex;
+
+    // Workers block on this when out of work
+    boost::condition_variable condWorker;
+
+    // The master blocks on this while the round is running
+    boost::condition_variable condMaster;
+
+    // Mutex serializing calls into the PoW processor
+    boost::mutex mutexProcess;
+
+    // The current round
+    uint256 hash;
+    uint16_t nShift;
+    uint64_t nDifficulty;
+    uint64_t nSieveSize;
+    uint64_t nTargetGap;
+    double dPrimeDensity;
+    PoWProcessor *pprocessor;
+    mpz_t mpzBase;
+    std::vector<uint32_t> vResidues;
+
+    // Adders per segment
+    uint64_t nSegmentSize;
+    unsigned int nSegments;
+
+    // Primes from this index on are bucket sieved
+    size_t nBucketPrime;
+
+    // Bit offsets of the bucket sieved hits, by residue chunk and segment
+    // (nChunk * nSegments + nSegment); each chunk fills its own buckets
+    std::vector<std::vector<uint32_t> > vBuckets;
+
+    // Work items of the current round: residue chunks, then segments
+    unsigned int nResidueChunks;
+    unsigned int nResidueDone;
+    unsigned int nItems;
+    unsigned int nNextItem;
+
+    // Work items that have not completed yet
+    unsigned int nPending;
+
+    // Set when the round should be given up
+    volatile bool fAbort;
+
+    // Statistics of the current round
+    uint64_t nRoundTests;
+    uint64_t nRoundPrimes;
+    int64_t nRoundStart;
+
+    double dPrimesPerSec;
+    double dTestsPerSec;
+
+    uint64_t GetWindowBits(unsigned int nSegment) const;
+    void ComputeResidues(unsigned int nChunk);
+    bool NextPrime(const std::vector<uint32_t>& vSieve, uint64_t nStart, uint64_t nBits, uint64_t& i,
+                   uint64_t& nPrime, mpz_t mpzCandidate, mpz_t mpzExp, mpz_t mpzResult, uint64_t& nTests);
+    void ScanSegment(unsigned int nSegment, std::vector<uint32_t>& vSieve,
+                     mpz_t mpzCandidate, mpz_t mpzExp, mpz_t mpzResult,
+                     uint64_t& nTests, uint64_t& nPrimes, CMiningThreadStats* pstats);
+    void Submit(uint64_t nAdder, CMiningThreadStats* pstats);
+
+public:
+    CSharedSieve(uint64_t nPrimes, uint64_t nSegmentSizeIn = DEFAULT_SIEVE_SEGMENT_SIZE);
+    ~CSharedSieve();
+
+    /** Start a round on hash. The previous round must have finished. */
+    void Start(const uint256& hashIn, uint16_t nShiftIn, uint64_t nDifficultyIn,
+               uint64_t nSieveSizeIn, PoWProcessor *pprocessorIn);
+
+    /** Wait until every work item of the current round is done */
+    void Wait();
+
+    /** Skip the remaining work items of the current round */
+    void Abort();
+
+    /** Worker thread, runs until interrupted. Counts its work in pstats if given. */
+    void Thread(CMiningThreadStats* pstats = NULL);
+
+    double GetPrimesPerSec() { return dPrimesPerSec; }
+    double GetTestsPerSec() { return dTestsPerSec; }
+};
+
+#endif // GAPCOIN_GAPSIEVE_H
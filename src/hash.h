@@ -100,6 +100,40 @@ inline uint256 Hash(const T1 p1begin, const T1 p1end,
     return hash2;
 }
 
+/** Double-SHA256 of messages that share a fixed prefix.
+ *  The SHA-256 state after the complete 64 byte blocks of the prefix is
+ *  computed once, hashing a message then only processes the rest.
+ */
+class CMidstateHash
+{
+private:
+    SHA256_CTX ctxMid;
+    std::vector<unsigned char> vTail;
+
+public:
+    CMidstateHash(const unsigned char* pbegin, const unsigned char* pend)
+    {
+        size_t nBlocks = (pend - pbegin) / SHA256_CBLOCK * SHA256_CBLOCK;
+        SHA256_Init(&ctxMid);
+        SHA256_Update(&ctxMid, pbegin, nBlocks);
+        vTail.assign(pbegin + nBlocks, pend);
+    }
+
+    // Hash of prefix || suffix
+    uint256 GetHash(const unsigned char* pbegin, const unsigned char* pend) const
+    {
+        SHA256_CTX ctx = ctxMid;
+        if (!vTail.empty())
+            SHA256_Update(&ctx, &vTail[0], vTail.size());
+        SHA256_Update(&ctx, pbegin, pend - pbegin);
+        uint256 hash1;
+        SHA256_Final((unsigned char*)&hash1, &ctx);
+        uint256 hash2;
+        SHA256((unsigned char*)&hash1, sizeof(hash1), (unsigned char*)&hash2);
+        return hash2;
+    }
+};
+
 template<typename T>
 uint256 SerializeHash(const T& obj, int nType=SER_GETHASH, int nVersion=PROTOCOL_VERSION)
 {
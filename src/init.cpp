@@ -14,7 +14,9 @@
 #include "main.h"
 #include "miner.h"
 #include "net.h"
+#include "powcache.h"
 #include "rpcserver.h"
+#include "stratum.h"
 #include "txdb.h"
 #include "ui_interface.h"
 #include "util.h"
@@ -114,6 +116,7 @@ void Shutdown()
     RenameThread("gapcoin-shutoff");
     mempool.AddTransactionsUpdated(1);
     StopRPCThreads();
+    StopStratumServer();
     ShutdownRPCMining();
 #ifdef ENABLE_WALLET
     if (pwalletMain)
@@ -122,6 +125,8 @@ void Shutdown()
 #endif
     StopNode();
     UnregisterNodeSignals(GetNodeSignals());
+    if (GetBoolArg("-persistmempool", true))
+        DumpMempool();
     {
         LOCK(cs_main);
 #ifdef ENABLE_WALLET
@@ -206,8 +211,13 @@ std::string HelpMessage(HelpMessageMode hmm)
     strUsage += "  -dbcache=<n>           " + strprintf(_("Set database cache size in megabytes (%d to %d, default: %d)"), nMinDbCache, nMaxDbCache, nDefaultDbCache) + "\n";
     strUsage += "  -keypool=<n>           " + _("Set key pool size to <n> (default: 100)") + "\n";
     strUsage += "  -loadblock=<file>      " + _("Imports blocks from external blk000??.dat file") + " " + _("on startup") + "\n";
-    strUsage += "  -par=<n>               " + strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), -(int)boost::thread::hardware_concurrency(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS) + "\n";
+    strUsage += "  -maxmempool=<n>        " + strprintf(_("Keep the transaction memory pool below <n> megabytes (default: %u)"), DEFAULT_MAX_MEMPOOL_SIZE) + "\n";
+    strUsage += "  -par=<n>               " + strprintf(_("Set the number of script and proof-of-work verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), -(int)boost::thread::hardware_concurrency(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS) + "\n";
+    strUsage += "  -persistmempool        " + _("Save the memory pool to mempool.dat on shutdown and every 15 minutes, and load it on startup (default: 1)") + "\n";
+    strUsage += "  -persistpowcache       " + _("Keep the results of proof-of-work checks in the block index database (default: 0)") + "\n";
     strUsage += "  -pid=<file>            " + _("Specify pid file (default: gapcoind.pid)") + "\n";
+    strUsage += "  -primeindex            " + _("Maintain an index of the prime gaps, used by listprimerecords and listbestprimes (default: 0)") + "\n";
+    strUsage += "  -powcache=<n>          " + strprintf(_("Number of proof-of-work check results to keep in memory (default: %u)"), DEFAULT_POW_CACHE_SIZE) + "\n";
     strUsage += "  -slowstart             " + _("Check Proof of Work of ever loaded block on startup") + "\n";
     strUsage += "  -reindex               " + _("Rebuild block chain index from current blk000??.dat files") + " " + _("on startup") + "\n";
     strUsage += "  -txindex               " + _("Maintain a full transaction index (default: 0)") + "\n";
@@ -269,18 +279,25 @@ std::string HelpMessage(HelpMessageMode hmm)
     strUsage += "  -debug=<category>      " + _("Output debugging information (default: 0, supplying <category> is optional)") + "\n";
     strUsage += "                         " + _("If <category> is not supplied, output all debugging information.") + "\n";
     strUsage += "                         " + _("<category> can be:");
-    strUsage +=                                 " addrman, alert, coindb, db, lock, rand, rpc, selectcoins, mempool, net"; // Don't translate these and qt below
+    strUsage +=                                 " addrman, alert, coindb, db, lock, rand, rpc, selectcoins, mempool, net, stratum"; // Don't translate these and qt below
     if (hmm == HMM_GAPCOIN_QT)
         strUsage += ", qt";
     strUsage += ".\n";
     strUsage += "  -gen                   " + _("Generate coins (default: 0)") + "\n";
     strUsage += "  -genproclimit=<n>      " + _("Set the processor limit for when generation is on (-1 = unlimited, default: -1)") + "\n";
+    strUsage += "  -sharedsieve           " + _("Let all generation threads work together on one sieve (default: 0)") + "\n";
+    strUsage += "  -tuneminer=<n>         " + _("Calibrate the miner at startup, timing each candidate for <n> seconds (default: 0 = off)") + "\n";
     strUsage += "  -help-debug            " + _("Show all debugging options (usage: --help -help-debug)") + "\n";
     strUsage += "  -logtimestamps         " + _("Prepend debug output with timestamp (default: 1)") + "\n";
     if (GetBoolArg("-help-debug", false))
     {
+        strUsage += "  -limitancestorcount=<n> " + strprintf(_("Do not accept transactions with more than <n> unconfirmed ancestors, themselves included (default: %u)"), DEFAULT_ANCESTOR_LIMIT) + "\n";
+        strUsage += "  -limitancestorsize=<n> " + strprintf(_("Do not accept transactions whose unconfirmed ancestors, themselves included, exceed <n> kilobytes (default: %u)"), DEFAULT_ANCESTOR_SIZE_LIMIT) + "\n";
+        strUsage += "  -limitdescendantcount=<n> " + strprintf(_("Do not accept transactions that would give an unconfirmed ancestor more than <n> descendants, itself included (default: %u)"), DEFAULT_DESCENDANT_LIMIT) + "\n";
+        strUsage += "  -limitdescendantsize=<n> " + strprintf(_("Do not accept transactions that would give an unconfirmed ancestor more than <n> kilobytes of descendants, itself included (default: %u)"), DEFAULT_DESCENDANT_SIZE_LIMIT) + "\n";
         strUsage += "  -limitfreerelay=<n>    " + _("Continuously rate-limit free transactions to <n>*1000 bytes per minute (default:15)") + "\n";
-        strUsage += "  -maxsigcachesize=<n>   " + _("Limit size of signature cache to <n> entries (default: 50000)") + "\n";
+        strUsage += "  -sigcachesize=<n>      " + strprintf(_("Limit size of signature cache to <n> megabytes (default: %u)"), DEFAULT_SIG_CACHE_SIZE) + "\n";
+        strUsage += "  -sigverifier=<name>    " + _("Signature verification backend, native or openssl (default: native)") + "\n";
     }
     strUsage += "  -mintxfee=<amt>        " + _("Fees smaller than this are considered zero fee (for transaction creation) (default:") + " " + FormatMoney(CTransaction::nMinTxFee) + ")" + "\n";
     strUsage += "  -minrelaytxfee=<amt>   " + _("Fees smaller than this are considered zero fee (for relaying) (default:") + " " + FormatMoney(CTransaction::nMinRelayTxFee) + ")" + "\n";
@@ -311,6 +328,15 @@ std::string HelpMessage(HelpMessageMode hmm)
     strUsage += "  -rpcallowip=<ip>       " + _("Allow JSON-RPC connections from specified IP address") + "\n";
     strUsage += "  -rpcthreads=<n>        " + _("Set the number of threads to service RPC calls (default: 4)") + "\n";
 
+    strUsage += "\n" + _("Work server options:") + "\n";
+    strUsage += "  -stratum               " + _("Serve work to external miners over TCP, stratum style (default: 0)") + "\n";
+    strUsage += "  -stratumaddress=<addr> " + _("Pay the blocks found by the work server to <addr>") + "\n";
+    strUsage += "  -stratumbind=<ip>      " + _("Listen for miners on <ip> (default: 127.0.0.1)") + "\n";
+    strUsage += "  -stratumport=<port>    " + _("Listen for miners on <port> (default: 31398 or testnet: 19610)") + "\n";
+    strUsage += "  -stratumdifficulty=<n> " + strprintf(_("Accept shares of at least merit <n> (default: %.1f)"), DEFAULT_STRATUM_DIFFICULTY) + "\n";
+    strUsage += "  -stratummaxconnections=<n> " + strprintf(_("Serve at most <n> miners at once (default: %u)"), DEFAULT_STRATUM_MAX_CONNECTIONS) + "\n";
+    strUsage += "  -stratumthreads=<n>    " + _("Set the number of threads to check shares (default: 2)") + "\n";
+
     strUsage += "\n" + _("RPC SSL options: (see the Gapcoin Wiki for SSL setup instructions)") + "\n";
     strUsage += "  -rpcssl                                  " + _("Use OpenSSL (https) for JSON-RPC connections") + "\n";
     strUsage += "  -rpcsslcertificatechainfile=<file.cert>  " + _("Server certificate file (default: server.cert)") + "\n";
@@ -383,6 +409,10 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
             LogPrintf("Warning: Could not open blocks file %s\n", path.string());
         }
     }
+
+    // After the blocks, so the coins the transactions spend are there
+    if (GetBoolArg("-persistmempool", true))
+        LoadMempool();
 }
 
 /** Initialize gapcoin.
@@ -516,7 +546,25 @@ bool AppInit2(boost::thread_group& threadGroup)
     if (GetBoolArg("-debugnet", false))
         InitWarning(_("Warning: Deprecated argument -debugnet ignored, use -debug=net"));
 
+    // -maxsigcachesize (deprecated) counted signatures, -sigcachesize is in megabytes
+    if (mapArgs.count("-maxsigcachesize"))
+    {
+        int64_t nEntries = std::max(GetArg("-maxsigcachesize", 0), (int64_t)0);
+        int64_t nPerMegabyte = (1 << 20) / SIG_CACHE_ENTRY_SIZE;
+        int64_t nMegabytes = nEntries / nPerMegabyte + (nEntries % nPerMegabyte != 0);
+        if (SoftSetArg("-sigcachesize", strprintf("%d", nMegabytes)))
+            LogPrintf("AppInit2 : parameter interaction: -maxsigcachesize=%d -> setting -sigcachesize=%d\n", nEntries, nMegabytes);
+        InitWarning(_("Warning: Deprecated argument -maxsigcachesize counts signatures, use -sigcachesize=<n> megabytes"));
+    }
+
     fBenchmark = GetBoolArg("-benchmark", false);
+    std::string strSigVerifier = GetArg("-sigverifier", "native");
+    if (strSigVerifier == "openssl")
+        SetSignatureVerifier(SIGVERIFIER_OPENSSL);
+    else if (strSigVerifier != "native")
+        return InitError(strprintf(_("Unknown signature verifier: '%s'"), strSigVerifier));
+    else if (!SetSignatureVerifier(SIGVERIFIER_NATIVE))
+        LogPrintf("Native signature verification not available in this build, using OpenSSL\n");
     mempool.setSanityCheck(GetBoolArg("-checkmempool", RegTest()));
     Checkpoints::fEnabled = GetBoolArg("-checkpoints", true);
 
@@ -529,6 +577,9 @@ bool AppInit2(boost::thread_group& threadGroup)
     else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
         nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
 
+    powcache.SetMaxSize(std::max((int64_t)0, GetArg("-powcache", DEFAULT_POW_CACHE_SIZE)));
+    powcache.SetPersist(GetBoolArg("-persistpowcache", false));
+
     fServer = GetBoolArg("-server", false);
     fPrintToConsole = GetBoolArg("-printtoconsole", false);
     fLogTimestamps = GetBoolArg("-logtimestamps", true);
@@ -572,6 +623,7 @@ bool AppInit2(boost::thread_group& threadGroup)
         else
             return InitError(strprintf(_("Invalid amount for -minrelaytxfee=<amount>: '%s'"), mapArgs["-minrelaytxfee"]));
     }
+    mempool.SetSizeLimit(std::max(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE), (int64_t)0) * 1000000);
 
 #ifdef ENABLE_WALLET
     if (mapArgs.count("-paytxfee"))
@@ -617,9 +669,13 @@ bool AppInit2(boost::thread_group& threadGroup)
     std::ostringstream strErrors;
 
     if (nScriptCheckThreads) {
-        LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
+        LogPrintf("Using %u threads for script and proof-of-work verification and transaction admission\n", nScriptCheckThreads);
         for (int i=0; i<nScriptCheckThreads-1; i++)
             threadGroup.create_thread(&ThreadScriptCheck);
+        for (int i=0; i<nScriptCheckThreads-1; i++)
+            threadGroup.create_thread(&ThreadPoWCheck);
+        for (int i=0; i<nScriptCheckThreads; i++)
+            threadGroup.create_thread(&ThreadTxAccept);
     }
 
     int64_t nStart;
@@ -857,6 +913,12 @@ bool AppInit2(boost::thread_group& threadGroup)
                     break;
                 }
 
+                // Check for changed -primeindex state
+                if (fPrimeIndex != GetBoolArg("-primeindex", false)) {
+                    strLoadError = _("You need to rebuild the database using -reindex to change -primeindex");
+                    break;
+                }
+
                 uiInterface.InitMessage(_("Verifying blocks..."));
                 if (!VerifyDB(GetArg("-checklevel", 3),
                               GetArg("-checkblocks", 288))) {
@@ -1054,6 +1116,8 @@ bool AppInit2(boost::thread_group& threadGroup)
             vImportFiles.push_back(strFile);
     }
     threadGroup.create_thread(boost::bind(&ThreadImport, vImportFiles));
+    if (GetBoolArg("-persistmempool", true))
+        threadGroup.create_thread(boost::bind(&LoopForever<bool (*)()>, "dumpmempool", &DumpMempool, DUMP_MEMPOOL_INTERVAL * 1000));
 
     // ********************************************************* Step 10: load peers
 
@@ -1094,11 +1158,24 @@ bool AppInit2(boost::thread_group& threadGroup)
     InitRPCMining();
     if (fServer)
         StartRPCThreads();
+    if (GetBoolArg("-stratum", false))
+    {
+        std::string strStratumError;
+        if (!StartStratumServer(strStratumError))
+            return InitError(strStratumError);
+    }
 
 #ifdef ENABLE_WALLET
     // Generate coins in the background
     if (pwalletMain)
+    {
+        if (GetBoolArg("-gen", false) && GetArg("-tuneminer", 0) > 0)
+        {
+            uiInterface.InitMessage(_("Calibrating the miner..."));
+            TuneMiningParams(GetArg("-genproclimit", -1), GetArg("-tuneminer", 0));
+        }
         GenerateGapcoins(GetBoolArg("-gen", false), pwalletMain, GetArg("-genproclimit", -1));
+    }
 #endif
 
     // ********************************************************* Step 12: finished
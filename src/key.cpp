@@ -4,6 +4,8 @@
 
 #include "key.h"
 
+#include "secp256k1.h"
+
 #include <openssl/bn.h>
 #include <openssl/ecdsa.h>
 #include <openssl/obj_mac.h>
@@ -434,9 +436,31 @@ bool CKey::Load(CPrivKey &privkey, CPubKey &vchPubKey, bool fSkipCheck=false) {
     return true;
 }
 
+static SignatureVerifier sigVerifier = Secp256k1Available() ? SIGVERIFIER_NATIVE : SIGVERIFIER_OPENSSL;
+
+bool SetSignatureVerifier(SignatureVerifier verifier) {
+    if (verifier == SIGVERIFIER_NATIVE && !Secp256k1Available())
+        return false;
+    sigVerifier = verifier;
+    return true;
+}
+
+SignatureVerifier GetSignatureVerifier() {
+    return sigVerifier;
+}
+
 bool CPubKey::Verify(const uint256 &hash, const std::vector<unsigned char>& vchSig) const {
+    return Verify(hash, vchSig, sigVerifier);
+}
+
+bool CPubKey::Verify(const uint256 &hash, const std::vector<unsigned char>& vchSig, SignatureVerifier verifier) const {
     if (!IsValid())
         return false;
+    if (verifier == SIGVERIFIER_NATIVE && !vchSig.empty()) {
+        int ret = Secp256k1Verify(begin(), size(), (const unsigned char*)&hash, &vchSig[0], vchSig.size());
+        if (ret != SECP256K1_UNSUPPORTED)
+            return ret == SECP256K1_VALID;
+    }
     CECKey key;
     if (!key.SetPubKey(*this))
         return false;
@@ -38,6 +38,18 @@ public:
     CScriptID(const uint160 &in) : uint160(in) { }
 };
 
+/** Backends of CPubKey::Verify() */
+enum SignatureVerifier
+{
+    SIGVERIFIER_OPENSSL, // OpenSSL's generic ECDSA_verify
+    SIGVERIFIER_NATIVE   // the secp256k1 specific code in secp256k1.cpp, which
+                         // leaves unusual encodings to OpenSSL
+};
+
+/** Select the backend of CPubKey::Verify(); false if this build doesn't have it */
+bool SetSignatureVerifier(SignatureVerifier verifier);
+SignatureVerifier GetSignatureVerifier();
+
 /** An encapsulated public key. */
 class CPubKey {
 private:
@@ -155,6 +167,8 @@ public:
     // Verify a DER signature (~72 bytes).
     // If this public key is not fully valid, the return value will be false.
     bool Verify(const uint256 &hash, const std::vector<unsigned char>& vchSig) const;
+    // Same with the given backend rather than the selected one.
+    bool Verify(const uint256 &hash, const std::vector<unsigned char>& vchSig, SignatureVerifier verifier) const;
 
     // Verify a compact signature (~65 bytes).
     // See CKey::SignCompact.
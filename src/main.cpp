@@ -12,11 +12,14 @@
 #include "checkqueue.h"
 #include "init.h"
 #include "net.h"
+#include "powcache.h"
+#include "secp256k1.h"
 #include "txdb.h"
 #include "txmempool.h"
 #include "ui_interface.h"
 #include "util.h"
 
+#include <deque>
 #include <sstream>
 
 #include <boost/algorithm/string/replace.hpp>
@@ -38,6 +41,10 @@ CCriticalSection cs_main;
 
 CTxMemPool mempool;
 
+// Notified on every new tip, waited on with csBestBlock held
+CWaitableCriticalSection csBestBlock;
+boost::condition_variable_any cvBlockChange;
+
 map<uint256, CBlockIndex*> mapBlockIndex;
 CChain chainActive;
 CChain chainMostWork;
@@ -47,6 +54,7 @@ bool fImporting = false;
 bool fReindex = false;
 bool fBenchmark = false;
 bool fTxIndex = false;
+bool fPrimeIndex = false;
 unsigned int nCoinCacheSize = 5000;
 
 /** Fees smaller than this (in satoshi) are considered zero fee (for transaction creation) */
@@ -814,13 +822,10 @@ int64_t GetMinFee(const CTransaction& tx, unsigned int nBytes, bool fAllowFree,
 }
 
 
-bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fRejectInsaneFee)
+// Checks of a loose transaction that need neither the chain nor the pool,
+// and so no lock
+static bool CheckLooseTransaction(CValidationState &state, const CTransaction &tx)
 {
-    AssertLockHeld(cs_main);
-    if (pfMissingInputs)
-        *pfMissingInputs = false;
-
     if (!CheckTransaction(tx, state))
         return error("AcceptToMemoryPool: : CheckTransaction failed");
 
@@ -829,6 +834,34 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         return state.DoS(100, error("AcceptToMemoryPool: : coinbase as individual tx"),
                          REJECT_INVALID, "coinbase");
 
+    return true;
+}
+
+// Turn tx away if it would make too long a chain of unconfirmed transactions
+static bool CheckMempoolChainLimits(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, unsigned int nSize)
+{
+    uint64_t nLimitAncestors = max(GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT), (int64_t)0);
+    uint64_t nLimitAncestorSize = max(GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT), (int64_t)0) * 1000;
+    uint64_t nLimitDescendants = max(GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT), (int64_t)0);
+    uint64_t nLimitDescendantSize = max(GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT), (int64_t)0) * 1000;
+    std::string strError;
+    if (!pool.CheckPackageLimits(tx, nSize, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, strError))
+        return state.DoS(0, error("AcceptToMemoryPool : %s, %s", strError, tx.GetHash().ToString()),
+                         REJECT_NONSTANDARD, "too-long-mempool-chain");
+    return true;
+}
+
+// Everything AcceptToMemoryPool checks against the chain and the pool,
+// except the scripts of the inputs: these are left in vChecks, so they can
+// be verified without holding cs_main
+static bool PrepareMempoolAccept(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                                 bool* pfMissingInputs, bool fRejectInsaneFee, int64_t nAcceptTime,
+                                 CTxMemPoolEntry& entry, std::vector<CScriptCheck>& vChecks)
+{
+    AssertLockHeld(cs_main);
+    if (pfMissingInputs)
+        *pfMissingInputs = false;
+
     // Rather not work on nonstandard transactions (unless -testnet/-regtest)
     string reason;
     if (Params().NetworkID() == CChainParams::MAIN && !IsStandardTx(tx, reason))
@@ -902,9 +935,11 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         int64_t nValueIn = view.GetValueIn(tx);
         int64_t nValueOut = tx.GetValueOut();
         int64_t nFees = nValueIn-nValueOut;
-        double dPriority = view.GetPriority(tx, chainActive.Height());
+        int64_t nInChainValue = 0;
+        double dPriority = view.GetPriority(tx, chainActive.Height(), &nInChainValue);
 
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height());
+        entry = CTxMemPoolEntry(tx, nFees, nAcceptTime ? nAcceptTime : GetTime(), dPriority, chainActive.Height(),
+                                nInChainValue, GetP2SHSigOpCount(tx, view));
         unsigned int nSize = entry.GetTxSize();
 
         // Don't accept it if it can't get into a block
@@ -914,6 +949,13 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
                                       hash.ToString(), nFees, txMinFee),
                              REJECT_INSUFFICIENTFEE, "insufficient fee");
 
+        // A full pool evicted packages paying more than this recently
+        int64_t nMempoolMinFee = (int64_t)(pool.GetMinFeePerKb() * nSize / 1000);
+        if (fLimitFree && nFees < nMempoolMinFee)
+            return state.DoS(0, error("AcceptToMemoryPool : mempool min fee not met %s, %d < %d",
+                                      hash.ToString(), nFees, nMempoolMinFee),
+                             REJECT_INSUFFICIENTFEE, "mempool min fee not met");
+
         // Continuously rate-limit free transactions
         // This mitigates 'penny-flooding' -- sending thousands of free transactions just to
         // be annoying or make others' transactions take longer to confirm.
@@ -943,18 +985,449 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
                          hash.ToString(),
                          nFees, CTransaction::nMinRelayTxFee * 10000);
 
-        // Check against previous transactions
+        if (!CheckMempoolChainLimits(pool, state, tx, nSize))
+            return false;
+
+        // Check against previous transactions, collecting the script checks
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        if (!CheckInputs(tx, state, view, true, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC))
+        if (!CheckInputs(tx, state, view, true, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC, &vChecks))
         {
             return error("AcceptToMemoryPool: : ConnectInputs failed %s", hash.ToString());
         }
-        // Store transaction in memory
-        pool.addUnchecked(hash, entry);
     }
+    return true;
+}
+
+// Run the script checks PrepareMempoolAccept left; takes no locks
+static bool CheckMempoolScripts(CValidationState &state, const CTransaction &tx, std::vector<CScriptCheck>& vChecks)
+{
+    BOOST_FOREACH(CScriptCheck& check, vChecks)
+    {
+        if (check())
+            continue;
+
+        // As in CheckInputs: don't trigger DoS protection for failures
+        // caused by non-canonical encodings only
+        check.DropFlags(SCRIPT_VERIFY_STRICTENC);
+        if (check())
+            state.Invalid(false, REJECT_NONSTANDARD, "non-canonical");
+        else
+            state.DoS(100, false, REJECT_NONSTANDARD, "non-canonical");
+        return error("AcceptToMemoryPool: : ConnectInputs failed %s", tx.GetHash().ToString());
+    }
+    return true;
+}
+
+// Store a transaction that passed all checks in the pool, unless a full
+// pool evicts it right away
+static bool AddToMemPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, const CTxMemPoolEntry& entry)
+{
+    // The pool may have changed since PrepareMempoolAccept checked
+    if (!CheckMempoolChainLimits(pool, state, tx, entry.GetTxSize()))
+        return false;
+
+    uint256 hash = tx.GetHash();
+    pool.addUnchecked(hash, entry);
+    if (!pool.exists(hash))
+        return state.DoS(0, error("AcceptToMemoryPool : mempool full, %s not kept", hash.ToString()),
+                         REJECT_INSUFFICIENTFEE, "mempool full");
 
     g_signals.SyncTransaction(hash, tx, NULL);
+    return true;
+}
+
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                        bool* pfMissingInputs, bool fRejectInsaneFee, int64_t nAcceptTime)
+{
+    AssertLockHeld(cs_main);
+    if (pfMissingInputs)
+        *pfMissingInputs = false;
+
+    if (!CheckLooseTransaction(state, tx))
+        return false;
+
+    CTxMemPoolEntry entry;
+    std::vector<CScriptCheck> vChecks;
+    if (!PrepareMempoolAccept(pool, state, tx, fLimitFree, pfMissingInputs, fRejectInsaneFee, nAcceptTime, entry, vChecks))
+        return false;
+    if (!CheckMempoolScripts(state, tx, vChecks))
+        return false;
+
+    return AddToMemPool(pool, state, tx, entry);
+}
+
+// Admission of a prepared transaction whose scripts were checked after
+// cs_main was let go: a block or another transaction may have spent its
+// inputs meanwhile, a reorganization may have taken away their coins, or a
+// full pool its mempool parents. Prevouts can't change under a txid, so
+// the fee and the scripts stay valid; the cheap checks are repeated.
+static bool FinishMempoolAccept(CTxMemPool& pool, CValidationState &state, const CTransaction &tx,
+                                const CTxMemPoolEntry& entry, bool* pfMissingInputs)
+{
+    AssertLockHeld(cs_main);
+    uint256 hash = tx.GetHash();
+    if (pool.exists(hash))
+        return false;
+
+    {
+        CCoinsView dummy;
+        CCoinsViewCache view(dummy);
+
+        {
+        LOCK(pool.cs);
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            if (pool.mapNextTx.count(txin.prevout))
+                return false;
 
+        CCoinsViewMemPool viewMemPool(*pcoinsTip, pool);
+        view.SetBackend(viewMemPool);
+        if (view.HaveCoins(hash))
+            return false;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+            if (!view.HaveCoins(txin.prevout.hash)) {
+                if (pfMissingInputs)
+                    *pfMissingInputs = true;
+                return false;
+            }
+        }
+        if (!view.HaveInputs(tx))
+            return state.Invalid(error("AcceptToMemoryPool : inputs already spent"),
+                                 REJECT_DUPLICATE, "bad-txns-inputs-spent");
+        view.GetBestBlock();
+        view.SetBackend(dummy);
+        }
+
+        // Coinbase maturity, for the chain as it is now
+        if (!CheckInputs(tx, state, view, false, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC))
+            return error("AcceptToMemoryPool: : ConnectInputs failed %s", hash.ToString());
+    }
+
+    return AddToMemPool(pool, state, tx, entry);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Mempool admission of network transactions
+//
+
+// Network transactions queued for the admission threads, with a reference
+// held on the node they came from; a NULL node marks an orphan whose
+// parent arrived. Guarded by mutexTxAccept.
+static boost::mutex mutexTxAccept;
+static boost::condition_variable condTxAccept;
+static std::deque<std::pair<CTransaction, CNode*> > queueTxAccept;
+static int nTxAcceptThreads = 0;
+
+// Admit one network transaction, holding cs_main only around the pool and
+// chain lookups; orphans it resolves are appended to vOrphans
+static void ProcessTxAccept(const CTransaction& tx, CNode* pfrom, std::vector<CTransaction>& vOrphans)
+{
+    uint256 hash = tx.GetHash();
+    bool fMissingInputs = false;
+    bool fAccepted = false;
+    CValidationState state;
+    if (CheckLooseTransaction(state, tx))
+    {
+        CTxMemPoolEntry entry;
+        std::vector<CScriptCheck> vChecks;
+        bool fPrepared;
+        {
+            LOCK(cs_main);
+            fPrepared = PrepareMempoolAccept(mempool, state, tx, true, &fMissingInputs, false, 0, entry, vChecks);
+        }
+        if (fPrepared && CheckMempoolScripts(state, tx, vChecks))
+        {
+            LOCK(cs_main);
+            fAccepted = FinishMempoolAccept(mempool, state, tx, entry, &fMissingInputs);
+        }
+    }
+
+    LOCK(cs_main);
+    CInv inv(MSG_TX, hash);
+    if (fAccepted)
+    {
+        mempool.check(pcoinsTip);
+        RelayTransaction(tx, hash);
+        mapAlreadyAskedFor.erase(inv);
+        EraseOrphanTx(hash);
+
+        if (pfrom)
+            LogPrint("mempool", "AcceptToMemoryPool: %s %s : accepted %s (poolsz %u)\n",
+                pfrom->addr.ToString(), pfrom->cleanSubVer,
+                hash.ToString(),
+                mempool.mapTx.size());
+        else
+            LogPrint("mempool", "   accepted orphan tx %s\n", hash.ToString());
+
+        // Process any orphan transactions that depended on this one
+        map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(hash);
+        if (itByPrev != mapOrphanTransactionsByPrev.end()) {
+            BOOST_FOREACH(const uint256& orphanHash, itByPrev->second)
+                vOrphans.push_back(mapOrphanTransactions[orphanHash]);
+        }
+    }
+    else if (!pfrom)
+    {
+        // Orphans use a dummy state so someone can't setup nodes to counter-DoS based on orphan
+        // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
+        // anyone relaying LegitTxX banned)
+        if (!fMissingInputs)
+        {
+            // invalid or too-little-fee orphan
+            EraseOrphanTx(hash);
+            LogPrint("mempool", "   removed orphan tx %s\n", hash.ToString());
+        }
+        return;
+    }
+    else if (fMissingInputs)
+    {
+        AddOrphanTx(tx);
+
+        // cs_main was let go since the inputs were found missing, so another
+        // thread may have accepted the last missing parent and looked for
+        // its orphans before this one was added; if so, retry it here. A
+        // parent that is still missing will find it when it arrives.
+        bool fParentsFound = true;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            if (!mempool.exists(txin.prevout.hash) && !pcoinsTip->HaveCoins(txin.prevout.hash))
+                fParentsFound = false;
+        if (fParentsFound)
+            vOrphans.push_back(tx);
+
+        // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
+        unsigned int nEvicted = LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS);
+        if (nEvicted > 0)
+            LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
+    }
+
+    int nDoS = 0;
+    if (pfrom && state.IsInvalid(nDoS))
+    {
+        LogPrint("mempool", "%s from %s %s was not accepted into the memory pool: %s\n", hash.ToString(),
+            pfrom->addr.ToString(), pfrom->cleanSubVer,
+            state.GetRejectReason());
+        pfrom->PushMessage("reject", string("tx"), state.GetRejectCode(),
+                           state.GetRejectReason(), hash);
+        if (nDoS > 0)
+            Misbehaving(pfrom->GetId(), nDoS);
+    }
+}
+
+// Hand a network transaction to the admission threads, or admit it right
+// here if there are none or they are too far behind
+static void QueueTxAccept(const CTransaction& tx, CNode* pfrom)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutexTxAccept);
+        if (nTxAcceptThreads > 0 && queueTxAccept.size() < MAX_TXACCEPT_QUEUE)
+        {
+            if (pfrom)
+                pfrom->AddRef();
+            queueTxAccept.push_back(std::make_pair(tx, pfrom));
+            condTxAccept.notify_one();
+            return;
+        }
+    }
+
+    std::vector<CTransaction> vOrphans;
+    ProcessTxAccept(tx, pfrom, vOrphans);
+    for (unsigned int i = 0; i < vOrphans.size(); i++)
+    {
+        // ProcessTxAccept appends to vOrphans, so don't pass it a reference into it
+        CTransaction orphanTx = vOrphans[i];
+        ProcessTxAccept(orphanTx, NULL, vOrphans);
+    }
+}
+
+void ThreadTxAccept()
+{
+    RenameThread("gapcoin-txaccept");
+    {
+        boost::unique_lock<boost::mutex> lock(mutexTxAccept);
+        nTxAcceptThreads++;
+    }
+
+    // the node of the job being processed, still referenced
+    CNode* pfrom = NULL;
+    try
+    {
+        while (true)
+        {
+            CTransaction tx;
+            {
+                boost::unique_lock<boost::mutex> lock(mutexTxAccept);
+                while (queueTxAccept.empty())
+                    condTxAccept.wait(lock);
+                tx = queueTxAccept.front().first;
+                pfrom = queueTxAccept.front().second;
+                queueTxAccept.pop_front();
+            }
+
+            std::vector<CTransaction> vOrphans;
+            ProcessTxAccept(tx, pfrom, vOrphans);
+            if (pfrom)
+                pfrom->Release();
+            pfrom = NULL;
+
+            // Resolved orphans go back through the queue so the other
+            // threads share them; if it is full, QueueTxAccept admits them
+            // here instead, which is intended
+            BOOST_FOREACH(const CTransaction& orphanTx, vOrphans)
+                QueueTxAccept(orphanTx, NULL);
+        }
+    }
+    catch (boost::thread_interrupted)
+    {
+        if (pfrom)
+            pfrom->Release();
+
+        boost::unique_lock<boost::mutex> lock(mutexTxAccept);
+        nTxAcceptThreads--;
+
+        // Nothing is queued once the last thread is gone, so release the
+        // nodes of the jobs left behind
+        if (nTxAcceptThreads == 0)
+        {
+            while (!queueTxAccept.empty())
+            {
+                if (queueTxAccept.front().second)
+                    queueTxAccept.front().second->Release();
+                queueTxAccept.pop_front();
+            }
+        }
+        throw;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// mempool.dat
+//
+
+// Not dumped before LoadMempool is done, so a shutdown while loading
+// doesn't lose the rest of the file
+static bool fMempoolLoaded = false;
+
+bool DumpMempool()
+{
+    int64_t nStart = GetTimeMillis();
+
+    // Parents before their children, so they load in order
+    std::vector<std::pair<uint64_t, const CTxMemPoolEntry*> > vSorted;
+    std::vector<CTxMemPoolEntry> vEntries;
+    {
+        LOCK(mempool.cs);
+        if (!fMempoolLoaded)
+            return false;
+        vEntries.reserve(mempool.mapTx.size());
+        for (map<uint256, CTxMemPoolEntry>::const_iterator it = mempool.mapTx.begin(); it != mempool.mapTx.end(); ++it)
+            vEntries.push_back(it->second);
+    }
+    vSorted.reserve(vEntries.size());
+    BOOST_FOREACH(const CTxMemPoolEntry& entry, vEntries)
+        vSorted.push_back(std::make_pair(entry.GetCountWithAncestors(), &entry));
+    sort(vSorted.begin(), vSorted.end());
+
+    // Generate random temporary filename
+    unsigned short randv = 0;
+    RAND_bytes((unsigned char *)&randv, sizeof(randv));
+    boost::filesystem::path pathTmp = GetDataDir() / strprintf("mempool.dat.%04x", randv);
+
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("%s : Failed to open file %s", __func__, pathTmp.string());
+
+    try {
+        fileout << FLATDATA(Params().MessageStart());
+        fileout << MEMPOOL_DUMP_VERSION;
+        fileout << (uint64_t)vSorted.size();
+        for (unsigned int i = 0; i < vSorted.size(); i++)
+        {
+            const CTxMemPoolEntry& entry = *vSorted[i].second;
+            fileout << entry.GetTx();
+            fileout << entry.GetTime();
+            fileout << entry.GetFee();
+        }
+    }
+    catch (std::exception &e) {
+        return error("%s : Serialize or I/O error - %s", __func__, e.what());
+    }
+    FileCommit(fileout);
+    fileout.fclose();
+
+    if (!RenameOver(pathTmp, GetDataDir() / "mempool.dat"))
+        return error("%s : Rename-into-place failed", __func__);
+
+    LogPrint("mempool", "Dumped %u transactions to mempool.dat  %dms\n",
+             (unsigned int)vSorted.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+bool LoadMempool()
+{
+    boost::filesystem::path pathMempool = GetDataDir() / "mempool.dat";
+    FILE *file = fopen(pathMempool.string().c_str(), "rb");
+    CAutoFile filein = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!filein)
+    {
+        // Nothing to load the first time
+        LOCK(mempool.cs);
+        fMempoolLoaded = true;
+        return false;
+    }
+
+    // The file has no checksum: it is read as it streams in, and every
+    // transaction goes through AcceptToMemoryPool anyway
+    int64_t nStart = GetTimeMillis();
+    unsigned int nAccepted = 0, nFailed = 0;
+    int64_t nFeesAccepted = 0;
+    try {
+        unsigned char pchMsgTmp[4];
+        uint64_t nVersion, nCount;
+        filein >> FLATDATA(pchMsgTmp);
+        if (memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp)))
+            throw std::runtime_error("invalid network magic number");
+        filein >> nVersion;
+        if (nVersion != MEMPOOL_DUMP_VERSION)
+            throw std::runtime_error(strprintf("unknown version %d", nVersion));
+        filein >> nCount;
+
+        // Take cs_main for one batch at a time, so RPC and the network go on
+        // while the pool fills
+        while (nCount > 0 && !ShutdownRequested())
+        {
+            LOCK(cs_main);
+            for (unsigned int i = 0; i < MEMPOOL_LOAD_BATCH && nCount > 0; i++, nCount--)
+            {
+                CTransaction tx;
+                int64_t nTime, nFee;
+                filein >> tx;
+                filein >> nTime;
+                filein >> nFee;
+
+                CValidationState state;
+                if (AcceptToMemoryPool(mempool, state, tx, false, NULL, false, nTime))
+                {
+                    nAccepted++;
+                    nFeesAccepted += nFee;
+                }
+                else
+                    nFailed++;
+            }
+        }
+    }
+    catch (std::exception &e) {
+        LogPrintf("%s : Deserialize or I/O error - %s\n", __func__, e.what());
+    }
+
+    LogPrintf("Loaded %u transactions paying %s from mempool.dat, %u failed  %dms\n",
+              nAccepted, FormatMoney(nFeesAccepted), nFailed, GetTimeMillis() - nStart);
+    if (!ShutdownRequested())
+    {
+        LOCK(mempool.cs);
+        fMempoolLoaded = true;
+    }
     return true;
 }
 
@@ -1265,18 +1738,73 @@ uint64_t GetNextWorkRequired(const CBlockIndex* pindexLast, const CBlockHeader *
 }
 
 
+bool CPoWCheck::operator()() const {
+    return powcache.Get(hash, nShift, nAdd, nDifficulty).fValid;
+}
+
+uint256 CPoWCheck::GetProofHash() const {
+    return ::GetProofHash(hash, nShift, nAdd, nDifficulty);
+}
+
+static CCheckQueue<CPoWCheck> powcheckqueue(1, MAX_SCRIPTCHECK_THREADS);
+
+// Only one batch can use powcheckqueue at a time
+static CCriticalSection cs_powcheckqueue;
+
+void ThreadPoWCheck() {
+    RenameThread("gapcoin-powch");
+    powcheckqueue.Thread();
+}
+
 bool CheckProofOfWork(const uint256 hash, const uint16_t nShift, const std::vector<uint8_t> *const nAdd, const uint64_t nDifficulty)
 {
-    std::vector<uint8_t> vHash(hash.begin(), hash.end());
-  
-    PoW pow(&vHash, nShift, nAdd, nDifficulty);
-
     // Check proof of work matches claimed amount
-    if (!pow.valid())
+    if (!powcache.Get(hash, nShift, *nAdd, nDifficulty).fValid)
         return error("CheckProofOfWork() : hash does not match nDifficulty");
 
     return true;
 }
+
+bool CheckProofOfWorkBatch(std::vector<CPoWCheck> &vChecks)
+{
+    // Skip what is known already
+    bool fOk = true;
+    for (unsigned int i = 0; i < vChecks.size(); )
+    {
+        CPoWResult result;
+        if (powcache.Lookup(vChecks[i].GetProofHash(), result))
+        {
+            fOk &= result.fValid;
+            vChecks[i].swap(vChecks.back());
+            vChecks.pop_back();
+            continue;
+        }
+        i++;
+    }
+
+    if (!fOk || vChecks.empty())
+    {
+        vChecks.clear();
+        return fOk;
+    }
+
+    if (nScriptCheckThreads && vChecks.size() > 1)
+    {
+        LOCK(cs_powcheckqueue);
+        CCheckQueueControl<CPoWCheck> control(&powcheckqueue);
+        control.Add(vChecks);
+        fOk = control.Wait();
+    }
+    else
+    {
+        BOOST_FOREACH(const CPoWCheck &check, vChecks)
+            if (fOk)
+                fOk = check();
+    }
+    vChecks.clear();
+
+    return fOk;
+}
       
 
 // Return maximum amount of blocks that other nodes claim to have
@@ -1483,11 +2011,34 @@ void UpdateCoins(const CTransaction& tx, CValidationState &state, CCoinsViewCach
 
 bool CScriptCheck::operator()() const {
     const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
-    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType))
+    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType, phasher.get()))
         return error("CScriptCheck() : %s VerifySignature failed", ptxTo->GetHash().ToString());
     return true;
 }
 
+bool CScriptCheck::operator()(CSecp256k1Batch& batch) const {
+    return VerifyScript(ptxTo->vin[nIn].scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType, phasher.get(), &batch);
+}
+
+bool RunChecks(std::vector<CScriptCheck>& vChecks)
+{
+    // Run the scripts taking the signatures on trust and verify those
+    // together. If the batch or a script fails, a signature that should fail
+    // may have been taken for valid, so then the checks run again one by one
+    // to find out.
+    CSecp256k1Batch batch;
+    bool fOk = true;
+    for (unsigned int i = 0; fOk && i < vChecks.size(); i++)
+        fOk = vChecks[i](batch);
+    if (fOk && batch.Verify())
+        return true;
+
+    BOOST_FOREACH(const CScriptCheck& check, vChecks)
+        if (!check())
+            return false;
+    return true;
+}
+
 bool VerifySignature(const CCoins& txFrom, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType)
 {
     return CScriptCheck(txFrom, txTo, nIn, flags, nHashType)();
@@ -1554,12 +2105,17 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, CCoinsViewCach
         // before the last block chain checkpoint. This is safe because block merkle hashes are
         // still computed and checked, and any change will be caught at the next checkpoint.
         if (fScriptChecks) {
+            // Inputs share the serialization of tx for their signature hashes
+            boost::shared_ptr<const CSignatureHasher> phasher;
+            if (tx.vin.size() > 1)
+                phasher.reset(new CSignatureHasher(tx));
+
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 const COutPoint &prevout = tx.vin[i].prevout;
                 const CCoins &coins = inputs.GetCoins(prevout.hash);
 
                 // Verify signature
-                CScriptCheck check(coins, tx, i, flags, 0);
+                CScriptCheck check(coins, tx, i, flags, 0, phasher);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
@@ -1567,7 +2123,7 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, CCoinsViewCach
                     if (flags & SCRIPT_VERIFY_STRICTENC) {
                         // For now, check whether the failure was caused by non-canonical
                         // encodings or not; if so, don't trigger DoS protection.
-                        CScriptCheck check(coins, tx, i, flags & (~SCRIPT_VERIFY_STRICTENC), 0);
+                        CScriptCheck check(coins, tx, i, flags & (~SCRIPT_VERIFY_STRICTENC), 0, phasher);
                         if (check())
                             return state.Invalid(false, REJECT_NONSTANDARD, "non-canonical");
                     }
@@ -1695,7 +2251,7 @@ void static FlushBlockFile(bool fFinalize = false)
 
 bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
 
-static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128, MAX_SCRIPTCHECK_THREADS);
 
 void ThreadScriptCheck() {
     RenameThread("gapcoin-scriptch");
@@ -1716,6 +2272,9 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
     // Special case for the genesis block, skipping connection of its transactions
     // (its coinbase is unspendable)
     if (block.GetHash() == Params().HashGenesisBlock()) {
+        if (fPrimeIndex && !fJustCheck)
+            if (!pblocktree->WritePrimeRecord(CPrimeRecord(block, pindex->nHeight)))
+                return state.Abort(_("Failed to write prime index"));
         view.SetBestBlock(pindex->GetBlockHash());
         return true;
     }
@@ -1852,6 +2411,10 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
         if (!pblocktree->WriteTxIndex(vPos))
             return state.Abort(_("Failed to write transaction index"));
 
+    if (fPrimeIndex && !fJustCheck)
+        if (!pblocktree->WritePrimeRecord(CPrimeRecord(block, pindex->nHeight)))
+            return state.Abort(_("Failed to write prime index"));
+
     // add this block to the view's block chain
     bool ret;
     ret = view.SetBestBlock(pindex->GetBlockHash());
@@ -1896,6 +2459,10 @@ void static UpdateTip(CBlockIndex *pindexNew) {
     // New best block
     nTimeBestReceived = GetTime();
     mempool.AddTransactionsUpdated(1);
+    {
+        boost::unique_lock<CWaitableCriticalSection> lock(csBestBlock);
+        cvBlockChange.notify_all();
+    }
     LogPrintf("UpdateTip: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f\n",
       chainActive.Tip()->GetBlockHash().ToString(), chainActive.Height(), log(chainActive.Tip()->nChainWork.getdouble())/log(2.0), (unsigned long)chainActive.Tip()->nChainTx,
       DateTimeStrFormat("%Y-%m-%d %H:%M:%S", chainActive.Tip()->GetBlockTime()),
@@ -1937,6 +2504,10 @@ bool static DisconnectTip(CValidationState &state) {
             return error("DisconnectTip() : DisconnectBlock %s failed", pindexDelete->GetBlockHash().ToString());
         assert(view.Flush());
     }
+    // Not in DisconnectBlock, which VerifyDB also calls to check the undo data
+    if (fPrimeIndex)
+        if (!pblocktree->ErasePrimeRecord(CPrimeRecord(block, pindexDelete->nHeight)))
+            return state.Abort(_("Failed to write prime index"));
     if (fBenchmark)
         LogPrintf("- Disconnect: %.2fms\n", (GetTimeMicros() - nStart) * 0.001);
     // Write the chain state to disk, if necessary.
@@ -1990,11 +2561,7 @@ bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew) {
         return false;
     // Remove conflicting transactions from the mempool.
     list<CTransaction> txConflicted;
-    BOOST_FOREACH(const CTransaction &tx, block.vtx) {
-        list<CTransaction> unused;
-        mempool.remove(tx, unused);
-        mempool.removeConflicts(tx, txConflicted);
-    }
+    mempool.removeForBlock(block.vtx, txConflicted);
     mempool.check(pcoinsTip);
     // Update chainActive & related variables.
     UpdateTip(pindexNew);
@@ -2456,6 +3023,21 @@ int64_t CBlockIndex::GetMedianTime() const
     return pindex->GetMedianTimePast();
 }
 
+CPrimeRecord::CPrimeRecord(const CBlock &block, int nHeightIn)
+{
+    CPoWResult result = powcache.Get(block, true);
+
+    nHeight   = nHeightIn;
+    hashBlock = block.GetHash();
+    nTime     = block.nTime;
+    nMerit    = result.nMerit;
+    nGapLen   = result.nGapLen;
+    vGapStart = result.vGapStart;
+    vGapEnd   = result.vGapEnd;
+    BOOST_FOREACH(const CTxOut &txout, block.vtx[0].vout)
+        vMinerScripts.push_back(txout.scriptPubKey);
+}
+
 void PushGetBlocks(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd)
 {
     AssertLockHeld(cs_main);
@@ -2833,6 +3415,10 @@ bool static LoadBlockIndexDB()
     pblocktree->ReadFlag("txindex", fTxIndex);
     LogPrintf("LoadBlockIndexDB(): transaction index %s\n", fTxIndex ? "enabled" : "disabled");
 
+    // Check whether we have a prime gap index
+    pblocktree->ReadFlag("primeindex", fPrimeIndex);
+    LogPrintf("LoadBlockIndexDB(): prime gap index %s\n", fPrimeIndex ? "enabled" : "disabled");
+
     // Load pointer to end of best chain
     std::map<uint256, CBlockIndex*>::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
     if (it == mapBlockIndex.end())
@@ -2946,6 +3532,8 @@ bool InitBlockIndex() {
     // Use the provided setting for -txindex in the new database
     fTxIndex = GetBoolArg("-txindex", false);
     pblocktree->WriteFlag("txindex", fTxIndex);
+    fPrimeIndex = GetBoolArg("-primeindex", false);
+    pblocktree->WriteFlag("primeindex", fPrimeIndex);
     LogPrintf("Initializing databases...\n");
 
     // Only add the genesis block if not reindexing (in which case we reuse the one already on disk)
@@ -3041,12 +3629,40 @@ void PrintBlockTree()
     }
 }
 
+// Process blocks read by LoadExternalBlockFile, after checking their proofs of work in parallel
+static bool ProcessExternalBlocks(std::vector<std::pair<uint64_t, CBlock> > &vBlocks, CDiskBlockPos *dbp, int &nLoaded)
+{
+    // ProcessBlock finds the invalid ones again
+    std::vector<CPoWCheck> vChecks;
+    for (unsigned int i = 0; i < vBlocks.size(); i++)
+        vChecks.push_back(CPoWCheck(vBlocks[i].second));
+    CheckProofOfWorkBatch(vChecks);
+
+    for (unsigned int i = 0; i < vBlocks.size(); i++) {
+        LOCK(cs_main);
+        if (dbp)
+            dbp->nPos = vBlocks[i].first;
+        CValidationState state;
+        if (ProcessBlock(state, NULL, &vBlocks[i].second, dbp))
+            nLoaded++;
+        if (state.IsError()) {
+            vBlocks.clear();
+            return false;
+        }
+    }
+    vBlocks.clear();
+    return true;
+}
+
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
 {
     int64_t nStart = GetTimeMillis();
 
     int nLoaded = 0;
     try {
+        // Blocks with their positions, processed in batches of MAX_POW_CHECK_BATCH
+        std::vector<std::pair<uint64_t, CBlock> > vBlocks;
+
         CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION);
         uint64_t nStartByte = 0;
         if (dbp) {
@@ -3091,19 +3707,15 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
 
                 // process block
                 if (nBlockPos >= nStartByte) {
-                    LOCK(cs_main);
-                    if (dbp)
-                        dbp->nPos = nBlockPos;
-                    CValidationState state;
-                    if (ProcessBlock(state, NULL, &block, dbp))
-                        nLoaded++;
-                    if (state.IsError())
+                    vBlocks.push_back(make_pair(nBlockPos, block));
+                    if (vBlocks.size() >= MAX_POW_CHECK_BATCH && !ProcessExternalBlocks(vBlocks, dbp, nLoaded))
                         break;
                 }
             } catch (std::exception &e) {
                 LogPrintf("%s : Deserialize or I/O error - %s", __func__, e.what());
             }
         }
+        ProcessExternalBlocks(vBlocks, dbp, nLoaded);
         fclose(fileIn);
     } catch(std::runtime_error &e) {
         AbortNode(_("Error: system error: ") + e.what());
@@ -3685,89 +4297,15 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
     else if (strCommand == "tx")
     {
-        vector<uint256> vWorkQueue;
-        vector<uint256> vEraseQueue;
         CTransaction tx;
         vRecv >> tx;
 
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
-        LOCK(cs_main);
-
-        bool fMissingInputs = false;
-        CValidationState state;
-        if (AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs))
-        {
-            mempool.check(pcoinsTip);
-            RelayTransaction(tx, inv.hash);
-            mapAlreadyAskedFor.erase(inv);
-            vWorkQueue.push_back(inv.hash);
-            vEraseQueue.push_back(inv.hash);
-
-
-            LogPrint("mempool", "AcceptToMemoryPool: %s %s : accepted %s (poolsz %u)\n",
-                pfrom->addr.ToString(), pfrom->cleanSubVer,
-                tx.GetHash().ToString(),
-                mempool.mapTx.size());
-
-            // Recursively process any orphan transactions that depended on this one
-            for (unsigned int i = 0; i < vWorkQueue.size(); i++)
-            {
-                uint256 hashPrev = vWorkQueue[i];
-                for (set<uint256>::iterator mi = mapOrphanTransactionsByPrev[hashPrev].begin();
-                     mi != mapOrphanTransactionsByPrev[hashPrev].end();
-                     ++mi)
-                {
-                    const uint256& orphanHash = *mi;
-                    const CTransaction& orphanTx = mapOrphanTransactions[orphanHash];
-                    bool fMissingInputs2 = false;
-                    // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
-                    // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
-                    // anyone relaying LegitTxX banned)
-                    CValidationState stateDummy;
-
-                    if (AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2))
-                    {
-                        LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
-                        RelayTransaction(orphanTx, orphanHash);
-                        mapAlreadyAskedFor.erase(CInv(MSG_TX, orphanHash));
-                        vWorkQueue.push_back(orphanHash);
-                        vEraseQueue.push_back(orphanHash);
-                    }
-                    else if (!fMissingInputs2)
-                    {
-                        // invalid or too-little-fee orphan
-                        vEraseQueue.push_back(orphanHash);
-                        LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
-                    }
-                    mempool.check(pcoinsTip);
-                }
-            }
-
-            BOOST_FOREACH(uint256 hash, vEraseQueue)
-                EraseOrphanTx(hash);
-        }
-        else if (fMissingInputs)
-        {
-            AddOrphanTx(tx);
-
-            // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
-            unsigned int nEvicted = LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS);
-            if (nEvicted > 0)
-                LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
-        }
-        int nDoS = 0;
-        if (state.IsInvalid(nDoS))
-        {
-            LogPrint("mempool", "%s from %s %s was not accepted into the memory pool: %s\n", tx.GetHash().ToString(),
-                pfrom->addr.ToString(), pfrom->cleanSubVer,
-                state.GetRejectReason());
-            pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
-                               state.GetRejectReason(), inv.hash);
-            if (nDoS > 0)
-                Misbehaving(pfrom->GetId(), nDoS);
-        }
+        // Script checks are the bulk of the work; they run on the admission
+        // threads, so one peer's transactions don't hold up the others
+        QueueTxAccept(tx, pfrom);
     }
 
 
@@ -4023,6 +4561,30 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 }
 
 // requires LOCK(cs_vRecvMsg)
+// Check the proofs of work of a run of received block messages in parallel,
+// before ProcessMessage handles them one by one
+static void CheckBlockMessagesPoW(std::deque<CNetMessage>::iterator it, std::deque<CNetMessage>::iterator itEnd)
+{
+    std::vector<CPoWCheck> vChecks;
+    for (; it != itEnd && vChecks.size() < MAX_POW_CHECK_BATCH; it++) {
+        CNetMessage& msg = *it;
+        if (!msg.complete() || msg.hdr.GetCommand() != "block")
+            break;
+
+        // Only copy the start of the message, where the header is
+        unsigned int nHeaderSize = std::min((unsigned int)msg.vRecv.size(), 1000U);
+        CDataStream ssHeader(msg.vRecv.begin(), msg.vRecv.begin() + nHeaderSize, msg.vRecv.GetType(), msg.vRecv.GetVersion());
+        try {
+            CBlockHeader header;
+            ssHeader >> header;
+            vChecks.push_back(CPoWCheck(header));
+        } catch (std::exception &e) {
+            // ProcessMessage reports malformed blocks
+        }
+    }
+    CheckProofOfWorkBatch(vChecks);
+}
+
 bool ProcessMessages(CNode* pfrom)
 {
     //if (fDebug)
@@ -4096,6 +4658,10 @@ bool ProcessMessages(CNode* pfrom)
             continue;
         }
 
+        // Check the proofs of work of the queued blocks in parallel
+        if (strCommand == "block" && nScriptCheckThreads && !fImporting && !fReindex)
+            CheckBlockMessagesPoW(it - 1, pfrom->vRecvMsg.end());
+
         // Process message
         bool fRet = false;
         try
@@ -30,6 +30,8 @@
 #include <utility>
 #include <vector>
 
+#include <boost/shared_ptr.hpp>
+
 class CBlockIndex;
 class CBloomFilter;
 class CInv;
@@ -53,6 +55,14 @@ static const unsigned int MAX_STANDARD_TX_SIZE = 100000;
 static const unsigned int MAX_BLOCK_SIGOPS = MAX_BLOCK_SIZE/50;
 /** The maximum number of orphan transactions kept in memory */
 static const unsigned int MAX_ORPHAN_TRANSACTIONS = MAX_BLOCK_SIZE/100;
+/** Version of the mempool.dat format */
+static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+/** Seconds between writes of mempool.dat */
+static const int64_t DUMP_MEMPOOL_INTERVAL = 900;
+/** Transactions loaded from mempool.dat per hold of cs_main */
+static const unsigned int MEMPOOL_LOAD_BATCH = 100;
+/** The maximum number of network transactions waiting for the admission threads; beyond, the message handler admits them itself */
+static const unsigned int MAX_TXACCEPT_QUEUE = 1000;
 /** The maximum number of orphan blocks kept in memory */
 static const unsigned int MAX_ORPHAN_BLOCKS = 750;
 /** The maximum size of a blk?????.dat file (since 0.8) */
@@ -66,9 +76,11 @@ static const int COINBASE_MATURITY = 100;
 /** Threshold for nLockTime: below this value it is interpreted as block number, otherwise as UNIX timestamp. */
 static const unsigned int LOCKTIME_THRESHOLD = 500000000; // Tue Nov  5 00:53:20 1985 UTC
 /** Maximum number of script-checking threads allowed */
-static const int MAX_SCRIPTCHECK_THREADS = 16;
+static const int MAX_SCRIPTCHECK_THREADS = 64;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
+/** Maximum number of proofs of work checked together on the proof-of-work checking threads */
+static const unsigned int MAX_POW_CHECK_BATCH = 128;
 /** Number of blocks that can be requested at any given time from a single peer. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 128;
 /** Timeout in seconds before considering a block download peer unresponsive. */
@@ -94,6 +106,8 @@ static const unsigned char REJECT_CHECKPOINT = 0x43;
 extern CScript COINBASE_FLAGS;
 extern CCriticalSection cs_main;
 extern CTxMemPool mempool;
+extern CWaitableCriticalSection csBestBlock;
+extern boost::condition_variable_any cvBlockChange;
 extern std::map<uint256, CBlockIndex*> mapBlockIndex;
 extern uint64_t nLastBlockTx;
 extern uint64_t nLastBlockSize;
@@ -104,6 +118,7 @@ extern bool fReindex;
 extern bool fBenchmark;
 extern int nScriptCheckThreads;
 extern bool fTxIndex;
+extern bool fPrimeIndex;
 extern unsigned int nCoinCacheSize;
 
 // Minimum disk space required - used in CheckDiskSpace()
@@ -115,6 +130,7 @@ class CBlockTreeDB;
 struct CDiskBlockPos;
 class CTxUndo;
 class CScriptCheck;
+class CPoWCheck;
 class CValidationState;
 class CWalletInterface;
 struct CNodeStateStats;
@@ -163,8 +179,16 @@ bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the thread admitting network transactions to the memory pool */
+void ThreadTxAccept();
+/** Run an instance of the proof-of-work checking thread */
+void ThreadPoWCheck();
 /** Check whether a block hash satisfies the proof-of-work requirement specified by nDifficulty */
 bool CheckProofOfWork(const uint256 hash, const uint16_t nShift, const std::vector<uint8_t> *const nAdd, const uint64_t nDifficulty);
+/** Check many proofs of work in parallel on the proof-of-work checking threads.
+ *  The results go to powcache, so CheckProofOfWork does not test them again.
+ *  vChecks is emptied. */
+bool CheckProofOfWorkBatch(std::vector<CPoWCheck> &vChecks);
 /** Calculate the minimum amount of work a received block needs, without knowing its direct parent */
 uint64_t ComputeMinWork(uint64_t nBase, int64_t nTime);
 /** Get the number of active peers */
@@ -196,7 +220,11 @@ void Misbehaving(NodeId nodeid, int howmuch);
 
 /** (try to) add transaction to memory pool **/
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fRejectInsaneFee=false);
+                        bool* pfMissingInputs, bool fRejectInsaneFee=false, int64_t nAcceptTime=0);
+/** Write the memory pool to mempool.dat */
+bool DumpMempool();
+/** Add the transactions of mempool.dat to the memory pool, a batch at a time */
+bool LoadMempool();
 
 
 
@@ -240,6 +268,52 @@ struct CDiskBlockPos
     bool IsNull() const { return (nFile == -1); }
 };
 
+/** Prime gap of a block in the main chain, as stored by -primeindex */
+struct CPrimeRecord
+{
+    int nHeight;
+    uint256 hashBlock;
+    unsigned int nTime;
+    uint64_t nMerit;
+    uint64_t nGapLen;
+    std::vector<uint8_t> vGapStart;
+    std::vector<uint8_t> vGapEnd;
+    std::vector<CScript> vMinerScripts; // coinbase outputs
+
+    IMPLEMENT_SERIALIZE(
+        READWRITE(nHeight);
+        READWRITE(hashBlock);
+        READWRITE(nTime);
+        READWRITE(nMerit);
+        READWRITE(nGapLen);
+        READWRITE(vGapStart);
+        READWRITE(vGapEnd);
+        READWRITE(vMinerScripts);
+    )
+
+    CPrimeRecord() {
+        SetNull();
+    }
+
+    CPrimeRecord(const CBlock &block, int nHeightIn);
+
+    void SetNull() {
+        nHeight = 0;
+        hashBlock = 0;
+        nTime = 0;
+        nMerit = 0;
+        nGapLen = 0;
+        vGapStart.clear();
+        vGapEnd.clear();
+        vMinerScripts.clear();
+    }
+
+    // -primeindex groups the records by integer merit
+    unsigned int GetMeritBucket() const {
+        return (unsigned int)(nMerit >> 48);
+    }
+};
+
 struct CDiskTxPos : public CDiskBlockPos
 {
     unsigned int nTxOffset; // after header
@@ -413,14 +487,21 @@ private:
     unsigned int nIn;
     unsigned int nFlags;
     int nHashType;
+    // Shared by the checks of all inputs of ptxTo, if set
+    boost::shared_ptr<const CSignatureHasher> phasher;
 
 public:
     CScriptCheck() {}
-    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn) :
+    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn,
+                 const boost::shared_ptr<const CSignatureHasher>& phasherIn = boost::shared_ptr<const CSignatureHasher>()) :
         scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
-        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn) { }
+        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn), phasher(phasherIn) { }
 
     bool operator()() const;
+    // Run the script leaving the signatures it can to batch, see EvalScript
+    bool operator()(CSecp256k1Batch& batch) const;
+
+    void DropFlags(unsigned int nFlagsDrop) { nFlags &= ~nFlagsDrop; }
 
     void swap(CScriptCheck &check) {
         scriptPubKey.swap(check.scriptPubKey);
@@ -428,6 +509,39 @@ public:
         std::swap(nIn, check.nIn);
         std::swap(nFlags, check.nFlags);
         std::swap(nHashType, check.nHashType);
+        phasher.swap(check.phasher);
+    }
+};
+
+/** Run the script checks with their signatures verified as one batch */
+bool RunChecks(std::vector<CScriptCheck>& vChecks);
+
+/** Closure representing one proof-of-work verification */
+class CPoWCheck
+{
+private:
+    uint256 hash;
+    uint16_t nShift;
+    std::vector<uint8_t> nAdd;
+    uint64_t nDifficulty;
+
+public:
+    CPoWCheck() : nShift(0), nDifficulty(0) {}
+    CPoWCheck(const uint256 &hashIn, uint16_t nShiftIn, const std::vector<uint8_t> &nAddIn, uint64_t nDifficultyIn) :
+        hash(hashIn), nShift(nShiftIn), nAdd(nAddIn), nDifficulty(nDifficultyIn) { }
+    CPoWCheck(const CBlockHeader &header) :
+        hash(header.GetHash()), nShift(header.nShift), nAdd(header.nAdd), nDifficulty(header.nDifficulty) { }
+
+    bool operator()() const;
+
+    // The block hash does not cover nShift and nAdd, this hash does
+    uint256 GetProofHash() const;
+
+    void swap(CPoWCheck &check) {
+        std::swap(hash, check.hash);
+        std::swap(nShift, check.nShift);
+        nAdd.swap(check.nAdd);
+        std::swap(nDifficulty, check.nDifficulty);
     }
 };
 
@@ -8,12 +8,20 @@
 #include "core.h"
 #include "main.h"
 #include "net.h"
+#include "powcache.h"
 #ifdef ENABLE_WALLET
+#include "gapsieve.h"
+#include "miningstats.h"
 #include "wallet.h"
 #include "PoWCore/src/PoW.h"
 #include "PoWCore/src/PoWProcessor.h"
 #include "PoWCore/src/PoWUtils.h"
 #include "PoWCore/src/Sieve.h"
+
+#include <deque>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/signals2/signal.hpp>
 #endif
 //////////////////////////////////////////////////////////////////////////////
 //
@@ -48,37 +56,142 @@ class BlockProcessor : public PoWProcessor {
 
 };
 
+/**
+ * What CreateNewBlock checks about a mempool transaction. It is kept across
+ * calls, so the coins view and the script checks are only hit for
+ * transactions that are new since the last template. Size, fee, sigops and
+ * priority come precomputed with the CTxMemPoolEntry.
+ */
+class CTemplateTx
+{
+public:
+    bool fValid;                 // inputs and scripts checked against the tip
+    set<uint256> setDependsOn;   // inputs spent from other mempool transactions
 
-// Some explaining would be appreciated
-class COrphan
+    CTemplateTx() : fValid(false) {}
+};
+
+/**
+ * The per transaction state of CreateNewBlock. A block on top of the last
+ * tip only drops the transactions that spent mempool outputs or failed
+ * their checks; anything else, like a reorganization, starts over.
+ */
+class CBlockAssembler
 {
+private:
+    CBlockIndex* pindexLast;
+    map<uint256, CTemplateTx> mapTemplateTx;
+
 public:
-    const CTransaction* ptx;
-    set<uint256> setDependsOn;
-    double dPriority;
-    double dFeePerKb;
+    CBlockAssembler() : pindexLast(NULL) {}
 
-    COrphan(const CTransaction* ptxIn)
+    /** Drop what is no longer valid on top of pindexPrev or no longer in the mempool */
+    void Update(CBlockIndex* pindexPrev)
     {
-        ptx = ptxIn;
-        dPriority = dFeePerKb = 0;
+        AssertLockHeld(cs_main);
+        AssertLockHeld(mempool.cs);
+
+        map<uint256, CTemplateTx>::iterator it;
+        if (pindexPrev != pindexLast)
+        {
+            if (pindexLast == NULL || pindexPrev->pprev != pindexLast)
+                mapTemplateTx.clear();
+            for (it = mapTemplateTx.begin(); it != mapTemplateTx.end(); )
+            {
+                if (!it->second.fValid || !it->second.setDependsOn.empty())
+                    mapTemplateTx.erase(it++);
+                else
+                    ++it;
+            }
+            pindexLast = pindexPrev;
+        }
+
+        for (it = mapTemplateTx.begin(); it != mapTemplateTx.end(); )
+        {
+            if (!mempool.mapTx.count(it->first))
+                mapTemplateTx.erase(it++);
+            else
+                ++it;
+        }
     }
 
-    void print() const
+    /** The state of the mempool transaction tx, computed on first use; NULL if
+     *  an input is missing. view must bring the mempool into view. */
+    const CTemplateTx* Get(const uint256& hash, const CTransaction& tx, CCoinsViewCache& view)
     {
-        LogPrintf("COrphan(hash=%s, dPriority=%.1f, dFeePerKb=%.1f)\n",
-               ptx->GetHash().ToString(), dPriority, dFeePerKb);
-        BOOST_FOREACH(uint256 hash, setDependsOn)
-            LogPrintf("   setDependsOn %s\n", hash.ToString());
+        map<uint256, CTemplateTx>::iterator it = mapTemplateTx.find(hash);
+        if (it != mapTemplateTx.end())
+            return &it->second;
+
+        CTemplateTx entry;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        {
+            // Has to wait for dependencies
+            if (mempool.mapTx.count(txin.prevout.hash))
+            {
+                entry.setDependsOn.insert(txin.prevout.hash);
+                continue;
+            }
+
+            // This should never happen; all transactions in the memory
+            // pool should connect to either transactions in the chain
+            // or other transactions in the memory pool.
+            if (!view.HaveCoins(txin.prevout.hash))
+            {
+                LogPrintf("ERROR: mempool transaction missing input\n");
+                if (fDebug) assert("mempool transaction missing input" == 0);
+                return NULL;
+            }
+        }
+
+        CValidationState state;
+        entry.fValid = view.HaveInputs(tx) && CheckInputs(tx, state, view, true, SCRIPT_VERIFY_P2SH);
+
+        it = mapTemplateTx.insert(make_pair(hash, entry)).first;
+        return &it->second;
+    }
+
+    /** Whether the mempool transaction tx can go into a block on top of pindexPrev */
+    bool IsIncludable(const uint256& hash, const CTransaction& tx, CBlockIndex* pindexPrev, CCoinsViewCache& view)
+    {
+        if (tx.IsCoinBase() || !IsFinalTx(tx, pindexPrev->nHeight + 1))
+            return false;
+        const CTemplateTx* pentry = Get(hash, tx, view);
+        return pentry && pentry->fValid;
     }
 };
 
+static CBlockAssembler blockassembler;
+
 
 uint64_t nLastBlockTx = 0;
 uint64_t nLastBlockSize = 0;
 
+// Mining parameters, written by setgenerate and TuneMiningParams while the
+// miner threads read them
+static CCriticalSection cs_miningParams;
+static uint64_t nMiningSieveSize = 33554432;
+static uint64_t nMiningPrimes = 900000;
+static uint16_t nMiningShift = 25;
+
+void GetMiningParams(uint64_t& nSieveSize, uint64_t& nPrimes, uint16_t& nShift)
+{
+    LOCK(cs_miningParams);
+    nSieveSize = nMiningSieveSize;
+    nPrimes    = nMiningPrimes;
+    nShift     = nMiningShift;
+}
+
+void SetMiningParams(uint64_t nSieveSize, uint64_t nPrimes, uint16_t nShift)
+{
+    LOCK(cs_miningParams);
+    nMiningSieveSize = nSieveSize;
+    nMiningPrimes    = nPrimes;
+    nMiningShift     = nShift;
+}
+
 // We want to sort transactions by priority and fee, so:
-typedef boost::tuple<double, double, const CTransaction*> TxPriority;
+typedef boost::tuple<double, double, const CTxMemPoolEntry*, uint256> TxPriority;
 class TxPriorityCompare
 {
     bool byFee;
@@ -101,6 +214,88 @@ public:
     }
 };
 
+/** Totals of a package whose ancestors are partly in the block already */
+struct CPackage
+{
+    uint64_t nSize;
+    int64_t nFees;
+    unsigned int nSigOps;
+
+    double GetFeePerKb() const { return double(nFees) / (double(nSize) / 1000.0); }
+};
+
+/** The transactions picked for a new block so far */
+class CTemplateSelection
+{
+public:
+    CBlockTemplate* pblocktemplate;
+    uint64_t nBlockSize;
+    uint64_t nBlockTx;
+    int nBlockSigOps;
+    int64_t nFees;
+    set<uint256> setInBlock;
+    set<COutPoint> setSpent;
+
+    // Packages with ancestors in the block, with what is left of them, by
+    // the fee rate of that
+    map<uint256, CPackage> mapModified;
+    set<CFeeRateKey> setModified;
+    // Packages that didn't fit or couldn't go in; they don't get better
+    set<uint256> setFailed;
+
+    CTemplateSelection(CBlockTemplate* pblocktemplateIn) :
+        pblocktemplate(pblocktemplateIn), nBlockSize(1000), nBlockTx(0), nBlockSigOps(100), nFees(0) {}
+
+    // Inputs were checked against the tip and the mempool, which leaves
+    // double spends between mempool transactions
+    bool IsSpent(const CTransaction& tx) const
+    {
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            if (setSpent.count(txin.prevout))
+                return true;
+        return false;
+    }
+
+    void Add(const uint256& hash, const CTxMemPoolEntry& entry)
+    {
+        const CTransaction& tx = entry.GetTx();
+        pblocktemplate->block.vtx.push_back(tx);
+        pblocktemplate->vTxFees.push_back(entry.GetFee());
+        pblocktemplate->vTxSigOps.push_back(entry.GetSigOpCount());
+        nBlockSize += entry.GetTxSize();
+        ++nBlockTx;
+        nBlockSigOps += entry.GetSigOpCount();
+        nFees += entry.GetFee();
+        setInBlock.insert(hash);
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            setSpent.insert(txin.prevout);
+
+        // Its descendants no longer pay for it
+        set<uint256> setDescendants;
+        mempool.CalculateDescendants(hash, setDescendants);
+        BOOST_FOREACH(const uint256& hashDescendant, setDescendants)
+        {
+            // Not back in with totals that still count this transaction
+            if (setFailed.count(hashDescendant))
+                continue;
+            map<uint256, CPackage>::iterator it = mapModified.find(hashDescendant);
+            if (it == mapModified.end())
+            {
+                const CTxMemPoolEntry& descendant = mempool.mapTx[hashDescendant];
+                CPackage package = { descendant.GetSizeWithAncestors(), descendant.GetFeesWithAncestors(),
+                                     descendant.GetSigOpsWithAncestors() };
+                it = mapModified.insert(make_pair(hashDescendant, package)).first;
+            }
+            else
+                setModified.erase(CFeeRateKey(it->second.GetFeePerKb(), hashDescendant));
+            it->second.nSize -= entry.GetTxSize();
+            it->second.nFees -= entry.GetFee();
+            it->second.nSigOps -= entry.GetSigOpCount();
+            setModified.insert(CFeeRateKey(it->second.GetFeePerKb(), hashDescendant));
+        }
+    }
+};
+
 CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
 {
     // Create new block
@@ -141,180 +336,199 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
     {
         LOCK2(cs_main, mempool.cs);
         CBlockIndex* pindexPrev = chainActive.Tip();
-        CCoinsViewCache view(*pcoinsTip, true);
+        blockassembler.Update(pindexPrev);
+
+        // Only used for transactions that are new since the last template
+        CCoinsViewMemPool viewMemPool(*pcoinsTip, mempool);
+        CCoinsViewCache view(viewMemPool, true);
 
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
+        CTemplateSelection selection(pblocktemplate.get());
         bool fPrintPriority = GetBoolArg("-printpriority", false);
 
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.begin();
-             mi != mempool.mapTx.end(); ++mi)
+        // High-priority transactions first, regardless of the fees they pay
+        if (nBlockPrioritySize > 0)
         {
-            const CTransaction& tx = mi->second.GetTx();
-            if (tx.IsCoinBase() || !IsFinalTx(tx, pindexPrev->nHeight + 1))
-                continue;
-
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            int64_t nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            // Transactions waiting for mempool inputs, by the inputs they spend
+            map<uint256, vector<TxPriority> > mapDependers;
+            map<uint256, unsigned int> mapDependsLeft;
+
+            // This vector will be sorted into a priority queue:
+            vector<TxPriority> vecPriority;
+            vecPriority.reserve(mempool.mapTx.size());
+            for (map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.begin();
+                 mi != mempool.mapTx.end(); ++mi)
             {
-                // Read prev transaction
-                if (!view.HaveCoins(txin.prevout.hash))
-                {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].GetTx().vout[txin.prevout.n].nValue;
+                if (!blockassembler.IsIncludable(mi->first, mi->second.GetTx(), pindexPrev, view))
                     continue;
-                }
-                const CCoins &coins = view.GetCoins(txin.prevout.hash);
-
-                int64_t nValueIn = coins.vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = pindexPrev->nHeight - coins.nHeight + 1;
 
-                dPriority += (double)nValueIn * nConf;
+                // The priority in the next block
+                TxPriority txPriority(mi->second.GetPriority(pindexPrev->nHeight + 1), mi->second.GetFeePerKb(),
+                                      &mi->second, mi->first);
+                const set<uint256>& setParents = mi->second.GetParents();
+                if (!setParents.empty())
+                {
+                    BOOST_FOREACH(const uint256& hashParent, setParents)
+                        mapDependers[hashParent].push_back(txPriority);
+                    mapDependsLeft[mi->first] = setParents.size();
+                }
+                else
+                    vecPriority.push_back(txPriority);
             }
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / modified_txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority = tx.ComputePriority(dPriority, nTxSize);
 
-            // This is a more accurate fee-per-kilobyte than is used by the client code, because the
-            // client code rounds up the size to the nearest 1K. That's good, because it gives an
-            // incentive to create smaller transactions.
-            double dFeePerKb =  double(nTotalIn-tx.GetValueOut()) / (double(nTxSize)/1000.0);
+            TxPriorityCompare comparer(false);
+            std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
 
-            if (porphan)
+            while (!vecPriority.empty())
             {
-                porphan->dPriority = dPriority;
-                porphan->dFeePerKb = dFeePerKb;
-            }
-            else
-                vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &mi->second.GetTx()));
-        }
+                // Take highest priority transaction off the priority queue:
+                double dPriority = vecPriority.front().get<0>();
+                double dFeePerKb = vecPriority.front().get<1>();
+                const CTxMemPoolEntry& entry = *(vecPriority.front().get<2>());
+                uint256 hash = vecPriority.front().get<3>();
+
+                std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                vecPriority.pop_back();
+
+                // Size limits
+                unsigned int nTxSize = entry.GetTxSize();
+                if (selection.nBlockSize + nTxSize >= nBlockMaxSize)
+                    continue;
 
-        // Collect transactions into block
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
+                // Legacy and pay-to-script-hash limits on sigOps:
+                if (selection.nBlockSigOps + entry.GetSigOpCount() >= MAX_BLOCK_SIGOPS)
+                    continue;
 
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                // The rest goes by fee once past the priority size or we run out
+                // of high-priority transactions:
+                if ((selection.nBlockSize + nTxSize >= nBlockPrioritySize) || !AllowFree(dPriority))
+                    break;
 
-        while (!vecPriority.empty())
-        {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            double dFeePerKb = vecPriority.front().get<1>();
-            const CTransaction& tx = *(vecPriority.front().get<2>());
-
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
+                if (selection.IsSpent(entry.GetTx()))
+                    continue;
 
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
+                selection.Add(hash, entry);
 
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
+                if (fPrintPriority)
+                {
+                    LogPrintf("priority %.1f feeperkb %.1f txid %s\n",
+                           dPriority, dFeePerKb, hash.ToString());
+                }
 
-            // Skip free transactions if we're past the minimum block size:
-            if (fSortedByFee && (dFeePerKb < CTransaction::nMinRelayTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
+                // Add transactions that depend on this one to the priority queue
+                map<uint256, vector<TxPriority> >::iterator itDependers = mapDependers.find(hash);
+                if (itDependers != mapDependers.end())
+                {
+                    BOOST_FOREACH(const TxPriority& txPriority, itDependers->second)
+                    {
+                        if (--mapDependsLeft[txPriority.get<3>()] == 0)
+                        {
+                            vecPriority.push_back(txPriority);
+                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                        }
+                    }
+                }
+            }
+        }
 
-            // Prioritize by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || !AllowFree(dPriority)))
+        // Then by the fee rate of each transaction together with its mempool
+        // ancestors that are not in the block yet, so a child can pay for its
+        // parents. Packages that lost ancestors to the block compete with what
+        // is left of them from selection.setModified.
+        set<uint256>& setFailed = selection.setFailed;
+        int nConsecutiveFailed = 0;
+        set<CFeeRateKey>::const_reverse_iterator mi = mempool.setAncestorFeeRate.rbegin();
+        while (true)
+        {
+            while (mi != mempool.setAncestorFeeRate.rend() &&
+                   (selection.setInBlock.count(mi->second) || setFailed.count(mi->second) ||
+                    selection.mapModified.count(mi->second)))
+                ++mi;
+
+            uint256 hash;
+            CPackage package;
+            if (!selection.setModified.empty() &&
+                (mi == mempool.setAncestorFeeRate.rend() || selection.setModified.rbegin()->first > mi->first))
             {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                hash = selection.setModified.rbegin()->second;
+                package = selection.mapModified[hash];
+                selection.setModified.erase(--selection.setModified.end());
+                selection.mapModified.erase(hash);
+                if (setFailed.count(hash))
+                    continue;
             }
+            else if (mi != mempool.setAncestorFeeRate.rend())
+            {
+                hash = mi->second;
+                const CTxMemPoolEntry& entry = mempool.mapTx[hash];
+                package.nSize = entry.GetSizeWithAncestors();
+                package.nFees = entry.GetFeesWithAncestors();
+                package.nSigOps = entry.GetSigOpsWithAncestors();
+                ++mi;
+            }
+            else
+                break;
 
-            if (!view.HaveInputs(tx))
-                continue;
-
-            int64_t nTxFees = view.GetValueIn(tx)-tx.GetValueOut();
-
-            nTxSigOps += GetP2SHSigOpCount(tx, view);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            CValidationState state;
-            if (!CheckInputs(tx, state, view, true, SCRIPT_VERIFY_P2SH))
+            // Size and sigOp limits
+            if (selection.nBlockSize + package.nSize >= nBlockMaxSize ||
+                selection.nBlockSigOps + package.nSigOps >= MAX_BLOCK_SIGOPS)
+            {
+                setFailed.insert(hash);
+                // Give up once the block is close to full
+                if (++nConsecutiveFailed > 1000 && selection.nBlockSize + 4000 > nBlockMaxSize)
+                    break;
                 continue;
+            }
 
-            CTxUndo txundo;
-            uint256 hash = tx.GetHash();
-            UpdateCoins(tx, state, view, txundo, pindexPrev->nHeight+1, hash);
-
-            // Added
-            pblock->vtx.push_back(tx);
-            pblocktemplate->vTxFees.push_back(nTxFees);
-            pblocktemplate->vTxSigOps.push_back(nTxSigOps);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
+            // Stop at free transactions if we're past the minimum block size,
+            // nothing after them pays more:
+            if (package.GetFeePerKb() < CTransaction::nMinRelayTxFee &&
+                selection.nBlockSize + package.nSize >= nBlockMinSize)
+                break;
 
-            if (fPrintPriority)
+            // The package, parents first: a transaction has more ancestors than any of them
+            set<uint256> setAncestors;
+            mempool.CalculateAncestors(hash, setAncestors);
+            vector<pair<uint64_t, uint256> > vPackage;
+            vPackage.push_back(make_pair(mempool.mapTx[hash].GetCountWithAncestors(), hash));
+            BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
+                if (!selection.setInBlock.count(hashAncestor))
+                    vPackage.push_back(make_pair(mempool.mapTx[hashAncestor].GetCountWithAncestors(), hashAncestor));
+            sort(vPackage.begin(), vPackage.end());
+
+            bool fIncludable = true;
+            set<COutPoint> setPackageSpent;
+            for (unsigned int i = 0; i < vPackage.size() && fIncludable; i++)
+            {
+                const CTxMemPoolEntry& entry = mempool.mapTx[vPackage[i].second];
+                fIncludable = blockassembler.IsIncludable(vPackage[i].second, entry.GetTx(), pindexPrev, view) &&
+                              !selection.IsSpent(entry.GetTx());
+                BOOST_FOREACH(const CTxIn& txin, entry.GetTx().vin)
+                    fIncludable = fIncludable && setPackageSpent.insert(txin.prevout).second;
+            }
+            if (!fIncludable)
             {
-                LogPrintf("priority %.1f feeperkb %.1f txid %s\n",
-                       dPriority, dFeePerKb, tx.GetHash().ToString());
+                setFailed.insert(hash);
+                continue;
             }
 
-            // Add transactions that depend on this one to the priority queue
-            if (mapDependers.count(hash))
+            nConsecutiveFailed = 0;
+            for (unsigned int i = 0; i < vPackage.size(); i++)
             {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
+                const CTxMemPoolEntry& entry = mempool.mapTx[vPackage[i].second];
+                selection.Add(vPackage[i].second, entry);
+
+                if (fPrintPriority)
                 {
-                    if (!porphan->setDependsOn.empty())
-                    {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                        {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
+                    LogPrintf("priority %.1f feeperkb %.1f packagefeeperkb %.1f txid %s\n",
+                           entry.GetPriority(pindexPrev->nHeight + 1), entry.GetFeePerKb(),
+                           package.GetFeePerKb(), vPackage[i].second.ToString());
                 }
             }
         }
 
-        nLastBlockTx = nBlockTx;
+        uint64_t nBlockSize = selection.nBlockSize;
+        nFees = selection.nFees;
+        nLastBlockTx = selection.nBlockTx;
         nLastBlockSize = nBlockSize;
         LogPrintf("CreateNewBlock(): total size %u\n", nBlockSize);
 
@@ -322,7 +536,10 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
         pblock->hashPrevBlock  = pindexPrev->GetBlockHash();
         UpdateTime(*pblock, pindexPrev);
         pblock->nDifficulty    = GetNextWorkRequired(pindexPrev, pblock);
-        pblock->nShift         = nMiningShift;
+        {
+            LOCK(cs_miningParams);
+            pblock->nShift     = nMiningShift;
+        }
         pblock->nNonce         = 0;
 
         pblock->vtx[0].vout[0].nValue = GetBlockValue(pindexPrev->nHeight+1, nFees, GetNextWorkRequired(pindexPrev, pblock));
@@ -369,9 +586,6 @@ void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int&
 double dHashesPerSec = 0.0;
 double dTestsPerSec = 0.0;
 double d15GapsPerHour = 0.0;
-uint64_t nMiningSieveSize = 33554432;
-uint64_t nMiningPrimes = 900000;
-uint16_t nMiningShift = 25;
 static std::vector<double> dThreadHashesPerSec;
 static std::vector<double> dThreadTestsPerSec;
 
@@ -387,20 +601,15 @@ CBlockTemplate* CreateNewBlockWithKey(CReserveKey& reservekey)
 
 bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey)
 {
-    uint256 hash = pblock->GetHash();
-    PoW pow(new std::vector<uint8_t>(hash.begin(), hash.end()), 
-            pblock->nShift, 
-            &pblock->nAdd, 
-            pblock->nDifficulty);
-
-    uint64_t nDifficulty = pow.difficulty();
-
-    if (nDifficulty < pblock->nDifficulty)
+    // ProcessBlock will find the result in powcache
+    if (!powcache.Get(*pblock).fValid)
         return false;
 
+    CPoWResult result = powcache.Get(*pblock, true);
+
     //// debug print
     LogPrintf("GapcoinMiner:\n");
-    LogPrintf("proof-of-work found  \ndifficulty: %" PRIu64 "  \ntarget: %" PRIu64 "\n", nDifficulty, pblock->nDifficulty);
+    LogPrintf("proof-of-work found  \nmerit: %" PRIu64 "  \ngaplen: %" PRIu64 "  \ntarget: %" PRIu64 "\n", result.nMerit, result.nGapLen, pblock->nDifficulty);
     pblock->print();
     LogPrintf("generated %s\n", FormatMoney(pblock->vtx[0].vout[0].nValue));
 
@@ -428,7 +637,352 @@ bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey)
     return true;
 }
 
-void static GapcoinMiner(CWallet *pwallet, uint64_t nThread, uint64_t numThreads)
+/* header hash has to be greater than 2^255 - 1 */
+static const uint256 hashMinerTarget("0x7FFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFF");
+
+/** Number of qualifying hashes kept ready per miner */
+static const unsigned int HASH_QUEUE_SIZE = 16;
+/** Number of nonces hashed at once, outside of the lock */
+static const unsigned int HASH_BATCH_SIZE = 8;
+
+/**
+ * Searches the nonces of the miners' block headers for hashes above
+ * hashMinerTarget in its own thread, so the sieve never waits on hashing.
+ * Everything in front of nNonce is hashed once per header, every nonce
+ * then only costs the last SHA-256 block and the outer hash.
+ */
+class CHashProducer
+{
+private:
+    struct CHashWork
+    {
+        // Header fields in front of nNonce, NULL while there is no header
+        boost::shared_ptr<const CMidstateHash> pmidstate;
+        unsigned int nNextNonce;
+        unsigned int nNonceStep;
+
+        // Changes with every new header, to drop batches of an old one
+        unsigned int nGeneration;
+
+        // Ready (nonce, hash) pairs
+        std::deque<std::pair<unsigned int, uint256> > queue;
+
+        CHashWork() : nNextNonce(0), nNonceStep(1), nGeneration(0) {}
+    };
+
+    boost::mutex mutex;
+
+    // The producer waits on this while all queues are full
+    boost::condition_variable condProducer;
+
+    // Miners wait on this while their queue is empty
+    boost::condition_variable condConsumer;
+
+    std::vector<CHashWork> vWork;
+
+public:
+    /** Register a miner, returns its id */
+    unsigned int AddConsumer()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        vWork.push_back(CHashWork());
+        return vWork.size() - 1;
+    }
+
+    /** Search header from nonce nFirstNonce on, in steps of nNonceStep */
+    void SetHeader(unsigned int nConsumer, const CBlockHeader& header, unsigned int nFirstNonce, unsigned int nNonceStep)
+    {
+        boost::shared_ptr<const CMidstateHash> pmidstate(new CMidstateHash(
+                (const unsigned char*)BEGIN(header.nVersion), (const unsigned char*)BEGIN(header.nNonce)));
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        CHashWork& work = vWork[nConsumer];
+        work.pmidstate  = pmidstate;
+        work.nNextNonce = nFirstNonce;
+        work.nNonceStep = nNonceStep;
+        work.nGeneration++;
+        work.queue.clear();
+        condProducer.notify_one();
+    }
+
+    /** Next qualifying nonce and hash of the miner's header */
+    void Pop(unsigned int nConsumer, unsigned int& nNonce, uint256& hash)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        CHashWork& work = vWork[nConsumer];
+        while (work.queue.empty())
+            condConsumer.wait(lock);
+
+        nNonce = work.queue.front().first;
+        hash   = work.queue.front().second;
+        work.queue.pop_front();
+        condProducer.notify_one();
+    }
+
+    /** Producer thread, runs until interrupted */
+    void Thread(CMiningThreadStats* pstats)
+    {
+        std::vector<std::pair<unsigned int, uint256> > vBatch;
+        while (true)
+        {
+            boost::shared_ptr<const CMidstateHash> pmidstate;
+            unsigned int nConsumer = 0, nGeneration = 0, nNonce = 0, nStep = 1;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!pmidstate)
+                {
+                    for (nConsumer = 0; nConsumer < vWork.size(); nConsumer++)
+                    {
+                        CHashWork& work = vWork[nConsumer];
+                        if (work.pmidstate && work.queue.size() < HASH_QUEUE_SIZE)
+                        {
+                            // reserve a batch of nonces
+                            pmidstate   = work.pmidstate;
+                            nGeneration = work.nGeneration;
+                            nNonce      = work.nNextNonce;
+                            nStep       = work.nNonceStep;
+                            work.nNextNonce += nStep * HASH_BATCH_SIZE;
+                            break;
+                        }
+                    }
+                    if (!pmidstate)
+                        condProducer.wait(lock);
+                }
+            }
+
+            vBatch.clear();
+            int64_t nTimeStart = GetTimeMicros();
+            for (unsigned int i = 0; i < HASH_BATCH_SIZE; i++, nNonce += nStep)
+            {
+                uint256 hash = pmidstate->GetHash((const unsigned char*)BEGIN(nNonce), (const unsigned char*)END(nNonce));
+                if (hash > hashMinerTarget)
+                    vBatch.push_back(std::make_pair(nNonce, hash));
+            }
+            pstats->nHashes     += HASH_BATCH_SIZE;
+            pstats->nHashMicros += GetTimeMicros() - nTimeStart;
+
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                CHashWork& work = vWork[nConsumer];
+                if (work.nGeneration == nGeneration && !vBatch.empty())
+                {
+                    work.queue.insert(work.queue.end(), vBatch.begin(), vBatch.end());
+                    condConsumer.notify_all();
+                }
+            }
+        }
+    }
+};
+
+
+/** Seconds between template rebuilds for new mempool transactions */
+static const int MINER_TEMPLATE_REFRESH = 10;
+
+/** A block template shared by all internal miners */
+struct CMinerWork
+{
+    boost::shared_ptr<CBlockTemplate> ptemplate;
+    CBlockIndex* pindexPrev;
+
+    // Merkle branch of the coinbase, the only transaction the miners change
+    std::vector<uint256> vMerkleBranch;
+
+    CMinerWork() : pindexPrev(NULL) {}
+
+    /** Copy the template into block, with the miner's own coinbase */
+    void MakeBlock(CBlock& block, const CScript& scriptPubKey, unsigned int nExtraNonce) const
+    {
+        block = ptemplate->block;
+        block.vMerkleTree.clear();
+
+        unsigned int nHeight = pindexPrev->nHeight+1; // Height first in coinbase required for block.version=2
+        block.vtx[0].vout[0].scriptPubKey = scriptPubKey;
+        block.vtx[0].vin[0].scriptSig = (CScript() << nHeight << CBigNum(nExtraNonce)) + COINBASE_FLAGS;
+        assert(block.vtx[0].vin[0].scriptSig.size() <= 100);
+
+        block.hashMerkleRoot = CBlock::CheckMerkleBranch(block.vtx[0].GetHash(), vMerkleBranch, 0);
+    }
+};
+
+/**
+ * Builds the block templates of the internal miners. A new tip wakes it
+ * up right away (see cvBlockChange); it then tells the miners to drop
+ * their work, which aborts shared sieves mid-round, and builds a single
+ * template for all of them. New mempool transactions are picked up at
+ * most every MINER_TEMPLATE_REFRESH seconds and do not make the current
+ * work stale: the miners switch over at their next hash, patching just
+ * their coinbase and the merkle root into the new template.
+ */
+class CMinerTemplates
+{
+private:
+    boost::mutex mutex;
+
+    // Miners wait on this for a template of the current tip
+    boost::condition_variable condMiner;
+
+    // The newest template
+    boost::shared_ptr<const CMinerWork> pwork;
+
+    // The newest tip, the template may not be built on it yet
+    CBlockIndex* pindexTip;
+
+public:
+    /** Called when a new tip shows up, before its template is ready */
+    boost::signals2::signal<void ()> NotifyNewTip;
+
+    CMinerTemplates() : pindexTip(NULL) {}
+
+    /** Newest template, waits until there is one for the current tip */
+    boost::shared_ptr<const CMinerWork> GetWork()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (!pwork || pwork->pindexPrev != pindexTip)
+            condMiner.wait(lock);
+        return pwork;
+    }
+
+    /** Whether a block of pworkIn would no longer extend the tip */
+    bool IsStale(const CMinerWork* pworkIn)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return pworkIn->pindexPrev != pindexTip;
+    }
+
+    /** Whether pworkIn is still the newest template */
+    bool IsCurrent(const CMinerWork* pworkIn)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return pworkIn == pwork.get() && pworkIn->pindexPrev == pindexTip;
+    }
+
+    /** Template builder thread, runs until interrupted */
+    void Thread(CMiningThreadStats* pstats)
+    {
+        const CScript scriptDummy = CScript() << OP_TRUE;
+        unsigned int nTransactionsUpdatedLast = 0;
+        int64_t nLastBuild = 0;
+
+        while (true)
+        {
+            // Only this thread changes pindexTip, so it can read it unlocked
+            CBlockIndex* pindexNew;
+            {
+                boost::unique_lock<CWaitableCriticalSection> lock(csBestBlock);
+                while ((pindexNew = chainActive.Tip()) == pindexTip &&
+                       (mempool.GetTransactionsUpdated() == nTransactionsUpdatedLast ||
+                        GetTime() - nLastBuild < MINER_TEMPLATE_REFRESH))
+                    cvBlockChange.timed_wait(lock, boost::posix_time::seconds(1));
+            }
+
+            int64_t nTimeStart = GetTimeMicros();
+            bool fNewTip = (pindexNew != pindexTip);
+            if (fNewTip)
+            {
+                {
+                    boost::unique_lock<boost::mutex> lock(mutex);
+                    pindexTip = pindexNew;
+                }
+                NotifyNewTip();
+            }
+
+            nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
+            nLastBuild = GetTime();
+
+            boost::shared_ptr<CMinerWork> pworkNew(new CMinerWork());
+            pworkNew->ptemplate.reset(CreateNewBlock(scriptDummy));
+            if (!pworkNew->ptemplate)
+                return;
+
+            const CBlock& block = pworkNew->ptemplate->block;
+            {
+                LOCK(cs_main);
+                pworkNew->pindexPrev = mapBlockIndex[block.hashPrevBlock];
+            }
+            pworkNew->vMerkleBranch = block.GetMerkleBranch(0);
+
+            LogPrint("miner", "GapcoinTemplates: %s, %u transactions in block (%u bytes)\n",
+                     fNewTip ? "new tip" : "new transactions", block.vtx.size(),
+                     ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION));
+
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                pwork = pworkNew;
+                condMiner.notify_all();
+            }
+
+            pstats->nTemplates++;
+            pstats->nTemplateMicros += GetTimeMicros() - nTimeStart;
+        }
+    }
+};
+
+/** Gives up the sieve as soon as the block is stale */
+class MinerBlockProcessor : public BlockProcessor {
+
+  public:
+
+    MinerBlockProcessor(CBlock *pblock, CWallet *wallet, CReserveKey *reservekey,
+                        CMinerTemplates *ptemplates, const CMinerWork *pwork,
+                        CMiningThreadStats *pstats = NULL) :
+      BlockProcessor(pblock, wallet, reservekey) {
+      this->ptemplates = ptemplates;
+      this->pwork = pwork;
+      this->pstats = pstats;
+    }
+
+    bool process(PoW *pow) {
+      if (pstats)
+        pstats->AddGap(pow->merit());
+
+      if (ptemplates->IsStale(pwork))
+        return false;
+
+      return BlockProcessor::process(pow);
+    }
+
+  private:
+
+    CMinerTemplates *ptemplates;
+    const CMinerWork *pwork;
+    CMiningThreadStats *pstats;
+
+};
+
+void static GapcoinTemplates(boost::shared_ptr<CMinerTemplates> ptemplates)
+{
+    LogPrintf("GapcoinTemplates started\n");
+    RenameThread("gapcoin-templates");
+
+    boost::shared_ptr<CMiningThreadStats> pstats = miningstats.Register("templates");
+    try {
+        ptemplates->Thread(pstats.get());
+    }
+    catch (boost::thread_interrupted)
+    {
+        LogPrintf("GapcoinTemplates terminated\n");
+        throw;
+    }
+}
+
+void static GapcoinHasher(boost::shared_ptr<CHashProducer> phasher)
+{
+    LogPrintf("GapcoinHasher started\n");
+    RenameThread("gapcoin-hasher");
+
+    boost::shared_ptr<CMiningThreadStats> pstats = miningstats.Register("hasher");
+    try {
+        phasher->Thread(pstats.get());
+    }
+    catch (boost::thread_interrupted)
+    {
+        LogPrintf("GapcoinHasher terminated\n");
+        throw;
+    }
+}
+
+void static GapcoinMiner(CWallet *pwallet, uint64_t nThread, uint64_t numThreads,
+                         boost::shared_ptr<CMinerTemplates> ptemplates, boost::shared_ptr<CHashProducer> phasher)
 {
     LogPrintf("GapcoinMiner started\n");
     SetThreadPriority(THREAD_PRIORITY_LOWEST);
@@ -437,8 +991,15 @@ void static GapcoinMiner(CWallet *pwallet, uint64_t nThread, uint64_t numThreads
     // Each thread has its own key and counter
     CReserveKey reservekey(pwallet);
     unsigned int nExtraNonce = 0;
-    uint256 hashTarget = uint256("0x7FFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFF");
-    Sieve sieve(NULL, nMiningPrimes, nMiningSieveSize); 
+    unsigned int nConsumer = phasher->AddConsumer();
+    boost::shared_ptr<CMiningThreadStats> pstats = miningstats.Register(strprintf("miner %u", nThread));
+    uint64_t nSieveSize, nPrimes;
+    uint16_t nShift;
+    GetMiningParams(nSieveSize, nPrimes, nShift);
+    Sieve sieve(NULL, nPrimes, nSieveSize);
+    CBlockIndex* pindexPrevLast = NULL;
+    CBlock block;
+    CBlock *pblock = &block;
 
     try { while (true) {
         if (Params().NetworkID() != CChainParams::REGTEST) {
@@ -449,41 +1010,52 @@ void static GapcoinMiner(CWallet *pwallet, uint64_t nThread, uint64_t numThreads
         }
 
         //
-        // Create new block
+        // Create new block from the newest template
         //
-        unsigned int nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
-        CBlockIndex* pindexPrev = chainActive.Tip();
+        boost::shared_ptr<const CMinerWork> pwork = ptemplates->GetWork();
+        CBlockIndex* pindexPrev = pwork->pindexPrev;
 
-        auto_ptr<CBlockTemplate> pblocktemplate(CreateNewBlockWithKey(reservekey));
-        if (!pblocktemplate.get())
+        CPubKey pubkey;
+        if (!reservekey.GetReservedKey(pubkey))
             return;
-        CBlock *pblock = &pblocktemplate->block;
-        IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
 
-        LogPrintf("Running GapcoinMiner with %u transactions in block (%u bytes)\n", pblock->vtx.size(),
-               ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION));
+        if (pindexPrev != pindexPrevLast)
+        {
+            nExtraNonce = 0;
+            pindexPrevLast = pindexPrev;
+        }
+        pwork->MakeBlock(*pblock, CScript() << pubkey << OP_CHECKSIG, ++nExtraNonce);
+        UpdateTime(*pblock, pindexPrev);
+
+        LogPrint("miner", "Running GapcoinMiner with %u transactions in block\n", pblock->vtx.size());
 
         //
         // Search
         //
-        BlockProcessor processor(pblock, pwallet, &reservekey);
+        MinerBlockProcessor processor(pblock, pwallet, &reservekey, ptemplates.get(), pwork.get(), pstats.get());
         sieve.set_pprocessor(&processor);
-        int64_t nStart = GetTime();
-        
+
         /* provide unique hashes for each thread */
-        pblock->nNonce = nThread;
+        phasher->SetHeader(nConsumer, *pblock, nThread, numThreads);
 
         while (true)
         {
-            /* header hash has to be greater than 2^255 - 1 */
-            while (pblock->GetHash() <= hashTarget)
-              pblock->nNonce += numThreads;
-            
-            uint256 hash = pblock->GetHash();
+            uint256 hash;
+            int64_t nTimeStart = GetTimeMicros();
+            phasher->Pop(nConsumer, pblock->nNonce, hash);
             std::vector<uint8_t> vHash(hash.begin(), hash.end());
+            int64_t nTimeHashed = GetTimeMicros();
 
             PoW pow(&vHash, pblock->nShift, &pblock->nAdd, pblock->nDifficulty);
             sieve.run_sieve(&pow, NULL);
+            int64_t nTimeSieved = GetTimeMicros();
+
+            // the PoWCore sieve only reports rates, and no candidates
+            pstats->nHashes++;
+            pstats->nHashMicros  += nTimeHashed - nTimeStart;
+            pstats->nSieveRounds++;
+            pstats->nSieveMicros += nTimeSieved - nTimeHashed;
+            pstats->nTests       += (uint64_t) (sieve.tests_per_second() * (nTimeSieved - nTimeHashed) / 1000000.0);
 
             static CCriticalSection cs;
             {
@@ -507,22 +1079,24 @@ void static GapcoinMiner(CWallet *pwallet, uint64_t nThread, uint64_t numThreads
                 }
                 
             }
+            miningstats.LogPeriodically();
             
 
             // Check for stop or if block needs to be rebuilt
             boost::this_thread::interruption_point();
             if (vNodes.empty() && Params().NetworkID() != CChainParams::REGTEST)
                 break;
-            if (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 60)
-                break;
-            if (pindexPrev != chainActive.Tip())
+            if (!ptemplates->IsCurrent(pwork.get()))
                 break;
 
             // Update nTime every few seconds
+            unsigned int nTimeOld = pblock->nTime;
             UpdateTime(*pblock, pindexPrev);
             // Changing pblock->nTime can change work required on testnet:
             if (TestNet())
               break;
+            if (pblock->nTime != nTimeOld)
+                phasher->SetHeader(nConsumer, *pblock, nThread, numThreads);
         }
     } }
     catch (boost::thread_interrupted)
@@ -538,9 +1112,371 @@ void static GapcoinMiner(CWallet *pwallet, uint64_t nThread, uint64_t numThreads
     }
 }
 
+void static GapcoinSieveWorker(boost::shared_ptr<CSharedSieve> psieve, int nThread)
+{
+    LogPrintf("GapcoinSieveWorker started\n");
+    SetThreadPriority(THREAD_PRIORITY_LOWEST);
+    RenameThread("gapcoin-sieve");
+
+    boost::shared_ptr<CMiningThreadStats> pstats = miningstats.Register(strprintf("sieve %d", nThread));
+    try {
+        psieve->Thread(pstats.get());
+    }
+    catch (boost::thread_interrupted)
+    {
+        LogPrintf("GapcoinSieveWorker terminated\n");
+        throw;
+    }
+}
+
+/**
+ * Miner for -sharedsieve: builds the blocks and hands each hash to the
+ * GapcoinSieveWorker threads, which sieve it together.
+ */
+void static GapcoinSharedMiner(CWallet *pwallet, boost::shared_ptr<CSharedSieve> psieve,
+                               boost::shared_ptr<CMinerTemplates> ptemplates, boost::shared_ptr<CHashProducer> phasher)
+{
+    LogPrintf("GapcoinSharedMiner started\n");
+    RenameThread("gapcoin-miner");
+
+    CReserveKey reservekey(pwallet);
+    unsigned int nExtraNonce = 0;
+    unsigned int nConsumer = phasher->AddConsumer();
+    boost::shared_ptr<CMiningThreadStats> pstats = miningstats.Register("sharedminer");
+    CBlockIndex* pindexPrevLast = NULL;
+    CBlock block;
+    CBlock *pblock = &block;
+
+    try { while (true) {
+        if (Params().NetworkID() != CChainParams::REGTEST) {
+            // Busy-wait for the network to come online so we don't waste time mining
+            // on an obsolete chain. In regtest mode we expect to fly solo.
+            while (vNodes.empty())
+                MilliSleep(1000);
+        }
+
+        //
+        // Create new block from the newest template
+        //
+        boost::shared_ptr<const CMinerWork> pwork = ptemplates->GetWork();
+        CBlockIndex* pindexPrev = pwork->pindexPrev;
+
+        CPubKey pubkey;
+        if (!reservekey.GetReservedKey(pubkey))
+            return;
+
+        if (pindexPrev != pindexPrevLast)
+        {
+            nExtraNonce = 0;
+            pindexPrevLast = pindexPrev;
+        }
+        pwork->MakeBlock(*pblock, CScript() << pubkey << OP_CHECKSIG, ++nExtraNonce);
+        UpdateTime(*pblock, pindexPrev);
+
+        LogPrint("miner", "Running GapcoinSharedMiner with %u transactions in block\n", pblock->vtx.size());
+
+        //
+        // Search
+        //
+        MinerBlockProcessor processor(pblock, pwallet, &reservekey, ptemplates.get(), pwork.get());
+        phasher->SetHeader(nConsumer, *pblock, 0, 1);
+
+        while (true)
+        {
+            uint256 hash;
+            int64_t nTimeStart = GetTimeMicros();
+            phasher->Pop(nConsumer, pblock->nNonce, hash);
+            pstats->nHashes++;
+            pstats->nHashMicros += GetTimeMicros() - nTimeStart;
+
+            uint64_t nSieveSize, nPrimes;
+            uint16_t nShift;
+            GetMiningParams(nSieveSize, nPrimes, nShift);
+
+            try {
+                psieve->Start(hash, pblock->nShift, pblock->nDifficulty, nSieveSize, &processor);
+
+                // a new tip may have missed the round it should abort
+                if (ptemplates->IsStale(pwork.get()))
+                    psieve->Abort();
+                psieve->Wait();
+            }
+            catch (boost::thread_interrupted)
+            {
+                // the workers must be done with processor before it goes away
+                psieve->Abort();
+                psieve->Wait();
+                throw;
+            }
+
+            dHashesPerSec = psieve->GetPrimesPerSec();
+            dTestsPerSec  = psieve->GetTestsPerSec();
+
+            static int64_t nLogTime = 0;
+            if (GetTime() - nLogTime > 30 * 60)
+            {
+                nLogTime = GetTime();
+                LogPrintf("primemeter %6.0f primes/s\n", dHashesPerSec);
+            }
+            miningstats.LogPeriodically();
+
+            // Check for stop or if block needs to be rebuilt
+            boost::this_thread::interruption_point();
+            if (vNodes.empty() && Params().NetworkID() != CChainParams::REGTEST)
+                break;
+            if (!ptemplates->IsCurrent(pwork.get()))
+                break;
+
+            // Update nTime every few seconds
+            unsigned int nTimeOld = pblock->nTime;
+            UpdateTime(*pblock, pindexPrev);
+            // Changing pblock->nTime can change work required on testnet:
+            if (TestNet())
+              break;
+            if (pblock->nTime != nTimeOld)
+                phasher->SetHeader(nConsumer, *pblock, 0, 1);
+        }
+    } }
+    catch (boost::thread_interrupted)
+    {
+        LogPrintf("GapcoinSharedMiner terminated\n");
+        dHashesPerSec = 0.0;
+        dTestsPerSec  = 0.0;
+        throw;
+    }
+}
+
+//
+// Miner calibration
+//
+static CCriticalSection cs_miningTuning;
+static CMiningTuning miningTuning;
+
+/** Candidates of TuneMiningParams */
+static const uint16_t vTuneShifts[] = { 20, 25, 32, 45, 64 };
+static const uint64_t vTunePrimes[] = { 250000, 500000, 900000, 2000000, 4000000 };
+static const uint64_t vTuneSieveSizes[] = { 1 << 22, 1 << 23, 1 << 24, 1 << 25, 1 << 26 };
+
+/** Keeps sieving, the calibration only measures the speed */
+class TuneProcessor : public PoWProcessor {
+
+  public:
+
+    bool process(PoW *pow) {
+      return true;
+    }
+};
+
+static uint256 GetTuneHash()
+{
+    uint256 hash;
+    do {
+        hash = GetRandHash();
+    } while (hash <= hashMinerTarget);
+    return hash;
+}
+
+void static TuneSieveThread(uint64_t nSieveSize, uint64_t nPrimes, uint16_t nShift, uint64_t nDifficulty,
+                            int nSeconds, double* pdPrimesPerSec)
+{
+    TuneProcessor processor;
+    Sieve sieve(&processor, nPrimes, nSieveSize);
+    std::vector<uint8_t> vAdd;
+
+    int64_t nStart = GetTimeMillis();
+    do {
+        uint256 hash = GetTuneHash();
+        std::vector<uint8_t> vHash(hash.begin(), hash.end());
+
+        PoW pow(&vHash, nShift, &vAdd, nDifficulty);
+        sieve.run_sieve(&pow, NULL);
+        boost::this_thread::interruption_point();
+    } while (GetTimeMillis() - nStart < nSeconds * 1000);
+
+    *pdPrimesPerSec = sieve.avg_primes_per_sec();
+}
+
+/** Primes per second of all threads together with the given parameters,
+ *  using the shared sieve or a PoWCore sieve per thread */
+static double MeasureMiningParams(bool fShared, int nThreads, uint64_t nSieveSize, uint64_t nPrimes,
+                                  uint16_t nShift, uint64_t nDifficulty, int nSeconds)
+{
+    boost::thread_group threads;
+
+    if (fShared)
+    {
+        TuneProcessor processor;
+        CSharedSieve sieve(nPrimes);
+        for (int i = 0; i < nThreads; i++)
+            threads.create_thread(boost::bind(&CSharedSieve::Thread, &sieve, (CMiningThreadStats*) NULL));
+
+        double dPrimesPerSec = 0.0;
+        int nRounds = 0;
+        try {
+            int64_t nStart = GetTimeMillis();
+            do {
+                sieve.Start(GetTuneHash(), nShift, nDifficulty, nSieveSize, &processor);
+                sieve.Wait();
+                dPrimesPerSec += sieve.GetPrimesPerSec();
+                nRounds++;
+                boost::this_thread::interruption_point();
+            } while (GetTimeMillis() - nStart < nSeconds * 1000);
+        }
+        catch (boost::thread_interrupted)
+        {
+            sieve.Abort();
+            sieve.Wait();
+            threads.interrupt_all();
+            threads.join_all();
+            throw;
+        }
+        threads.interrupt_all();
+        threads.join_all();
+
+        return dPrimesPerSec / nRounds;
+    }
+
+    std::vector<double> vPrimesPerSec(nThreads, 0.0);
+    for (int i = 0; i < nThreads; i++)
+        threads.create_thread(boost::bind(&TuneSieveThread, nSieveSize, nPrimes, nShift, nDifficulty,
+                                          nSeconds, &vPrimesPerSec[i]));
+    try {
+        threads.join_all();
+    }
+    catch (boost::thread_interrupted)
+    {
+        threads.interrupt_all();
+        threads.join_all();
+        throw;
+    }
+
+    double dPrimesPerSec = 0.0;
+    for (int i = 0; i < nThreads; i++)
+        dPrimesPerSec += vPrimesPerSec[i];
+
+    return dPrimesPerSec;
+}
+
+/** Measures candidate and keeps it in best if it finds more gaps */
+static void TryMiningParams(CMiningTuning& best, CMiningTuning candidate, int nThreads,
+                            uint64_t nDifficulty, int nSeconds)
+{
+    // the sieve can only cover 2^shift numbers
+    if (candidate.nShift < 64 && candidate.nSieveSize > (((uint64_t) 1) << candidate.nShift))
+        candidate.nSieveSize = (((uint64_t) 1) << candidate.nShift);
+
+    if (best.nTime != 0 && candidate.nSieveSize == best.nSieveSize &&
+        candidate.nPrimes == best.nPrimes && candidate.nShift == best.nShift)
+        return;
+
+    static PoWUtils powUtils;
+    double dPrimesPerSec = MeasureMiningParams(GetBoolArg("-sharedsieve", false), nThreads, candidate.nSieveSize,
+                                               candidate.nPrimes, candidate.nShift, nDifficulty, nSeconds);
+    candidate.dGapsPerHour = powUtils.gaps_per_day(dPrimesPerSec, nDifficulty) / 24.0;
+
+    LogPrintf("TuneMiningParams : sievesize %u sieveprimes %u shift %u: %.0f primes/s, %g gaps/h\n",
+              candidate.nSieveSize, candidate.nPrimes, candidate.nShift, dPrimesPerSec, candidate.dGapsPerHour);
+
+    if (best.nTime == 0 || candidate.dGapsPerHour > best.dGapsPerHour)
+    {
+        best = candidate;
+        best.nTime = GetTime();
+    }
+}
+
+static int GetBenchThreads(int nThreads)
+{
+    if (nThreads < 0) {
+        if (Params().NetworkID() == CChainParams::REGTEST)
+            nThreads = 1;
+        else
+            nThreads = boost::thread::hardware_concurrency();
+    }
+    return std::max(nThreads, 1);
+}
+
+static uint64_t GetBenchDifficulty()
+{
+    LOCK(cs_main);
+    if (chainActive.Tip() == NULL)
+        return (TestNet() ? PoWUtils::min_test_difficulty : PoWUtils::min_difficulty);
+    return chainActive.Tip()->nDifficulty;
+}
+
+CMiningTuning TuneMiningParams(int nThreads, int nSeconds)
+{
+    nThreads = GetBenchThreads(nThreads);
+    nSeconds = std::max(nSeconds, 1);
+    uint64_t nDifficulty = GetBenchDifficulty();
+
+    LogPrintf("TuneMiningParams : calibrating %d threads, %d seconds per candidate\n", nThreads, nSeconds);
+
+    // start from the current parameters, then sweep one at a time
+    CMiningTuning best, candidate;
+    GetMiningParams(candidate.nSieveSize, candidate.nPrimes, candidate.nShift);
+    TryMiningParams(best, candidate, nThreads, nDifficulty, nSeconds);
+
+    for (unsigned int i = 0; i < sizeof(vTuneShifts) / sizeof(vTuneShifts[0]); i++)
+    {
+        candidate = best;
+        candidate.nShift = vTuneShifts[i];
+        TryMiningParams(best, candidate, nThreads, nDifficulty, nSeconds);
+    }
+    for (unsigned int i = 0; i < sizeof(vTunePrimes) / sizeof(vTunePrimes[0]); i++)
+    {
+        candidate = best;
+        candidate.nPrimes = vTunePrimes[i];
+        TryMiningParams(best, candidate, nThreads, nDifficulty, nSeconds);
+    }
+    for (unsigned int i = 0; i < sizeof(vTuneSieveSizes) / sizeof(vTuneSieveSizes[0]); i++)
+    {
+        candidate = best;
+        candidate.nSieveSize = vTuneSieveSizes[i];
+        TryMiningParams(best, candidate, nThreads, nDifficulty, nSeconds);
+    }
+
+    LogPrintf("TuneMiningParams : picked sievesize %u sieveprimes %u shift %u, %g gaps/h\n",
+              best.nSieveSize, best.nPrimes, best.nShift, best.dGapsPerHour);
+
+    SetMiningParams(best.nSieveSize, best.nPrimes, best.nShift);
+    {
+        LOCK(cs_miningTuning);
+        miningTuning = best;
+    }
+    return best;
+}
+
+CMiningTuning GetMiningTuning()
+{
+    LOCK(cs_miningTuning);
+    return miningTuning;
+}
+
+void BenchmarkSieves(int nThreads, int nSeconds, double& dPoWCorePrimesPerSec, double& dSharedPrimesPerSec)
+{
+    nThreads = GetBenchThreads(nThreads);
+    nSeconds = std::max(nSeconds, 1);
+    uint64_t nDifficulty = GetBenchDifficulty();
+
+    uint64_t nSieveSize, nPrimes;
+    uint16_t nShift;
+    GetMiningParams(nSieveSize, nPrimes, nShift);
+
+    dPoWCorePrimesPerSec = MeasureMiningParams(false, nThreads, nSieveSize, nPrimes,
+                                               nShift, nDifficulty, nSeconds);
+    dSharedPrimesPerSec  = MeasureMiningParams(true, nThreads, nSieveSize, nPrimes,
+                                               nShift, nDifficulty, nSeconds);
+
+    LogPrintf("BenchmarkSieves : %d threads, sievesize %u sieveprimes %u shift %u: "
+              "PoWCore %.0f primes/s, shared sieve %.0f primes/s\n", nThreads, nSieveSize,
+              nPrimes, nShift, dPoWCorePrimesPerSec, dSharedPrimesPerSec);
+}
+
 void GenerateGapcoins(bool fGenerate, CWallet* pwallet, int nThreads)
 {
+    static CCriticalSection cs_minerThreads;
     static boost::thread_group* minerThreads = NULL;
+    LOCK(cs_minerThreads);
 
     if (nThreads < 0) {
         if (Params().NetworkID() == CChainParams::REGTEST)
@@ -551,11 +1487,16 @@ void GenerateGapcoins(bool fGenerate, CWallet* pwallet, int nThreads)
 
     if (minerThreads != NULL)
     {
+        // wait for the old threads, they would skew a calibration and
+        // still read the mining parameters
         minerThreads->interrupt_all();
+        minerThreads->join_all();
         delete minerThreads;
         minerThreads = NULL;
     }
 
+    miningstats.Clear();
+
     if (nThreads == 0 || !fGenerate)
         return;
 
@@ -563,10 +1504,33 @@ void GenerateGapcoins(bool fGenerate, CWallet* pwallet, int nThreads)
     dThreadTestsPerSec.clear();
 
     minerThreads = new boost::thread_group();
+
+    // builds the block templates of all miner threads
+    boost::shared_ptr<CMinerTemplates> ptemplates(new CMinerTemplates());
+    minerThreads->create_thread(boost::bind(&GapcoinTemplates, ptemplates));
+
+    // hashes the headers of all miner threads
+    boost::shared_ptr<CHashProducer> phasher(new CHashProducer());
+    minerThreads->create_thread(boost::bind(&GapcoinHasher, phasher));
+
+    if (GetBoolArg("-sharedsieve", false))
+    {
+        // one sieve and prime table for all threads
+        uint64_t nSieveSize, nPrimes;
+        uint16_t nShift;
+        GetMiningParams(nSieveSize, nPrimes, nShift);
+        boost::shared_ptr<CSharedSieve> psieve(new CSharedSieve(nPrimes));
+        ptemplates->NotifyNewTip.connect(boost::bind(&CSharedSieve::Abort, psieve));
+        minerThreads->create_thread(boost::bind(&GapcoinSharedMiner, pwallet, psieve, ptemplates, phasher));
+        for (int i = 0; i < nThreads; i++)
+            minerThreads->create_thread(boost::bind(&GapcoinSieveWorker, psieve, i));
+        return;
+    }
+
     for (int i = 0; i < nThreads; i++) {
         dThreadHashesPerSec.push_back(0.0);
         dThreadTestsPerSec.push_back(0.0);
-        minerThreads->create_thread(boost::bind(&GapcoinMiner, pwallet, i, nThreads));
+        minerThreads->create_thread(boost::bind(&GapcoinMiner, pwallet, i, nThreads, ptemplates, phasher));
     }
 
 }
@@ -15,6 +15,21 @@ class CReserveKey;
 class CScript;
 class CWallet;
 
+/** Default seconds the miner calibration runs each candidate for */
+static const int DEFAULT_TUNE_MINER_SECONDS = 10;
+
+/** Mining parameters picked by TuneMiningParams */
+struct CMiningTuning
+{
+    uint64_t nSieveSize;
+    uint64_t nPrimes;
+    uint16_t nShift;
+    double dGapsPerHour;  // expected at the difficulty of the calibration
+    int64_t nTime;        // 0 if the miner was never calibrated
+
+    CMiningTuning() : nSieveSize(0), nPrimes(0), nShift(0), dGapsPerHour(0.0), nTime(0) {}
+};
+
 /** Run the miner threads */
 void GenerateGapcoins(bool fGenerate, CWallet* pwallet, int nThreads);
 /** Generate a new block, without valid proof-of-work */
@@ -24,11 +39,20 @@ CBlockTemplate* CreateNewBlockWithKey(CReserveKey& reservekey);
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
 /** Check mined block */
 bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey);
+/** The sieve size, sieve primes and header shift the miner uses */
+void GetMiningParams(uint64_t& nSieveSize, uint64_t& nPrimes, uint16_t& nShift);
+void SetMiningParams(uint64_t nSieveSize, uint64_t nPrimes, uint16_t nShift);
+/** Calibrate the mining parameters for this host.
+ *  Sieves with nThreads threads for nSeconds per candidate; the miner must
+ *  not be running. */
+CMiningTuning TuneMiningParams(int nThreads, int nSeconds);
+/** Result of the last calibration */
+CMiningTuning GetMiningTuning();
+/** Time the PoWCore sieve against the shared sieve (-sharedsieve) with the
+ *  current mining parameters, nSeconds each; the miner must not be running */
+void BenchmarkSieves(int nThreads, int nSeconds, double& dPoWCorePrimesPerSec, double& dSharedPrimesPerSec);
 
 extern double dHashesPerSec;
 extern double dTestsPerSec;
-extern uint64_t nMiningSieveSize;
-extern uint64_t nMiningPrimes;
-extern uint16_t nMiningShift;
 
 #endif // GAPCOIN_MINER_H
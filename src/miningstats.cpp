@@ -0,0 +1,112 @@
+// Copyright (c) 2014 The Gapcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "miningstats.h"
+
+#include "util.h"
+
+#include <boost/foreach.hpp>
+
+using namespace std;
+
+CMiningStats miningstats;
+
+CMiningThreadStats::CMiningThreadStats(const string& strNameIn) : strName(strNameIn),
+    nSieveMicros(0), nSieveRounds(0), nCandidates(0), nTests(0), nTestMicros(0), nTestsSaved(0),
+    nHashes(0), nHashMicros(0), nTemplates(0), nTemplateMicros(0)
+{
+    for (unsigned int i = 0; i <= MINING_STATS_MAX_MERIT; i++)
+        vGaps[i] = 0;
+}
+
+void CMiningThreadStats::AddGap(uint64_t nMerit)
+{
+    vGaps[min(nMerit >> 48, (uint64_t) MINING_STATS_MAX_MERIT)]++;
+}
+
+void CMiningThreadStats::Add(const CMiningThreadStats& other)
+{
+    nSieveMicros    += other.nSieveMicros;
+    nSieveRounds    += other.nSieveRounds;
+    nCandidates     += other.nCandidates;
+    nTests          += other.nTests;
+    nTestMicros     += other.nTestMicros;
+    nTestsSaved     += other.nTestsSaved;
+    nHashes         += other.nHashes;
+    nHashMicros     += other.nHashMicros;
+    nTemplates      += other.nTemplates;
+    nTemplateMicros += other.nTemplateMicros;
+    for (unsigned int i = 0; i <= MINING_STATS_MAX_MERIT; i++)
+        vGaps[i] += other.vGaps[i];
+}
+
+CMiningStats::CMiningStats() : nStartTime(0), nLastLogTime(0)
+{
+}
+
+boost::shared_ptr<CMiningThreadStats> CMiningStats::Register(const string& strName)
+{
+    boost::shared_ptr<CMiningThreadStats> pstats(new CMiningThreadStats(strName));
+
+    LOCK(cs);
+    if (vThreads.empty())
+        nStartTime = nLastLogTime = GetTime();
+    vThreads.push_back(pstats);
+    return pstats;
+}
+
+void CMiningStats::Clear()
+{
+    LOCK(cs);
+    vThreads.clear();
+}
+
+vector<CMiningThreadStats> CMiningStats::GetThreads() const
+{
+    vector<CMiningThreadStats> vStats;
+
+    LOCK(cs);
+    vStats.reserve(vThreads.size());
+    BOOST_FOREACH(const boost::shared_ptr<CMiningThreadStats>& pstats, vThreads)
+        vStats.push_back(*pstats);
+    return vStats;
+}
+
+int64_t CMiningStats::GetStartTime() const
+{
+    LOCK(cs);
+    return nStartTime;
+}
+
+void CMiningStats::LogPeriodically()
+{
+    {
+        LOCK(cs);
+        if (vThreads.empty() || GetTime() - nLastLogTime < MINING_STATS_LOG_INTERVAL)
+            return;
+        nLastLogTime = GetTime();
+    }
+
+    CMiningThreadStats total;
+    vector<CMiningThreadStats> vStats = GetThreads();
+    BOOST_FOREACH(const CMiningThreadStats& stats, vStats)
+        total.Add(stats);
+
+    // shares of the time the miner threads spent in each stage
+    double dElapsed = max((int64_t) 1, GetTime() - GetStartTime());
+    double dBusy = max((uint64_t) 1, total.nSieveMicros + total.nTestMicros + total.nHashMicros);
+
+    string strGaps;
+    for (unsigned int i = 0; i <= MINING_STATS_MAX_MERIT; i++)
+        if (total.vGaps[i] > 0)
+            strGaps += strprintf(" %u%s:%u", i, i == MINING_STATS_MAX_MERIT ? "+" : "", total.vGaps[i]);
+
+    LogPrintf("miningstats: sieve %.1f%% tests %.1f%% hashes %.1f%%, %.0f candidates/s %.0f tests/s "
+              "(%.0f saved/s), %u templates (avg %.1f ms), gaps by merit:%s\n",
+              100.0 * total.nSieveMicros / dBusy, 100.0 * total.nTestMicros / dBusy,
+              100.0 * total.nHashMicros / dBusy, total.nCandidates / dElapsed, total.nTests / dElapsed,
+              total.nTestsSaved / dElapsed,
+              total.nTemplates, total.nTemplates ? total.nTemplateMicros / 1000.0 / total.nTemplates : 0.0,
+              strGaps.empty() ? " none" : strGaps);
+}
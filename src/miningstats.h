@@ -0,0 +1,93 @@
+// Copyright (c) 2014 The Gapcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef GAPCOIN_MININGSTATS_H
+#define GAPCOIN_MININGSTATS_H
+
+#include "sync.h"
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+
+/** Gaps are counted per integer merit up to this, higher ones in the last slot */
+static const unsigned int MINING_STATS_MAX_MERIT = 32;
+
+/** Seconds between the miningstats log lines */
+static const int MINING_STATS_LOG_INTERVAL = 10 * 60;
+
+/**
+ * Counters of one mining thread, split by stage. Only the owning thread
+ * writes them, so the mining loops never take a lock; readers may see a
+ * slightly stale picture.
+ */
+class CMiningThreadStats
+{
+public:
+    std::string strName;
+
+    // Sieving; with the per-thread PoWCore sieve this includes its tests
+    uint64_t nSieveMicros;
+    uint64_t nSieveRounds;
+
+    // Sieve survivors, and the Fermat tests done on them
+    uint64_t nCandidates;
+    uint64_t nTests;
+    uint64_t nTestMicros;
+
+    // Survivors the shared sieve skipped because no gap could start there
+    uint64_t nTestsSaved;
+
+    // Searching for (or waiting on) header hashes above the miner target
+    uint64_t nHashes;
+    uint64_t nHashMicros;
+
+    // Block templates built, and the time it took
+    uint64_t nTemplates;
+    uint64_t nTemplateMicros;
+
+    // Reported gaps by integer merit
+    uint64_t vGaps[MINING_STATS_MAX_MERIT + 1];
+
+    CMiningThreadStats(const std::string& strNameIn = "");
+
+    /** Count a gap of nMerit, fixed point with 48 fraction bits */
+    void AddGap(uint64_t nMerit);
+
+    /** Add the counters of other, for totals */
+    void Add(const CMiningThreadStats& other);
+};
+
+/** The stats of all mining threads since the miner was started */
+class CMiningStats
+{
+private:
+    mutable CCriticalSection cs;
+    std::vector<boost::shared_ptr<CMiningThreadStats> > vThreads;
+    int64_t nStartTime;
+    int64_t nLastLogTime;
+
+public:
+    CMiningStats();
+
+    /** New counters for a thread; they stay valid after Clear */
+    boost::shared_ptr<CMiningThreadStats> Register(const std::string& strName);
+
+    /** Forget all threads, when the miner is restarted */
+    void Clear();
+
+    /** Copy of the counters of every thread */
+    std::vector<CMiningThreadStats> GetThreads() const;
+
+    int64_t GetStartTime() const;
+
+    /** Write the miningstats log line if it is due */
+    void LogPeriodically();
+};
+
+extern CMiningStats miningstats;
+
+#endif // GAPCOIN_MININGSTATS_H
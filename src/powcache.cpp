@@ -0,0 +1,139 @@
+// Copyright (c) 2014 The Gapcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "powcache.h"
+
+#include "core.h"
+#include "hash.h"
+#include "main.h"
+#include "txdb.h"
+#include "PoWCore/src/PoW.h"
+
+using namespace std;
+
+CPoWCache powcache;
+
+uint256 GetProofHash(const uint256& hash, uint16_t nShift, const vector<uint8_t>& nAdd, uint64_t nDifficulty)
+{
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << hash << nShift << nAdd << nDifficulty;
+    return ss.GetHash();
+}
+
+CPoWCache::CPoWCache() : nMaxSize(DEFAULT_POW_CACHE_SIZE), fPersist(false)
+{
+}
+
+void CPoWCache::SetMaxSize(unsigned int nMaxSizeIn)
+{
+    LOCK(cs);
+    nMaxSize = nMaxSizeIn;
+    while (dequeResults.size() > nMaxSize)
+    {
+        mapResults.erase(dequeResults.front());
+        dequeResults.pop_front();
+    }
+}
+
+void CPoWCache::SetPersist(bool fPersistIn)
+{
+    LOCK(cs);
+    fPersist = fPersistIn;
+}
+
+bool CPoWCache::Lookup(const uint256& hashProof, CPoWResult& result)
+{
+    {
+        LOCK(cs);
+        map<uint256, CPoWResult>::const_iterator mi = mapResults.find(hashProof);
+        if (mi != mapResults.end())
+        {
+            result = mi->second;
+            return true;
+        }
+        if (!fPersist || pblocktree == NULL)
+            return false;
+    }
+
+    if (!pblocktree->ReadPoWResult(hashProof, result))
+        return false;
+
+    Insert(hashProof, result);
+    return true;
+}
+
+void CPoWCache::Insert(const uint256& hashProof, const CPoWResult& result)
+{
+    bool fWrite;
+    {
+        LOCK(cs);
+        if (nMaxSize > 0)
+        {
+            pair<map<uint256, CPoWResult>::iterator, bool> ret = mapResults.insert(make_pair(hashProof, result));
+            if (ret.second)
+                dequeResults.push_back(hashProof);
+            else
+                ret.first->second = result;
+
+            if (dequeResults.size() > nMaxSize)
+            {
+                mapResults.erase(dequeResults.front());
+                dequeResults.pop_front();
+            }
+        }
+        fWrite = fPersist && result.fValid && pblocktree != NULL;
+    }
+
+    if (fWrite)
+        pblocktree->WritePoWResult(hashProof, result);
+}
+
+CPoWResult CPoWCache::Get(const uint256& hash, uint16_t nShift, const vector<uint8_t>& nAdd,
+                          uint64_t nDifficulty, bool fGap)
+{
+    uint256 hashProof = GetProofHash(hash, nShift, nAdd, nDifficulty);
+
+    CPoWResult result;
+    if (Lookup(hashProof, result) && (result.fHaveGap || !fGap))
+        return result;
+
+    // Test it without holding the lock, this is the expensive part
+    vector<uint8_t> vHash(hash.begin(), hash.end());
+    PoW pow(&vHash, nShift, &nAdd, nDifficulty);
+
+    result.fValid = pow.valid();
+    if (fGap)
+    {
+        result.fHaveGap = true;
+        result.nMerit   = pow.merit();
+        result.nGapLen  = pow.gap_len();
+        pow.get_gap(&result.vGapStart, &result.vGapEnd);
+    }
+
+    Insert(hashProof, result);
+    return result;
+}
+
+CPoWResult CPoWCache::Get(const CBlockHeader& header, bool fGap)
+{
+    return Get(header.GetHash(), header.nShift, header.nAdd, header.nDifficulty, fGap);
+}
+
+CPoWResult CPoWCache::Get(const CBlockIndex* pindex, bool fGap)
+{
+    return Get(pindex->GetBlockHash(), pindex->nShift, pindex->nAdd, pindex->nDifficulty, fGap);
+}
+
+unsigned int CPoWCache::size() const
+{
+    LOCK(cs);
+    return mapResults.size();
+}
+
+void CPoWCache::Clear()
+{
+    LOCK(cs);
+    mapResults.clear();
+    dequeResults.clear();
+}
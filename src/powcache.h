@@ -0,0 +1,104 @@
+// Copyright (c) 2014 The Gapcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef GAPCOIN_POWCACHE_H
+#define GAPCOIN_POWCACHE_H
+
+#include "serialize.h"
+#include "sync.h"
+#include "uint256.h"
+
+#include <deque>
+#include <map>
+#include <stdint.h>
+#include <vector>
+
+class CBlockHeader;
+class CBlockIndex;
+
+/** Default number of proof-of-work results kept in memory (-powcache) */
+static const unsigned int DEFAULT_POW_CACHE_SIZE = 50000;
+
+/** Hash of everything a proof of work depends on.
+ *  The block hash alone does not cover nShift and nAdd.
+ */
+uint256 GetProofHash(const uint256& hash, uint16_t nShift, const std::vector<uint8_t>& nAdd, uint64_t nDifficulty);
+
+/** Outcome of testing a proof of work */
+class CPoWResult
+{
+public:
+    bool fValid;
+
+    // The gap; validation does not need it, so it is only filled in on request
+    bool fHaveGap;
+    uint64_t nMerit;
+    uint64_t nGapLen;
+    std::vector<uint8_t> vGapStart;
+    std::vector<uint8_t> vGapEnd;
+
+    CPoWResult()
+    {
+        SetNull();
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(fValid);
+        READWRITE(fHaveGap);
+        READWRITE(nMerit);
+        READWRITE(nGapLen);
+        READWRITE(vGapStart);
+        READWRITE(vGapEnd);
+    )
+
+    void SetNull()
+    {
+        fValid = false;
+        fHaveGap = false;
+        nMerit = 0;
+        nGapLen = 0;
+        vGapStart.clear();
+        vGapEnd.clear();
+    }
+};
+
+/** Results of tested proofs of work, so that every proof is tested once.
+ *  The newest results are kept in memory; with -persistpowcache valid ones
+ *  are also written to the block tree database and survive restarts.
+ */
+class CPoWCache
+{
+private:
+    mutable CCriticalSection cs;
+    std::map<uint256, CPoWResult> mapResults;
+    std::deque<uint256> dequeResults; // oldest first
+    unsigned int nMaxSize;
+    bool fPersist;
+
+    void Insert(const uint256& hashProof, const CPoWResult& result);
+
+public:
+    CPoWCache();
+
+    void SetMaxSize(unsigned int nMaxSizeIn);
+    void SetPersist(bool fPersistIn);
+
+    /** Known result of a proof, see GetProofHash */
+    bool Lookup(const uint256& hashProof, CPoWResult& result);
+
+    /** Result of the proof, tested now if it is not known yet.
+     *  With fGap the gap of the result is filled in as well. */
+    CPoWResult Get(const uint256& hash, uint16_t nShift, const std::vector<uint8_t>& nAdd,
+                   uint64_t nDifficulty, bool fGap = false);
+    CPoWResult Get(const CBlockHeader& header, bool fGap = false);
+    CPoWResult Get(const CBlockIndex* pindex, bool fGap = false);
+
+    unsigned int size() const;
+    void Clear();
+};
+
+extern CPoWCache powcache;
+
+#endif // GAPCOIN_POWCACHE_H
@@ -10,6 +10,8 @@
 #include "wallet.h"
 #include "init.h"
 #include "base58.h"
+#include "powcache.h"
+#include "txdb.h"
 
 #include <stdint.h>
 
@@ -40,12 +42,8 @@ static PoWUtils *utils = new PoWUtils();
 Object blockToJSON(const CBlock& block, const CBlockIndex* blockindex)
 {
 
-    uint256 hash = block.GetHash();
-    std::vector<uint8_t> vHash(hash.begin(), hash.end());
-    PoW pow(&vHash, block.nShift, &block.nAdd, block.nDifficulty);
-
-    std::vector<uint8_t> vStart, vEnd;
-    pow.get_gap(&vStart, &vEnd);
+    CPoWResult powresult = powcache.Get(block, true);
+    std::vector<uint8_t> vStart(powresult.vGapStart), vEnd(powresult.vGapEnd);
 
     std::vector<uint8_t> vDifficulty(block.nAdd.begin(), block.nAdd.end());
 
@@ -82,8 +80,8 @@ Object blockToJSON(const CBlock& block, const CBlockIndex* blockindex)
     result.push_back(Pair("adder", bnTarget.ToString()));
     result.push_back(Pair("gapstart", bnStart.ToString()));
     result.push_back(Pair("gapend", bnEnd.ToString()));
-    result.push_back(Pair("gaplen", pow.gap_len()));
-    result.push_back(Pair("merit", utils->get_readable_difficulty(pow.merit())));
+    result.push_back(Pair("gaplen", powresult.nGapLen));
+    result.push_back(Pair("merit", utils->get_readable_difficulty(powresult.nMerit)));
     result.push_back(Pair("chainwork", nChainWork.ToString()));
 
     if (blockindex->pprev)
@@ -481,158 +479,196 @@ Value getblockchaininfo(const Array& params, bool fHelp)
     return obj;
 }
 
-/**
- * returns all prime gaps with the given merit if they exist
- */
-Value listprimerecords(const Array& params, bool fHelp)
+static Object PrimeRecordToJSON(const CPrimeRecord& record)
 {
-    if (fHelp || params.size() < 1 || params.size() > 1)
-        throw runtime_error(
-            "listprimerecords merit\n"
-            "\nReturns a list of all prime gaps with the given integer merit.\n"
-            "\nArguments:\n"
-            "1. merit        (numeric 1,2,3..) the prime gap merit.\n");
+    std::vector<uint8_t> vStart(record.vGapStart), vEnd(record.vGapEnd);
 
-    uint64_t nMerit  = params[0].get_int();
+    /* insert 0 a the begining to avoid sig problems */
+    vStart.push_back(0);
+    vEnd.push_back(0);
 
-    Array ret;
+    CBigNum bnStart, bnEnd;
+    bnStart.setvch(vStart);
+    bnEnd.setvch(vEnd);
 
-    for (CBlockIndex* pindex = chainActive.Tip(); pindex; pindex = pindex->pprev)
+    bool fMine = false;
+    if (pwalletMain)
     {
+        BOOST_FOREACH(const CScript& script, record.vMinerScripts)
+        {
+            if (IsMine(*pwalletMain, script))
+            {
+                fMine = true;
+                break;
+            }
+        }
+    }
 
-        uint256 hash = pindex->GetBlockHash();
-        std::vector<uint8_t> vHash(hash.begin(), hash.end());
-        PoW pow(&vHash, pindex->nShift, &pindex->nAdd, pindex->nDifficulty);
+    CTxDestination address;
+    std::string strAddress = "invalid";
+    if (record.vMinerScripts.size() > 1)
+        strAddress = "multiple";
+    else if (!record.vMinerScripts.empty() && ExtractDestination(record.vMinerScripts[0], address))
+        strAddress = CGapcoinAddress(address).ToString();
+
+    Object entry;
+    entry.push_back(Pair("time", DateTimeStrFormat("%Y-%m-%d %H:%M:%S UTC", record.nTime).c_str()));
+    entry.push_back(Pair("epoch", (boost::int64_t) record.nTime));
+    entry.push_back(Pair("height", record.nHeight));
+    entry.push_back(Pair("ismine", fMine));
+    entry.push_back(Pair("mineraddress", strAddress));
+    entry.push_back(Pair("gapstart", bnStart.ToString()));
+    entry.push_back(Pair("gapend", bnEnd.ToString()));
+    entry.push_back(Pair("gaplen", record.nGapLen));
+    entry.push_back(Pair("merit", utils->get_readable_difficulty(record.nMerit)));
+    return entry;
+}
 
-        uint64_t curMerit = pow.merit();
+struct CompareBucketHeightDesc
+{
+    bool operator()(const CPrimeRecord& a, const CPrimeRecord& b) const
+    {
+        if (a.GetMeritBucket() != b.GetMeritBucket())
+            return a.GetMeritBucket() > b.GetMeritBucket();
+        return a.nHeight > b.nHeight;
+    }
+};
 
-        if (nMerit != (curMerit >> 48))
-            continue;
+struct CompareMerit
+{
+    bool operator()(const CPrimeRecord& a, const CPrimeRecord& b) const
+    {
+        return a.nMerit < b.nMerit;
+    }
+};
 
-        std::vector<uint8_t> vStart, vEnd;
-        pow.get_gap(&vStart, &vEnd);
-        
-        std::vector<uint8_t> vDifficulty(pindex->nAdd.begin(), pindex->nAdd.end());
-        
-        /* insert 0 a the begining to avoid sig problems */
-        vDifficulty.push_back(0);
-        vStart.push_back(0);
-        vEnd.push_back(0);
-        
-        CBigNum bnTarget, bnStart, bnEnd;
-        bnTarget.setvch(vDifficulty);
-        bnStart.setvch(vStart);
-        bnEnd.setvch(vEnd);
+/**
+ * prime records of the main chain with an integer merit between nBucketMin
+ * and nBucketMax, ordered like CBlockTreeDB::ReadPrimeRecords. Without
+ * -primeindex the whole chain has to be walked.
+ */
+static void GetPrimeRecords(unsigned int nBucketMin, unsigned int nBucketMax, unsigned int nCount,
+                            bool fWholeBuckets, std::vector<CPrimeRecord>& vRecords)
+{
+    if (fPrimeIndex)
+    {
+        if (!pblocktree->ReadPrimeRecords(nBucketMin, nBucketMax, nCount, fWholeBuckets, vRecords))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Failed to read prime index");
+        return;
+    }
+
+    std::vector<CPrimeRecord> vAll;
+    for (CBlockIndex* pindex = chainActive.Tip(); pindex; pindex = pindex->pprev)
+    {
+        unsigned int nBucket = powcache.Get(pindex, true).nMerit >> 48;
+        if (nBucket < nBucketMin || nBucket > nBucketMax)
+            continue;
 
         CBlock block;
-        ReadBlockFromDisk(block, pindex);
-
-        Object entry;
-        entry.push_back(Pair("time", DateTimeStrFormat("%Y-%m-%d %H:%M:%S UTC", pindex->GetBlockTime()).c_str()));
-        entry.push_back(Pair("epoch", (boost::int64_t) pindex->GetBlockTime()));
-        entry.push_back(Pair("height", pindex->nHeight));
-        entry.push_back(Pair("ismine", pwalletMain->IsMine(block.vtx[0])));
-        CTxDestination address;
-        entry.push_back(Pair("mineraddress", (block.vtx[0].vout.size() > 1)? "multiple" : ExtractDestination(block.vtx[0].vout[0].scriptPubKey, address)? CGapcoinAddress(address).ToString().c_str() : "invalid"));
-        entry.push_back(Pair("gapstart", bnStart.ToString()));
-        entry.push_back(Pair("gapend", bnEnd.ToString()));
-        entry.push_back(Pair("gaplen", pow.gap_len()));
-        entry.push_back(Pair("merit", utils->get_readable_difficulty(curMerit)));
-        ret.push_back(entry);
+        if (!ReadBlockFromDisk(block, pindex))
+            throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
+        vAll.push_back(CPrimeRecord(block, pindex->nHeight));
     }
+    std::stable_sort(vAll.begin(), vAll.end(), CompareBucketHeightDesc());
 
-    return ret;
+    for (unsigned int i = 0; i < vAll.size(); i++)
+    {
+        if (vRecords.size() >= nCount &&
+            (!fWholeBuckets || vAll[i].GetMeritBucket() != vRecords.back().GetMeritBucket()))
+            break;
+        vRecords.push_back(vAll[i]);
+    }
 }
 
-struct PrimeRecord {
-  
-  uint64_t nMerit;
-  Object nObj;
+/**
+ * returns all prime gaps with the given merit if they exist
+ */
+Value listprimerecords(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 3)
+        throw runtime_error(
+            "listprimerecords merit ( count from )\n"
+            "\nReturns a list of all prime gaps with the given integer merit, newest first.\n"
+            "This is fast with -primeindex, otherwise the whole chain is scanned.\n"
+            "\nArguments:\n"
+            "1. merit        (numeric 1,2,3..) the prime gap merit.\n"
+            "2. count        (numeric, optional) the number of prime gaps to return, all by default\n"
+            "3. from         (numeric, optional, default=0) the number of prime gaps to skip\n");
 
-  PrimeRecord(uint64_t m, Object o) : nMerit(m), nObj(o) { }
+    unsigned int nMerit = params[0].get_int();
+    unsigned int nCount = std::numeric_limits<unsigned int>::max();
+    unsigned int nFrom  = 0;
+    if (params.size() > 1)
+    {
+        if (params[1].get_int() < 0)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative count");
+        nCount = params[1].get_int();
+    }
+    if (params.size() > 2)
+    {
+        if (params[2].get_int() < 0)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative from");
+        nFrom = params[2].get_int();
+    }
 
-  bool operator < (const PrimeRecord& rec) const
-  {
-      return (nMerit < rec.nMerit);
-  }
-};
+    std::vector<CPrimeRecord> vRecords;
+    GetPrimeRecords(nMerit, nMerit, (nCount > std::numeric_limits<unsigned int>::max() - nFrom) ?
+                    std::numeric_limits<unsigned int>::max() : nFrom + nCount, false, vRecords);
+
+    Array ret;
+    for (unsigned int i = nFrom; i < vRecords.size(); i++)
+        ret.push_back(PrimeRecordToJSON(vRecords[i]));
+
+    return ret;
+}
 
 /**
  * returns the best prime gaps
  */
 Value listbestprimes(const Array& params, bool fHelp)
 {
-    if (fHelp || params.size() < 1 || params.size() > 2)
+    if (fHelp || params.size() < 1 || params.size() > 3)
         throw runtime_error(
-            "listbestprimes amount (min merit)\n"
+            "listbestprimes amount ( merit from )\n"
             "\nReturns a sorted list of the best prime gaps merits.\n"
+            "This is fast with -primeindex, otherwise the whole chain is scanned.\n"
             "\nArguments:\n"
             "1. amount        (numeric). number of prime gaps to display\n"
-            "2. merit         (numeric, default = 16). minimum merit to display\n");
+            "2. merit         (numeric, default = 16). minimum merit to display\n"
+            "3. from          (numeric, default = 0). number of best prime gaps to skip\n");
 
-    uint64_t amount = params[0].get_int();
-    uint64_t nMerit = 16;
+    if (params[0].get_int() < 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative amount");
+    unsigned int amount = params[0].get_int();
+    unsigned int nMerit = 16;
+    unsigned int nFrom  = 0;
 
     if (params.size() > 1)
       nMerit = params[1].get_int();
-
-    std::vector<PrimeRecord> records;
-
-    for (CBlockIndex* pindex = chainActive.Tip(); pindex; pindex = pindex->pprev)
+    if (params.size() > 2)
     {
-
-        uint256 hash = pindex->GetBlockHash();
-        std::vector<uint8_t> vHash(hash.begin(), hash.end());
-        PoW pow(&vHash, pindex->nShift, &pindex->nAdd, pindex->nDifficulty);
-
-        uint64_t curMerit = pow.merit();
-
-        if (nMerit > (curMerit >> 48))
-            continue;
-
-        std::vector<uint8_t> vStart, vEnd;
-        pow.get_gap(&vStart, &vEnd);
-        
-        std::vector<uint8_t> vDifficulty(pindex->nAdd.begin(), pindex->nAdd.end());
-        
-        /* insert 0 a the begining to avoid sig problems */
-        vDifficulty.push_back(0);
-        vStart.push_back(0);
-        vEnd.push_back(0);
-        
-        CBigNum bnTarget, bnStart, bnEnd;
-        bnTarget.setvch(vDifficulty);
-        bnStart.setvch(vStart);
-        bnEnd.setvch(vEnd);
-
-        CBlock block;
-        ReadBlockFromDisk(block, pindex);
-
-        Object entry;
-        entry.push_back(Pair("time", DateTimeStrFormat("%Y-%m-%d %H:%M:%S UTC", pindex->GetBlockTime()).c_str()));
-        entry.push_back(Pair("epoch", (boost::int64_t) pindex->GetBlockTime()));
-        entry.push_back(Pair("height", pindex->nHeight));
-        entry.push_back(Pair("ismine", pwalletMain->IsMine(block.vtx[0])));
-        CTxDestination address;
-        entry.push_back(Pair("mineraddress", (block.vtx[0].vout.size() > 1)? "multiple" : ExtractDestination(block.vtx[0].vout[0].scriptPubKey, address)? CGapcoinAddress(address).ToString().c_str() : "invalid"));
-        entry.push_back(Pair("gapstart", bnStart.ToString()));
-        entry.push_back(Pair("gapend", bnEnd.ToString()));
-        entry.push_back(Pair("gaplen", pow.gap_len()));
-        entry.push_back(Pair("merit", utils->get_readable_difficulty(curMerit)));
-
-        PrimeRecord rec(curMerit, entry);
-        records.push_back(rec);
+        if (params[2].get_int() < 0)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative from");
+        nFrom = params[2].get_int();
     }
 
-    std::sort(records.begin(), records.end());
+    // whole buckets, records of the last one are only ordered by height
+    std::vector<CPrimeRecord> vRecords;
+    GetPrimeRecords(nMerit, std::numeric_limits<unsigned int>::max(), nFrom + amount + 1, true, vRecords);
+
+    std::stable_sort(vRecords.begin(), vRecords.end(), CompareMerit());
+    if (vRecords.size() > nFrom)
+        vRecords.resize(vRecords.size() - nFrom);
+    else
+        vRecords.clear();
 
     Array ret;
 
-    for (uint32_t i = (records.size() > (1 + amount)) ? records.size() - (1 + amount) : 0;
-         i < records.size(); 
+    for (uint32_t i = (vRecords.size() > (1 + amount)) ? vRecords.size() - (1 + amount) : 0;
+         i < vRecords.size(); 
          i++) {
 
-      ret.push_back(records[i].nObj);
+      ret.push_back(PrimeRecordToJSON(vRecords[i]));
     }
 
     return ret;
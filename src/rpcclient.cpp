@@ -132,6 +132,9 @@ Array RPCConvertValues(const std::string &strMethod, const std::vector<std::stri
     if (strMethod == "setgenerate"            && n > 2) ConvertTo<int64_t>(params[2]);
     if (strMethod == "setgenerate"            && n > 3) ConvertTo<int64_t>(params[3]);
     if (strMethod == "setgenerate"            && n > 4) ConvertTo<int64_t>(params[4]);
+    if (strMethod == "tuneminer"              && n > 0) ConvertTo<int64_t>(params[0]);
+    if (strMethod == "benchsieve"             && n > 0) ConvertTo<int64_t>(params[0]);
+    if (strMethod == "benchsigverify"         && n > 0) ConvertTo<int64_t>(params[0]);
     if (strMethod == "getnetworkprimesps"     && n > 0) ConvertTo<int64_t>(params[0]);
     if (strMethod == "getnetworkprimesps"     && n > 1) ConvertTo<int64_t>(params[1]);
     if (strMethod == "sendtoaddress"          && n > 1) ConvertTo<double>(params[1]);
@@ -167,6 +170,9 @@ Array RPCConvertValues(const std::string &strMethod, const std::vector<std::stri
     if (strMethod == "listprimerecords"       && n > 0) ConvertTo<int64_t>(params[0]);
     if (strMethod == "listbestprimes"         && n > 0) ConvertTo<int64_t>(params[0]);
     if (strMethod == "listbestprimes"         && n > 1) ConvertTo<int64_t>(params[1]);
+    if (strMethod == "listbestprimes"         && n > 2) ConvertTo<int64_t>(params[2]);
+    if (strMethod == "listprimerecords"       && n > 1) ConvertTo<int64_t>(params[1]);
+    if (strMethod == "listprimerecords"       && n > 2) ConvertTo<int64_t>(params[2]);
     if (strMethod == "getrawtransaction"      && n > 1) ConvertTo<int64_t>(params[1]);
     if (strMethod == "createrawtransaction"   && n > 0) ConvertTo<Array>(params[0]);
     if (strMethod == "createrawtransaction"   && n > 1) ConvertTo<Object>(params[1]);
@@ -9,12 +9,19 @@
 #include "net.h"
 #include "main.h"
 #include "miner.h"
+#include "miningstats.h"
+#include "powcache.h"
+#include "stratum.h"
 #ifdef ENABLE_WALLET
 #include "db.h"
 #include "wallet.h"
 #endif
+#include <deque>
 #include <stdint.h>
 
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+
 #include "json/json_spirit_utils.h"
 #include "json/json_spirit_value.h"
 
@@ -178,32 +185,38 @@ Value setgenerate(const Array& params, bool fHelp)
             fGenerate = false;
     }
 
+    uint64_t nSieveSize, nPrimes;
+    uint16_t nShift;
+    GetMiningParams(nSieveSize, nPrimes, nShift);
+
     if (params.size() > 2)
     {
-        nMiningSieveSize = (params[2].get_int() < 1000) ? 1000 : params[2].get_int();
+        nSieveSize = (params[2].get_int() < 1000) ? 1000 : params[2].get_int();
 
-        if (nMiningShift < 64 && nMiningSieveSize > (((uint64_t) 1) << nMiningShift))
-           nMiningSieveSize = (((uint64_t) 1) << nMiningShift);
+        if (nShift < 64 && nSieveSize > (((uint64_t) 1) << nShift))
+           nSieveSize = (((uint64_t) 1) << nShift);
     }
 
     if (params.size() > 3)
     {
-        nMiningPrimes = (params[3].get_int() < 1000) ? 1000 : params[3].get_int();
+        nPrimes = (params[3].get_int() < 1000) ? 1000 : params[3].get_int();
     }
 
     if (params.size() > 4)
     {
         if (params[4].get_int() < 14)
-            nMiningShift = 14;
+            nShift = 14;
         else if (params[4].get_int() >= (1 << 16))
-            nMiningShift = (1 << 16) - 1;
+            nShift = (1 << 16) - 1;
         else
-            nMiningShift = params[4].get_int();
+            nShift = params[4].get_int();
 
-        if (nMiningShift < 64 && nMiningSieveSize > (((uint64_t) 1) << nMiningShift))
-           nMiningSieveSize = (((uint64_t) 1) << nMiningShift);
+        if (nShift < 64 && nSieveSize > (((uint64_t) 1) << nShift))
+           nSieveSize = (((uint64_t) 1) << nShift);
     }
 
+    SetMiningParams(nSieveSize, nPrimes, nShift);
+
     // -regtest mode: don't return until nGenProcLimit blocks are generated
     if (fGenerate && Params().NetworkID() == CChainParams::REGTEST)
     {
@@ -242,6 +255,192 @@ Value setgenerate(const Array& params, bool fHelp)
     return Value::null;
 }
 
+static Object MiningTuningToJSON(const CMiningTuning& tuning)
+{
+    Object obj;
+    obj.push_back(Pair("sievesize",        tuning.nSieveSize));
+    obj.push_back(Pair("sieveprimes",      tuning.nPrimes));
+    obj.push_back(Pair("shift",            (int)tuning.nShift));
+    obj.push_back(Pair("gapsperhour",      tuning.dGapsPerHour));
+    obj.push_back(Pair("time",             tuning.nTime));
+    return obj;
+}
+
+Value tuneminer(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "tuneminer ( seconds )\n"
+            "\nCalibrates sievesize, sieveprimes and shift for this host and uses the best ones.\n"
+            "Short mining runs are timed with each candidate; generation is paused meanwhile.\n"
+            "\nArguments:\n"
+            "1. seconds      (numeric, optional, default=" + itostr(DEFAULT_TUNE_MINER_SECONDS) + ") Seconds to run each candidate\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"sievesize\": n             (numeric) The picked size of the prime sieve\n"
+            "  \"sieveprimes\": n           (numeric) The picked amount of primes used in the sieve\n"
+            "  \"shift\": n                 (numeric) The picked header shift\n"
+            "  \"gapsperhour\": xxx.xxxxx   (numeric) The expected gaps per hour at the current difficulty\n"
+            "  \"time\": n                  (numeric) The time of the calibration\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("tuneminer", "")
+            + HelpExampleRpc("tuneminer", "5")
+        );
+
+    if (pwalletMain == NULL)
+        throw JSONRPCError(RPC_METHOD_NOT_FOUND, "Method not found (disabled)");
+
+    int nSeconds = DEFAULT_TUNE_MINER_SECONDS;
+    if (params.size() > 0)
+        nSeconds = params[0].get_int();
+    if (nSeconds < 1)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "seconds must be positive");
+
+    // the miner threads would compete with the calibration
+    bool fGenerate = GetBoolArg("-gen", false);
+    int nGenProcLimit = GetArg("-genproclimit", -1);
+    if (fGenerate)
+        GenerateGapcoins(false, pwalletMain, 0);
+
+    CMiningTuning tuning = TuneMiningParams(nGenProcLimit, nSeconds);
+
+    if (fGenerate)
+        GenerateGapcoins(true, pwalletMain, nGenProcLimit);
+
+    return MiningTuningToJSON(tuning);
+}
+
+static Object MiningThreadStatsToJSON(const CMiningThreadStats& stats)
+{
+    Object gaps;
+    for (unsigned int i = 0; i <= MINING_STATS_MAX_MERIT; i++)
+        if (stats.vGaps[i] > 0)
+            gaps.push_back(Pair(strprintf("%u%s", i, i == MINING_STATS_MAX_MERIT ? "+" : ""), stats.vGaps[i]));
+
+    Object obj;
+    obj.push_back(Pair("name",             stats.strName));
+    obj.push_back(Pair("sievetime",        stats.nSieveMicros / 1000000.0));
+    obj.push_back(Pair("sieverounds",      stats.nSieveRounds));
+    obj.push_back(Pair("candidates",       stats.nCandidates));
+    obj.push_back(Pair("tests",            stats.nTests));
+    obj.push_back(Pair("testtime",         stats.nTestMicros / 1000000.0));
+    obj.push_back(Pair("testssaved",       stats.nTestsSaved));
+    obj.push_back(Pair("hashes",           stats.nHashes));
+    obj.push_back(Pair("hashtime",         stats.nHashMicros / 1000000.0));
+    obj.push_back(Pair("templates",        stats.nTemplates));
+    obj.push_back(Pair("templatetime",     stats.nTemplateMicros / 1000000.0));
+    obj.push_back(Pair("gaps",             gaps));
+    return obj;
+}
+
+Value getminingstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getminingstats\n"
+            "\nReturns the work of every internal mining thread by stage, since generation was started.\n"
+            "Times are in seconds; sieve time includes the tests unless -sharedsieve is used.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"uptime\": n,               (numeric) Seconds since generation was started\n"
+            "  \"total\": {...},            (object) The sums of all threads\n"
+            "  \"threads\": [               (array of objects) One entry per thread\n"
+            "    {\n"
+            "      \"name\": \"...\",          (string) The thread\n"
+            "      \"sievetime\": n,        (numeric) Time spent sieving\n"
+            "      \"sieverounds\": n,      (numeric) The sieve runs or segments\n"
+            "      \"candidates\": n,       (numeric) Numbers left by the sieve\n"
+            "      \"tests\": n,            (numeric) Fermat tests of candidates\n"
+            "      \"testtime\": n,         (numeric) Time spent testing\n"
+            "      \"testssaved\": n,       (numeric) Candidates the shared sieve skipped without a test\n"
+            "      \"hashes\": n,           (numeric) Header hashes searched or used\n"
+            "      \"hashtime\": n,         (numeric) Time spent searching or waiting for hashes\n"
+            "      \"templates\": n,        (numeric) Block templates built\n"
+            "      \"templatetime\": n,     (numeric) Time spent building them\n"
+            "      \"gaps\": {\"merit\": n}   (object) Gaps found per integer merit\n"
+            "    }, ...\n"
+            "  ]\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getminingstats", "")
+            + HelpExampleRpc("getminingstats", "")
+        );
+
+    std::vector<CMiningThreadStats> vStats = miningstats.GetThreads();
+    CMiningThreadStats total("total");
+    Array threads;
+    BOOST_FOREACH(const CMiningThreadStats& stats, vStats)
+    {
+        total.Add(stats);
+        threads.push_back(MiningThreadStatsToJSON(stats));
+    }
+
+    Object obj;
+    obj.push_back(Pair("uptime",           vStats.empty() ? 0 : GetTime() - miningstats.GetStartTime()));
+    obj.push_back(Pair("total",            MiningThreadStatsToJSON(total)));
+    obj.push_back(Pair("threads",          threads));
+    return obj;
+}
+
+Value benchsieve(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "benchsieve ( seconds )\n"
+            "\nTimes the per-thread PoWCore sieve and the shared sieve (-sharedsieve) with the current\n"
+            "sievesize, sieveprimes and shift. Generation is paused meanwhile.\n"
+            "\nArguments:\n"
+            "1. seconds      (numeric, optional, default=" + itostr(DEFAULT_TUNE_MINER_SECONDS) + ") Seconds to run each sieve\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"threads\": n               (numeric) The threads used, see genproclimit\n"
+            "  \"sievesize\": n             (numeric) The size of the prime sieve\n"
+            "  \"sieveprimes\": n           (numeric) The amount of primes used in the sieve\n"
+            "  \"shift\": n                 (numeric) The header shift\n"
+            "  \"powcore\": n               (numeric) Primes per second of the PoWCore sieve\n"
+            "  \"sharedsieve\": n           (numeric) Primes per second of the shared sieve\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("benchsieve", "")
+            + HelpExampleRpc("benchsieve", "5")
+        );
+
+    if (pwalletMain == NULL)
+        throw JSONRPCError(RPC_METHOD_NOT_FOUND, "Method not found (disabled)");
+
+    int nSeconds = DEFAULT_TUNE_MINER_SECONDS;
+    if (params.size() > 0)
+        nSeconds = params[0].get_int();
+    if (nSeconds < 1)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "seconds must be positive");
+
+    // the miner threads would compete with the benchmark
+    bool fGenerate = GetBoolArg("-gen", false);
+    int nGenProcLimit = GetArg("-genproclimit", -1);
+    if (fGenerate)
+        GenerateGapcoins(false, pwalletMain, 0);
+
+    double dPoWCorePrimesPerSec, dSharedPrimesPerSec;
+    BenchmarkSieves(nGenProcLimit, nSeconds, dPoWCorePrimesPerSec, dSharedPrimesPerSec);
+
+    if (fGenerate)
+        GenerateGapcoins(true, pwalletMain, nGenProcLimit);
+
+    uint64_t nSieveSize, nPrimes;
+    uint16_t nShift;
+    GetMiningParams(nSieveSize, nPrimes, nShift);
+
+    Object obj;
+    obj.push_back(Pair("threads",          nGenProcLimit < 0 ? (int) boost::thread::hardware_concurrency() : max(nGenProcLimit, 1)));
+    obj.push_back(Pair("sievesize",        nSieveSize));
+    obj.push_back(Pair("sieveprimes",      nPrimes));
+    obj.push_back(Pair("shift",            (int)nShift));
+    obj.push_back(Pair("powcore",          dPoWCorePrimesPerSec));
+    obj.push_back(Pair("sharedsieve",      dSharedPrimesPerSec));
+    return obj;
+}
+
 Value getprimespersec(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -280,6 +479,7 @@ Value getmininginfo(const Array& params, bool fHelp)
             "  \"sievesize\": n             (numeric, optional) The size of the prime sieve.\n"
             "  \"sieveprimes\": n           (numeric, optional) The amount of primes used in the sieve.\n"
             "  \"shift\": n                 (numeric, optional) The header shift.\n"
+            "  \"tuning\": {...}            (object, optional) The last calibration (see tuneminer)\n"
             "  \"primespersec\": n          (numeric) The primes per second of the generation, or 0 if no generation.\n"
             "  \"testspersec\": n           (numeric) The primes tests per second of the generation, or 0 if no generation.\n"
             "  \"gapsperday\": xxx.xxxxx    (numeric) The estimated (difficulty) gaps per day\n"
@@ -308,9 +508,15 @@ Value getmininginfo(const Array& params, bool fHelp)
 #endif
     obj.push_back(Pair("genproclimit",     (int)GetArg("-genproclimit", -1)));
 #ifdef ENABLE_WALLET
-    obj.push_back(Pair("sievesize",        nMiningSieveSize));
-    obj.push_back(Pair("sieveprimes",      nMiningPrimes));
-    obj.push_back(Pair("shift",            nMiningShift));
+    uint64_t nSieveSize, nPrimes;
+    uint16_t nShift;
+    GetMiningParams(nSieveSize, nPrimes, nShift);
+    obj.push_back(Pair("sievesize",        nSieveSize));
+    obj.push_back(Pair("sieveprimes",      nPrimes));
+    obj.push_back(Pair("shift",            (int)nShift));
+    CMiningTuning tuning = GetMiningTuning();
+    if (tuning.nTime != 0)
+        obj.push_back(Pair("tuning",       MiningTuningToJSON(tuning)));
     obj.push_back(Pair("primespersec",     getprimespersec(params, false)));
     obj.push_back(Pair("testspersec",      (int) dTestsPerSec));
     obj.push_back(Pair("gapsperday",       powUtils->gaps_per_day(dHashesPerSec, difficulty)));
@@ -324,6 +530,160 @@ Value getmininginfo(const Array& params, bool fHelp)
 
 #ifdef ENABLE_WALLET
 
+/** Number of getwork headers a submission is accepted for */
+static const unsigned int GETWORK_MAX_WORK = 10000;
+/** Seconds before new mempool transactions make a new getwork template */
+static const int GETWORK_TEMPLATE_REFRESH = 60;
+
+/**
+ * Work handed out by getwork, keyed by its merkle root, for any number of
+ * RPC threads. Every tip starts a new epoch that drops the work of the old
+ * one; the work holds its template by shared_ptr, so a submission still
+ * running for an old tip keeps it alive and the last user frees it.
+ *
+ * cs only guards the lookups and inserts. New templates are made under
+ * csBuild, submissions are rebuilt from a copy of the template and tested
+ * without any lock, so they never wait on CreateNewBlock or on each other.
+ */
+class CGetWorkStore
+{
+private:
+    struct CWork
+    {
+        boost::shared_ptr<CBlockTemplate> ptemplate;
+        CScript scriptSig;
+    };
+
+    mutable CCriticalSection cs;
+    std::map<uint256, CWork> mapWork;
+    std::deque<uint256> dequeWork; // oldest first
+
+    // Only used under csBuild
+    CCriticalSection csBuild;
+    boost::shared_ptr<CBlockTemplate> ptemplate;
+    CBlockIndex* pindexPrev;
+    unsigned int nTransactionsUpdatedLast;
+    int64_t nStart;
+    unsigned int nExtraNonce;
+
+public:
+    CGetWorkStore() : pindexPrev(NULL), nTransactionsUpdatedLast(0), nStart(0), nExtraNonce(0)
+    {
+    }
+
+    /** A new header to work on, from the current template */
+    bool GetWork(CReserveKey& reservekey, CBlock& block)
+    {
+        LOCK(csBuild);
+
+        // Update block
+        CBlockIndex* pindexTip;
+        {
+            LOCK(cs_main);
+            pindexTip = chainActive.Tip();
+        }
+        if (pindexPrev != pindexTip ||
+            (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > GETWORK_TEMPLATE_REFRESH))
+        {
+            // Store the pindexBest used before CreateNewBlock, to avoid races
+            nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
+            nStart = GetTime();
+
+            // Create new block
+            boost::shared_ptr<CBlockTemplate> ptemplateNew(CreateNewBlockWithKey(reservekey));
+            if (!ptemplateNew)
+            {
+                // Make a new block next time, despite this failure
+                pindexPrev = NULL;
+                return false;
+            }
+
+            // The tip may have moved since it was read above, so take the
+            // previous block from the template itself
+            CBlockIndex* pindexPrevNew;
+            {
+                LOCK(cs_main);
+                pindexPrevNew = mapBlockIndex[ptemplateNew->block.hashPrevBlock];
+            }
+
+            if (pindexPrev != pindexPrevNew)
+            {
+                // The work of the old tip is obsolete now
+                LOCK(cs);
+                mapWork.clear();
+                dequeWork.clear();
+            }
+
+            // Need to update only after we know CreateNewBlock succeeded
+            ptemplate = ptemplateNew;
+            pindexPrev = pindexPrevNew;
+        }
+
+        block = ptemplate->block;
+
+        // Update nTime
+        UpdateTime(block, pindexPrev);
+        block.nNonce = 0;
+
+        // Update nExtraNonce
+        IncrementExtraNonce(&block, pindexPrev, nExtraNonce);
+
+        // Save
+        CWork work;
+        work.ptemplate = ptemplate;
+        work.scriptSig = block.vtx[0].vin[0].scriptSig;
+
+        {
+            LOCK(cs);
+            if (mapWork.insert(make_pair(block.hashMerkleRoot, work)).second)
+                dequeWork.push_back(block.hashMerkleRoot);
+            while (dequeWork.size() > GETWORK_MAX_WORK)
+            {
+                mapWork.erase(dequeWork.front());
+                dequeWork.pop_front();
+            }
+        }
+        return true;
+    }
+
+    /** The block of the work with header.hashMerkleRoot, solved with the
+     *  nTime, nNonce, nShift and nAdd of header; false if it is unknown */
+    bool GetBlock(const CBlockHeader& header, CBlock& block) const
+    {
+        CWork work;
+        {
+            LOCK(cs);
+            std::map<uint256, CWork>::const_iterator mi = mapWork.find(header.hashMerkleRoot);
+            if (mi == mapWork.end())
+                return false;
+            work = mi->second;
+        }
+
+        block = work.ptemplate->block;
+        block.nTime  = header.nTime;
+        block.nNonce = header.nNonce;
+        block.nShift = header.nShift;
+        block.nAdd   = header.nAdd;
+        block.vtx[0].vin[0].scriptSig = work.scriptSig;
+        block.hashMerkleRoot = block.BuildMerkleTree();
+        return true;
+    }
+
+    /** CheckWork for a block from GetBlock */
+    bool CheckWork(CBlock& block, CWallet& wallet, CReserveKey& reservekey)
+    {
+        // The proof is tested without a lock, CheckWork then finds it in
+        // powcache; only a found block waits for csBuild, which guards the key
+        if (!powcache.Get(block).fValid)
+            return false;
+
+        LOCK(csBuild);
+        return ::CheckWork(&block, wallet, reservekey);
+    }
+};
+
+static CGetWorkStore getworkstore;
+
 static inline void CBlockToCharAry(CBlock* pblock, char* pdata)
 {
 
@@ -365,66 +725,19 @@ Value getwork(const Array& params, bool fHelp)
     if (IsInitialBlockDownload())
         throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "Gapcoin is downloading blocks...");
 
-    typedef map<uint256, pair<CBlock*, CScript> > mapNewBlock_t;
-    static mapNewBlock_t mapNewBlock;    // FIXME: thread safety
-    static vector<CBlockTemplate*> vNewBlockTemplate;
-
     if (params.size() == 0)
     {
-        // Update block
-        static unsigned int nTransactionsUpdatedLast;
-        static CBlockIndex* pindexPrev;
-        static int64_t nStart;
-        static CBlockTemplate* pblocktemplate;
-        if (pindexPrev != chainActive.Tip() ||
-            (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 60))
-        {
-            if (pindexPrev != chainActive.Tip())
-            {
-                // Deallocate old blocks since they're obsolete now
-                mapNewBlock.clear();
-                BOOST_FOREACH(CBlockTemplate* pblocktemplate, vNewBlockTemplate)
-                    delete pblocktemplate;
-                vNewBlockTemplate.clear();
-            }
-
-            // Clear pindexPrev so future getworks make a new block, despite any failures from here on
-            pindexPrev = NULL;
-
-            // Store the pindexBest used before CreateNewBlock, to avoid races
-            nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
-            CBlockIndex* pindexPrevNew = chainActive.Tip();
-            nStart = GetTime();
-
-            // Create new block
-            pblocktemplate = CreateNewBlockWithKey(*pMiningKey);
-            if (!pblocktemplate)
-                throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
-            vNewBlockTemplate.push_back(pblocktemplate);
-
-            // Need to update only after we know CreateNewBlock succeeded
-            pindexPrev = pindexPrevNew;
-        }
-        CBlock* pblock = &pblocktemplate->block; // pointer for convenience
-
-        // Update nTime
-        UpdateTime(*pblock, pindexPrev);
-        pblock->nNonce = 0;
-
-        // Update nExtraNonce
-        static unsigned int nExtraNonce = 0;
-        IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
-
-        // Save
-        mapNewBlock[pblock->hashMerkleRoot] = make_pair(pblock, pblock->vtx[0].vin[0].scriptSig);
+        CBlock block;
+        if (!getworkstore.GetWork(*pMiningKey, block))
+            throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
 
         char pdata[80];
-        CBlockToCharAry(pblock, pdata);
+        CBlockToCharAry(&block, pdata);
 
         Object result;
         result.push_back(Pair("data",         HexStr(BEGIN(pdata), END(pdata))));
-        result.push_back(Pair("hash",         pblock->GetHash().GetHex()));
-        result.push_back(Pair("difficulty",   pblock->nDifficulty));
+        result.push_back(Pair("hash",         block.GetHash().GetHex()));
+        result.push_back(Pair("difficulty",   block.nDifficulty));
         return result;
     }
     else
@@ -441,30 +754,39 @@ Value getwork(const Array& params, bool fHelp)
 
         CBlock* pdata = (CBlock*)&vchData[0];
 
+        CBlockHeader header;
+        header.hashMerkleRoot = pdata->hashMerkleRoot;
+        header.nTime  = pdata->nTime;
+        header.nNonce = pdata->nNonce;
+        header.nShift = pdata->nShift;
+        header.nAdd.assign(vchData.begin() + 86, vchData.end());
 
         // Get saved block
-        if (!mapNewBlock.count(pdata->hashMerkleRoot))
+        CBlock block;
+        if (!getworkstore.GetBlock(header, block))
             return false;
-        CBlock* pblock = mapNewBlock[pdata->hashMerkleRoot].first;
 
-        /* save adder */
-        pblock->nAdd.clear();
-        for (unsigned int i = 86; i < vchData.size(); i++) {
-          pblock->nAdd.push_back(vchData[i]);
-        }
-
-        pblock->nTime  = pdata->nTime;
-        pblock->nNonce = pdata->nNonce;
-        pblock->nShift = pdata->nShift;
-        pblock->vtx[0].vin[0].scriptSig = mapNewBlock[pdata->hashMerkleRoot].second;
-        pblock->hashMerkleRoot = pblock->BuildMerkleTree();
-        
         assert(pwalletMain != NULL);
-        return CheckWork(pblock, *pwalletMain, *pMiningKey);
+        return getworkstore.CheckWork(block, *pwalletMain, *pMiningKey);
     }
 }
 #endif
 
+/** Seconds a long poll waits after a mempool change before it returns a new template */
+static const int64_t GBT_LONGPOLL_MEMPOOL_DELAY = 60;
+/** Seconds after which a long poll returns a fresh template even if nothing changed */
+static const int64_t GBT_LONGPOLL_TIMEOUT = 300;
+
+static bool IsLongPollReady(uint256 hashWatchedChain, unsigned int nTransactionsUpdatedWatched, int64_t nMempoolTime)
+{
+    {
+        LOCK(cs_main);
+        if (chainActive.Tip()->GetBlockHash() != hashWatchedChain)
+            return true;
+    }
+    return mempool.GetTransactionsUpdated() != nTransactionsUpdatedWatched && GetTime() >= nMempoolTime;
+}
+
 Value getblocktemplate(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() > 1)
@@ -481,7 +803,9 @@ Value getblocktemplate(const Array& params, bool fHelp)
             "       \"capabilities\":[       (array, optional) A list of strings\n"
             "           \"support\"           (string) client side supported feature, 'longpoll', 'coinbasetxn', 'coinbasevalue', 'proposal', 'serverlist', 'workid'\n"
             "           ,...\n"
-            "         ]\n"
+            "         ],\n"
+            "       \"longpollid\":\"id\"     (string, optional) the longpollid of an earlier template: wait until there is a new block\n"
+            "                                  or the mempool changed, then return a new template\n"
             "     }\n"
             "\n"
 
@@ -518,7 +842,8 @@ Value getblocktemplate(const Array& params, bool fHelp)
             "  \"sizelimit\" : n,                  (numeric) limit of block size\n"
             "  \"curtime\" : ttt,                  (numeric) current timestamp in seconds since epoch (Jan 1 1970 GMT)\n"
             "  \"bits\" : \"xxx\",                 (string) target of next block\n"
-            "  \"height\" : n                      (numeric) The height of the next block\n"
+            "  \"height\" : n,                     (numeric) The height of the next block\n"
+            "  \"longpollid\" : \"id\"              (string) id to pass back in the request to wait for a new template\n"
             "}\n"
 
             "\nExamples:\n"
@@ -527,6 +852,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
          );
 
     std::string strMode = "template";
+    Value lpval;
     if (params.size() > 0)
     {
         const Object& oparam = params[0].get_obj();
@@ -539,6 +865,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
         }
         else
             throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid mode");
+        lpval = find_value(oparam, "longpollid");
     }
 
     if (strMode != "template")
@@ -550,6 +877,34 @@ Value getblocktemplate(const Array& params, bool fHelp)
     if (IsInitialBlockDownload())
         throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "Gapcoin is downloading blocks...");
 
+    if (lpval.type() == str_type)
+    {
+        // Format: <hashBestChain><nTransactionsUpdatedLast>
+        const std::string& lpstr = lpval.get_str();
+        if (lpstr.size() <= 64 || !IsHex(lpstr.substr(0, 64)))
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid longpollid");
+        uint256 hashWatchedChain(lpstr.substr(0, 64));
+        unsigned int nTransactionsUpdatedWatched = atoi64(lpstr.substr(64));
+        int64_t nNow = GetTime();
+        int64_t nMempoolTime = nNow + GBT_LONGPOLL_MEMPOOL_DELAY;
+
+        if (!IsLongPollReady(hashWatchedChain, nTransactionsUpdatedWatched, nMempoolTime))
+        {
+            // Nothing new yet: park the request without holding an RPC thread
+            // and run it again, without the longpollid, once there is.
+            Object oparam;
+            BOOST_FOREACH(const Pair& p, params[0].get_obj())
+                if (p.name_ != "longpollid")
+                    oparam.push_back(p);
+
+            RPCLongPoll poll;
+            poll.fnReady = boost::bind(&IsLongPollReady, hashWatchedChain, nTransactionsUpdatedWatched, nMempoolTime);
+            poll.params.push_back(oparam);
+            poll.nDeadline = nNow + GBT_LONGPOLL_TIMEOUT;
+            throw poll;
+        }
+    }
+
     // Update block
     static unsigned int nTransactionsUpdatedLast;
     static CBlockIndex* pindexPrev;
@@ -645,6 +1000,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
     result.push_back(Pair("curtime", (int64_t)pblock->nTime));
     result.push_back(Pair("bits", HexBits(pblock->nDifficulty)));
     result.push_back(Pair("height", (int64_t)(pindexPrev->nHeight+1)));
+    result.push_back(Pair("longpollid", pindexPrev->GetBlockHash().GetHex() + i64tostr(nTransactionsUpdatedLast)));
 
     return result;
 }
@@ -687,3 +1043,62 @@ Value submitblock(const Array& params, bool fHelp)
 
     return Value::null;
 }
+
+Value getstratuminfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getstratuminfo\n"
+            "\nReturns the state of the work server (-stratum) and the share accounting of its workers.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"port\": n,                 (numeric) The port miners connect to\n"
+            "  \"difficulty\": n,           (numeric) The share difficulty in merit\n"
+            "  \"connections\": n,          (numeric) Connected miners\n"
+            "  \"jobs\": n,                 (numeric) Jobs shares are accepted for\n"
+            "  \"height\": n,               (numeric) Height of the block of the current job\n"
+            "  \"workers\": [               (array of objects) One entry per worker name\n"
+            "    {\n"
+            "      \"name\": \"...\",          (string) The worker\n"
+            "      \"accepted\": n,         (numeric) Valid shares\n"
+            "      \"rejected\": n,         (numeric) Invalid, duplicate or too weak shares\n"
+            "      \"stale\": n,            (numeric) Shares for jobs that were already dropped\n"
+            "      \"blocks\": n,           (numeric) Shares that were accepted as blocks\n"
+            "      \"bestmerit\": n,        (numeric) The best merit of its shares\n"
+            "      \"lastshare\": n         (numeric) Time of its last valid share\n"
+            "    }, ...\n"
+            "  ]\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getstratuminfo", "")
+            + HelpExampleRpc("getstratuminfo", "")
+        );
+
+    CStratumInfo info;
+    if (!GetStratumInfo(info))
+        throw JSONRPCError(RPC_MISC_ERROR, "The work server is not running, see -stratum");
+
+    Array workers;
+    for (map<string, CStratumWorkerStats>::const_iterator mi = info.mapWorkers.begin(); mi != info.mapWorkers.end(); ++mi)
+    {
+        const CStratumWorkerStats& stats = mi->second;
+        Object worker;
+        worker.push_back(Pair("name",      mi->first));
+        worker.push_back(Pair("accepted",  stats.nAccepted));
+        worker.push_back(Pair("rejected",  stats.nRejected));
+        worker.push_back(Pair("stale",     stats.nStale));
+        worker.push_back(Pair("blocks",    stats.nBlocks));
+        worker.push_back(Pair("bestmerit", powUtils->get_readable_difficulty(stats.nBestMerit)));
+        worker.push_back(Pair("lastshare", stats.nLastShare));
+        workers.push_back(worker);
+    }
+
+    Object obj;
+    obj.push_back(Pair("port",        (int) info.nPort));
+    obj.push_back(Pair("difficulty",  powUtils->get_readable_difficulty(info.nShareDifficulty)));
+    obj.push_back(Pair("connections", (int) info.nConnections));
+    obj.push_back(Pair("jobs",        (int) info.nJobs));
+    obj.push_back(Pair("height",      info.nHeight));
+    obj.push_back(Pair("workers",     workers));
+    return obj;
+}
@@ -9,6 +9,7 @@
 #include "net.h"
 #include "netbase.h"
 #include "rpcserver.h"
+#include "secp256k1.h"
 #include "util.h"
 #ifdef ENABLE_WALLET
 #include "wallet.h"
@@ -325,3 +326,74 @@ Value verifymessage(const Array& params, bool fHelp)
 
     return (pubkey.GetID() == keyID);
 }
+
+// Verifications per second of a single thread with the given backend
+static double TimeSignatureVerifier(SignatureVerifier verifier, int nSeconds, const vector<CPubKey>& vPubKeys,
+                                    const vector<uint256>& vHashes, const vector<vector<unsigned char> >& vSigs)
+{
+    int64_t nStart = GetTimeMicros();
+    int64_t nEnd = nStart + nSeconds * 1000000LL;
+    int64_t nVerified = 0;
+    int64_t nNow;
+    do
+    {
+        for (unsigned int i = 0; i < vPubKeys.size(); i++)
+            if (!vPubKeys[i].Verify(vHashes[i], vSigs[i], verifier))
+                throw JSONRPCError(RPC_INTERNAL_ERROR, "Signature failed to verify");
+        nVerified += vPubKeys.size();
+        nNow = GetTimeMicros();
+    } while (nNow < nEnd);
+    return nVerified * 1000000.0 / (nNow - nStart);
+}
+
+Value benchsigverify(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "benchsigverify ( seconds )\n"
+            "\nTimes ECDSA signature verification on one core with each backend (see -sigverifier),\n"
+            "on signatures of fresh compressed and uncompressed keys.\n"
+            "\nArguments:\n"
+            "1. seconds      (numeric, optional, default=1) Seconds to run each backend\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"openssl\": n               (numeric) Verifications per second with OpenSSL\n"
+            "  \"native\": n                (numeric) Verifications per second with the native code, if available\n"
+            "  \"speedup\": x.xx            (numeric) native / openssl\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("benchsigverify", "")
+            + HelpExampleRpc("benchsigverify", "5")
+        );
+
+    int nSeconds = 1;
+    if (params.size() > 0)
+        nSeconds = params[0].get_int();
+    if (nSeconds < 1)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "seconds must be positive");
+
+    vector<CPubKey> vPubKeys;
+    vector<uint256> vHashes;
+    vector<vector<unsigned char> > vSigs;
+    for (int i = 0; i < 32; i++)
+    {
+        CKey key;
+        key.MakeNewKey(i % 2 == 0);
+        vPubKeys.push_back(key.GetPubKey());
+        vHashes.push_back(GetRandHash());
+        vSigs.push_back(vector<unsigned char>());
+        if (!key.Sign(vHashes.back(), vSigs.back()))
+            throw JSONRPCError(RPC_INTERNAL_ERROR, "Sign failed");
+    }
+
+    Object obj;
+    double dOpenSSLPerSec = TimeSignatureVerifier(SIGVERIFIER_OPENSSL, nSeconds, vPubKeys, vHashes, vSigs);
+    obj.push_back(Pair("openssl",          dOpenSSLPerSec));
+    if (Secp256k1Available())
+    {
+        double dNativePerSec = TimeSignatureVerifier(SIGVERIFIER_NATIVE, nSeconds, vPubKeys, vHashes, vSigs);
+        obj.push_back(Pair("native",           dNativePerSec));
+        obj.push_back(Pair("speedup",          dNativePerSec / dOpenSSLPerSec));
+    }
+    return obj;
+}
@@ -23,6 +23,7 @@
 #include <boost/iostreams/concepts.hpp>
 #include <boost/iostreams/stream.hpp>
 #include <boost/shared_ptr.hpp>
+#include <list>
 #include "json/json_spirit_writer_template.h"
 
 using namespace std;
@@ -39,6 +40,7 @@ static ssl::context* rpc_ssl_context = NULL;
 static boost::thread_group* rpc_worker_group = NULL;
 static boost::asio::io_service::work *rpc_dummy_work = NULL;
 static std::vector< boost::shared_ptr<ip::tcp::acceptor> > rpc_acceptors;
+static deadline_timer* rpc_longpoll_timer = NULL;
 
 void RPCTypeCheck(const Array& params,
                   const list<Value_type>& typesExpected,
@@ -264,6 +266,7 @@ static const CRPCCommand vRPCCommands[] =
     { "getblocktemplate",       &getblocktemplate,       true,      false,      false },
     { "getmininginfo",          &getmininginfo,          true,      false,      false },
     { "getnetworkprimesps",     &getnetworkprimesps,     true,      false,      false },
+    { "getstratuminfo",         &getstratuminfo,         true,      true,       false },
     { "submitblock",            &submitblock,            false,     false,      false },
 
     /* Raw transactions */
@@ -278,6 +281,7 @@ static const CRPCCommand vRPCCommands[] =
     { "createmultisig",         &createmultisig,         true,      true ,      false },
     { "validateaddress",        &validateaddress,        true,      false,      false }, /* uses wallet if enabled */
     { "verifymessage",          &verifymessage,          false,     false,      false },
+    { "benchsigverify",         &benchsigverify,         true,      true,       false },
 
 #ifdef ENABLE_WALLET
     /* Wallet */
@@ -322,9 +326,12 @@ static const CRPCCommand vRPCCommands[] =
 
     /* Wallet-enabled mining */
     { "getgenerate",            &getgenerate,            true,      false,      false },
+    { "getminingstats",         &getminingstats,         true,      true,       false },
     { "getprimespersec",        &getprimespersec,        true,      false,      false },
-    { "getwork",                &getwork,                true,      false,      true  },
+    { "getwork",                &getwork,                true,      true,       true  },
     { "setgenerate",            &setgenerate,            true,      true,       false },
+    { "tuneminer",              &tuneminer,              true,      true,       false },
+    { "benchsieve",             &benchsieve,             true,      true,       false },
 #endif // ENABLE_WALLET
 };
 
@@ -440,7 +447,114 @@ private:
     iostreams::stream< SSLIOStreamDevice<Protocol> > _stream;
 };
 
-void ServiceConnection(AcceptedConnection *conn);
+bool ServiceConnection(boost::shared_ptr<AcceptedConnection> conn);
+
+/** A long poll waiting for something new, see RPCLongPoll */
+struct CRPCParkedRequest
+{
+    boost::shared_ptr<AcceptedConnection> conn;
+    Value id;
+    string strMethod;
+    RPCLongPoll poll;
+    bool fRun;  // keep the connection alive after the reply
+};
+
+static CCriticalSection cs_rpcParked;
+static list<CRPCParkedRequest> listRPCParked;
+static bool fRPCLongPollTimer = false;
+
+static void RPCCheckParked();
+
+static void RPCLongPollTimerHandler(const boost::system::error_code& err)
+{
+    if (err)
+        return;
+    {
+        LOCK(cs_rpcParked);
+        fRPCLongPollTimer = false;
+    }
+    RPCCheckParked();
+}
+
+// Parked requests are checked once a second for their deadline and for
+// mempool changes; a new tip checks them right away.
+static void RPCScheduleLongPollTimer()
+{
+    AssertLockHeld(cs_rpcParked);
+    if (fRPCLongPollTimer || listRPCParked.empty() || rpc_longpoll_timer == NULL)
+        return;
+    rpc_longpoll_timer->expires_from_now(posix_time::seconds(1));
+    rpc_longpoll_timer->async_wait(&RPCLongPollTimerHandler);
+    fRPCLongPollTimer = true;
+}
+
+static void RPCPark(const CRPCParkedRequest& req)
+{
+    LOCK(cs_rpcParked);
+    listRPCParked.push_back(req);
+    RPCScheduleLongPollTimer();
+}
+
+static void RPCResumeParked(CRPCParkedRequest req)
+{
+    try
+    {
+        Value result = tableRPC.execute(req.strMethod, req.poll.params);
+        req.conn->stream() << HTTPReply(HTTP_OK, JSONRPCReply(result, Value::null, req.id), req.fRun) << std::flush;
+    }
+    catch (RPCLongPoll& poll)
+    {
+        req.poll = poll;
+        RPCPark(req);
+        return;
+    }
+    catch (Object& objError)
+    {
+        ErrorReply(req.conn->stream(), objError, req.id);
+        req.fRun = false;
+    }
+    catch (std::exception& e)
+    {
+        ErrorReply(req.conn->stream(), JSONRPCError(RPC_PARSE_ERROR, e.what()), req.id);
+        req.fRun = false;
+    }
+
+    if (!req.fRun || ServiceConnection(req.conn))
+        req.conn->close();
+}
+
+static void RPCCheckParked()
+{
+    vector<CRPCParkedRequest> vReady;
+    {
+        LOCK(cs_rpcParked);
+        int64_t nNow = GetTime();
+        list<CRPCParkedRequest>::iterator it = listRPCParked.begin();
+        while (it != listRPCParked.end())
+        {
+            if (nNow >= it->poll.nDeadline || it->poll.fnReady())
+            {
+                vReady.push_back(*it);
+                listRPCParked.erase(it++);
+            }
+            else
+                ++it;
+        }
+        RPCScheduleLongPollTimer();
+        if (vReady.empty() || rpc_io_service == NULL)
+            return;
+    }
+
+    // Answer them on the worker threads, one handler each
+    BOOST_FOREACH(const CRPCParkedRequest& req, vReady)
+        rpc_io_service->post(boost::bind(&RPCResumeParked, req));
+}
+
+static void RPCNotifyBlocksChanged()
+{
+    if (rpc_io_service != NULL)
+        rpc_io_service->post(&RPCCheckParked);
+}
 
 // Forward declaration required for RPCListen
 template <typename Protocol, typename SocketAcceptorService>
@@ -504,10 +618,8 @@ static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol,
             conn->stream() << HTTPReply(HTTP_FORBIDDEN, "", false) << std::flush;
         conn->close();
     }
-    else {
-        ServiceConnection(conn.get());
+    else if (ServiceConnection(conn))
         conn->close();
-    }
 }
 
 void StartRPCThreads()
@@ -625,6 +737,9 @@ void StartRPCThreads()
         return;
     }
 
+    rpc_longpoll_timer = new deadline_timer(*rpc_io_service);
+    uiInterface.NotifyBlocksChanged.connect(&RPCNotifyBlocksChanged);
+
     rpc_worker_group = new boost::thread_group();
     for (int i = 0; i < GetArg("-rpcthreads", 4); i++)
         rpc_worker_group->create_thread(boost::bind(&asio::io_service::run, rpc_io_service));
@@ -657,10 +772,23 @@ void StopRPCThreads()
         timer.second->cancel();
     deadlineTimers.clear();
 
+    // Drop the parked long polls
+    uiInterface.NotifyBlocksChanged.disconnect(&RPCNotifyBlocksChanged);
+    {
+        LOCK(cs_rpcParked);
+        if (rpc_longpoll_timer != NULL)
+            rpc_longpoll_timer->cancel();
+        BOOST_FOREACH(CRPCParkedRequest& req, listRPCParked)
+            req.conn->close();
+        listRPCParked.clear();
+        fRPCLongPollTimer = false;
+    }
+
     rpc_io_service->stop();
     if (rpc_worker_group != NULL)
         rpc_worker_group->join_all();
     delete rpc_dummy_work; rpc_dummy_work = NULL;
+    delete rpc_longpoll_timer; rpc_longpoll_timer = NULL;
     delete rpc_worker_group; rpc_worker_group = NULL;
     delete rpc_ssl_context; rpc_ssl_context = NULL;
     delete rpc_io_service; rpc_io_service = NULL;
@@ -735,7 +863,16 @@ static Object JSONRPCExecOne(const Value& req)
     try {
         jreq.parse(req);
 
-        Value result = tableRPC.execute(jreq.strMethod, jreq.params);
+        Value result;
+        try
+        {
+            result = tableRPC.execute(jreq.strMethod, jreq.params);
+        }
+        catch (RPCLongPoll& poll)
+        {
+            // Batches are not parked, answer with what there is now
+            result = tableRPC.execute(jreq.strMethod, poll.params);
+        }
         rpc_result = JSONRPCReplyObj(result, Value::null, jreq.id);
     }
     catch (Object& objError)
@@ -760,7 +897,8 @@ static string JSONRPCExecBatch(const Array& vReq)
     return write_string(Value(ret), false) + "\n";
 }
 
-void ServiceConnection(AcceptedConnection *conn)
+/** Serve requests on conn; false if a request was parked and conn must be left open */
+bool ServiceConnection(boost::shared_ptr<AcceptedConnection> conn)
 {
     bool fRun = true;
     while (fRun && !ShutdownRequested())
@@ -829,6 +967,13 @@ void ServiceConnection(AcceptedConnection *conn)
 
             conn->stream() << HTTPReply(HTTP_OK, strReply, fRun) << std::flush;
         }
+        catch (RPCLongPoll& poll)
+        {
+            // Give the thread back until there is something new to answer with
+            CRPCParkedRequest req = { conn, jreq.id, jreq.strMethod, poll, fRun };
+            RPCPark(req);
+            return false;
+        }
         catch (Object& objError)
         {
             ErrorReply(conn->stream(), objError, jreq.id);
@@ -840,6 +985,7 @@ void ServiceConnection(AcceptedConnection *conn)
             break;
         }
     }
+    return true;
 }
 
 json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params) const
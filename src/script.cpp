@@ -7,16 +7,18 @@
 
 #include "bignum.h"
 #include "core.h"
+#include "cuckoocache.h"
 #include "hash.h"
 #include "key.h"
 #include "keystore.h"
+#include "secp256k1.h"
 #include "sync.h"
 #include "uint256.h"
 #include "util.h"
 
+#include <limits>
+
 #include <boost/foreach.hpp>
-#include <boost/tuple/tuple.hpp>
-#include <boost/tuple/tuple_comparison.hpp>
 
 using namespace std;
 using namespace boost;
@@ -31,7 +33,7 @@ static const CBigNum bnFalse(0);
 static const CBigNum bnTrue(1);
 static const size_t nMaxNumSize = 4;
 
-bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, int flags);
+bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, int flags, const CSignatureHasher* phasher = NULL, CSecp256k1Batch* pbatch = NULL);
 
 CBigNum CastToBigNum(const valtype& vch)
 {
@@ -304,7 +306,8 @@ bool IsCanonicalSignature(const valtype &vchSig, unsigned int flags) {
     return true;
 }
 
-bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType)
+bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType,
+                const CSignatureHasher* phasher, CSecp256k1Batch* pbatch)
 {
     CAutoBN_CTX pctx;
     CScript::const_iterator pc = script.begin();
@@ -858,7 +861,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     scriptCode.FindAndDelete(CScript(vchSig));
 
                     bool fSuccess = IsCanonicalSignature(vchSig, flags) && IsCanonicalPubKey(vchPubKey, flags) &&
-                        CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags);
+                        CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, phasher, pbatch);
 
                     popstack(stack);
                     popstack(stack);
@@ -919,7 +922,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
 
                         // Check signature
                         bool fOk = IsCanonicalSignature(vchSig, flags) && IsCanonicalPubKey(vchPubKey, flags) &&
-                            CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags);
+                            CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, phasher, pbatch);
 
                         if (fOk) {
                             isig++;
@@ -1094,6 +1097,65 @@ uint256 SignatureHash(const CScript &scriptCode, const CTransaction& txTo, unsig
     return ss.GetHash();
 }
 
+CSignatureHasher::CSignatureHasher(const CTransaction& txToIn) : txTo(txToIn)
+{
+    // txTo as SIGHASH_ALL serializes it for every input, except that the
+    // script of the input being signed is empty here
+    CDataStream ss(SER_GETHASH, 0);
+    ss << txTo.nVersion;
+    WriteCompactSize(ss, txTo.vin.size());
+    vPrefixEnd.reserve(txTo.vin.size());
+    BOOST_FOREACH(const CTxIn& txin, txTo.vin)
+    {
+        ss << txin.prevout;
+        vPrefixEnd.push_back(ss.size());
+        ss << CScript() << txin.nSequence;
+    }
+    ss << txTo.vout << txTo.nLockTime;
+    vData.assign(ss.begin(), ss.end());
+
+    // The SHA-256 state at each 64 byte block boundary
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    vMidstates.reserve(vData.size() / SHA256_CBLOCK + 1);
+    vMidstates.push_back(ctx);
+    for (size_t nPos = 0; nPos + SHA256_CBLOCK <= vData.size(); nPos += SHA256_CBLOCK)
+    {
+        SHA256_Update(&ctx, &vData[nPos], SHA256_CBLOCK);
+        vMidstates.push_back(ctx);
+    }
+}
+
+uint256 CSignatureHasher::SignatureHash(const CScript &scriptCode, unsigned int nIn, int nHashType) const
+{
+    if (nIn >= txTo.vin.size() || (nHashType & SIGHASH_ANYONECANPAY) ||
+        (nHashType & 0x1f) == SIGHASH_NONE || (nHashType & 0x1f) == SIGHASH_SINGLE)
+        return ::SignatureHash(scriptCode, txTo, nIn, nHashType);
+
+    // Resume at the last block boundary before the script of input nIn...
+    size_t nPrefixEnd = vPrefixEnd[nIn];
+    size_t nBlock = nPrefixEnd / SHA256_CBLOCK;
+    SHA256_CTX ctx = vMidstates[nBlock];
+    SHA256_Update(&ctx, &vData[nBlock * SHA256_CBLOCK], nPrefixEnd - nBlock * SHA256_CBLOCK);
+
+    // ... put the script in place of the empty one ...
+    CDataStream ssScript(SER_GETHASH, 0);
+    CTransactionSignatureSerializer(txTo, scriptCode, nIn, nHashType).SerializeScriptCode(ssScript, SER_GETHASH, 0);
+    SHA256_Update(&ctx, &ssScript[0], ssScript.size());
+
+    // ... and hash the rest
+    SHA256_Update(&ctx, &vData[nPrefixEnd + 1], vData.size() - nPrefixEnd - 1);
+    CDataStream ssHashType(SER_GETHASH, 0);
+    ssHashType << nHashType;
+    SHA256_Update(&ctx, &ssHashType[0], ssHashType.size());
+
+    uint256 hash1;
+    SHA256_Final((unsigned char*)&hash1, &ctx);
+    uint256 hash2;
+    SHA256((unsigned char*)&hash1, sizeof(hash1), (unsigned char*)&hash2);
+    return hash2;
+}
+
 
 // Valid signature cache, to avoid doing expensive ECDSA signature checking
 // twice for every transaction (once when accepted into memory pool, and
@@ -1102,57 +1164,53 @@ uint256 SignatureHash(const CScript &scriptCode, const CTransaction& txTo, unsig
 class CSignatureCache
 {
 private:
-     // sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, CPubKey> sigdata_type;
-    std::set< sigdata_type> setValid;
+    // Entries are salted hashes of (signature hash, signature, public key):
+    // 32 bytes each, and no use precomputing signatures that collide in
+    // the table without knowing the salt
+    uint256 nonce;
+    CCuckooCache table;
     boost::shared_mutex cs_sigcache;
 
+    uint256 GetEntry(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+    {
+        CHashWriter ss(SER_GETHASH, 0);
+        ss << nonce << hash << vchSig << pubKey;
+        return ss.GetHash();
+    }
+
 public:
+    CSignatureCache()
+    {
+        nonce = GetRandHash();
+        int64_t nMaxCacheSize = std::min(GetArg("-sigcachesize", DEFAULT_SIG_CACHE_SIZE), (int64_t)MAX_SIG_CACHE_SIZE);
+        // megabytes that fit in a size_t on 32-bit builds
+        nMaxCacheSize = std::min(nMaxCacheSize, (int64_t)(std::numeric_limits<size_t>::max() >> 20));
+        if (nMaxCacheSize > 0)
+        {
+            size_t nEntries = table.Setup((size_t)nMaxCacheSize << 20);
+            LogPrintf("Using %d MiB for the signature cache, room for %u signatures\n", nMaxCacheSize, nEntries);
+        }
+    }
+
     bool
     Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
     {
+        uint256 entry = GetEntry(hash, vchSig, pubKey);
         boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
-
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
-        return false;
+        return table.Contains(entry);
     }
 
     void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
     {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64_t nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
-
+        uint256 entry = GetEntry(hash, vchSig, pubKey);
         boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
-
-        while (static_cast<int64_t>(setValid.size()) > nMaxCacheSize)
-        {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
-        }
-
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+        table.Insert(entry);
     }
 };
 
 bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode,
-              const CTransaction& txTo, unsigned int nIn, int nHashType, int flags)
+              const CTransaction& txTo, unsigned int nIn, int nHashType, int flags, const CSignatureHasher* phasher,
+              CSecp256k1Batch* pbatch)
 {
     static CSignatureCache signatureCache;
 
@@ -1169,11 +1227,15 @@ bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubK
         return false;
     vchSig.pop_back();
 
-    uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType);
+    uint256 sighash = phasher ? phasher->SignatureHash(scriptCode, nIn, nHashType) : SignatureHash(scriptCode, txTo, nIn, nHashType);
 
     if (signatureCache.Get(sighash, vchSig, pubkey))
         return true;
 
+    if (pbatch && !vchSig.empty() && GetSignatureVerifier() == SIGVERIFIER_NATIVE &&
+        pbatch->Add(pubkey.begin(), pubkey.size(), (const unsigned char*)&sighash, &vchSig[0], vchSig.size()))
+        return true;
+
     if (!pubkey.Verify(sighash, vchSig))
         return false;
 
@@ -1597,14 +1659,14 @@ void ExtractAffectedKeys(const CKeyStore &keystore, const CScript& scriptPubKey,
 }
 
 bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
-                  unsigned int flags, int nHashType)
+                  unsigned int flags, int nHashType, const CSignatureHasher* phasher, CSecp256k1Batch* pbatch)
 {
     vector<vector<unsigned char> > stack, stackCopy;
-    if (!EvalScript(stack, scriptSig, txTo, nIn, flags, nHashType))
+    if (!EvalScript(stack, scriptSig, txTo, nIn, flags, nHashType, phasher, pbatch))
         return false;
     if (flags & SCRIPT_VERIFY_P2SH)
         stackCopy = stack;
-    if (!EvalScript(stack, scriptPubKey, txTo, nIn, flags, nHashType))
+    if (!EvalScript(stack, scriptPubKey, txTo, nIn, flags, nHashType, phasher, pbatch))
         return false;
     if (stack.empty())
         return false;
@@ -1627,7 +1689,7 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
         CScript pubKey2(pubKeySerialized.begin(), pubKeySerialized.end());
         popstack(stackCopy);
 
-        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, flags, nHashType))
+        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, flags, nHashType, phasher, pbatch))
             return false;
         if (stackCopy.empty())
             return false;
@@ -20,10 +20,17 @@
 
 class CCoins;
 class CKeyStore;
+class CSecp256k1Batch;
 class CTransaction;
 
 static const unsigned int MAX_SCRIPT_ELEMENT_SIZE = 520; // bytes
 static const unsigned int MAX_OP_RETURN_RELAY = 40;      // bytes
+/** Default for -sigcachesize, the size of the signature cache in megabytes */
+static const unsigned int DEFAULT_SIG_CACHE_SIZE = 32;
+/** Upper bound for -sigcachesize */
+static const unsigned int MAX_SIG_CACHE_SIZE = 16384;
+/** Bytes a signature takes in the cache, to convert the old -maxsigcachesize */
+static const unsigned int SIG_CACHE_ENTRY_SIZE = 32;
 
 /** Signature hash types/flags */
 enum
@@ -675,7 +682,33 @@ public:
 bool IsCanonicalPubKey(const std::vector<unsigned char> &vchPubKey, unsigned int flags);
 bool IsCanonicalSignature(const std::vector<unsigned char> &vchSig, unsigned int flags);
 
-bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
+/**
+ * Signature hashes for the inputs of one transaction. A signature hash
+ * commits to the whole transaction, so each input rehashed all of it; this
+ * serializes the transaction once, keeps the SHA-256 midstates along it and
+ * only hashes from the input being signed on. SIGHASH_NONE, SIGHASH_SINGLE
+ * and SIGHASH_ANYONECANPAY fall back to SignatureHash().
+ * txTo must outlive it and not change.
+ */
+class CSignatureHasher
+{
+private:
+    const CTransaction& txTo;
+    std::vector<unsigned char> vData; // txTo with all input scripts empty
+    std::vector<unsigned int> vPrefixEnd; // Position of the script of each input in vData
+    std::vector<SHA256_CTX> vMidstates; // State after each 64 byte block of vData
+
+public:
+    CSignatureHasher(const CTransaction& txToIn);
+    uint256 SignatureHash(const CScript &scriptCode, unsigned int nIn, int nHashType) const;
+};
+
+/**
+ * With pbatch, signatures it takes are assumed valid and left to the batch;
+ * a script that passes is only valid once the batch verifies.
+ */
+bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType,
+                const CSignatureHasher* phasher = NULL, CSecp256k1Batch* pbatch = NULL);
 bool Solver(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<std::vector<unsigned char> >& vSolutionsRet);
 int ScriptSigArgsExpected(txnouttype t, const std::vector<std::vector<unsigned char> >& vSolutions);
 bool IsStandard(const CScript& scriptPubKey, txnouttype& whichType);
@@ -686,7 +719,8 @@ bool ExtractDestination(const CScript& scriptPubKey, CTxDestination& addressRet)
 bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<CTxDestination>& addressRet, int& nRequiredRet);
 bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
 bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
-bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
+bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType,
+                  const CSignatureHasher* phasher = NULL, CSecp256k1Batch* pbatch = NULL);
 
 // Given two sets of signatures for scriptPubKey, possibly with OP_0 placeholders,
 // combine them intelligently and return the result.
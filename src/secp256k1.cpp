@@ -0,0 +1,1144 @@
+// Copyright (c) 2014 The Gapcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "secp256k1.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __SIZEOF_INT128__
+
+// ECDSA verification specialized to secp256k1:
+//  - field elements mod p and scalars mod n are four 64-bit limbs, and as
+//    p = 2^256 - 0x1000003D1 a product is reduced with two small folds
+//  - u1*G + u2*Q is a single interleaved multiplication over the wNAF digits
+//    of both scalars, so the doublings are shared; the odd multiples of G
+//    are precomputed once, those of Q for each verification
+//  - with the endomorphism lambda*(x, y) = (beta*x, y) each scalar is split
+//    into two of about 128 bits, which halves the doublings again
+namespace {
+
+typedef unsigned __int128 uint128_t;
+
+// Field elements, always fully reduced mod p
+struct CFieldElem
+{
+    uint64_t n[4]; // little endian limbs
+};
+
+const uint64_t FIELD_K = 0x1000003D1ULL; // 2^256 - p
+const CFieldElem FIELD_ONE = {{1, 0, 0, 0}};
+const CFieldElem FIELD_SEVEN = {{7, 0, 0, 0}};
+const CFieldElem FIELD_BETA = {{0xC1396C28719501EEULL, 0x9CF0497512F58995ULL, 0x6E64479EAC3434E9ULL, 0x7AE96A2B657C0710ULL}};
+const uint64_t FIELD_P0 = 0xFFFFFFFEFFFFFC2FULL; // the other limbs of p are all ones
+const uint64_t FIELD_P[4] = {FIELD_P0, ~0ULL, ~0ULL, ~0ULL};
+const uint64_t FIELD_P_PLUS_1_DIV_4[4] = {0xFFFFFFFFBFFFFF0CULL, ~0ULL, ~0ULL, 0x3FFFFFFFFFFFFFFFULL};
+
+// Scalars, always fully reduced mod n
+struct CScalar
+{
+    uint64_t n[4];
+};
+
+const CScalar SCALAR_N = {{0xBFD25E8CD0364141ULL, 0xBAAEDCE6AF48A03BULL, 0xFFFFFFFFFFFFFFFEULL, 0xFFFFFFFFFFFFFFFFULL}};
+const CScalar SCALAR_N_HALF = {{0xDFE92F46681B20A0ULL, 0x5D576E7357A4501DULL, 0xFFFFFFFFFFFFFFFFULL, 0x7FFFFFFFFFFFFFFFULL}};
+const uint64_t SCALAR_NC[3] = {0x402DA1732FC9BEBFULL, 0x4551231950B75FC4ULL, 1}; // 2^256 - n
+const CScalar SCALAR_P_MINUS_N = {{0x402DA1722FC9BAEEULL, 0x4551231950B75FC4ULL, 1, 0}};
+
+// Endomorphism: lambda^3 = 1 mod n, and k = k1 + k2*lambda with
+// k2 = -c1*b1 - c2*b2, c1 = round(k*g1 / 2^384), c2 = round(k*g2 / 2^384)
+// for the short lattice basis (a1, b1), (a2, b2); g1 = 2^384*b2/n, g2 = 2^384*-b1/n.
+const CScalar SCALAR_LAMBDA = {{0xDF02967C1B23BD72ULL, 0x122E22EA20816678ULL, 0xA5261C028812645AULL, 0x5363AD4CC05C30E0ULL}};
+const CScalar SCALAR_G1 = {{0xE893209A45DBB031ULL, 0x3DAA8A1471E8CA7FULL, 0xE86C90E49284EB15ULL, 0x3086D221A7D46BCDULL}};
+const CScalar SCALAR_G2 = {{0x1571B4AE8AC47F71ULL, 0x221208AC9DF506C6ULL, 0x6F547FA90ABFE4C4ULL, 0xE4437ED6010E8828ULL}};
+const CScalar SCALAR_MINUS_B1 = {{0x6F547FA90ABFE4C3ULL, 0xE4437ED6010E8828ULL, 0, 0}};
+const CScalar SCALAR_MINUS_B2 = {{0xD765CDA83DB1562CULL, 0x8A280AC50774346DULL, 0xFFFFFFFFFFFFFFFEULL, 0xFFFFFFFFFFFFFFFFULL}};
+
+const CFieldElem GENERATOR_X = {{0x59F2815B16F81798ULL, 0x029BFCDB2DCE28D9ULL, 0x55A06295CE870B07ULL, 0x79BE667EF9DCBBACULL}};
+const CFieldElem GENERATOR_Y = {{0x9C47D08FFB10D4B8ULL, 0xFD17B448A6855419ULL, 0x5DA4FBFC0E1108A8ULL, 0x483ADA7726A3C465ULL}};
+
+// wNAF widths; the generator tables hold 2^(WINDOW_G-2) points each
+const int WINDOW_G = 10;
+const int WINDOW_Q = 5;
+const int MAX_WNAF_LEN = 258;
+
+// (c0, c1, c2) += a*b
+inline void MulAdd(uint64_t& c0, uint64_t& c1, uint64_t& c2, uint64_t a, uint64_t b)
+{
+    uint128_t t = (uint128_t)a * b;
+    uint64_t nLow = (uint64_t)t, nHigh = (uint64_t)(t >> 64);
+    c0 += nLow;
+    nHigh += (c0 < nLow);
+    c1 += nHigh;
+    c2 += (c1 < nHigh);
+}
+
+// (c0, c1, c2) += 2*a*b
+inline void MulAdd2(uint64_t& c0, uint64_t& c1, uint64_t& c2, uint64_t a, uint64_t b)
+{
+    uint128_t t = (uint128_t)a * b;
+    uint64_t nLow = (uint64_t)t, nHigh = (uint64_t)(t >> 64);
+    c2 += nHigh >> 63;
+    nHigh = (nHigh << 1) | (nLow >> 63);
+    nLow <<= 1;
+    c0 += nLow;
+    // nHigh may be all ones here, and then the carry wraps it to zero and
+    // has to go into c2 instead
+    nHigh += (c0 < nLow);
+    c2 += (c0 < nLow) & (nHigh == 0);
+    c1 += nHigh;
+    c2 += (c1 < nHigh);
+}
+
+inline void NextColumn(uint64_t& nOut, uint64_t& c0, uint64_t& c1, uint64_t& c2)
+{
+    nOut = c0;
+    c0 = c1;
+    c1 = c2;
+    c2 = 0;
+}
+
+// 256 x 256 -> 512 bit product, column by column
+inline void Mul256(uint64_t t[8], const uint64_t a[4], const uint64_t b[4])
+{
+    uint64_t c0 = 0, c1 = 0, c2 = 0;
+    MulAdd(c0, c1, c2, a[0], b[0]);
+    NextColumn(t[0], c0, c1, c2);
+    MulAdd(c0, c1, c2, a[0], b[1]);
+    MulAdd(c0, c1, c2, a[1], b[0]);
+    NextColumn(t[1], c0, c1, c2);
+    MulAdd(c0, c1, c2, a[0], b[2]);
+    MulAdd(c0, c1, c2, a[1], b[1]);
+    MulAdd(c0, c1, c2, a[2], b[0]);
+    NextColumn(t[2], c0, c1, c2);
+    MulAdd(c0, c1, c2, a[0], b[3]);
+    MulAdd(c0, c1, c2, a[1], b[2]);
+    MulAdd(c0, c1, c2, a[2], b[1]);
+    MulAdd(c0, c1, c2, a[3], b[0]);
+    NextColumn(t[3], c0, c1, c2);
+    MulAdd(c0, c1, c2, a[1], b[3]);
+    MulAdd(c0, c1, c2, a[2], b[2]);
+    MulAdd(c0, c1, c2, a[3], b[1]);
+    NextColumn(t[4], c0, c1, c2);
+    MulAdd(c0, c1, c2, a[2], b[3]);
+    MulAdd(c0, c1, c2, a[3], b[2]);
+    NextColumn(t[5], c0, c1, c2);
+    MulAdd(c0, c1, c2, a[3], b[3]);
+    NextColumn(t[6], c0, c1, c2);
+    t[7] = c0;
+}
+
+// a^2, each cross product computed once
+inline void Sqr256(uint64_t t[8], const uint64_t a[4])
+{
+    uint64_t c0 = 0, c1 = 0, c2 = 0;
+    MulAdd(c0, c1, c2, a[0], a[0]);
+    NextColumn(t[0], c0, c1, c2);
+    MulAdd2(c0, c1, c2, a[0], a[1]);
+    NextColumn(t[1], c0, c1, c2);
+    MulAdd2(c0, c1, c2, a[0], a[2]);
+    MulAdd(c0, c1, c2, a[1], a[1]);
+    NextColumn(t[2], c0, c1, c2);
+    MulAdd2(c0, c1, c2, a[0], a[3]);
+    MulAdd2(c0, c1, c2, a[1], a[2]);
+    NextColumn(t[3], c0, c1, c2);
+    MulAdd2(c0, c1, c2, a[1], a[3]);
+    MulAdd(c0, c1, c2, a[2], a[2]);
+    NextColumn(t[4], c0, c1, c2);
+    MulAdd2(c0, c1, c2, a[2], a[3]);
+    NextColumn(t[5], c0, c1, c2);
+    MulAdd(c0, c1, c2, a[3], a[3]);
+    NextColumn(t[6], c0, c1, c2);
+    t[7] = c0;
+}
+
+int Cmp256(const uint64_t a[4], const uint64_t b[4])
+{
+    for (int i = 3; i >= 0; i--)
+    {
+        if (a[i] < b[i])
+            return -1;
+        if (a[i] > b[i])
+            return 1;
+    }
+    return 0;
+}
+
+// r = a - b, returns the borrow
+uint64_t Sub256(uint64_t r[4], const uint64_t a[4], const uint64_t b[4])
+{
+    uint64_t nBorrow = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        uint64_t ai = a[i], bi = b[i];
+        r[i] = ai - bi - nBorrow;
+        nBorrow = (ai < bi || (ai == bi && nBorrow)) ? 1 : 0;
+    }
+    return nBorrow;
+}
+
+void SetB32(uint64_t r[4], const unsigned char b32[32])
+{
+    for (int i = 0; i < 4; i++)
+    {
+        r[i] = 0;
+        for (int j = 0; j < 8; j++)
+            r[i] = (r[i] << 8) | b32[31 - 8 * i - 7 + j];
+    }
+}
+
+//
+// Field
+//
+
+void FeNormalize(CFieldElem& r)
+{
+    // r < 2^256 < 2p, so subtracting p once is enough
+    if (r.n[3] == ~0ULL && r.n[2] == ~0ULL && r.n[1] == ~0ULL && r.n[0] >= FIELD_P0)
+    {
+        r.n[0] -= FIELD_P0;
+        r.n[1] = r.n[2] = r.n[3] = 0;
+    }
+}
+
+// r += nHigh * 2^256, which is nHigh * FIELD_K mod p
+void FeFold(CFieldElem& r, uint64_t nHigh)
+{
+    while (nHigh)
+    {
+        uint128_t t = (uint128_t)nHigh * FIELD_K + r.n[0];
+        r.n[0] = (uint64_t)t;
+        t >>= 64;
+        for (int i = 1; i < 4; i++)
+        {
+            t += r.n[i];
+            r.n[i] = (uint64_t)t;
+            t >>= 64;
+        }
+        nHigh = (uint64_t)t;
+    }
+    FeNormalize(r);
+}
+
+bool FeSetB32(CFieldElem& r, const unsigned char b32[32])
+{
+    SetB32(r.n, b32);
+    return !(r.n[3] == ~0ULL && r.n[2] == ~0ULL && r.n[1] == ~0ULL && r.n[0] >= FIELD_P0);
+}
+
+bool FeIsZero(const CFieldElem& a)
+{
+    return (a.n[0] | a.n[1] | a.n[2] | a.n[3]) == 0;
+}
+
+bool FeEqual(const CFieldElem& a, const CFieldElem& b)
+{
+    return memcmp(a.n, b.n, sizeof(a.n)) == 0;
+}
+
+void FeAdd(CFieldElem& r, const CFieldElem& a, const CFieldElem& b)
+{
+    uint128_t t = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        t += (uint128_t)a.n[i] + b.n[i];
+        r.n[i] = (uint64_t)t;
+        t >>= 64;
+    }
+    FeFold(r, (uint64_t)t);
+}
+
+void FeSub(CFieldElem& r, const CFieldElem& a, const CFieldElem& b)
+{
+    if (Sub256(r.n, a.n, b.n))
+    {
+        // r is a - b + 2^256 and a - b + p is wanted
+        uint64_t nBorrow = r.n[0] < FIELD_K ? 1 : 0;
+        r.n[0] -= FIELD_K;
+        for (int i = 1; i < 4; i++)
+        {
+            uint64_t v = r.n[i];
+            r.n[i] = v - nBorrow;
+            nBorrow = v < nBorrow ? 1 : 0;
+        }
+    }
+}
+
+void FeNeg(CFieldElem& r, const CFieldElem& a)
+{
+    CFieldElem zero = {{0, 0, 0, 0}};
+    FeSub(r, zero, a);
+}
+
+// r = t mod p: t = lo + hi*2^256 = lo + hi*FIELD_K mod p
+void FeReduce(CFieldElem& r, const uint64_t t[8])
+{
+    uint128_t c = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        c += (uint128_t)t[i] + (uint128_t)t[4 + i] * FIELD_K;
+        r.n[i] = (uint64_t)c;
+        c >>= 64;
+    }
+    FeFold(r, (uint64_t)c);
+}
+
+void FeMul(CFieldElem& r, const CFieldElem& a, const CFieldElem& b)
+{
+    uint64_t t[8];
+    Mul256(t, a.n, b.n);
+    FeReduce(r, t);
+}
+
+void FeSqr(CFieldElem& r, const CFieldElem& a)
+{
+    uint64_t t[8];
+    Sqr256(t, a.n);
+    FeReduce(r, t);
+}
+
+// r = a^e with a fixed window of four bits
+void FePow(CFieldElem& r, const CFieldElem& a, const uint64_t e[4])
+{
+    CFieldElem table[16];
+    table[0] = FIELD_ONE;
+    for (int i = 1; i < 16; i++)
+        FeMul(table[i], table[i - 1], a);
+    CFieldElem x = FIELD_ONE;
+    for (int i = 63; i >= 0; i--)
+    {
+        for (int j = 0; j < 4; j++)
+            FeSqr(x, x);
+        int nNibble = (e[i / 16] >> (4 * (i % 16))) & 15;
+        if (nNibble)
+            FeMul(x, x, table[nNibble]);
+    }
+    r = x;
+}
+
+// As p = 3 mod 4 a square root of a is a^((p+1)/4), if a has one
+bool FeSqrt(CFieldElem& r, const CFieldElem& a)
+{
+    CFieldElem x, x2;
+    FePow(x, a, FIELD_P_PLUS_1_DIV_4);
+    FeSqr(x2, x);
+    if (!FeEqual(x2, a))
+        return false;
+    r = x;
+    return true;
+}
+
+//
+// Scalars
+//
+
+// r = t mod n
+void ScReduce(CScalar& r, const uint64_t tIn[8])
+{
+    // t = lo + hi*2^256 = lo + hi*(2^256 - n) mod n, each fold removes
+    // about 127 bits
+    uint64_t t[8];
+    memcpy(t, tIn, sizeof(t));
+    while (t[4] | t[5] | t[6] | t[7])
+    {
+        uint64_t x[8] = {t[0], t[1], t[2], t[3], 0, 0, 0, 0};
+        for (int i = 0; i < 4; i++)
+        {
+            uint64_t nCarry = 0;
+            for (int j = 0; j < 3; j++)
+            {
+                uint128_t u = (uint128_t)t[4 + i] * SCALAR_NC[j] + x[i + j] + nCarry;
+                x[i + j] = (uint64_t)u;
+                nCarry = (uint64_t)(u >> 64);
+            }
+            for (int k = i + 3; nCarry && k < 8; k++)
+            {
+                x[k] += nCarry;
+                nCarry = x[k] < nCarry ? 1 : 0;
+            }
+        }
+        memcpy(t, x, sizeof(t));
+    }
+    memcpy(r.n, t, sizeof(r.n));
+    if (Cmp256(r.n, SCALAR_N.n) >= 0)
+        Sub256(r.n, r.n, SCALAR_N.n);
+}
+
+// Sets r to b32 mod n; fOverflow tells whether b32 was n or more
+void ScSetB32(CScalar& r, const unsigned char b32[32], bool& fOverflow)
+{
+    SetB32(r.n, b32);
+    fOverflow = Cmp256(r.n, SCALAR_N.n) >= 0;
+    if (fOverflow)
+        Sub256(r.n, r.n, SCALAR_N.n);
+}
+
+bool ScIsZero(const CScalar& a)
+{
+    return (a.n[0] | a.n[1] | a.n[2] | a.n[3]) == 0;
+}
+
+bool ScIsHigh(const CScalar& a)
+{
+    return Cmp256(a.n, SCALAR_N_HALF.n) > 0;
+}
+
+void ScAdd(CScalar& r, const CScalar& a, const CScalar& b)
+{
+    uint128_t t = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        t += (uint128_t)a.n[i] + b.n[i];
+        r.n[i] = (uint64_t)t;
+        t >>= 64;
+    }
+    if (t || Cmp256(r.n, SCALAR_N.n) >= 0)
+        Sub256(r.n, r.n, SCALAR_N.n);
+}
+
+void ScNeg(CScalar& r, const CScalar& a)
+{
+    if (ScIsZero(a))
+        r = a;
+    else
+        Sub256(r.n, SCALAR_N.n, a.n);
+}
+
+void ScMul(CScalar& r, const CScalar& a, const CScalar& b)
+{
+    uint64_t t[8];
+    Mul256(t, a.n, b.n);
+    ScReduce(r, t);
+}
+
+// Halves x mod m, for an odd m
+void HalveMod(uint64_t x[4], const uint64_t m[4])
+{
+    uint64_t nTop = 0;
+    if (x[0] & 1)
+    {
+        uint128_t t = 0;
+        for (int i = 0; i < 4; i++)
+        {
+            t += (uint128_t)x[i] + m[i];
+            x[i] = (uint64_t)t;
+            t >>= 64;
+        }
+        nTop = (uint64_t)t;
+    }
+    for (int i = 0; i < 3; i++)
+        x[i] = (x[i] >> 1) | (x[i + 1] << 63);
+    x[3] = (x[3] >> 1) | (nTop << 63);
+}
+
+// r = r - a mod m, for r and a below m
+void SubMod(uint64_t r[4], const uint64_t a[4], const uint64_t m[4])
+{
+    if (Sub256(r, r, a))
+    {
+        uint128_t t = 0;
+        for (int i = 0; i < 4; i++)
+        {
+            t += (uint128_t)r[i] + m[i];
+            r[i] = (uint64_t)t;
+            t >>= 64;
+        }
+    }
+}
+
+// r = a^-1 mod m for a nonzero a below the odd prime m, with the binary
+// extended Euclidean algorithm. Not constant time, which is fine for
+// verification where all the inputs are public.
+void InvMod(uint64_t r[4], const uint64_t a[4], const uint64_t m[4])
+{
+    // x1*a = u and x2*a = v mod m throughout
+    uint64_t u[4], v[4], x1[4] = {1, 0, 0, 0}, x2[4] = {0, 0, 0, 0};
+    const uint64_t one[4] = {1, 0, 0, 0};
+    memcpy(u, a, sizeof(u));
+    memcpy(v, m, sizeof(v));
+    while (Cmp256(u, one) != 0 && Cmp256(v, one) != 0)
+    {
+        while (!(u[0] & 1))
+        {
+            for (int i = 0; i < 3; i++)
+                u[i] = (u[i] >> 1) | (u[i + 1] << 63);
+            u[3] >>= 1;
+            HalveMod(x1, m);
+        }
+        while (!(v[0] & 1))
+        {
+            for (int i = 0; i < 3; i++)
+                v[i] = (v[i] >> 1) | (v[i + 1] << 63);
+            v[3] >>= 1;
+            HalveMod(x2, m);
+        }
+        if (Cmp256(u, v) >= 0)
+        {
+            Sub256(u, u, v);
+            SubMod(x1, x2, m);
+        }
+        else
+        {
+            Sub256(v, v, u);
+            SubMod(x2, x1, m);
+        }
+    }
+    memcpy(r, Cmp256(u, one) == 0 ? x1 : x2, 4 * sizeof(uint64_t));
+}
+
+void ScInv(CScalar& r, const CScalar& a)
+{
+    InvMod(r.n, a.n, SCALAR_N.n);
+}
+
+void FeInv(CFieldElem& r, const CFieldElem& a)
+{
+    InvMod(r.n, a.n, FIELD_P);
+}
+
+// r = round(a*b / 2^384)
+void ScMulShift384(CScalar& r, const CScalar& a, const CScalar& b)
+{
+    uint64_t t[8];
+    Mul256(t, a.n, b.n);
+    uint128_t c = (uint128_t)t[6] + (t[5] >> 63);
+    r.n[0] = (uint64_t)c;
+    r.n[1] = t[7] + (uint64_t)(c >> 64);
+    r.n[2] = r.n[3] = 0;
+}
+
+// k = k1 + k2*lambda mod n with k1, k2 of about 128 bits, when taken as
+// -k1 or -k2 if ScIsHigh()
+void ScSplitLambda(CScalar& k1, CScalar& k2, const CScalar& k)
+{
+    CScalar c1, c2, t;
+    ScMulShift384(c1, k, SCALAR_G1);
+    ScMulShift384(c2, k, SCALAR_G2);
+    ScMul(k2, c1, SCALAR_MINUS_B1);
+    ScMul(t, c2, SCALAR_MINUS_B2);
+    ScAdd(k2, k2, t);
+    ScMul(t, k2, SCALAR_LAMBDA);
+    ScNeg(t, t);
+    ScAdd(k1, k, t);
+}
+
+// Width w NAF of a: digits are 0 or odd in (-2^(w-1), 2^(w-1)), least
+// significant first. Returns the number of digits.
+int ScWNAF(int pnWnaf[MAX_WNAF_LEN], const CScalar& a, int w)
+{
+    memset(pnWnaf, 0, MAX_WNAF_LEN * sizeof(int));
+    int nLen = 0, nCarry = 0, nBit = 0;
+    while (nBit <= 256)
+    {
+        // the w bits of a from nBit on
+        int nLimb = nBit / 64, nShift = nBit % 64;
+        uint64_t nBits = nLimb < 4 ? a.n[nLimb] >> nShift : 0;
+        if (nShift + w > 64 && nLimb + 1 < 4)
+            nBits |= a.n[nLimb + 1] << (64 - nShift);
+        if ((int)(nBits & 1) == nCarry)
+        {
+            nBit++;
+            continue;
+        }
+        int nDigit = (int)(nBits & ((1U << w) - 1)) + nCarry;
+        nCarry = (nDigit >> (w - 1)) & 1;
+        nDigit -= nCarry << w;
+        pnWnaf[nBit] = nDigit;
+        nLen = nBit + 1;
+        nBit += w;
+    }
+    return nLen;
+}
+
+//
+// Group: y^2 = x^3 + 7
+//
+
+struct CGroupElemA
+{
+    CFieldElem x, y;
+};
+
+// Jacobian coordinates, (x/z^2, y/z^3)
+struct CGroupElemJ
+{
+    CFieldElem x, y, z;
+    bool fInfinity;
+};
+
+void GeDouble(CGroupElemJ& r, const CGroupElemJ& a)
+{
+    // No point has y = 0 as the group order is odd
+    if (a.fInfinity)
+    {
+        r.fInfinity = true;
+        return;
+    }
+    CFieldElem A, B, C, D, E, F, t, x3, y3, z3;
+    FeSqr(A, a.x);
+    FeSqr(B, a.y);
+    FeSqr(C, B);
+    FeAdd(t, a.x, B);
+    FeSqr(t, t);
+    FeSub(t, t, A);
+    FeSub(t, t, C);
+    FeAdd(D, t, t);
+    FeAdd(E, A, A);
+    FeAdd(E, E, A);
+    FeSqr(F, E);
+    FeSub(x3, F, D);
+    FeSub(x3, x3, D);
+    FeAdd(C, C, C);
+    FeAdd(C, C, C);
+    FeAdd(C, C, C);
+    FeSub(t, D, x3);
+    FeMul(y3, E, t);
+    FeSub(y3, y3, C);
+    FeMul(z3, a.y, a.z);
+    FeAdd(z3, z3, z3);
+    r.x = x3;
+    r.y = y3;
+    r.z = z3;
+    r.fInfinity = false;
+}
+
+// Common tail of the additions: H = U2 - U1 and R = S2 - S1 for Z3 = z*H
+void GeAddTail(CGroupElemJ& r, const CGroupElemJ& a, const CFieldElem& U1, const CFieldElem& S1,
+               const CFieldElem& U2, const CFieldElem& S2, const CFieldElem& z)
+{
+    CFieldElem H, R;
+    FeSub(H, U2, U1);
+    FeSub(R, S2, S1);
+    if (FeIsZero(H))
+    {
+        if (FeIsZero(R))
+            GeDouble(r, a);
+        else
+            r.fInfinity = true;
+        return;
+    }
+    CFieldElem H2, H3, U1H2, x3, y3, t;
+    FeSqr(H2, H);
+    FeMul(H3, H, H2);
+    FeMul(U1H2, U1, H2);
+    FeSqr(x3, R);
+    FeSub(x3, x3, H3);
+    FeSub(x3, x3, U1H2);
+    FeSub(x3, x3, U1H2);
+    FeSub(t, U1H2, x3);
+    FeMul(y3, R, t);
+    FeMul(t, S1, H3);
+    FeSub(y3, y3, t);
+    FeMul(r.z, z, H);
+    r.x = x3;
+    r.y = y3;
+    r.fInfinity = false;
+}
+
+void GeAdd(CGroupElemJ& r, const CGroupElemJ& a, const CGroupElemJ& b)
+{
+    if (a.fInfinity)
+    {
+        r = b;
+        return;
+    }
+    if (b.fInfinity)
+    {
+        r = a;
+        return;
+    }
+    CFieldElem Z1Z1, Z2Z2, U1, U2, S1, S2, z;
+    FeSqr(Z1Z1, a.z);
+    FeSqr(Z2Z2, b.z);
+    FeMul(U1, a.x, Z2Z2);
+    FeMul(U2, b.x, Z1Z1);
+    FeMul(S1, a.y, b.z);
+    FeMul(S1, S1, Z2Z2);
+    FeMul(S2, b.y, a.z);
+    FeMul(S2, S2, Z1Z1);
+    FeMul(z, a.z, b.z);
+    GeAddTail(r, a, U1, S1, U2, S2, z);
+}
+
+void GeAddAffine(CGroupElemJ& r, const CGroupElemJ& a, const CGroupElemA& b)
+{
+    if (a.fInfinity)
+    {
+        r.x = b.x;
+        r.y = b.y;
+        r.z = FIELD_ONE;
+        r.fInfinity = false;
+        return;
+    }
+    CFieldElem Z1Z1, U2, S2, z = a.z;
+    FeSqr(Z1Z1, a.z);
+    FeMul(U2, b.x, Z1Z1);
+    FeMul(S2, b.y, a.z);
+    FeMul(S2, S2, Z1Z1);
+    GeAddTail(r, a, a.x, a.y, U2, S2, z);
+}
+
+// Odd multiples G, 3G, 5G, ... of the generator and of lambda*G, affine
+struct CGeneratorTables
+{
+    CGroupElemA vG[1 << (WINDOW_G - 2)];
+    CGroupElemA vLambdaG[1 << (WINDOW_G - 2)];
+
+    CGeneratorTables()
+    {
+        CGroupElemJ p, g2;
+        p.x = GENERATOR_X;
+        p.y = GENERATOR_Y;
+        p.z = FIELD_ONE;
+        p.fInfinity = false;
+        GeDouble(g2, p);
+        for (int i = 0; i < (1 << (WINDOW_G - 2)); i++)
+        {
+            if (i > 0)
+                GeAdd(p, p, g2);
+            CFieldElem zi, zi2, zi3;
+            FeInv(zi, p.z);
+            FeSqr(zi2, zi);
+            FeMul(zi3, zi2, zi);
+            FeMul(vG[i].x, p.x, zi2);
+            FeMul(vG[i].y, p.y, zi3);
+            FeMul(vLambdaG[i].x, vG[i].x, FIELD_BETA);
+            vLambdaG[i].y = vG[i].y;
+        }
+    }
+};
+
+const CGeneratorTables& GetGeneratorTables()
+{
+    static CGeneratorTables tables;
+    return tables;
+}
+
+// Splits k for the endomorphism and returns the wNAFs of both halves,
+// with the digits negated where the half was; returns the longest length
+int SplitWNAF(int pnWnaf1[MAX_WNAF_LEN], int& nLen1, int pnWnaf2[MAX_WNAF_LEN], int& nLen2,
+              const CScalar& k, int w)
+{
+    CScalar k1, k2;
+    ScSplitLambda(k1, k2, k);
+    bool fNeg1 = ScIsHigh(k1), fNeg2 = ScIsHigh(k2);
+    if (fNeg1)
+        ScNeg(k1, k1);
+    if (fNeg2)
+        ScNeg(k2, k2);
+    nLen1 = ScWNAF(pnWnaf1, k1, w);
+    nLen2 = ScWNAF(pnWnaf2, k2, w);
+    for (int i = 0; fNeg1 && i < nLen1; i++)
+        pnWnaf1[i] = -pnWnaf1[i];
+    for (int i = 0; fNeg2 && i < nLen2; i++)
+        pnWnaf2[i] = -pnWnaf2[i];
+    return nLen1 > nLen2 ? nLen1 : nLen2;
+}
+
+void AddDigit(CGroupElemJ& r, const CGroupElemJ* table, int nDigit)
+{
+    if (nDigit > 0)
+        GeAdd(r, r, table[(nDigit - 1) / 2]);
+    else if (nDigit < 0)
+    {
+        CGroupElemJ p = table[(-nDigit - 1) / 2];
+        FeNeg(p.y, p.y);
+        GeAdd(r, r, p);
+    }
+}
+
+void AddDigit(CGroupElemJ& r, const CGroupElemA* table, int nDigit)
+{
+    if (nDigit > 0)
+        GeAddAffine(r, r, table[(nDigit - 1) / 2]);
+    else if (nDigit < 0)
+    {
+        CGroupElemA p = table[(-nDigit - 1) / 2];
+        FeNeg(p.y, p.y);
+        GeAddAffine(r, r, p);
+    }
+}
+
+// r = nq*q + ng*G, given the odd multiples of q and lambda*q
+template<typename TQ>
+void ECMultTables(CGroupElemJ& r, const TQ* vQ, const TQ* vLambdaQ, const CScalar& nq, const CScalar& ng)
+{
+    const CGeneratorTables& tables = GetGeneratorTables();
+
+    int pnWnafQ1[MAX_WNAF_LEN], pnWnafQ2[MAX_WNAF_LEN], pnWnafG1[MAX_WNAF_LEN], pnWnafG2[MAX_WNAF_LEN];
+    int nLenQ1, nLenQ2, nLenG1, nLenG2;
+    int nLen = SplitWNAF(pnWnafQ1, nLenQ1, pnWnafQ2, nLenQ2, nq, WINDOW_Q);
+    int nLenG = SplitWNAF(pnWnafG1, nLenG1, pnWnafG2, nLenG2, ng, WINDOW_G);
+    if (nLenG > nLen)
+        nLen = nLenG;
+
+    r.fInfinity = true;
+    for (int i = nLen - 1; i >= 0; i--)
+    {
+        GeDouble(r, r);
+        if (i < nLenQ1)
+            AddDigit(r, vQ, pnWnafQ1[i]);
+        if (i < nLenQ2)
+            AddDigit(r, vLambdaQ, pnWnafQ2[i]);
+        if (i < nLenG1)
+            AddDigit(r, tables.vG, pnWnafG1[i]);
+        if (i < nLenG2)
+            AddDigit(r, tables.vLambdaG, pnWnafG2[i]);
+    }
+}
+
+// Odd multiples q, 3q, 5q, ... in Jacobian coordinates
+void GetOddMultiples(CGroupElemJ vQ[1 << (WINDOW_Q - 2)], const CGroupElemA& q)
+{
+    CGroupElemJ q2;
+    vQ[0].x = q.x;
+    vQ[0].y = q.y;
+    vQ[0].z = FIELD_ONE;
+    vQ[0].fInfinity = false;
+    GeDouble(q2, vQ[0]);
+    for (int i = 1; i < (1 << (WINDOW_Q - 2)); i++)
+        GeAdd(vQ[i], vQ[i - 1], q2);
+}
+
+// r = nq*q + ng*G
+void ECMult(CGroupElemJ& r, const CGroupElemA& q, const CScalar& nq, const CScalar& ng)
+{
+    CGroupElemJ vQ[1 << (WINDOW_Q - 2)], vLambdaQ[1 << (WINDOW_Q - 2)];
+    GetOddMultiples(vQ, q);
+    for (int i = 0; i < (1 << (WINDOW_Q - 2)); i++)
+    {
+        vLambdaQ[i] = vQ[i];
+        FeMul(vLambdaQ[i].x, vQ[i].x, FIELD_BETA);
+    }
+    ECMultTables(r, vQ, vLambdaQ, nq, ng);
+}
+
+bool ParsePubKey(CGroupElemA& q, const unsigned char* pch, size_t nLen)
+{
+    if (nLen == 33 && (pch[0] == 0x02 || pch[0] == 0x03))
+    {
+        if (!FeSetB32(q.x, pch + 1))
+            return false;
+        CFieldElem y2;
+        FeSqr(y2, q.x);
+        FeMul(y2, y2, q.x);
+        FeAdd(y2, y2, FIELD_SEVEN);
+        if (!FeSqrt(q.y, y2))
+            return false;
+        if ((q.y.n[0] & 1) != (pch[0] & 1))
+            FeNeg(q.y, q.y);
+        return true;
+    }
+    if (nLen == 65 && pch[0] == 0x04)
+    {
+        if (!FeSetB32(q.x, pch + 1) || !FeSetB32(q.y, pch + 33))
+            return false;
+        CFieldElem lhs, rhs;
+        FeSqr(lhs, q.y);
+        FeSqr(rhs, q.x);
+        FeMul(rhs, rhs, q.x);
+        FeAdd(rhs, rhs, FIELD_SEVEN);
+        return FeEqual(lhs, rhs);
+    }
+    return false;
+}
+
+// Copies a DER integer to 32 big endian bytes; false if it is bigger
+bool GetDERInteger(unsigned char b32[32], const unsigned char* pch, size_t nLen)
+{
+    if (nLen > 1 && pch[0] == 0)
+    {
+        pch++;
+        nLen--;
+    }
+    if (nLen > 32)
+        return false;
+    memset(b32, 0, 32);
+    memcpy(b32 + 32 - nLen, pch, nLen);
+    return true;
+}
+
+// Splits a strict DER signature 0x30 len 0x02 lenR R 0x02 lenS S, both
+// integers positive and minimally encoded. fOverflow tells whether r or s
+// take more than 32 bytes.
+bool ParseStrictDER(const unsigned char* sig, size_t nLen, unsigned char r32[32], unsigned char s32[32], bool& fOverflow)
+{
+    if (nLen < 8 || nLen > 72)
+        return false;
+    if (sig[0] != 0x30 || sig[1] != nLen - 2)
+        return false;
+    unsigned int nLenR = sig[3];
+    if (5 + nLenR >= nLen)
+        return false;
+    unsigned int nLenS = sig[5 + nLenR];
+    if (nLenR + nLenS + 6 != nLen)
+        return false;
+
+    if (sig[2] != 0x02 || nLenR == 0 || (sig[4] & 0x80))
+        return false;
+    if (nLenR > 1 && sig[4] == 0x00 && !(sig[5] & 0x80))
+        return false;
+
+    if (sig[nLenR + 4] != 0x02 || nLenS == 0 || (sig[nLenR + 6] & 0x80))
+        return false;
+    if (nLenS > 1 && sig[nLenR + 6] == 0x00 && !(sig[nLenR + 7] & 0x80))
+        return false;
+
+    fOverflow = !GetDERInteger(r32, sig + 4, nLenR) || !GetDERInteger(s32, sig + nLenR + 6, nLenS);
+    return true;
+}
+
+// Parses a signature and digest into r, s and e; SECP256K1_VALID means
+// they're usable
+int ParseSignature(CScalar& r, CScalar& s, CScalar& e, const unsigned char* pchSig, size_t nSigLen,
+                   const unsigned char* pchHash)
+{
+    unsigned char r32[32], s32[32];
+    bool fOverflow;
+    if (!ParseStrictDER(pchSig, nSigLen, r32, s32, fOverflow))
+        return SECP256K1_UNSUPPORTED;
+    if (fOverflow)
+        return SECP256K1_INVALID;
+
+    // 0 < r, s < n, and the digest is taken mod n like OpenSSL does
+    ScSetB32(r, r32, fOverflow);
+    if (fOverflow || ScIsZero(r))
+        return SECP256K1_INVALID;
+    ScSetB32(s, s32, fOverflow);
+    if (fOverflow || ScIsZero(s))
+        return SECP256K1_INVALID;
+    ScSetB32(e, pchHash, fOverflow);
+    return SECP256K1_VALID;
+}
+
+// Whether the x coordinate of pt is r mod n
+bool CheckR(const CGroupElemJ& pt, const CScalar& r)
+{
+    if (pt.fInfinity)
+        return false;
+
+    // compared as r*z^2 == X to save the inversion; x < p, so x can also
+    // be r + n
+    CFieldElem fr, zz, t;
+    memcpy(fr.n, r.n, sizeof(fr.n));
+    FeSqr(zz, pt.z);
+    FeMul(t, fr, zz);
+    if (FeEqual(t, pt.x))
+        return true;
+    if (Cmp256(r.n, SCALAR_P_MINUS_N.n) < 0)
+    {
+        CFieldElem fn;
+        memcpy(fn.n, SCALAR_N.n, sizeof(fn.n));
+        FeAdd(fr, fr, fn);
+        FeMul(t, fr, zz);
+        if (FeEqual(t, pt.x))
+            return true;
+    }
+    return false;
+}
+
+} // anon namespace
+
+bool Secp256k1Available()
+{
+    return true;
+}
+
+void Secp256k1FieldMul(uint64_t r[4], const uint64_t a[4], const uint64_t b[4])
+{
+    CFieldElem x, y;
+    memcpy(x.n, a, sizeof(x.n));
+    memcpy(y.n, b, sizeof(y.n));
+    FeMul(x, x, y);
+    memcpy(r, x.n, sizeof(x.n));
+}
+
+void Secp256k1FieldSqr(uint64_t r[4], const uint64_t a[4])
+{
+    CFieldElem x;
+    memcpy(x.n, a, sizeof(x.n));
+    FeSqr(x, x);
+    memcpy(r, x.n, sizeof(x.n));
+}
+
+int Secp256k1Verify(const unsigned char* pchPubKey, size_t nPubKeyLen, const unsigned char* pchHash,
+                    const unsigned char* pchSig, size_t nSigLen)
+{
+    CScalar r, s, e;
+    int nParsed = ParseSignature(r, s, e, pchSig, nSigLen, pchHash);
+    if (nParsed == SECP256K1_UNSUPPORTED)
+        return SECP256K1_UNSUPPORTED;
+    CGroupElemA q;
+    if (!ParsePubKey(q, pchPubKey, nPubKeyLen))
+        return SECP256K1_UNSUPPORTED;
+    if (nParsed == SECP256K1_INVALID)
+        return SECP256K1_INVALID;
+
+    CScalar w, u1, u2;
+    ScInv(w, s);
+    ScMul(u1, e, w);
+    ScMul(u2, r, w);
+    CGroupElemJ pt;
+    ECMult(pt, q, u2, u1);
+    return CheckR(pt, r) ? SECP256K1_VALID : SECP256K1_INVALID;
+}
+
+bool CSecp256k1Batch::Add(const unsigned char* pchPubKey, size_t nPubKeyLen, const unsigned char* pchHash,
+                          const unsigned char* pchSig, size_t nSigLen)
+{
+    CScalar r, s, e;
+    if (ParseSignature(r, s, e, pchSig, nSigLen, pchHash) != SECP256K1_VALID)
+        return false;
+
+    // Keys often sign several inputs in a row
+    unsigned int nKey = vKeys.size();
+    for (unsigned int i = vKeys.size(); i-- > 0; )
+    {
+        if (vKeys[i].nLen == nPubKeyLen && memcmp(vKeys[i].vch, pchPubKey, nPubKeyLen) == 0)
+        {
+            nKey = i;
+            break;
+        }
+    }
+    if (nKey == vKeys.size())
+    {
+        CGroupElemA q;
+        if (nPubKeyLen > sizeof(vKeys[0].vch) || !ParsePubKey(q, pchPubKey, nPubKeyLen))
+            return false;
+        vKeys.push_back(CBatchKey());
+        CBatchKey& key = vKeys.back();
+        memcpy(key.vch, pchPubKey, nPubKeyLen);
+        key.nLen = nPubKeyLen;
+        memcpy(key.x, q.x.n, sizeof(key.x));
+        memcpy(key.y, q.y.n, sizeof(key.y));
+    }
+
+    vEntries.push_back(CBatchEntry());
+    CBatchEntry& entry = vEntries.back();
+    entry.nKey = nKey;
+    memcpy(entry.r, r.n, sizeof(entry.r));
+    memcpy(entry.s, s.n, sizeof(entry.s));
+    memcpy(entry.e, e.n, sizeof(entry.e));
+    return true;
+}
+
+bool CSecp256k1Batch::Verify()
+{
+    const unsigned int nEntries = vEntries.size(), nKeys = vKeys.size();
+    const unsigned int nTable = 1 << (WINDOW_Q - 2);
+    if (nEntries == 0)
+        return true;
+
+    // All s^-1 with one inversion: with the running products
+    // p_i = s_0 * ... * s_i, s_i^-1 = p_i^-1 * p_(i-1)
+    std::vector<CScalar> vW(nEntries);
+    CScalar acc;
+    memcpy(acc.n, vEntries[0].s, sizeof(acc.n));
+    vW[0] = acc;
+    for (unsigned int i = 1; i < nEntries; i++)
+    {
+        CScalar s;
+        memcpy(s.n, vEntries[i].s, sizeof(s.n));
+        ScMul(acc, acc, s);
+        vW[i] = acc;
+    }
+    ScInv(acc, acc);
+    for (unsigned int i = nEntries - 1; i > 0; i--)
+    {
+        CScalar s;
+        memcpy(s.n, vEntries[i].s, sizeof(s.n));
+        ScMul(vW[i], acc, vW[i - 1]);
+        ScMul(acc, acc, s);
+    }
+    vW[0] = acc;
+
+    // The tables of odd multiples of every key, made affine with one
+    // inversion the same way, so the additions of q get cheaper too
+    std::vector<CGroupElemJ> vJacobian(nKeys * nTable);
+    for (unsigned int k = 0; k < nKeys; k++)
+    {
+        CGroupElemA q;
+        memcpy(q.x.n, vKeys[k].x, sizeof(q.x.n));
+        memcpy(q.y.n, vKeys[k].y, sizeof(q.y.n));
+        GetOddMultiples(&vJacobian[k * nTable], q);
+    }
+    std::vector<CFieldElem> vZInv(vJacobian.size());
+    CFieldElem facc = vJacobian[0].z;
+    vZInv[0] = facc;
+    for (unsigned int i = 1; i < vJacobian.size(); i++)
+    {
+        FeMul(facc, facc, vJacobian[i].z);
+        vZInv[i] = facc;
+    }
+    FeInv(facc, facc);
+    for (unsigned int i = vJacobian.size() - 1; i > 0; i--)
+    {
+        FeMul(vZInv[i], facc, vZInv[i - 1]);
+        FeMul(facc, facc, vJacobian[i].z);
+    }
+    vZInv[0] = facc;
+    std::vector<CGroupElemA> vAffine(vJacobian.size()), vLambdaAffine(vJacobian.size());
+    for (unsigned int i = 0; i < vJacobian.size(); i++)
+    {
+        CFieldElem zi2, zi3;
+        FeSqr(zi2, vZInv[i]);
+        FeMul(zi3, zi2, vZInv[i]);
+        FeMul(vAffine[i].x, vJacobian[i].x, zi2);
+        FeMul(vAffine[i].y, vJacobian[i].y, zi3);
+        FeMul(vLambdaAffine[i].x, vAffine[i].x, FIELD_BETA);
+        vLambdaAffine[i].y = vAffine[i].y;
+    }
+
+    bool fOk = true;
+    for (unsigned int i = 0; fOk && i < nEntries; i++)
+    {
+        const CBatchEntry& entry = vEntries[i];
+        CScalar r, e, u1, u2;
+        memcpy(r.n, entry.r, sizeof(r.n));
+        memcpy(e.n, entry.e, sizeof(e.n));
+        ScMul(u1, e, vW[i]);
+        ScMul(u2, r, vW[i]);
+        CGroupElemJ pt;
+        ECMultTables(pt, &vAffine[entry.nKey * nTable], &vLambdaAffine[entry.nKey * nTable], u2, u1);
+        fOk = CheckR(pt, r);
+    }
+    Clear();
+    return fOk;
+}
+
+#else
+
+bool Secp256k1Available()
+{
+    return false;
+}
+
+void Secp256k1FieldMul(uint64_t r[4], const uint64_t a[4], const uint64_t b[4])
+{
+    memset(r, 0, 4 * sizeof(uint64_t));
+}
+
+void Secp256k1FieldSqr(uint64_t r[4], const uint64_t a[4])
+{
+    memset(r, 0, 4 * sizeof(uint64_t));
+}
+
+int Secp256k1Verify(const unsigned char* pchPubKey, size_t nPubKeyLen, const unsigned char* pchHash,
+                    const unsigned char* pchSig, size_t nSigLen)
+{
+    return SECP256K1_UNSUPPORTED;
+}
+
+bool CSecp256k1Batch::Add(const unsigned char* pchPubKey, size_t nPubKeyLen, const unsigned char* pchHash,
+                          const unsigned char* pchSig, size_t nSigLen)
+{
+    return false;
+}
+
+bool CSecp256k1Batch::Verify()
+{
+    return true;
+}
+
+#endif
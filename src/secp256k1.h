@@ -0,0 +1,79 @@
+// Copyright (c) 2014 The Gapcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef GAPCOIN_SECP256K1_H
+#define GAPCOIN_SECP256K1_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/** Results of Secp256k1Verify() */
+enum
+{
+    SECP256K1_INVALID = 0,
+    SECP256K1_VALID = 1,
+    // An encoding the native code leaves to OpenSSL, so that both accept
+    // exactly the same signatures and keys
+    SECP256K1_UNSUPPORTED = -1
+};
+
+/** Whether this build has the native verifier; it needs 128-bit integers */
+bool Secp256k1Available();
+
+/** Field arithmetic mod p on fully reduced little endian limbs, for the tests */
+void Secp256k1FieldMul(uint64_t r[4], const uint64_t a[4], const uint64_t b[4]);
+void Secp256k1FieldSqr(uint64_t r[4], const uint64_t a[4]);
+
+/**
+ * Verify an ECDSA signature over secp256k1 without OpenSSL. Only strict DER
+ * signatures and well-formed compressed or uncompressed public keys are
+ * handled; anything else returns SECP256K1_UNSUPPORTED.
+ *
+ * pchHash are the 32 bytes OpenSSL's ECDSA_verify would get as the digest.
+ */
+int Secp256k1Verify(const unsigned char* pchPubKey, size_t nPubKeyLen, const unsigned char* pchHash,
+                    const unsigned char* pchSig, size_t nSigLen);
+
+/**
+ * Signatures verified together. ECDSA signatures only carry the x
+ * coordinate of R, so they can't be summed into one multi-scalar
+ * multiplication without trying both signs of every R; what a batch shares
+ * are the inversions of s and of the odd multiples of the keys, and the
+ * decompressed keys and tables of keys that sign more than once.
+ */
+class CSecp256k1Batch
+{
+private:
+    struct CBatchKey
+    {
+        unsigned char vch[65];
+        size_t nLen;
+        uint64_t x[4], y[4]; // affine, as in secp256k1.cpp
+    };
+    struct CBatchEntry
+    {
+        unsigned int nKey; // index in vKeys
+        uint64_t r[4], s[4], e[4];
+    };
+    std::vector<CBatchKey> vKeys;
+    std::vector<CBatchEntry> vEntries;
+
+public:
+    /**
+     * Queue a signature. Returns false and leaves it out when
+     * Secp256k1Verify() wouldn't say SECP256K1_VALID without doing the math;
+     * such signatures have to be verified on their own.
+     */
+    bool Add(const unsigned char* pchPubKey, size_t nPubKeyLen, const unsigned char* pchHash,
+             const unsigned char* pchSig, size_t nSigLen);
+
+    /** Whether all queued signatures are valid; empties the batch */
+    bool Verify();
+
+    size_t Size() const { return vEntries.size(); }
+    void Clear() { vKeys.clear(); vEntries.clear(); }
+};
+
+#endif // GAPCOIN_SECP256K1_H
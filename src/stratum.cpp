@@ -0,0 +1,766 @@
+// Copyright (c) 2014 The Gapcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "stratum.h"
+
+#include "base58.h"
+#include "chainparams.h"
+#include "hash.h"
+#include "main.h"
+#include "miner.h"
+#include "ui_interface.h"
+#include "util.h"
+#include "PoWCore/src/PoW.h"
+
+#include "json/json_spirit_reader_template.h"
+#include "json/json_spirit_utils.h"
+#include "json/json_spirit_writer_template.h"
+
+#include <deque>
+#include <memory>
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+namespace asio = boost::asio;
+using namespace json_spirit;
+using namespace std;
+
+/**
+ * The work server speaks line based JSON-RPC over TCP, in the style of the
+ * stratum mining protocol:
+ *
+ *   mining.subscribe              -> [[["mining.notify", session]], extranonce1, extranonce2_size]
+ *   mining.authorize worker pass  -> true; workers are names for the share accounting
+ *   mining.submit worker job extranonce2 ntime nonce shift adder -> true or an error
+ *
+ * and pushes
+ *
+ *   mining.set_difficulty merit
+ *   mining.notify job prevhash coinbase1 coinbase2 [branch] version difficulty ntime clean
+ *
+ * Hashes and byte strings are hex of their serialized bytes; version, ntime
+ * and nonce are hex numbers, difficulty is the 64 bit fixed point block
+ * difficulty in hex and the adder is little endian like nAdd, without
+ * trailing zero bytes.
+ */
+
+enum StratumErrorCode
+{
+    STRATUM_OTHER           = 20,
+    STRATUM_JOB_NOT_FOUND   = 21,
+    STRATUM_DUPLICATE_SHARE = 22,
+    STRATUM_LOW_DIFFICULTY  = 23,
+    STRATUM_UNAUTHORIZED    = 24,
+    STRATUM_NOT_SUBSCRIBED  = 25,
+};
+
+/** Longest request line a miner may send */
+static const size_t STRATUM_MAX_LINE = 16 * 1024;
+/** Longest worker name kept in the share accounting */
+static const size_t STRATUM_MAX_WORKER_NAME = 64;
+/** Merit and difficulty are fixed point with 48 fraction bits */
+static const double STRATUM_MERIT_ONE = 281474976710656.0;
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// CStratumJob
+//
+
+CStratumJob::CStratumJob(const string& strIdIn, const CBlock& blockIn, int nHeightIn) :
+    strId(strIdIn), block(blockIn), nHeight(nHeightIn)
+{
+    // Height first as required for block.version=2, then the open extranonce
+    const CScript scriptHeight = CScript() << nHeight;
+    CTransaction& txCoinbase = block.vtx[0];
+    txCoinbase.vin[0].scriptSig = (CScript(scriptHeight) << vector<unsigned char>(STRATUM_EXTRANONCE_SIZE, 0)) + COINBASE_FLAGS;
+    assert(txCoinbase.vin[0].scriptSig.size() <= 100);
+
+    // nVersion, vin, the coinbase prevout, the script length, the height
+    // and the push of the extranonce come before it
+    const size_t nOffset = 4 + GetSizeOfCompactSize(txCoinbase.vin.size()) + 36 +
+                           GetSizeOfCompactSize(txCoinbase.vin[0].scriptSig.size()) + scriptHeight.size() + 1;
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << txCoinbase;
+    vCoinbase1.assign(ss.begin(), ss.begin() + nOffset);
+    vCoinbase2.assign(ss.begin() + nOffset + STRATUM_EXTRANONCE_SIZE, ss.end());
+
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    vMerkleBranch = block.GetMerkleBranch(0);
+}
+
+vector<unsigned char> CStratumJob::GetCoinbase(const vector<unsigned char>& vExtraNonce) const
+{
+    assert(vExtraNonce.size() == STRATUM_EXTRANONCE_SIZE);
+
+    vector<unsigned char> vCoinbase(vCoinbase1);
+    vCoinbase.insert(vCoinbase.end(), vExtraNonce.begin(), vExtraNonce.end());
+    vCoinbase.insert(vCoinbase.end(), vCoinbase2.begin(), vCoinbase2.end());
+    return vCoinbase;
+}
+
+uint256 CStratumJob::GetMerkleRoot(const vector<unsigned char>& vExtraNonce) const
+{
+    vector<unsigned char> vCoinbase = GetCoinbase(vExtraNonce);
+    return CBlock::CheckMerkleBranch(Hash(vCoinbase.begin(), vCoinbase.end()), vMerkleBranch, 0);
+}
+
+CBlock CStratumJob::GetBlock(const vector<unsigned char>& vExtraNonce, unsigned int nTime, unsigned int nNonce,
+                             uint16_t nShift, const vector<unsigned char>& vAdd) const
+{
+    CBlock blockShare(block);
+    CDataStream ss(GetCoinbase(vExtraNonce), SER_NETWORK, PROTOCOL_VERSION);
+    ss >> blockShare.vtx[0];
+
+    blockShare.nTime  = nTime;
+    blockShare.nNonce = nNonce;
+    blockShare.nShift = nShift;
+    blockShare.nAdd   = vAdd;
+    blockShare.hashMerkleRoot = blockShare.BuildMerkleTree();
+    return blockShare;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Work server
+//
+
+class CStratumConnection;
+typedef boost::shared_ptr<CStratumConnection> StratumConnectionPtr;
+
+/** A connected miner. Its handlers run in its strand, so the members
+ *  below need no lock. */
+class CStratumConnection : public boost::enable_shared_from_this<CStratumConnection>
+{
+public:
+    asio::ip::tcp::socket socket;
+    asio::ip::tcp::endpoint peer;
+    asio::io_service::strand strand;
+    asio::streambuf buffer;
+    deque<string> dequeSend;
+    vector<unsigned char> vExtraNonce1;
+    set<string> setWorkers;
+    bool fSubscribed;
+    bool fClosed;
+
+    CStratumConnection(asio::io_service& service) :
+        socket(service), strand(service), buffer(STRATUM_MAX_LINE), fSubscribed(false), fClosed(false)
+    {
+    }
+};
+
+class CStratumServer
+{
+public:
+    asio::io_service service;
+    asio::ip::tcp::acceptor acceptor;
+    boost::thread_group threads;
+    CScript scriptPayout;
+    uint64_t nShareDifficulty;
+    unsigned short nPort;
+    unsigned int nMaxConnections;
+
+    mutable CCriticalSection cs;
+    set<StratumConnectionPtr> setConnections;
+    map<string, boost::shared_ptr<CStratumJob> > mapJobs;
+    deque<string> dequeJobs; // oldest first, the last one is current
+    map<string, CStratumWorkerStats> mapWorkers;
+    uint32_t nNextExtraNonce1;
+    unsigned int nJobCounter;
+
+    CStratumServer() : acceptor(service), nShareDifficulty(0), nPort(0), nMaxConnections(0), nNextExtraNonce1(0), nJobCounter(0)
+    {
+    }
+};
+
+static CStratumServer* pstratum = NULL;
+
+static void Accept();
+static void Read(StratumConnectionPtr conn);
+
+static void Close(StratumConnectionPtr conn)
+{
+    if (conn->fClosed)
+        return;
+    conn->fClosed = true;
+
+    boost::system::error_code ec;
+    conn->socket.close(ec);
+
+    LOCK(pstratum->cs);
+    pstratum->setConnections.erase(conn);
+}
+
+static void HandleWrite(StratumConnectionPtr conn, const boost::system::error_code& err)
+{
+    if (err)
+    {
+        Close(conn);
+        return;
+    }
+
+    conn->dequeSend.pop_front();
+    if (!conn->dequeSend.empty() && !conn->fClosed)
+        asio::async_write(conn->socket, asio::buffer(conn->dequeSend.front()),
+                          conn->strand.wrap(boost::bind(&HandleWrite, conn, asio::placeholders::error)));
+}
+
+/** Queue a message; writes are issued one at a time, in order */
+static void Send(StratumConnectionPtr conn, const Object& obj)
+{
+    if (conn->fClosed)
+        return;
+
+    conn->dequeSend.push_back(write_string(Value(obj), false) + "\n");
+    if (conn->dequeSend.size() == 1)
+        asio::async_write(conn->socket, asio::buffer(conn->dequeSend.front()),
+                          conn->strand.wrap(boost::bind(&HandleWrite, conn, asio::placeholders::error)));
+}
+
+static void SendResult(StratumConnectionPtr conn, const Value& id, const Value& result)
+{
+    Object reply;
+    reply.push_back(Pair("id", id));
+    reply.push_back(Pair("result", result));
+    reply.push_back(Pair("error", Value::null));
+    Send(conn, reply);
+}
+
+static void SendError(StratumConnectionPtr conn, const Value& id, int nCode, const string& strMessage)
+{
+    Array error;
+    error.push_back(nCode);
+    error.push_back(strMessage);
+    error.push_back(Value::null);
+
+    Object reply;
+    reply.push_back(Pair("id", id));
+    reply.push_back(Pair("result", Value::null));
+    reply.push_back(Pair("error", error));
+    Send(conn, reply);
+}
+
+static void SendNotification(StratumConnectionPtr conn, const string& strMethod, const Array& params)
+{
+    Object notification;
+    notification.push_back(Pair("id", Value::null));
+    notification.push_back(Pair("method", strMethod));
+    notification.push_back(Pair("params", params));
+    Send(conn, notification);
+}
+
+static void SendDifficulty(StratumConnectionPtr conn)
+{
+    Array params;
+    params.push_back(pstratum->nShareDifficulty / STRATUM_MERIT_ONE);
+    SendNotification(conn, "mining.set_difficulty", params);
+}
+
+static void SendJob(StratumConnectionPtr conn, boost::shared_ptr<CStratumJob> pjob, bool fClean)
+{
+    if (!conn->fSubscribed)
+        return;
+
+    const CBlock& block = pjob->block;
+    Array branch;
+    BOOST_FOREACH(const uint256& hash, pjob->vMerkleBranch)
+        branch.push_back(HexStr(hash.begin(), hash.end()));
+
+    Array params;
+    params.push_back(pjob->strId);
+    params.push_back(HexStr(block.hashPrevBlock.begin(), block.hashPrevBlock.end()));
+    params.push_back(HexStr(pjob->vCoinbase1));
+    params.push_back(HexStr(pjob->vCoinbase2));
+    params.push_back(branch);
+    params.push_back(strprintf("%08x", block.nVersion));
+    params.push_back(strprintf("%016x", block.nDifficulty));
+    params.push_back(strprintf("%08x", block.nTime));
+    params.push_back(fClean);
+    SendNotification(conn, "mining.notify", params);
+}
+
+static boost::shared_ptr<CStratumJob> GetCurrentJob()
+{
+    LOCK(pstratum->cs);
+    if (pstratum->dequeJobs.empty())
+        return boost::shared_ptr<CStratumJob>();
+    return pstratum->mapJobs[pstratum->dequeJobs.back()];
+}
+
+/** Parse a hex number of at most 8 digits */
+static bool ParseHexUInt32(const Value& value, unsigned int& n)
+{
+    if (value.type() != str_type)
+        return false;
+    const string& str = value.get_str();
+    if (str.empty() || str.size() > 8 || !IsHex(str.size() % 2 ? "0" + str : str))
+        return false;
+    n = strtoul(str.c_str(), NULL, 16);
+    return true;
+}
+
+static void Subscribe(StratumConnectionPtr conn, const Value& id)
+{
+    conn->fSubscribed = true;
+
+    const string strSession = HexStr(conn->vExtraNonce1);
+    Array subscription;
+    subscription.push_back("mining.notify");
+    subscription.push_back(strSession);
+    Array subscriptions;
+    subscriptions.push_back(subscription);
+
+    Array result;
+    result.push_back(subscriptions);
+    result.push_back(strSession);
+    result.push_back((int) STRATUM_EXTRANONCE2_SIZE);
+    SendResult(conn, id, result);
+
+    SendDifficulty(conn);
+    boost::shared_ptr<CStratumJob> pjob = GetCurrentJob();
+    if (pjob)
+        SendJob(conn, pjob, true);
+}
+
+static void Authorize(StratumConnectionPtr conn, const Value& id, const Array& params)
+{
+    if (params.size() < 1 || params[0].type() != str_type ||
+        params[0].get_str().empty() || params[0].get_str().size() > STRATUM_MAX_WORKER_NAME)
+    {
+        SendError(conn, id, STRATUM_OTHER, "Invalid worker name");
+        return;
+    }
+
+    const string& strWorker = params[0].get_str();
+    if (!conn->setWorkers.count(strWorker))
+    {
+        if (conn->setWorkers.size() >= STRATUM_MAX_WORKERS_PER_CONNECTION)
+        {
+            SendError(conn, id, STRATUM_OTHER, "Too many workers on this connection");
+            return;
+        }
+
+        // Names cost memory for good, so past STRATUM_MAX_WORKERS the one
+        // that went longest without a share is forgotten; a connection that
+        // still uses it starts counting anew
+        LOCK(pstratum->cs);
+        if (!pstratum->mapWorkers.count(strWorker) && pstratum->mapWorkers.size() >= STRATUM_MAX_WORKERS)
+        {
+            map<string, CStratumWorkerStats>::iterator miStalest = pstratum->mapWorkers.begin();
+            for (map<string, CStratumWorkerStats>::iterator mi = pstratum->mapWorkers.begin(); mi != pstratum->mapWorkers.end(); ++mi)
+                if (mi->second.nLastShare < miStalest->second.nLastShare)
+                    miStalest = mi;
+            pstratum->mapWorkers.erase(miStalest);
+        }
+        pstratum->mapWorkers[strWorker];
+    }
+
+    conn->setWorkers.insert(strWorker);
+    SendResult(conn, id, true);
+}
+
+/** Test a share and submit it as a block if it reaches the block difficulty */
+static void Submit(StratumConnectionPtr conn, const Value& id, const Array& params)
+{
+    if (!conn->fSubscribed)
+    {
+        SendError(conn, id, STRATUM_NOT_SUBSCRIBED, "Not subscribed");
+        return;
+    }
+    if (params.size() != 7 || params[0].type() != str_type || !conn->setWorkers.count(params[0].get_str()))
+    {
+        SendError(conn, id, STRATUM_UNAUTHORIZED, "Unauthorized worker");
+        return;
+    }
+    const string strWorker = params[0].get_str();
+
+    unsigned int nTime, nNonce;
+    if (params[1].type() != str_type ||
+        params[2].type() != str_type || params[2].get_str().size() != 2 * STRATUM_EXTRANONCE2_SIZE ||
+        !IsHex(params[2].get_str()) || !ParseHexUInt32(params[3], nTime) || !ParseHexUInt32(params[4], nNonce) ||
+        params[5].type() != int_type || params[5].get_int() < 0 || params[5].get_int() > 0xffff ||
+        params[6].type() != str_type || params[6].get_str().size() > 2 * 64 || !IsHex(params[6].get_str()) ||
+        params[6].get_str().substr(params[6].get_str().size() - 2) == "00")
+    {
+        {
+            LOCK(pstratum->cs);
+            pstratum->mapWorkers[strWorker].nRejected++;
+        }
+        SendError(conn, id, STRATUM_OTHER, "Invalid parameters");
+        return;
+    }
+    const vector<unsigned char> vExtraNonce2 = ParseHex(params[2].get_str());
+    const uint16_t nShift = params[5].get_int();
+    const vector<unsigned char> vAdd = ParseHex(params[6].get_str());
+
+    vector<unsigned char> vExtraNonce(conn->vExtraNonce1);
+    vExtraNonce.insert(vExtraNonce.end(), vExtraNonce2.begin(), vExtraNonce2.end());
+
+    boost::shared_ptr<CStratumJob> pjob;
+    {
+        LOCK(pstratum->cs);
+        CStratumWorkerStats& stats = pstratum->mapWorkers[strWorker];
+        map<string, boost::shared_ptr<CStratumJob> >::iterator mi = pstratum->mapJobs.find(params[1].get_str());
+        if (mi == pstratum->mapJobs.end())
+        {
+            stats.nStale++;
+            SendError(conn, id, STRATUM_JOB_NOT_FOUND, "Job not found");
+            return;
+        }
+        pjob = mi->second;
+
+        CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+        ss << vExtraNonce << nTime << nNonce << nShift << vAdd;
+        if (!pjob->setShares.insert(ss.GetHash()).second)
+        {
+            stats.nRejected++;
+            SendError(conn, id, STRATUM_DUPLICATE_SHARE, "Duplicate share");
+            return;
+        }
+    }
+
+    CBlock block = pjob->GetBlock(vExtraNonce, nTime, nNonce, nShift, vAdd);
+    if (nTime < pjob->block.nTime || nTime > GetAdjustedTime() + 2 * 60 * 60)
+    {
+        {
+            LOCK(pstratum->cs);
+            pstratum->mapWorkers[strWorker].nRejected++;
+        }
+        SendError(conn, id, STRATUM_OTHER, "Time out of range");
+        return;
+    }
+
+    // Test at the share difficulty; this is the expensive part, so it runs
+    // in this connection's strand, without any lock held
+    const uint64_t nDifficulty = min(pstratum->nShareDifficulty, block.nDifficulty);
+    uint256 hash = block.GetHash();
+    vector<uint8_t> vHash(hash.begin(), hash.end());
+    PoW pow(&vHash, block.nShift, &block.nAdd, nDifficulty);
+    const bool fValid = pow.valid();
+    const uint64_t nMerit = fValid ? pow.merit() : 0;
+
+    bool fBlock = fValid && nMerit >= block.nDifficulty;
+    if (fBlock)
+    {
+        LogPrintf("StratumServer: block found by %s (%s), merit %.6f\n", strWorker, conn->peer.address().to_string(),
+                  nMerit / STRATUM_MERIT_ONE);
+
+        LOCK(cs_main);
+        CValidationState state;
+        if (block.hashPrevBlock != chainActive.Tip()->GetBlockHash())
+            fBlock = error("StratumServer : found block is stale");
+        else if (!ProcessBlock(state, NULL, &block))
+            fBlock = error("StratumServer : ProcessBlock, block not accepted");
+    }
+
+    {
+        LOCK(pstratum->cs);
+        CStratumWorkerStats& stats = pstratum->mapWorkers[strWorker];
+        if (fValid)
+        {
+            stats.nAccepted++;
+            stats.nBestMerit = max(stats.nBestMerit, nMerit);
+            stats.nLastShare = GetTime();
+            if (fBlock)
+                stats.nBlocks++;
+        }
+        else
+            stats.nRejected++;
+    }
+
+    if (fValid)
+        SendResult(conn, id, true);
+    else
+        SendError(conn, id, STRATUM_LOW_DIFFICULTY, "Low difficulty share");
+}
+
+static void HandleRequest(StratumConnectionPtr conn, const string& strLine)
+{
+    Value valRequest;
+    if (!read_string(strLine, valRequest) || valRequest.type() != obj_type)
+    {
+        LogPrint("stratum", "StratumServer: unparsable request from %s\n", conn->peer.address().to_string());
+        Close(conn);
+        return;
+    }
+
+    const Object& request = valRequest.get_obj();
+    const Value& id = find_value(request, "id");
+    const Value& method = find_value(request, "method");
+    const Value& params = find_value(request, "params");
+    if (method.type() != str_type || (params.type() != array_type && params.type() != null_type))
+    {
+        SendError(conn, id, STRATUM_OTHER, "Invalid request");
+        return;
+    }
+
+    const string& strMethod = method.get_str();
+    const Array vParams = params.type() == array_type ? params.get_array() : Array();
+    if (strMethod == "mining.subscribe")
+        Subscribe(conn, id);
+    else if (strMethod == "mining.authorize")
+        Authorize(conn, id, vParams);
+    else if (strMethod == "mining.submit")
+        Submit(conn, id, vParams);
+    else
+        SendError(conn, id, STRATUM_OTHER, "Method not found");
+}
+
+static void HandleRead(StratumConnectionPtr conn, const boost::system::error_code& err, size_t nBytes)
+{
+    if (conn->fClosed)
+        return;
+    if (err)
+    {
+        // also when the line grows beyond STRATUM_MAX_LINE
+        Close(conn);
+        return;
+    }
+
+    istream stream(&conn->buffer);
+    string strLine;
+    getline(stream, strLine);
+    if (!strLine.empty() && strLine != "\r")
+        HandleRequest(conn, strLine);
+
+    Read(conn);
+}
+
+static void Read(StratumConnectionPtr conn)
+{
+    if (conn->fClosed)
+        return;
+    asio::async_read_until(conn->socket, conn->buffer, '\n',
+                           conn->strand.wrap(boost::bind(&HandleRead, conn, asio::placeholders::error,
+                                                         asio::placeholders::bytes_transferred)));
+}
+
+static void HandleAccept(StratumConnectionPtr conn, const boost::system::error_code& err)
+{
+    if (err == asio::error::operation_aborted || !pstratum->acceptor.is_open())
+        return;
+    Accept();
+
+    if (err)
+    {
+        LogPrintf("StratumServer: accept failed: %s\n", err.message());
+        return;
+    }
+
+    {
+        LOCK(pstratum->cs);
+        if (pstratum->setConnections.size() >= pstratum->nMaxConnections)
+        {
+            LogPrint("stratum", "StratumServer: connection from %s refused, %u miners connected\n",
+                     conn->peer.address().to_string(), pstratum->setConnections.size());
+            boost::system::error_code ec;
+            conn->socket.close(ec);
+            return;
+        }
+        uint32_t nExtraNonce1 = pstratum->nNextExtraNonce1++;
+        for (unsigned int i = 0; i < STRATUM_EXTRANONCE1_SIZE; i++)
+            conn->vExtraNonce1.push_back(nExtraNonce1 >> (8 * (STRATUM_EXTRANONCE1_SIZE - 1 - i)));
+        pstratum->setConnections.insert(conn);
+    }
+    LogPrint("stratum", "StratumServer: connection from %s\n", conn->peer.address().to_string());
+
+    conn->strand.dispatch(boost::bind(&Read, conn));
+}
+
+static void Accept()
+{
+    StratumConnectionPtr conn(new CStratumConnection(pstratum->service));
+    pstratum->acceptor.async_accept(conn->socket, conn->peer, boost::bind(&HandleAccept, conn, asio::placeholders::error));
+}
+
+/** Make a new job from a fresh template and push it to every miner */
+static bool NewJob(bool fClean)
+{
+    auto_ptr<CBlockTemplate> pblocktemplate(CreateNewBlock(pstratum->scriptPayout));
+    if (!pblocktemplate.get())
+        return false;
+
+    int nHeight;
+    {
+        LOCK(cs_main);
+        nHeight = mapBlockIndex[pblocktemplate->block.hashPrevBlock]->nHeight + 1;
+    }
+
+    boost::shared_ptr<CStratumJob> pjob;
+    vector<StratumConnectionPtr> vConnections;
+    {
+        LOCK(pstratum->cs);
+        pjob.reset(new CStratumJob(strprintf("%x", ++pstratum->nJobCounter), pblocktemplate->block, nHeight));
+
+        // Shares for the old tip are worthless
+        if (fClean)
+        {
+            pstratum->mapJobs.clear();
+            pstratum->dequeJobs.clear();
+        }
+        pstratum->mapJobs[pjob->strId] = pjob;
+        pstratum->dequeJobs.push_back(pjob->strId);
+        while (pstratum->dequeJobs.size() > STRATUM_MAX_JOBS)
+        {
+            pstratum->mapJobs.erase(pstratum->dequeJobs.front());
+            pstratum->dequeJobs.pop_front();
+        }
+        vConnections.assign(pstratum->setConnections.begin(), pstratum->setConnections.end());
+    }
+
+    LogPrint("stratum", "StratumServer: job %s at height %d, %u transactions\n", pjob->strId, nHeight,
+             pjob->block.vtx.size());
+
+    BOOST_FOREACH(StratumConnectionPtr conn, vConnections)
+        conn->strand.post(boost::bind(&SendJob, conn, pjob, fClean));
+    return true;
+}
+
+/** Pushes a new job on every new tip right away, and for new transactions
+ *  every STRATUM_JOB_REFRESH seconds */
+static void ThreadStratumJobs()
+{
+    RenameThread("gapcoin-stratum");
+    LogPrintf("ThreadStratumJobs started\n");
+
+    try
+    {
+        CBlockIndex* pindexLast = NULL;
+        unsigned int nTransactionsUpdatedLast = 0;
+        int64_t nLastJob = 0;
+
+        while (true)
+        {
+            CBlockIndex* pindexNew;
+            {
+                boost::unique_lock<CWaitableCriticalSection> lock(csBestBlock);
+                while ((pindexNew = chainActive.Tip()) == pindexLast &&
+                       (mempool.GetTransactionsUpdated() == nTransactionsUpdatedLast ||
+                        GetTime() - nLastJob < STRATUM_JOB_REFRESH))
+                    cvBlockChange.timed_wait(lock, boost::posix_time::seconds(1));
+            }
+            boost::this_thread::interruption_point();
+
+            // No work while the chain is not caught up; it would only be stale
+            if (IsInitialBlockDownload())
+            {
+                MilliSleep(1000);
+                continue;
+            }
+
+            nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
+            nLastJob = GetTime();
+            if (!NewJob(pindexNew != pindexLast))
+            {
+                LogPrintf("ThreadStratumJobs : CreateNewBlock failed\n");
+                continue;
+            }
+            pindexLast = pindexNew;
+        }
+    }
+    catch (boost::thread_interrupted)
+    {
+        LogPrintf("ThreadStratumJobs terminated\n");
+        throw;
+    }
+}
+
+bool StartStratumServer(string& strError)
+{
+    assert(pstratum == NULL);
+
+    CGapcoinAddress address(GetArg("-stratumaddress", ""));
+    if (!address.IsValid())
+    {
+        strError = _("-stratum requires a valid -stratumaddress to pay the blocks to");
+        return false;
+    }
+
+    double dDifficulty = DEFAULT_STRATUM_DIFFICULTY;
+    if (mapArgs.count("-stratumdifficulty"))
+        dDifficulty = atof(mapArgs["-stratumdifficulty"].c_str());
+    if (dDifficulty <= 0.0 || dDifficulty > 1000.0)
+    {
+        strError = strprintf(_("Invalid amount for -stratumdifficulty=<merit>: '%s'"), mapArgs["-stratumdifficulty"]);
+        return false;
+    }
+
+    pstratum = new CStratumServer();
+    pstratum->scriptPayout.SetDestination(address.Get());
+    pstratum->nShareDifficulty = (uint64_t) (dDifficulty * STRATUM_MERIT_ONE);
+    pstratum->nPort = GetArg("-stratumport", Params().StratumPort());
+    pstratum->nMaxConnections = max(GetArg("-stratummaxconnections", DEFAULT_STRATUM_MAX_CONNECTIONS), (int64_t)1);
+    pstratum->nNextExtraNonce1 = GetRand(0xffffffff);
+
+    // Miners are outside hosts as a rule, but only listen on loopback unless told
+    try
+    {
+        asio::ip::address bindAddress = asio::ip::address_v4::loopback();
+        if (mapArgs.count("-stratumbind"))
+            bindAddress = asio::ip::address::from_string(mapArgs["-stratumbind"]);
+
+        asio::ip::tcp::endpoint endpoint(bindAddress, pstratum->nPort);
+        pstratum->acceptor.open(endpoint.protocol());
+        pstratum->acceptor.set_option(asio::ip::tcp::acceptor::reuse_address(true));
+        pstratum->acceptor.bind(endpoint);
+        pstratum->acceptor.listen(asio::socket_base::max_connections);
+    }
+    catch (std::exception& e)
+    {
+        strError = strprintf(_("Unable to bind the work server to port %u: %s"), pstratum->nPort, e.what());
+        delete pstratum;
+        pstratum = NULL;
+        return false;
+    }
+
+    Accept();
+    pstratum->threads.create_thread(&ThreadStratumJobs);
+    for (int i = 0; i < GetArg("-stratumthreads", 2); i++)
+        pstratum->threads.create_thread(boost::bind(&asio::io_service::run, &pstratum->service));
+
+    LogPrintf("StratumServer: listening on port %u, share difficulty %.6f\n", pstratum->nPort, dDifficulty);
+    return true;
+}
+
+void StopStratumServer()
+{
+    if (pstratum == NULL)
+        return;
+
+    boost::system::error_code ec;
+    pstratum->acceptor.close(ec);
+    {
+        LOCK(pstratum->cs);
+        BOOST_FOREACH(StratumConnectionPtr conn, pstratum->setConnections)
+            conn->socket.close(ec);
+        pstratum->setConnections.clear();
+    }
+
+    pstratum->service.stop();
+    pstratum->threads.interrupt_all();
+    pstratum->threads.join_all();
+
+    delete pstratum;
+    pstratum = NULL;
+}
+
+bool GetStratumInfo(CStratumInfo& info)
+{
+    if (pstratum == NULL)
+        return false;
+
+    LOCK(pstratum->cs);
+    info.nPort = pstratum->nPort;
+    info.nShareDifficulty = pstratum->nShareDifficulty;
+    info.nConnections = pstratum->setConnections.size();
+    info.nJobs = pstratum->dequeJobs.size();
+    info.nHeight = pstratum->dequeJobs.empty() ? -1 : pstratum->mapJobs[pstratum->dequeJobs.back()]->nHeight;
+    info.mapWorkers = pstratum->mapWorkers;
+    return true;
+}
@@ -0,0 +1,98 @@
+// Copyright (c) 2014 The Gapcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef GAPCOIN_STRATUM_H
+#define GAPCOIN_STRATUM_H
+
+#include "core.h"
+#include "uint256.h"
+
+#include <map>
+#include <set>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/** Default share difficulty of the work server, in merit (-stratumdifficulty) */
+static const double DEFAULT_STRATUM_DIFFICULTY = 10.0;
+/** Bytes of the extranonce assigned to each connection */
+static const unsigned int STRATUM_EXTRANONCE1_SIZE = 4;
+/** Bytes of the extranonce each miner rolls itself */
+static const unsigned int STRATUM_EXTRANONCE2_SIZE = 4;
+static const unsigned int STRATUM_EXTRANONCE_SIZE = STRATUM_EXTRANONCE1_SIZE + STRATUM_EXTRANONCE2_SIZE;
+/** Seconds before new mempool transactions make a new job */
+static const int STRATUM_JOB_REFRESH = 60;
+/** Number of jobs shares are still accepted for */
+static const unsigned int STRATUM_MAX_JOBS = 8;
+/** Default for -stratummaxconnections, the number of miners served at once */
+static const unsigned int DEFAULT_STRATUM_MAX_CONNECTIONS = 1024;
+/** Worker names one connection may authorize */
+static const unsigned int STRATUM_MAX_WORKERS_PER_CONNECTION = 16;
+/** Worker names kept in the share accounting; the stalest one makes room */
+static const unsigned int STRATUM_MAX_WORKERS = 4096;
+
+/**
+ * A block template as handed out by the work server. The extranonce in the
+ * coinbase input is left open: miners build the coinbase from coinbase1,
+ * the extranonce of their connection, their own extranonce and coinbase2,
+ * and the merkle root from its hash and the merkle branch of the coinbase.
+ */
+class CStratumJob
+{
+public:
+    std::string strId;
+    CBlock block;
+    int nHeight;
+    std::vector<unsigned char> vCoinbase1;
+    std::vector<unsigned char> vCoinbase2;
+    std::vector<uint256> vMerkleBranch;
+
+    // Shares submitted for this job, to reject duplicates
+    std::set<uint256> setShares;
+
+    CStratumJob(const std::string& strIdIn, const CBlock& blockIn, int nHeightIn);
+
+    /** The serialized coinbase for an extranonce of STRATUM_EXTRANONCE_SIZE bytes */
+    std::vector<unsigned char> GetCoinbase(const std::vector<unsigned char>& vExtraNonce) const;
+
+    /** The merkle root a miner computes for vExtraNonce */
+    uint256 GetMerkleRoot(const std::vector<unsigned char>& vExtraNonce) const;
+
+    /** The full block of a submitted share */
+    CBlock GetBlock(const std::vector<unsigned char>& vExtraNonce, unsigned int nTime, unsigned int nNonce,
+                    uint16_t nShift, const std::vector<unsigned char>& vAdd) const;
+};
+
+/** Share accounting of one worker name */
+struct CStratumWorkerStats
+{
+    uint64_t nAccepted;
+    uint64_t nRejected;  // invalid, duplicate or below the share difficulty
+    uint64_t nStale;     // for a job that was already dropped
+    uint64_t nBlocks;
+    uint64_t nBestMerit;
+    int64_t nLastShare;
+
+    CStratumWorkerStats() : nAccepted(0), nRejected(0), nStale(0), nBlocks(0), nBestMerit(0), nLastShare(0) {}
+};
+
+/** State of the work server for getstratuminfo */
+struct CStratumInfo
+{
+    unsigned short nPort;
+    uint64_t nShareDifficulty;
+    unsigned int nConnections;
+    unsigned int nJobs;
+    int nHeight;
+    std::map<std::string, CStratumWorkerStats> mapWorkers;
+};
+
+/** Start the work server; returns false with strError set on a bad configuration */
+bool StartStratumServer(std::string& strError);
+/** Disconnect all miners and stop the work server threads */
+void StopStratumServer();
+/** Fill in info; false if the work server is not running */
+bool GetStratumInfo(CStratumInfo& info);
+
+#endif // GAPCOIN_STRATUM_H
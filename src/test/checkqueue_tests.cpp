@@ -0,0 +1,107 @@
+// Copyright (c) 2014 The Gapcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "checkqueue.h"
+
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+using namespace std;
+
+// Counts how often each check ran; fails the ones marked bad
+struct CCountingCheck
+{
+    static boost::mutex mutex;
+    static vector<int> vRuns;
+    int n;
+    bool fBad;
+
+    CCountingCheck(int nIn = -1, bool fBadIn = false) : n(nIn), fBad(fBadIn) {}
+
+    bool operator()()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        vRuns[n]++;
+        return !fBad;
+    }
+
+    void swap(CCountingCheck& check)
+    {
+        std::swap(n, check.n);
+        std::swap(fBad, check.fBad);
+    }
+};
+
+boost::mutex CCountingCheck::mutex;
+vector<int> CCountingCheck::vRuns;
+
+BOOST_AUTO_TEST_SUITE(checkqueue_tests)
+
+BOOST_AUTO_TEST_CASE(checkqueue_all_run_once)
+{
+    // more threads than slots, so some share a deque
+    CCheckQueue<CCountingCheck> queue(16, 4);
+    boost::thread_group threads;
+    for (int i = 0; i < 6; i++)
+        threads.create_thread(boost::bind(&CCheckQueue<CCountingCheck>::Thread, &queue));
+
+    // one big batch, many small ones, and nothing at all
+    int pnSizes[] = {5000, 1, 0, 3, 1000};
+    for (int nRound = 0; nRound < 20; nRound++)
+    {
+        int nTotal = 0;
+        CCountingCheck::vRuns.assign(10000, 0);
+        {
+            CCheckQueueControl<CCountingCheck> control(&queue);
+            for (unsigned int i = 0; i < sizeof(pnSizes) / sizeof(pnSizes[0]); i++)
+            {
+                vector<CCountingCheck> vChecks;
+                for (int j = 0; j < pnSizes[i]; j++)
+                    vChecks.push_back(CCountingCheck(nTotal++));
+                control.Add(vChecks);
+            }
+            BOOST_CHECK(control.Wait());
+        }
+        for (int i = 0; i < nTotal; i++)
+            BOOST_CHECK_EQUAL(CCountingCheck::vRuns[i], 1);
+    }
+
+    threads.interrupt_all();
+    threads.join_all();
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_failure)
+{
+    CCheckQueue<CCountingCheck> queue(16);
+    boost::thread_group threads;
+    for (int i = 0; i < 3; i++)
+        threads.create_thread(boost::bind(&CCheckQueue<CCountingCheck>::Thread, &queue));
+
+    CCountingCheck::vRuns.assign(1000, 0);
+    for (int nBad = 0; nBad < 1000; nBad += 250)
+    {
+        CCheckQueueControl<CCountingCheck> control(&queue);
+        vector<CCountingCheck> vChecks;
+        for (int i = 0; i < 1000; i++)
+            vChecks.push_back(CCountingCheck(i, i == nBad));
+        control.Add(vChecks);
+        BOOST_CHECK(!control.Wait());
+    }
+
+    // a failure doesn't stick to the next use of the queue
+    {
+        CCheckQueueControl<CCountingCheck> control(&queue);
+        vector<CCountingCheck> vChecks(100, CCountingCheck(0));
+        control.Add(vChecks);
+        BOOST_CHECK(control.Wait());
+    }
+
+    threads.interrupt_all();
+    threads.join_all();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
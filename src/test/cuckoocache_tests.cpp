@@ -0,0 +1,72 @@
+// Copyright (c) 2014 The Gapcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "cuckoocache.h"
+
+#include "util.h"
+
+#include <vector>
+
+#include <boost/foreach.hpp>
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(cuckoocache_tests)
+
+BOOST_AUTO_TEST_CASE(cuckoocache_contains)
+{
+    CCuckooCache cache;
+    BOOST_CHECK(!cache.Contains(GetRandHash()));
+    BOOST_CHECK_EQUAL(cache.Setup(1 << 16), (1U << 16) / 32);
+    BOOST_CHECK_EQUAL(cache.Size(), 2048U);
+
+    // half full, nothing is lost
+    vector<uint256> vInserted;
+    for (unsigned int i = 0; i < cache.Size() / 2; i++)
+    {
+        vInserted.push_back(GetRandHash());
+        BOOST_CHECK(cache.Insert(vInserted.back()));
+    }
+    BOOST_FOREACH(const uint256& digest, vInserted)
+        BOOST_CHECK(cache.Contains(digest));
+    for (unsigned int i = 0; i < 100; i++)
+        BOOST_CHECK(!cache.Contains(GetRandHash()));
+
+    // the null digest marks empty slots
+    BOOST_CHECK(cache.Insert(0));
+    BOOST_CHECK(!cache.Contains(0));
+
+    // Setup() empties it
+    cache.Setup(1 << 16);
+    BOOST_CHECK(!cache.Contains(vInserted[0]));
+}
+
+BOOST_AUTO_TEST_CASE(cuckoocache_overfull)
+{
+    CCuckooCache cache;
+    cache.Setup(1 << 14);
+
+    // twice as many as fit: the table fills up, and the recent ones are
+    // there rather than not
+    vector<uint256> vInserted;
+    unsigned int nDropped = 0;
+    for (unsigned int i = 0; i < 2 * cache.Size(); i++)
+    {
+        vInserted.push_back(GetRandHash());
+        if (!cache.Insert(vInserted.back()))
+            nDropped++;
+    }
+    BOOST_CHECK(nDropped >= cache.Size());
+
+    unsigned int nOld = 0, nNew = 0;
+    for (unsigned int i = 0; i < vInserted.size(); i++)
+        if (cache.Contains(vInserted[i]))
+            (i < cache.Size() ? nOld : nNew)++;
+    BOOST_CHECK(nOld + nNew > cache.Size() * 9 / 10);
+    BOOST_CHECK(nOld + nNew <= cache.Size());
+    BOOST_CHECK(nNew > nOld);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
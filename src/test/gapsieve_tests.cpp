@@ -0,0 +1,174 @@
+// Copyright (c) 2014 The Gapcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "gapsieve.h"
+#include "miningstats.h"
+#include "uint256.h"
+#include "PoWCore/src/PoW.h"
+#include "PoWCore/src/PoWProcessor.h"
+
+#include <set>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(gapsieve_tests)
+
+static const uint256 hashTest("0x9a4c4ebb554be537d63ddfc7a10acc11759a8363fb73090de82c6a34e33e92d7");
+
+// Collects the adders of all reported gaps
+class CCollectProcessor : public PoWProcessor
+{
+public:
+    boost::mutex mutex;
+    set<uint64_t> setAdders;
+
+    bool process(PoW *pow)
+    {
+        vector<uint8_t> vAdder;
+        pow->get_adder(&vAdder);
+
+        uint64_t nAdder = 0;
+        for (unsigned int i = vAdder.size(); i > 0; i--)
+            nAdder = (nAdder << 8) | vAdder[i - 1];
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        setAdders.insert(nAdder);
+        return true;
+    }
+};
+
+static void SetBase(mpz_t mpzBase, const uint256& hash, uint16_t nShift)
+{
+    mpz_import(mpzBase, hash.size(), -1, sizeof(uint8_t), 0, 0, hash.begin());
+    mpz_mul_2exp(mpzBase, mpzBase, nShift);
+}
+
+BOOST_AUTO_TEST_CASE(sieveprimes)
+{
+    CSievePrimes primes(1000);
+    BOOST_CHECK_EQUAL(primes.size(), 1000U);
+    BOOST_CHECK_EQUAL(primes[0], 2U);
+    BOOST_CHECK_EQUAL(primes[1], 3U);
+    BOOST_CHECK_EQUAL(primes[9], 29U);
+    BOOST_CHECK_EQUAL(primes[999], 7919U);
+}
+
+BOOST_AUTO_TEST_CASE(sievewindow)
+{
+    CSievePrimes primes(500);
+    mpz_t mpzBase, mpzN;
+    mpz_init(mpzBase);
+    mpz_init(mpzN);
+    SetBase(mpzBase, hashTest, 20);
+
+    vector<uint32_t> vResidues(primes.size());
+    for (unsigned int k = 0; k < primes.size(); k++)
+        vResidues[k] = mpz_fdiv_ui(mpzBase, primes[k]);
+
+    // windows at different phases of the wheel
+    const uint64_t vStart[] = { 0, 123456, 987654322 };
+    const uint64_t nBits = 2000;
+    vector<uint32_t> vSieve;
+    for (unsigned int n = 0; n < sizeof(vStart) / sizeof(vStart[0]); n++)
+    {
+        SieveWindow(primes, vResidues, vStart[n], nBits, vSieve);
+
+        for (uint64_t i = 0; i < nBits; i++)
+        {
+            mpz_add_ui(mpzN, mpzBase, vStart[n] + 2 * i + 1);
+
+            bool fComposite = false;
+            for (unsigned int k = 0; k < primes.size() && !fComposite; k++)
+                fComposite = mpz_divisible_ui_p(mpzN, primes[k]);
+
+            BOOST_CHECK_EQUAL((bool) (vSieve[i >> 5] & (1U << (i & 31))), fComposite);
+        }
+    }
+
+    mpz_clear(mpzBase);
+    mpz_clear(mpzN);
+}
+
+BOOST_AUTO_TEST_CASE(targetgapsize)
+{
+    mpz_t mpzStart;
+    mpz_init(mpzStart);
+    mpz_ui_pow_ui(mpzStart, 2, 100);
+
+    // ceil(20 * ln(2^100))
+    BOOST_CHECK_EQUAL(GetTargetGapSize(mpzStart, ((uint64_t) 20) << 48), 1387U);
+
+    mpz_clear(mpzStart);
+}
+
+BOOST_AUTO_TEST_CASE(sharedsieve)
+{
+    const uint16_t nShift = 20;
+    const uint64_t nSieveSize = 1 << 16;
+    const uint64_t nDifficulty = ((uint64_t) 2) << 48;
+
+    CSharedSieve sieve(2000, 1 << 12);
+    CCollectProcessor processor;
+
+    CMiningThreadStats vStats[3];
+    boost::thread_group threads;
+    for (int i = 0; i < 3; i++)
+        threads.create_thread(boost::bind(&CSharedSieve::Thread, &sieve, &vStats[i]));
+
+    sieve.Start(hashTest, nShift, nDifficulty, nSieveSize, &processor);
+    sieve.Wait();
+
+    threads.interrupt_all();
+    threads.join_all();
+
+    // compare with all gaps found by walking the primes
+    mpz_t mpzBase, mpzPrime, mpzNext;
+    mpz_init(mpzBase);
+    mpz_init(mpzPrime);
+    mpz_init(mpzNext);
+    SetBase(mpzBase, hashTest, nShift);
+    uint64_t nTarget = GetTargetGapSize(mpzBase, nDifficulty);
+
+    set<uint64_t> setExpected;
+    mpz_nextprime(mpzPrime, mpzBase);
+    mpz_sub(mpzNext, mpzPrime, mpzBase);
+    while (mpz_get_ui(mpzNext) < nSieveSize)
+    {
+        uint64_t nAdder = mpz_get_ui(mpzNext);
+        mpz_nextprime(mpzNext, mpzPrime);
+        mpz_sub(mpzPrime, mpzNext, mpzPrime);
+        if (mpz_get_ui(mpzPrime) >= nTarget)
+            setExpected.insert(nAdder);
+
+        mpz_set(mpzPrime, mpzNext);
+        mpz_sub(mpzNext, mpzPrime, mpzBase);
+    }
+
+    BOOST_CHECK(!setExpected.empty());
+    BOOST_CHECK(processor.setAdders == setExpected);
+
+    // every reported gap is counted once
+    CMiningThreadStats total;
+    for (int i = 0; i < 3; i++)
+        total.Add(vStats[i]);
+
+    uint64_t nGaps = 0;
+    for (unsigned int i = 0; i <= MINING_STATS_MAX_MERIT; i++)
+        nGaps += total.vGaps[i];
+
+    BOOST_CHECK_EQUAL(nGaps, setExpected.size());
+    BOOST_CHECK(total.nTests > 0);
+    BOOST_CHECK(total.nTestsSaved > 0);
+
+    mpz_clear(mpzBase);
+    mpz_clear(mpzPrime);
+    mpz_clear(mpzNext);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
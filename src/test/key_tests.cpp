@@ -6,13 +6,18 @@
 
 #include "base58.h"
 #include "script.h"
+#include "secp256k1.h"
 #include "uint256.h"
 #include "util.h"
 
 #include <string>
 #include <vector>
 
+#include <boost/foreach.hpp>
 #include <boost/test/unit_test.hpp>
+#include <openssl/bn.h>
+#include <openssl/ec.h>
+#include <openssl/obj_mac.h>
 
 using namespace std;
 
@@ -144,4 +149,209 @@ BOOST_AUTO_TEST_CASE(key_test1)
     }
 }
 
+BOOST_AUTO_TEST_CASE(key_verifier_crosscheck)
+{
+    // The native verifier must agree with OpenSSL on every signature,
+    // including the ones it hands over to OpenSSL
+    BOOST_CHECK(GetSignatureVerifier() == (Secp256k1Available() ? SIGVERIFIER_NATIVE : SIGVERIFIER_OPENSSL));
+    if (!Secp256k1Available())
+        return;
+
+    for (int n = 0; n < 64; n++)
+    {
+        CKey key;
+        key.MakeNewKey(n % 2 == 0);
+        CPubKey pubkey = key.GetPubKey();
+        uint256 hash = GetRandHash();
+        if (n % 16 == 1)
+            hash = ~uint256(0);
+        if (n % 16 == 3)
+            hash = 0;
+
+        vector<unsigned char> vchSig;
+        BOOST_CHECK(key.Sign(hash, vchSig));
+        BOOST_CHECK(pubkey.Verify(hash, vchSig, SIGVERIFIER_NATIVE));
+        BOOST_CHECK(pubkey.Verify(hash, vchSig, SIGVERIFIER_OPENSSL));
+
+        // flipped bits in the hash, r and s, and other keys
+        vector<vector<unsigned char> > vSigs;
+        vector<uint256> vHashes;
+        for (int i = 0; i < 8; i++)
+        {
+            vSigs.push_back(vchSig);
+            vSigs.back()[4 + GetRand(vchSig.size() - 4)] ^= 1 << GetRand(8);
+            vHashes.push_back(hash ^ (uint256(1) << GetRand(256)));
+        }
+        CKey keyOther;
+        keyOther.MakeNewKey(n % 4 < 2);
+        CPubKey pubkeyOther = keyOther.GetPubKey();
+
+        // r padded with a zero byte, which isn't strict DER
+        vector<unsigned char> vchPadded(vchSig.begin(), vchSig.begin() + 4);
+        vchPadded[1]++;
+        vchPadded[3]++;
+        vchPadded.push_back(0);
+        vchPadded.insert(vchPadded.end(), vchSig.begin() + 4, vchSig.end());
+        vSigs.push_back(vchPadded);
+
+        BOOST_FOREACH(const vector<unsigned char>& vchBad, vSigs)
+            BOOST_CHECK_EQUAL(pubkey.Verify(hash, vchBad, SIGVERIFIER_NATIVE), pubkey.Verify(hash, vchBad, SIGVERIFIER_OPENSSL));
+        BOOST_FOREACH(const uint256& hashBad, vHashes)
+            BOOST_CHECK(!pubkey.Verify(hashBad, vchSig, SIGVERIFIER_NATIVE));
+        BOOST_CHECK(!pubkeyOther.Verify(hash, vchSig, SIGVERIFIER_NATIVE));
+        BOOST_CHECK(!pubkeyOther.Verify(hash, vchSig, SIGVERIFIER_OPENSSL));
+    }
+
+    // OpenSSL stays selectable
+    BOOST_CHECK(SetSignatureVerifier(SIGVERIFIER_OPENSSL));
+    BOOST_CHECK(GetSignatureVerifier() == SIGVERIFIER_OPENSSL);
+    BOOST_CHECK(SetSignatureVerifier(SIGVERIFIER_NATIVE));
+}
+
+static void PushDERInteger(vector<unsigned char>& vch, const BIGNUM* bn)
+{
+    vector<unsigned char> vchInt(BN_num_bytes(bn));
+    BN_bn2bin(bn, &vchInt[0]);
+    if (vchInt[0] & 0x80)
+        vchInt.insert(vchInt.begin(), 0);
+    vch.push_back(0x02);
+    vch.push_back(vchInt.size());
+    vch.insert(vch.end(), vchInt.begin(), vchInt.end());
+}
+
+// A valid signature for a key nobody has the secret of: with the hash free
+// to choose, R = a*G + b*Q signs for r = R.x, s = r/b, e = a*s
+static bool ForgeSignature(const CPubKey& pubkey, uint256& hash, vector<unsigned char>& vchSig)
+{
+    EC_GROUP* group = EC_GROUP_new_by_curve_name(NID_secp256k1);
+    BN_CTX* ctx = BN_CTX_new();
+    BN_CTX_start(ctx);
+    BIGNUM* a = BN_CTX_get(ctx);
+    BIGNUM* b = BN_CTX_get(ctx);
+    BIGNUM* n = BN_CTX_get(ctx);
+    BIGNUM* x = BN_CTX_get(ctx);
+    BIGNUM* r = BN_CTX_get(ctx);
+    BIGNUM* s = BN_CTX_get(ctx);
+    BIGNUM* e = BN_CTX_get(ctx);
+    EC_POINT* q = EC_POINT_new(group);
+    EC_POINT* pt = EC_POINT_new(group);
+    bool fOk = EC_GROUP_get_order(group, n, ctx) &&
+               EC_POINT_oct2point(group, q, pubkey.begin(), pubkey.size(), ctx) &&
+               BN_rand_range(a, n) && BN_rand_range(b, n) && !BN_is_zero(b) &&
+               EC_POINT_mul(group, pt, a, q, b, ctx) &&
+               EC_POINT_get_affine_coordinates_GFp(group, pt, x, NULL, ctx) &&
+               BN_nnmod(r, x, n, ctx) && BN_mod_inverse(s, b, n, ctx) &&
+               BN_mod_mul(s, r, s, n, ctx) && BN_mod_mul(e, a, s, n, ctx);
+    if (fOk)
+    {
+        // ECDSA_verify reads the hash as a big endian number
+        hash = 0;
+        BN_bn2bin(e, hash.begin() + 32 - BN_num_bytes(e));
+        vchSig.clear();
+        PushDERInteger(vchSig, r);
+        PushDERInteger(vchSig, s);
+        vchSig.insert(vchSig.begin(), vchSig.size());
+        vchSig.insert(vchSig.begin(), 0x30);
+    }
+    EC_POINT_free(pt);
+    EC_POINT_free(q);
+    BN_CTX_end(ctx);
+    BN_CTX_free(ctx);
+    EC_GROUP_free(group);
+    return fOk;
+}
+
+BOOST_AUTO_TEST_CASE(key_verifier_sqr_carry)
+{
+    if (!Secp256k1Available())
+        return;
+
+    // Limbs near 0, 2^63 and 2^64 make the doubled cross products of a
+    // square carry through an all ones word
+    const uint64_t pnLimbs[] = {0, 1, 2, 0x7FFFFFFFFFFFFFFFULL, 0x8000000000000000ULL,
+                                0x8000000000000001ULL, 0xFFFFFFFFFFFFFFFEULL, 0xFFFFFFFFFFFFFFFFULL};
+    // the top limb stops short of all ones, so every element is below p
+    for (int i = 0; i < 8 * 8 * 8 * 7; i++)
+    {
+        uint64_t a[4] = {pnLimbs[i % 8], pnLimbs[i / 8 % 8], pnLimbs[i / 64 % 8], pnLimbs[i / 512]};
+        uint64_t pnSqr[4], pnMul[4];
+        Secp256k1FieldSqr(pnSqr, a);
+        Secp256k1FieldMul(pnMul, a, a);
+        BOOST_CHECK(memcmp(pnSqr, pnMul, sizeof(pnSqr)) == 0);
+    }
+
+    // Compressed keys whose x squares like that; decompressing them went
+    // wrong and left them to OpenSSL, which the native code must not need
+    for (uint64_t nTop = 2; nTop < 6; nTop++)
+    {
+        const uint64_t x[4] = {0xFFFFFFFFFFFFFFFEULL, 0x8000000000000001ULL, 0, nTop};
+        for (unsigned char chPrefix = 0x02; chPrefix <= 0x03; chPrefix++)
+        {
+            unsigned char vch[33];
+            vch[0] = chPrefix;
+            for (int i = 0; i < 32; i++)
+                vch[1 + i] = x[3 - i / 8] >> (8 * (7 - i % 8));
+            CPubKey pubkey(vch, vch + sizeof(vch));
+            BOOST_CHECK(pubkey.IsFullyValid());
+
+            uint256 hash;
+            vector<unsigned char> vchSig;
+            BOOST_CHECK(ForgeSignature(pubkey, hash, vchSig));
+            BOOST_CHECK(pubkey.Verify(hash, vchSig, SIGVERIFIER_OPENSSL));
+            BOOST_CHECK(Secp256k1Verify(pubkey.begin(), pubkey.size(), hash.begin(), &vchSig[0], vchSig.size()) == SECP256K1_VALID);
+            hash ^= 1;
+            BOOST_CHECK(!pubkey.Verify(hash, vchSig, SIGVERIFIER_OPENSSL));
+            BOOST_CHECK(Secp256k1Verify(pubkey.begin(), pubkey.size(), hash.begin(), &vchSig[0], vchSig.size()) == SECP256K1_INVALID);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(key_verifier_batch)
+{
+    if (!Secp256k1Available())
+        return;
+
+    // some keys signing several times, like inputs spending from one address
+    vector<CPubKey> vPubKeys;
+    vector<uint256> vHashes;
+    vector<vector<unsigned char> > vSigs;
+    CKey key;
+    for (int i = 0; i < 40; i++)
+    {
+        if (i % 3 == 0 || i > 30)
+            key.MakeNewKey(i % 2 == 0);
+        vPubKeys.push_back(key.GetPubKey());
+        vHashes.push_back(GetRandHash());
+        vSigs.push_back(vector<unsigned char>());
+        BOOST_CHECK(key.Sign(vHashes.back(), vSigs.back()));
+    }
+
+    CSecp256k1Batch batch;
+    BOOST_CHECK(batch.Verify());
+    for (unsigned int i = 0; i < vSigs.size(); i++)
+        BOOST_CHECK(batch.Add(vPubKeys[i].begin(), vPubKeys[i].size(), vHashes[i].begin(), &vSigs[i][0], vSigs[i].size()));
+    BOOST_CHECK_EQUAL(batch.Size(), vSigs.size());
+    BOOST_CHECK(batch.Verify());
+    BOOST_CHECK_EQUAL(batch.Size(), 0U);
+
+    // any one bad signature fails the batch
+    for (unsigned int nBad = 0; nBad < vSigs.size(); nBad += 7)
+    {
+        for (unsigned int i = 0; i < vSigs.size(); i++)
+        {
+            uint256 hash = vHashes[i];
+            if (i == nBad)
+                hash ^= 1;
+            BOOST_CHECK(batch.Add(vPubKeys[i].begin(), vPubKeys[i].size(), hash.begin(), &vSigs[i][0], vSigs[i].size()));
+        }
+        BOOST_CHECK(!batch.Verify());
+    }
+
+    // encodings left to OpenSSL aren't taken
+    vector<unsigned char> vchPadded(vSigs[0]);
+    vchPadded.push_back(0);
+    BOOST_CHECK(!batch.Add(vPubKeys[0].begin(), vPubKeys[0].size(), vHashes[0].begin(), &vchPadded[0], vchPadded.size()));
+    BOOST_CHECK_EQUAL(batch.Size(), 0U);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
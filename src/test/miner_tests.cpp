@@ -2,6 +2,7 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "hash.h"
 #include "main.h"
 #include "miner.h"
 #include "uint256.h"
@@ -46,6 +47,209 @@ struct {
     {2, 0xbbbeb305}, {2, 0xfe1c810a},
 };
 
+BOOST_AUTO_TEST_CASE(header_midstate)
+{
+    CBlockHeader header;
+    header.nVersion = 2;
+    header.hashPrevBlock = uint256("0x9a4c4ebb554be537d63ddfc7a10acc11759a8363fb73090de82c6a34e33e92d7");
+    header.hashMerkleRoot = uint256("0x3141c7c1b3b595f4735abf08623bfbced351e722f4ca48c95b19c670a164bf0e");
+    header.nTime = 1402000000;
+    header.nDifficulty = ((uint64_t) 20) << 48;
+
+    CMidstateHash midstate((const unsigned char*)BEGIN(header.nVersion), (const unsigned char*)BEGIN(header.nNonce));
+    for (unsigned int nNonce = 0; nNonce < 1000; nNonce += 7)
+    {
+        header.nNonce = nNonce;
+        BOOST_CHECK(midstate.GetHash((const unsigned char*)BEGIN(nNonce), (const unsigned char*)END(nNonce)) == header.GetHash());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(mempool_entry_cache)
+{
+    CTransaction tx;
+    tx.vin.resize(2);
+    tx.vin[0].scriptSig = CScript() << OP_1;
+    tx.vin[1].scriptSig = CScript() << OP_1;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = COIN;
+    tx.vout[0].scriptPubKey = CScript() << OP_1 << OP_CHECKSIG;
+
+    // 2 COIN of the inputs are in the chain, the rest in the mempool
+    CTxMemPoolEntry entry(tx, 10000, GetTime(), 50.0, 100, 2 * COIN, 3);
+    unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    BOOST_CHECK_EQUAL(entry.GetTxSize(), nTxSize);
+    BOOST_CHECK_EQUAL(entry.GetSigOpCount(), 4U);
+    BOOST_CHECK_CLOSE(entry.GetFeePerKb(), 10000 * 1000.0 / nTxSize, 1e-9);
+
+    // only the inputs in the chain gain priority
+    BOOST_CHECK_EQUAL(entry.GetPriority(100), 50.0);
+    BOOST_CHECK_CLOSE(entry.GetPriority(110), 50.0 + tx.ComputePriority(10.0 * 2 * COIN, nTxSize), 1e-9);
+}
+
+BOOST_AUTO_TEST_CASE(mempool_ancestor_state)
+{
+    CTxMemPool pool;
+
+    // a chain of three, each spending the one before
+    std::vector<CTransaction> vtx(3);
+    uint256 hashPrev = GetRandHash();
+    for (unsigned int i = 0; i < vtx.size(); i++)
+    {
+        vtx[i].vin.resize(1);
+        vtx[i].vin[0].prevout = COutPoint(hashPrev, 0);
+        vtx[i].vin[0].scriptSig = CScript() << OP_1;
+        vtx[i].vout.resize(1);
+        vtx[i].vout[0].nValue = COIN;
+        vtx[i].vout[0].scriptPubKey = CScript() << OP_1;
+        hashPrev = vtx[i].GetHash();
+    }
+    unsigned int nTxSize = ::GetSerializeSize(vtx[0], SER_NETWORK, PROTOCOL_VERSION);
+
+    // added out of order, as after a reorganization
+    pool.addUnchecked(vtx[0].GetHash(), CTxMemPoolEntry(vtx[0], 1000, GetTime(), 0.0, 1));
+    pool.addUnchecked(vtx[2].GetHash(), CTxMemPoolEntry(vtx[2], 5000, GetTime(), 0.0, 1));
+    pool.addUnchecked(vtx[1].GetHash(), CTxMemPoolEntry(vtx[1], 3000, GetTime(), 0.0, 1));
+
+    const CTxMemPoolEntry& entry = pool.mapTx[vtx[2].GetHash()];
+    BOOST_CHECK_EQUAL(entry.GetCountWithAncestors(), 3U);
+    BOOST_CHECK_EQUAL(entry.GetSizeWithAncestors(), 3U * nTxSize);
+    BOOST_CHECK_EQUAL(entry.GetFeesWithAncestors(), 9000);
+    BOOST_CHECK_EQUAL(pool.mapTx[vtx[1].GetHash()].GetParents().size(), 1U);
+    BOOST_CHECK_EQUAL(pool.mapTx[vtx[1].GetHash()].GetChildren().size(), 1U);
+
+    // best package first: the child with its parents beats the parent alone
+    BOOST_CHECK_EQUAL(pool.setAncestorFeeRate.size(), 3U);
+    BOOST_CHECK(pool.setAncestorFeeRate.rbegin()->second == vtx[2].GetHash());
+    BOOST_CHECK(pool.setAncestorFeeRate.begin()->second == vtx[0].GetHash());
+
+    // ... and the other way round for eviction
+    const CTxMemPoolEntry& first = pool.mapTx[vtx[0].GetHash()];
+    BOOST_CHECK_EQUAL(first.GetCountWithDescendants(), 3U);
+    BOOST_CHECK_EQUAL(first.GetSizeWithDescendants(), 3U * nTxSize);
+    BOOST_CHECK_EQUAL(first.GetFeesWithDescendants(), 9000);
+    BOOST_CHECK_EQUAL(pool.setDescendantScore.size(), 3U);
+    BOOST_CHECK(pool.setDescendantScore.rbegin()->second == vtx[2].GetHash());
+    BOOST_CHECK(pool.setDescendantScore.begin()->second == vtx[0].GetHash());
+
+    // the first one is mined: the rest no longer counts it
+    std::list<CTransaction> removed;
+    pool.remove(vtx[0], removed);
+    BOOST_CHECK_EQUAL(entry.GetCountWithAncestors(), 2U);
+    BOOST_CHECK_EQUAL(entry.GetFeesWithAncestors(), 8000);
+    BOOST_CHECK(pool.mapTx[vtx[1].GetHash()].GetParents().empty());
+    BOOST_CHECK_EQUAL(pool.setAncestorFeeRate.size(), 2U);
+
+    pool.remove(vtx[1], removed, true);
+    BOOST_CHECK(pool.mapTx.empty());
+    BOOST_CHECK(pool.setAncestorFeeRate.empty());
+    BOOST_CHECK(pool.setDescendantScore.empty());
+    BOOST_CHECK_EQUAL(pool.DynamicMemoryUsage(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(mempool_package_limits)
+{
+    CTxMemPool pool;
+    std::string strError;
+
+    // a chain of 26, each spending the first output of the one before
+    std::vector<CTransaction> vtx(26);
+    uint256 hashPrev = GetRandHash();
+    for (unsigned int i = 0; i < vtx.size(); i++)
+    {
+        vtx[i].vin.resize(1);
+        vtx[i].vin[0].prevout = COutPoint(hashPrev, 0);
+        vtx[i].vin[0].scriptSig = CScript() << OP_1;
+        vtx[i].vout.resize(2);
+        vtx[i].vout[0].nValue = COIN;
+        vtx[i].vout[0].scriptPubKey = CScript() << OP_1;
+        vtx[i].vout[1].nValue = COIN;
+        vtx[i].vout[1].scriptPubKey = CScript() << OP_1;
+        hashPrev = vtx[i].GetHash();
+    }
+    unsigned int nTxSize = ::GetSerializeSize(vtx[0], SER_NETWORK, PROTOCOL_VERSION);
+    for (unsigned int i = 0; i < 24; i++)
+        pool.addUnchecked(vtx[i].GetHash(), CTxMemPoolEntry(vtx[i], 1000, GetTime(), 0.0, 1));
+
+    // the 25th still fits, the 26th doesn't
+    BOOST_CHECK(pool.CheckPackageLimits(vtx[24], nTxSize, 25, 101000, 25, 101000, strError));
+    pool.addUnchecked(vtx[24].GetHash(), CTxMemPoolEntry(vtx[24], 1000, GetTime(), 0.0, 1));
+    BOOST_CHECK(!pool.CheckPackageLimits(vtx[25], nTxSize, 25, 101000, 25, 101000, strError));
+    BOOST_CHECK(pool.CheckPackageLimits(vtx[25], nTxSize, 26, 26 * nTxSize, 26, 26 * nTxSize, strError));
+
+    // each limit on its own
+    BOOST_CHECK(!pool.CheckPackageLimits(vtx[25], nTxSize, 100, 26 * nTxSize - 1, 100, 101000, strError));
+    BOOST_CHECK(!pool.CheckPackageLimits(vtx[25], nTxSize, 100, 101000, 25, 101000, strError));
+    BOOST_CHECK(!pool.CheckPackageLimits(vtx[25], nTxSize, 100, 101000, 100, 26 * nTxSize - 1, strError));
+
+    // a second child of the first has one ancestor, but that one has too
+    // many descendants already
+    CTransaction txSibling(vtx[1]);
+    txSibling.vin[0].prevout = COutPoint(vtx[0].GetHash(), 1);
+    BOOST_CHECK(pool.CheckPackageLimits(txSibling, nTxSize, 2, 2 * nTxSize, 26, 101000, strError));
+    BOOST_CHECK(!pool.CheckPackageLimits(txSibling, nTxSize, 2, 2 * nTxSize, 25, 101000, strError));
+
+    // spending nothing in the pool is always fine
+    BOOST_CHECK(pool.CheckPackageLimits(CTransaction(), nTxSize, 1, nTxSize, 1, nTxSize, strError));
+}
+
+BOOST_AUTO_TEST_CASE(mempool_size_limit)
+{
+    CTxMemPool pool;
+
+    // three unrelated transactions of the same size, and a child paying
+    // for the cheapest one
+    std::vector<CTransaction> vtx(4);
+    int64_t nFees[] = { 1000, 5000, 3000, 20000 };
+    for (unsigned int i = 0; i < vtx.size(); i++)
+    {
+        vtx[i].vin.resize(1);
+        vtx[i].vin[0].prevout = COutPoint(i == 3 ? vtx[0].GetHash() : GetRandHash(), 0);
+        vtx[i].vin[0].scriptSig = CScript() << OP_1;
+        vtx[i].vout.resize(1);
+        vtx[i].vout[0].nValue = COIN;
+        vtx[i].vout[0].scriptPubKey = CScript() << OP_1;
+    }
+    unsigned int nTxSize = ::GetSerializeSize(vtx[0], SER_NETWORK, PROTOCOL_VERSION);
+
+    size_t nUsage = 0;
+    for (unsigned int i = 0; i < vtx.size(); i++)
+    {
+        CTxMemPoolEntry entry(vtx[i], nFees[i], GetTime(), 0.0, 1);
+        BOOST_CHECK(entry.DynamicMemoryUsage() > nTxSize);
+        nUsage += entry.DynamicMemoryUsage();
+        pool.addUnchecked(vtx[i].GetHash(), entry);
+    }
+    BOOST_CHECK_EQUAL(pool.DynamicMemoryUsage(), nUsage);
+    BOOST_CHECK_EQUAL(pool.GetMinFeePerKb(), 0.0);
+
+    // one byte too many: the lowest paying package goes, not the cheapest
+    // transaction, whose child pays for it
+    pool.SetSizeLimit(nUsage - 1);
+    BOOST_CHECK_EQUAL(pool.size(), 3U);
+    BOOST_CHECK(!pool.exists(vtx[2].GetHash()));
+    BOOST_CHECK(pool.exists(vtx[0].GetHash()));
+    BOOST_CHECK(pool.DynamicMemoryUsage() < nUsage);
+
+    // it now takes more than the evicted fee rate to get in
+    double dMinFeePerKb = 3000 * 1000.0 / nTxSize + CTransaction::nMinRelayTxFee;
+    BOOST_CHECK_CLOSE(pool.GetMinFeePerKb(), dMinFeePerKb, 1e-9);
+
+    // which only decays once a block was found
+    SetMockTime(GetTime() + MEMPOOL_ROLLING_FEE_HALFLIFE);
+    BOOST_CHECK_CLOSE(pool.GetMinFeePerKb(), dMinFeePerKb, 1e-9);
+    std::list<CTransaction> conflicts;
+    pool.removeForBlock(std::vector<CTransaction>(), conflicts);
+    SetMockTime(GetTime() + MEMPOOL_ROLLING_FEE_HALFLIFE);
+    BOOST_CHECK(pool.GetMinFeePerKb() < dMinFeePerKb);
+    SetMockTime(GetTime() + 100 * MEMPOOL_ROLLING_FEE_HALFLIFE);
+    BOOST_CHECK_EQUAL(pool.GetMinFeePerKb(), 0.0);
+    SetMockTime(0);
+
+    // a pool over its limit evicts what it was just given
+    pool.addUnchecked(vtx[2].GetHash(), CTxMemPoolEntry(vtx[2], nFees[2], GetTime(), 0.0, 1));
+    BOOST_CHECK(!pool.exists(vtx[2].GetHash()));
+}
+
 // NOTE: These tests rely on CreateNewBlock doing its own self-validation!
 BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
 {
@@ -99,7 +303,7 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     {
         tx.vout[0].nValue -= 1000000;
         hash = tx.GetHash();
-        mempool.addUnchecked(hash, CTxMemPoolEntry(tx, 11, GetTime(), 111.0, 11));
+        mempool.addUnchecked(hash, CTxMemPoolEntry(tx, 1000000, GetTime(), 111.0, 11));
         tx.vin[0].prevout.hash = hash;
     }
     BOOST_CHECK(pblocktemplate = CreateNewBlock(scriptPubKey));
@@ -119,7 +323,7 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     {
         tx.vout[0].nValue -= 10000000;
         hash = tx.GetHash();
-        mempool.addUnchecked(hash, CTxMemPoolEntry(tx, 11, GetTime(), 111.0, 11));
+        mempool.addUnchecked(hash, CTxMemPoolEntry(tx, 10000000, GetTime(), 111.0, 11));
         tx.vin[0].prevout.hash = hash;
     }
     BOOST_CHECK(pblocktemplate = CreateNewBlock(scriptPubKey));
@@ -186,11 +390,80 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     tx.vout[0].nValue = 4900000000LL;
     tx.vout[0].scriptPubKey = CScript() << OP_1;
     hash = tx.GetHash();
-    mempool.addUnchecked(hash, CTxMemPoolEntry(tx, 11, GetTime(), 111.0, 11));
+    mempool.addUnchecked(hash, CTxMemPoolEntry(tx, 11, GetTime(), 111.0, 11, txFirst[0]->vout[0].nValue));
     tx.vout[0].scriptPubKey = CScript() << OP_2;
     hash = tx.GetHash();
-    mempool.addUnchecked(hash, CTxMemPoolEntry(tx, 11, GetTime(), 111.0, 11));
+    mempool.addUnchecked(hash, CTxMemPoolEntry(tx, 11, GetTime(), 111.0, 11, txFirst[0]->vout[0].nValue));
     BOOST_CHECK(pblocktemplate = CreateNewBlock(scriptPubKey));
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 2);
+    delete pblocktemplate;
+    mempool.clear();
+
+    // templates follow the mempool from one call to the next
+    tx.vout[0].scriptPubKey = CScript() << OP_1;
+    hash = tx.GetHash();
+    mempool.addUnchecked(hash, CTxMemPoolEntry(tx, 11, GetTime(), 111.0, 11, txFirst[0]->vout[0].nValue));
+    BOOST_CHECK(pblocktemplate = CreateNewBlock(scriptPubKey));
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 2);
+    delete pblocktemplate;
+    tx2.vin.resize(1);
+    tx2.vin[0].prevout.hash = hash;
+    tx2.vin[0].prevout.n = 0;
+    tx2.vin[0].scriptSig = CScript() << OP_1;
+    tx2.vout.resize(1);
+    tx2.vout[0].nValue = 4800000000LL;
+    tx2.vout[0].scriptPubKey = CScript() << OP_1;
+    mempool.addUnchecked(tx2.GetHash(), CTxMemPoolEntry(tx2, 100000000LL, GetTime(), 111.0, 11));
+    BOOST_CHECK(pblocktemplate = CreateNewBlock(scriptPubKey));
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 3);
+    BOOST_CHECK(pblocktemplate->block.vtx[2].GetHash() == tx2.GetHash());
+    delete pblocktemplate;
+    std::list<CTransaction> removed;
+    mempool.remove(tx, removed, true);
+    BOOST_CHECK_EQUAL(removed.size(), 2);
+    BOOST_CHECK(pblocktemplate = CreateNewBlock(scriptPubKey));
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 1);
+    delete pblocktemplate;
+    mempool.clear();
+
+    // a child pays for its free parent
+    hash = tx.GetHash();
+    mempool.addUnchecked(hash, CTxMemPoolEntry(tx, 0, GetTime(), 0.0, 11));
+    mempool.addUnchecked(tx2.GetHash(), CTxMemPoolEntry(tx2, 100000000LL, GetTime(), 0.0, 11));
+    BOOST_CHECK(pblocktemplate = CreateNewBlock(scriptPubKey));
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 3);
+    BOOST_CHECK(pblocktemplate->block.vtx[1].GetHash() == hash);
+    BOOST_CHECK(pblocktemplate->block.vtx[2].GetHash() == tx2.GetHash());
+    delete pblocktemplate;
+    mempool.clear();
+
+    // a package that failed stays out when more of its ancestors go in:
+    // tx3 spends tx and tx4 and pays best, but isn't final yet
+    CTransaction tx3, tx4;
+    tx4.vin.resize(1);
+    tx4.vin[0].prevout = COutPoint(txFirst[1]->GetHash(), 0);
+    tx4.vin[0].scriptSig = CScript() << OP_1;
+    tx4.vout.resize(1);
+    tx4.vout[0].nValue = 4900000000LL;
+    tx4.vout[0].scriptPubKey = CScript() << OP_1;
+    tx3.vin.resize(2);
+    tx3.vin[0].prevout = COutPoint(hash, 0);
+    tx3.vin[0].scriptSig = CScript() << OP_1;
+    tx3.vin[0].nSequence = 0;
+    tx3.vin[1].prevout = COutPoint(tx4.GetHash(), 0);
+    tx3.vin[1].scriptSig = CScript() << OP_1;
+    tx3.vin[1].nSequence = 0;
+    tx3.vout.resize(1);
+    tx3.vout[0].nValue = 9000000000LL;
+    tx3.vout[0].scriptPubKey = CScript() << OP_1;
+    tx3.nLockTime = chainActive.Tip()->nHeight + 2;
+    mempool.addUnchecked(hash, CTxMemPoolEntry(tx, 1000000LL, GetTime(), 0.0, 11));
+    mempool.addUnchecked(tx4.GetHash(), CTxMemPoolEntry(tx4, 500000LL, GetTime(), 0.0, 11));
+    mempool.addUnchecked(tx3.GetHash(), CTxMemPoolEntry(tx3, 700000000LL, GetTime(), 0.0, 11));
+    BOOST_CHECK(pblocktemplate = CreateNewBlock(scriptPubKey));
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 3);
+    BOOST_CHECK(pblocktemplate->block.vtx[1].GetHash() == hash);
+    BOOST_CHECK(pblocktemplate->block.vtx[2].GetHash() == tx4.GetHash());
     delete pblocktemplate;
     mempool.clear();
 
@@ -215,7 +488,7 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     tx.vout[0].scriptPubKey = CScript() << OP_1;
     tx.nLockTime = chainActive.Tip()->nHeight+1;
     hash = tx.GetHash();
-    mempool.addUnchecked(hash, CTxMemPoolEntry(tx, 11, GetTime(), 111.0, 11));
+    mempool.addUnchecked(hash, CTxMemPoolEntry(tx, 11, GetTime(), 111.0, 11, txFirst[0]->vout[0].nValue));
     BOOST_CHECK(!IsFinalTx(tx, chainActive.Tip()->nHeight + 1));
 
     // time locked
@@ -229,7 +502,7 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     tx2.vout[0].scriptPubKey = CScript() << OP_1;
     tx2.nLockTime = chainActive.Tip()->GetMedianTimePast()+1;
     hash = tx2.GetHash();
-    mempool.addUnchecked(hash, CTxMemPoolEntry(tx2, 11, GetTime(), 111.0, 11));
+    mempool.addUnchecked(hash, CTxMemPoolEntry(tx2, 11, GetTime(), 111.0, 11, txFirst[1]->vout[0].nValue));
     BOOST_CHECK(!IsFinalTx(tx2));
 
     BOOST_CHECK(pblocktemplate = CreateNewBlock(scriptPubKey));
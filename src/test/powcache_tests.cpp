@@ -0,0 +1,70 @@
+// Copyright (c) 2014 The Gapcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainparams.h"
+#include "core.h"
+#include "main.h"
+#include "powcache.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(powcache_tests)
+
+BOOST_AUTO_TEST_CASE(powcache_results)
+{
+    CPoWCache cache;
+    CBlockHeader header = Params().GenesisBlock().GetBlockHeader();
+    uint256 hashProof = GetProofHash(header.GetHash(), header.nShift, header.nAdd, header.nDifficulty);
+
+    CPoWResult result;
+    BOOST_CHECK(!cache.Lookup(hashProof, result));
+
+    result = cache.Get(header);
+    BOOST_CHECK(result.fValid);
+    BOOST_CHECK(!result.fHaveGap);
+    BOOST_CHECK(cache.Lookup(hashProof, result));
+    BOOST_CHECK(result.fValid);
+
+    // the gap is added on request
+    result = cache.Get(header, true);
+    BOOST_CHECK(result.fValid);
+    BOOST_CHECK(result.fHaveGap);
+    BOOST_CHECK(result.nMerit > 0);
+    BOOST_CHECK(result.nGapLen > 0);
+    BOOST_CHECK(!result.vGapStart.empty());
+    BOOST_CHECK(!result.vGapEnd.empty());
+    BOOST_CHECK_EQUAL(cache.size(), 1U);
+
+    // nAdd is not covered by the block hash, but by the proof hash
+    CBlockHeader headerBad = header;
+    headerBad.nAdd[0] ^= 1;
+    BOOST_CHECK(GetProofHash(headerBad.GetHash(), headerBad.nShift, headerBad.nAdd, headerBad.nDifficulty) != hashProof);
+    BOOST_CHECK(!cache.Get(headerBad).fValid);
+    BOOST_CHECK(cache.Get(header).fValid);
+    BOOST_CHECK_EQUAL(cache.size(), 2U);
+
+    // oldest results go first
+    cache.SetMaxSize(1);
+    BOOST_CHECK_EQUAL(cache.size(), 1U);
+    BOOST_CHECK(!cache.Lookup(hashProof, result));
+}
+
+BOOST_AUTO_TEST_CASE(powcache_persist)
+{
+    CPoWCache cache;
+    cache.SetPersist(true);
+
+    CBlockHeader header = Params().GenesisBlock().GetBlockHeader();
+    uint256 hashProof = GetProofHash(header.GetHash(), header.nShift, header.nAdd, header.nDifficulty);
+    BOOST_CHECK(cache.Get(header, true).fValid);
+
+    // read back from the block tree database
+    cache.Clear();
+    CPoWResult result;
+    BOOST_CHECK(cache.Lookup(hashProof, result));
+    BOOST_CHECK(result.fValid);
+    BOOST_CHECK(result.fHaveGap);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -10,6 +10,7 @@
 #include "key.h"
 #include "keystore.h"
 #include "main.h"
+#include "secp256k1.h"
 
 #include <fstream>
 #include <stdint.h>
@@ -460,4 +461,61 @@ BOOST_AUTO_TEST_CASE(script_standard_push)
     }
 }
 
+BOOST_AUTO_TEST_CASE(script_batch_checks)
+{
+    CKey key1, key2;
+    key1.MakeNewKey(true);
+    key2.MakeNewKey(false);
+
+    // The third output is spent with a signature that must fail
+    CTransaction txFrom;
+    txFrom.vout.resize(3);
+    txFrom.vout[0].scriptPubKey << key1.GetPubKey() << OP_CHECKSIG;
+    txFrom.vout[1].scriptPubKey << key2.GetPubKey() << OP_CHECKSIG;
+    txFrom.vout[2].scriptPubKey << key1.GetPubKey() << OP_CHECKSIG << OP_NOT;
+
+    CTransaction txTo;
+    txTo.vin.resize(3);
+    txTo.vout.resize(1);
+    txTo.vout[0].nValue = 1;
+    for (unsigned int i = 0; i < 3; i++)
+    {
+        txTo.vin[i].prevout.hash = txFrom.GetHash();
+        txTo.vin[i].prevout.n = i;
+    }
+    vector<unsigned char> vchSigs[3];
+    for (unsigned int i = 0; i < 3; i++)
+    {
+        uint256 hash = SignatureHash(txFrom.vout[i].scriptPubKey, txTo, i == 2 ? 0 : i, SIGHASH_ALL);
+        BOOST_CHECK((i == 1 ? key2 : key1).Sign(hash, vchSigs[i]));
+        vchSigs[i].push_back((unsigned char)SIGHASH_ALL);
+        txTo.vin[i].scriptSig << vchSigs[i];
+    }
+
+    CCoins coins(txFrom, 0);
+    vector<CScriptCheck> vChecks;
+    for (unsigned int i = 0; i < 3; i++)
+        vChecks.push_back(CScriptCheck(coins, txTo, i, flags | SCRIPT_VERIFY_NOCACHE, 0));
+
+    // Taken on trust the third signature fails the script, so the batch
+    // falls back to checking one by one
+    if (GetSignatureVerifier() == SIGVERIFIER_NATIVE)
+    {
+        CSecp256k1Batch batch;
+        BOOST_CHECK(vChecks[0](batch));
+        BOOST_CHECK(vChecks[1](batch));
+        BOOST_CHECK(!vChecks[2](batch));
+        BOOST_CHECK_EQUAL(batch.Size(), 3U);
+        BOOST_CHECK(!batch.Verify());
+    }
+    BOOST_CHECK(RunChecks(vChecks));
+
+    // A bad signature in a script that needs it to pass
+    txTo.vout[0].nValue = 2;
+    vChecks.resize(2);
+    BOOST_CHECK(!RunChecks(vChecks));
+    vChecks.resize(1);
+    BOOST_CHECK(!RunChecks(vChecks));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
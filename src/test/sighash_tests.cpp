@@ -161,6 +161,32 @@ BOOST_AUTO_TEST_CASE(sighash_test)
     #endif
 }
 
+// Goal: check that CSignatureHasher agrees with SignatureHash for every input
+BOOST_AUTO_TEST_CASE(sighash_hasher)
+{
+    seed_insecure_rand(false);
+
+    for (int i=0; i<2000; i++) {
+        int nHashType = insecure_rand();
+        CTransaction txTo;
+        RandomTransaction(txTo, (nHashType & 0x1f) == SIGHASH_SINGLE);
+        // Sometimes many inputs, so the midstates matter
+        if (i % 10 == 0) {
+            for (int j = 0; j < 40; j++)
+                txTo.vin.push_back(txTo.vin[insecure_rand() % txTo.vin.size()]);
+            if ((nHashType & 0x1f) == SIGHASH_SINGLE)
+                txTo.vout.resize(txTo.vin.size());
+        }
+        CScript scriptCode;
+        RandomScript(scriptCode);
+
+        CSignatureHasher hasher(txTo);
+        for (unsigned int nIn = 0; nIn < txTo.vin.size(); nIn++)
+            BOOST_CHECK(hasher.SignatureHash(scriptCode, nIn, nHashType) == SignatureHash(scriptCode, txTo, nIn, nHashType));
+        BOOST_CHECK(hasher.SignatureHash(scriptCode, 0, SIGHASH_ALL) == SignatureHash(scriptCode, txTo, 0, SIGHASH_ALL));
+    }
+}
+
 // Goal: check that SignatureHash generates correct hash
 BOOST_AUTO_TEST_CASE(sighash_from_data)
 {
@@ -0,0 +1,74 @@
+// Copyright (c) 2014 The Gapcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainparams.h"
+#include "core.h"
+#include "main.h"
+#include "stratum.h"
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(stratum_tests)
+
+static CBlock GetTemplateBlock(unsigned int nTransactions)
+{
+    CBlock block = Params().GenesisBlock();
+    for (unsigned int i = 1; i < nTransactions; i++)
+    {
+        CTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout.hash = block.vtx[i - 1].GetHash();
+        tx.vin[0].prevout.n = 0;
+        tx.vout.resize(1);
+        tx.vout[0].nValue = i * CENT;
+        tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+        block.vtx.push_back(tx);
+    }
+    return block;
+}
+
+BOOST_AUTO_TEST_CASE(stratum_job_merkle_root)
+{
+    for (unsigned int nTransactions = 1; nTransactions <= 6; nTransactions++)
+    {
+        CStratumJob job("1", GetTemplateBlock(nTransactions), 1234);
+        unsigned int nLevels = 0;
+        for (unsigned int n = nTransactions; n > 1; n = (n + 1) / 2)
+            nLevels++;
+        BOOST_CHECK_EQUAL(job.vMerkleBranch.size(), nLevels);
+
+        vector<unsigned char> vExtraNonce(STRATUM_EXTRANONCE_SIZE);
+        for (unsigned int i = 0; i < STRATUM_EXTRANONCE_SIZE; i++)
+            vExtraNonce[i] = 0x11 * (i + 1);
+
+        vector<unsigned char> vAdd(2, 0x42);
+        CBlock block = job.GetBlock(vExtraNonce, job.block.nTime + 1, 77, 25, vAdd);
+
+        // the miner's merkle root is the one of the full block
+        BOOST_CHECK(block.hashMerkleRoot == job.GetMerkleRoot(vExtraNonce));
+        BOOST_CHECK_EQUAL(block.vtx.size(), nTransactions);
+        BOOST_CHECK(block.hashPrevBlock == job.block.hashPrevBlock);
+        BOOST_CHECK_EQUAL(block.nTime, job.block.nTime + 1);
+        BOOST_CHECK_EQUAL(block.nNonce, 77U);
+        BOOST_CHECK_EQUAL(block.nShift, 25);
+        BOOST_CHECK(block.nAdd == vAdd);
+
+        // the coinbase starts with the height, followed by the extranonce
+        const CScript& scriptSig = block.vtx[0].vin[0].scriptSig;
+        CScript scriptExpected = CScript() << 1234 << vExtraNonce;
+        BOOST_CHECK(scriptSig.size() >= scriptExpected.size());
+        BOOST_CHECK(equal(scriptExpected.begin(), scriptExpected.end(), scriptSig.begin()));
+        BOOST_CHECK(block.vtx[0].vout == job.block.vtx[0].vout);
+
+        // every extranonce gives a different merkle root
+        vector<unsigned char> vExtraNonce2(vExtraNonce);
+        vExtraNonce2[STRATUM_EXTRANONCE_SIZE - 1]++;
+        BOOST_CHECK(job.GetMerkleRoot(vExtraNonce2) != job.GetMerkleRoot(vExtraNonce));
+        BOOST_CHECK(job.GetBlock(vExtraNonce2, block.nTime, 77, 25, vAdd).hashMerkleRoot == job.GetMerkleRoot(vExtraNonce2));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
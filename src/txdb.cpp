@@ -6,6 +6,7 @@
 #include "txdb.h"
 
 #include "core.h"
+#include "powcache.h"
 #include "uint256.h"
 
 #include <stdint.h>
@@ -181,6 +182,107 @@ bool CBlockTreeDB::ReadFlag(const std::string &name, bool &fValue) {
     return true;
 }
 
+bool CBlockTreeDB::ReadPoWResult(const uint256 &hashProof, CPoWResult &result) {
+    return Read(make_pair('p', hashProof), result);
+}
+
+bool CBlockTreeDB::WritePoWResult(const uint256 &hashProof, const CPoWResult &result) {
+    return Write(make_pair('p', hashProof), result);
+}
+
+// Key of a -primeindex record. The merit bucket and the height are big
+// endian, so that LevelDB keeps the records sorted by them.
+struct CPrimeIndexKey
+{
+    char chType;
+    unsigned int nBucket;
+    unsigned int nHeight;
+
+    CPrimeIndexKey(unsigned int nBucketIn = 0, unsigned int nHeightIn = 0) :
+        chType('g'), nBucket(nBucketIn), nHeight(nHeightIn) {}
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const {
+        return 9;
+    }
+
+    template<typename Stream> void Serialize(Stream &s, int nType, int nVersion) const {
+        unsigned char vch[9];
+        vch[0] = chType;
+        for (int i = 0; i < 4; i++) {
+            vch[1 + i] = (nBucket >> (24 - 8 * i)) & 0xff;
+            vch[5 + i] = (nHeight >> (24 - 8 * i)) & 0xff;
+        }
+        s.write((const char*)vch, sizeof(vch));
+    }
+
+    template<typename Stream> void Unserialize(Stream &s, int nType, int nVersion) {
+        unsigned char vch[9];
+        s.read((char*)vch, sizeof(vch));
+        chType = vch[0];
+        nBucket = nHeight = 0;
+        for (int i = 0; i < 4; i++) {
+            nBucket = (nBucket << 8) | vch[1 + i];
+            nHeight = (nHeight << 8) | vch[5 + i];
+        }
+    }
+};
+
+bool CBlockTreeDB::WritePrimeRecord(const CPrimeRecord &record) {
+    return Write(CPrimeIndexKey(record.GetMeritBucket(), record.nHeight), record);
+}
+
+bool CBlockTreeDB::ErasePrimeRecord(const CPrimeRecord &record) {
+    return Erase(CPrimeIndexKey(record.GetMeritBucket(), record.nHeight));
+}
+
+// Records from bucket nBucketMax down to nBucketMin, highest height first within
+// a bucket. Stops after nCount records, or with fWholeBuckets at the end of
+// the bucket that reached nCount.
+bool CBlockTreeDB::ReadPrimeRecords(unsigned int nBucketMin, unsigned int nBucketMax, unsigned int nCount, bool fWholeBuckets, std::vector<CPrimeRecord> &vRecords) {
+    leveldb::Iterator *pcursor = NewIterator();
+
+    // Seek behind the last record of nBucketMax
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << CPrimeIndexKey(nBucketMax, 0xffffffff);
+    pcursor->Seek(ssKeySet.str());
+    if (pcursor->Valid())
+        pcursor->Prev();
+    else
+        pcursor->SeekToLast();
+
+    unsigned int nLastBucket = nBucketMax;
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            if (ssKey.size() != 9)
+                break;
+            CPrimeIndexKey key;
+            ssKey >> key;
+            if (key.chType != 'g' || key.nBucket < nBucketMin)
+                break;
+            if (vRecords.size() >= nCount && (!fWholeBuckets || key.nBucket != nLastBucket))
+                break;
+            nLastBucket = key.nBucket;
+
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            CPrimeRecord record;
+            ssValue >> record;
+            vRecords.push_back(record);
+
+            pcursor->Prev();
+        } catch (std::exception &e) {
+            delete pcursor;
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+    }
+    delete pcursor;
+
+    return true;
+}
+
 bool CBlockTreeDB::LoadBlockIndexGuts()
 {
     leveldb::Iterator *pcursor = NewIterator();
@@ -189,6 +291,7 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
     ssKeySet << make_pair('b', uint256(0));
     pcursor->Seek(ssKeySet.str());
     bool slowStart = GetBoolArg("-slowstart", false);
+    std::vector<CBlockIndex*> vSlowStart;
 
     // Load mapBlockIndex
     while (pcursor->Valid()) {
@@ -221,8 +324,8 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
                 pindexNew->nStatus        = diskindex.nStatus;
                 pindexNew->nTx            = diskindex.nTx;
 
-                if (slowStart && !pindexNew->CheckIndex())
-                    return error("LoadBlockIndex() : CheckIndex failed: %s", pindexNew->ToString());
+                if (slowStart)
+                    vSlowStart.push_back(pindexNew);
 
                 pcursor->Next();
             } else {
@@ -234,5 +337,19 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
     }
     delete pcursor;
 
+    // Check the proofs of work in parallel, CheckIndex then finds the bad ones
+    for (unsigned int i = 0; i < vSlowStart.size(); i += MAX_POW_CHECK_BATCH) {
+        boost::this_thread::interruption_point();
+        unsigned int nEnd = std::min((unsigned int)vSlowStart.size(), i + MAX_POW_CHECK_BATCH);
+        std::vector<CPoWCheck> vChecks;
+        for (unsigned int j = i; j < nEnd; j++)
+            vChecks.push_back(CPoWCheck(vSlowStart[j]->GetBlockHash(), vSlowStart[j]->nShift, vSlowStart[j]->nAdd, vSlowStart[j]->nDifficulty));
+        CheckProofOfWorkBatch(vChecks);
+
+        for (unsigned int j = i; j < nEnd; j++)
+            if (!vSlowStart[j]->CheckIndex())
+                return error("LoadBlockIndex() : CheckIndex failed: %s", vSlowStart[j]->ToString());
+    }
+
     return true;
 }
@@ -16,6 +16,7 @@
 
 class CBigNum;
 class CCoins;
+class CPoWResult;
 class uint256;
 
 // -dbcache default (MiB)
@@ -63,6 +64,11 @@ public:
     bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &list);
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
+    bool ReadPoWResult(const uint256 &hashProof, CPoWResult &result);
+    bool WritePoWResult(const uint256 &hashProof, const CPoWResult &result);
+    bool WritePrimeRecord(const CPrimeRecord &record);
+    bool ErasePrimeRecord(const CPrimeRecord &record);
+    bool ReadPrimeRecords(unsigned int nBucketMin, unsigned int nBucketMax, unsigned int nCount, bool fWholeBuckets, std::vector<CPrimeRecord> &vRecords);
     bool LoadBlockIndexGuts();
 };
 
@@ -4,21 +4,58 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "core.h"
+#include "main.h"
 #include "txmempool.h"
 
+#include <math.h>
+
 using namespace std;
 
-CTxMemPoolEntry::CTxMemPoolEntry()
+// Rough heap usage of a pool transaction: its vectors and scripts, its
+// mapTx node, its nodes in the two fee rate indexes and, per input, the
+// mapNextTx node and the parent and child links it may cause. A std::map
+// or std::set node carries three pointers and a colour besides its value.
+static size_t EstimateEntryUsage(const CTransaction& tx)
+{
+    static const size_t nNodeOverhead = 4 * sizeof(void*);
+    size_t nUsage = nNodeOverhead + sizeof(uint256) + sizeof(CTxMemPoolEntry) +
+                    2 * (nNodeOverhead + sizeof(CFeeRateKey));
+    nUsage += tx.vin.capacity() * sizeof(CTxIn) + tx.vout.capacity() * sizeof(CTxOut);
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        nUsage += txin.scriptSig.capacity() + nNodeOverhead + sizeof(COutPoint) + sizeof(CInPoint) +
+                  2 * (nNodeOverhead + sizeof(uint256));
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        nUsage += txout.scriptPubKey.capacity();
+    return nUsage;
+}
+
+CTxMemPoolEntry::CTxMemPoolEntry():
+    nUsageSize(0), nCountWithAncestors(0), nSizeWithAncestors(0), nFeesWithAncestors(0), nSigOpsWithAncestors(0),
+    nCountWithDescendants(0), nSizeWithDescendants(0), nFeesWithDescendants(0)
 {
     nHeight = MEMPOOL_HEIGHT;
 }
 
 CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, int64_t _nFee,
                                  int64_t _nTime, double _dPriority,
-                                 unsigned int _nHeight):
-    tx(_tx), nFee(_nFee), nTime(_nTime), dPriority(_dPriority), nHeight(_nHeight)
+                                 unsigned int _nHeight, int64_t _nInChainValue,
+                                 unsigned int _nP2SHSigOps):
+    tx(_tx), nFee(_nFee), nTime(_nTime), dPriority(_dPriority), nHeight(_nHeight),
+    nInChainValue(_nInChainValue)
 {
     nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    nModSize = tx.CalculateModifiedSize(nTxSize);
+    nSigOps = GetLegacySigOpCount(tx) + _nP2SHSigOps;
+    dFeePerKb = double(nFee) / (double(nTxSize) / 1000.0);
+    nUsageSize = EstimateEntryUsage(tx);
+
+    nCountWithAncestors = 1;
+    nSizeWithAncestors = nTxSize;
+    nFeesWithAncestors = nFee;
+    nSigOpsWithAncestors = nSigOps;
+    nCountWithDescendants = 1;
+    nSizeWithDescendants = nTxSize;
+    nFeesWithDescendants = nFee;
 }
 
 CTxMemPoolEntry::CTxMemPoolEntry(const CTxMemPoolEntry& other)
@@ -29,8 +66,9 @@ CTxMemPoolEntry::CTxMemPoolEntry(const CTxMemPoolEntry& other)
 double
 CTxMemPoolEntry::GetPriority(unsigned int currentHeight) const
 {
-    int64_t nValueIn = tx.GetValueOut()+nFee;
-    double deltaPriority = ((double)(currentHeight-nHeight)*nValueIn)/nTxSize;
+    if (nModSize == 0)
+        return dPriority;
+    double deltaPriority = ((double)(currentHeight-nHeight)*nInChainValue)/nModSize;
     double dResult = dPriority + deltaPriority;
     return dResult;
 }
@@ -41,6 +79,18 @@ CTxMemPool::CTxMemPool()
     // accepting transactions becomes O(N^2) where N is the number
     // of transactions in the pool
     fSanityCheck = false;
+    nTotalUsage = 0;
+    nSizeLimit = 0;
+    dRollingMinFeePerKb = 0;
+    nLastRollingFeeUpdate = 0;
+    fBlockSinceLastRollingFeeBump = false;
+}
+
+void CTxMemPool::SetSizeLimit(size_t nSizeLimitIn)
+{
+    LOCK(cs);
+    nSizeLimit = nSizeLimitIn;
+    TrimToSize();
 }
 
 void CTxMemPool::pruneSpent(const uint256 &hashTx, CCoins &coins)
@@ -69,6 +119,125 @@ void CTxMemPool::AddTransactionsUpdated(unsigned int n)
 }
 
 
+void CTxMemPool::CalculateAncestors(const uint256& hash, std::set<uint256>& setAncestors) const
+{
+    std::vector<uint256> vQueue(1, hash);
+    while (!vQueue.empty())
+    {
+        std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.find(vQueue.back());
+        vQueue.pop_back();
+        if (it == mapTx.end())
+            continue;
+        BOOST_FOREACH(const uint256& hashParent, it->second.setParents)
+            if (setAncestors.insert(hashParent).second)
+                vQueue.push_back(hashParent);
+    }
+}
+
+void CTxMemPool::CalculateDescendants(const uint256& hash, std::set<uint256>& setDescendants) const
+{
+    std::vector<uint256> vQueue(1, hash);
+    while (!vQueue.empty())
+    {
+        std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.find(vQueue.back());
+        vQueue.pop_back();
+        if (it == mapTx.end())
+            continue;
+        BOOST_FOREACH(const uint256& hashChild, it->second.setChildren)
+            if (setDescendants.insert(hashChild).second)
+                vQueue.push_back(hashChild);
+    }
+}
+
+bool CTxMemPool::CheckPackageLimits(const CTransaction& tx, uint64_t nTxSize, uint64_t nLimitAncestors, uint64_t nLimitAncestorSize,
+                                    uint64_t nLimitDescendants, uint64_t nLimitDescendantSize, std::string& strError) const
+{
+    LOCK(cs);
+    std::set<uint256> setAncestors;
+    std::vector<uint256> vQueue;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        if (mapTx.count(txin.prevout.hash) && setAncestors.insert(txin.prevout.hash).second)
+            vQueue.push_back(txin.prevout.hash);
+
+    uint64_t nSizeWithAncestors = nTxSize;
+    while (!vQueue.empty())
+    {
+        if (setAncestors.size() + 1 > nLimitAncestors)
+        {
+            strError = strprintf("too many unconfirmed ancestors [limit: %u]", nLimitAncestors);
+            return false;
+        }
+
+        const CTxMemPoolEntry& ancestor = mapTx.find(vQueue.back())->second;
+        vQueue.pop_back();
+        nSizeWithAncestors += ancestor.GetTxSize();
+        if (nSizeWithAncestors > nLimitAncestorSize)
+        {
+            strError = strprintf("exceeds ancestor size limit [limit: %u]", nLimitAncestorSize);
+            return false;
+        }
+        if (ancestor.GetCountWithDescendants() + 1 > nLimitDescendants)
+        {
+            strError = strprintf("too many descendants for tx %s [limit: %u]", ancestor.GetTx().GetHash().ToString(), nLimitDescendants);
+            return false;
+        }
+        if (ancestor.GetSizeWithDescendants() + nTxSize > nLimitDescendantSize)
+        {
+            strError = strprintf("exceeds descendant size limit for tx %s [limit: %u]", ancestor.GetTx().GetHash().ToString(), nLimitDescendantSize);
+            return false;
+        }
+
+        BOOST_FOREACH(const uint256& hashParent, ancestor.setParents)
+            if (setAncestors.insert(hashParent).second)
+                vQueue.push_back(hashParent);
+    }
+    return true;
+}
+
+void CTxMemPool::UpdateAncestorState(const uint256& hash)
+{
+    CTxMemPoolEntry& entry = mapTx[hash];
+    setAncestorFeeRate.erase(CFeeRateKey(entry.GetAncestorFeePerKb(), hash));
+
+    std::set<uint256> setAncestors;
+    CalculateAncestors(hash, setAncestors);
+    entry.nCountWithAncestors = 1;
+    entry.nSizeWithAncestors = entry.nTxSize;
+    entry.nFeesWithAncestors = entry.nFee;
+    entry.nSigOpsWithAncestors = entry.nSigOps;
+    BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
+    {
+        const CTxMemPoolEntry& ancestor = mapTx[hashAncestor];
+        entry.nCountWithAncestors++;
+        entry.nSizeWithAncestors += ancestor.nTxSize;
+        entry.nFeesWithAncestors += ancestor.nFee;
+        entry.nSigOpsWithAncestors += ancestor.nSigOps;
+    }
+
+    setAncestorFeeRate.insert(CFeeRateKey(entry.GetAncestorFeePerKb(), hash));
+}
+
+void CTxMemPool::UpdateDescendantState(const uint256& hash)
+{
+    CTxMemPoolEntry& entry = mapTx[hash];
+    setDescendantScore.erase(CFeeRateKey(entry.GetDescendantScore(), hash));
+
+    std::set<uint256> setDescendants;
+    CalculateDescendants(hash, setDescendants);
+    entry.nCountWithDescendants = 1;
+    entry.nSizeWithDescendants = entry.nTxSize;
+    entry.nFeesWithDescendants = entry.nFee;
+    BOOST_FOREACH(const uint256& hashDescendant, setDescendants)
+    {
+        const CTxMemPoolEntry& descendant = mapTx[hashDescendant];
+        entry.nCountWithDescendants++;
+        entry.nSizeWithDescendants += descendant.nTxSize;
+        entry.nFeesWithDescendants += descendant.nFee;
+    }
+
+    setDescendantScore.insert(CFeeRateKey(entry.GetDescendantScore(), hash));
+}
+
 bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry)
 {
     // Add to memory pool without checking anything.
@@ -76,11 +245,69 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry)
     // all the appropriate checks.
     LOCK(cs);
     {
-        mapTx[hash] = entry;
-        const CTransaction& tx = mapTx[hash].GetTx();
+        // Already in the pool, with its links and totals
+        if (mapTx.count(hash))
+            return true;
+
+        CTxMemPoolEntry& newentry = mapTx[hash];
+        newentry = entry;
+        newentry.setParents.clear();
+        newentry.setChildren.clear();
+        const CTransaction& tx = newentry.GetTx();
         for (unsigned int i = 0; i < tx.vin.size(); i++)
+        {
             mapNextTx[tx.vin[i].prevout] = CInPoint(&tx, i);
+            std::map<uint256, CTxMemPoolEntry>::iterator it = mapTx.find(tx.vin[i].prevout.hash);
+            if (it != mapTx.end())
+            {
+                newentry.setParents.insert(it->first);
+                it->second.setChildren.insert(hash);
+            }
+        }
+
+        // Transactions of a disconnected block come back below the mempool
+        // transactions that spend them
+        for (unsigned int i = 0; i < tx.vout.size(); i++)
+        {
+            std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
+            if (it == mapNextTx.end())
+                continue;
+            uint256 hashChild = it->second.ptx->GetHash();
+            newentry.setChildren.insert(hashChild);
+            mapTx[hashChild].setParents.insert(hash);
+        }
+
+        UpdateAncestorState(hash);
+        std::set<uint256> setAncestors;
+        CalculateAncestors(hash, setAncestors);
+        if (newentry.setChildren.empty())
+        {
+            // The usual case: the ancestors gain just this transaction
+            setDescendantScore.insert(CFeeRateKey(newentry.GetDescendantScore(), hash));
+            BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
+            {
+                CTxMemPoolEntry& ancestor = mapTx[hashAncestor];
+                setDescendantScore.erase(CFeeRateKey(ancestor.GetDescendantScore(), hashAncestor));
+                ancestor.nCountWithDescendants++;
+                ancestor.nSizeWithDescendants += newentry.nTxSize;
+                ancestor.nFeesWithDescendants += newentry.nFee;
+                setDescendantScore.insert(CFeeRateKey(ancestor.GetDescendantScore(), hashAncestor));
+            }
+        }
+        else
+        {
+            std::set<uint256> setDescendants;
+            CalculateDescendants(hash, setDescendants);
+            BOOST_FOREACH(const uint256& hashDescendant, setDescendants)
+                UpdateAncestorState(hashDescendant);
+            UpdateDescendantState(hash);
+            BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
+                UpdateDescendantState(hashAncestor);
+        }
+        nTotalUsage += newentry.nUsageSize;
         nTransactionsUpdated++;
+
+        TrimToSize();
     }
     return true;
 }
@@ -100,12 +327,60 @@ void CTxMemPool::remove(const CTransaction &tx, std::list<CTransaction>& removed
                 remove(*it->second.ptx, removed, true);
             }
         }
-        if (mapTx.count(hash))
+        std::map<uint256, CTxMemPoolEntry>::iterator it = mapTx.find(hash);
+        if (it != mapTx.end())
         {
+            const CTxMemPoolEntry& entry = it->second;
+            setAncestorFeeRate.erase(CFeeRateKey(entry.GetAncestorFeePerKb(), hash));
+            setDescendantScore.erase(CFeeRateKey(entry.GetDescendantScore(), hash));
+
+            std::set<uint256> setAncestors, setDescendants;
+            CalculateAncestors(hash, setAncestors);
+            CalculateDescendants(hash, setDescendants);
+            BOOST_FOREACH(const uint256& hashParent, entry.setParents)
+                mapTx[hashParent].setChildren.erase(hash);
+            BOOST_FOREACH(const uint256& hashChild, entry.setChildren)
+                mapTx[hashChild].setParents.erase(hash);
+
+            if (!setAncestors.empty() && !setDescendants.empty())
+            {
+                // Taken out of the middle of a chain, which splits the
+                // package; not done by block connection or eviction
+                BOOST_FOREACH(const uint256& hashDescendant, setDescendants)
+                    UpdateAncestorState(hashDescendant);
+                BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
+                    UpdateDescendantState(hashAncestor);
+            }
+            else
+            {
+                // Descendants that stay no longer count it in their package,
+                // nor do ancestors that stay
+                BOOST_FOREACH(const uint256& hashDescendant, setDescendants)
+                {
+                    CTxMemPoolEntry& descendant = mapTx[hashDescendant];
+                    setAncestorFeeRate.erase(CFeeRateKey(descendant.GetAncestorFeePerKb(), hashDescendant));
+                    descendant.nCountWithAncestors--;
+                    descendant.nSizeWithAncestors -= entry.nTxSize;
+                    descendant.nFeesWithAncestors -= entry.nFee;
+                    descendant.nSigOpsWithAncestors -= entry.nSigOps;
+                    setAncestorFeeRate.insert(CFeeRateKey(descendant.GetAncestorFeePerKb(), hashDescendant));
+                }
+                BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
+                {
+                    CTxMemPoolEntry& ancestor = mapTx[hashAncestor];
+                    setDescendantScore.erase(CFeeRateKey(ancestor.GetDescendantScore(), hashAncestor));
+                    ancestor.nCountWithDescendants--;
+                    ancestor.nSizeWithDescendants -= entry.nTxSize;
+                    ancestor.nFeesWithDescendants -= entry.nFee;
+                    setDescendantScore.insert(CFeeRateKey(ancestor.GetDescendantScore(), hashAncestor));
+                }
+            }
+
+            nTotalUsage -= entry.nUsageSize;
             removed.push_front(tx);
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
                 mapNextTx.erase(txin.prevout);
-            mapTx.erase(hash);
+            mapTx.erase(it);
             nTransactionsUpdated++;
         }
     }
@@ -128,11 +403,87 @@ void CTxMemPool::removeConflicts(const CTransaction &tx, std::list<CTransaction>
     }
 }
 
+void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtx, std::list<CTransaction>& conflicts)
+{
+    LOCK(cs);
+    std::list<CTransaction> unused;
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+    {
+        remove(tx, unused);
+        removeConflicts(tx, conflicts);
+    }
+    fBlockSinceLastRollingFeeBump = true;
+}
+
+void CTxMemPool::TrimToSize()
+{
+    if (nSizeLimit == 0)
+        return;
+
+    unsigned int nEvicted = 0;
+    std::list<CTransaction> removed;
+    while (!setDescendantScore.empty() && nTotalUsage > nSizeLimit)
+    {
+        const CTxMemPoolEntry& entry = mapTx[setDescendantScore.begin()->second];
+        CTransaction tx = entry.GetTx();
+
+        // Whatever comes in next must pay more than the package that made
+        // room for it, and the relay fee on top
+        double dRemovedFeePerKb = entry.GetDescendantFeePerKb() + CTransaction::nMinRelayTxFee;
+        if (dRemovedFeePerKb > dRollingMinFeePerKb)
+        {
+            dRollingMinFeePerKb = dRemovedFeePerKb;
+            nLastRollingFeeUpdate = GetTime();
+            fBlockSinceLastRollingFeeBump = false;
+        }
+
+        removed.clear();
+        remove(tx, removed, true);
+        nEvicted += removed.size();
+    }
+    if (nEvicted > 0)
+        LogPrint("mempool", "TrimToSize() : evicted %u transactions, minimum fee rate now %.0f per kB\n",
+                 nEvicted, dRollingMinFeePerKb);
+}
+
+double CTxMemPool::GetMinFeePerKb()
+{
+    LOCK(cs);
+    if (!fBlockSinceLastRollingFeeBump || dRollingMinFeePerKb == 0)
+        return dRollingMinFeePerKb;
+
+    int64_t nNow = GetTime();
+    if (nNow > nLastRollingFeeUpdate + 10)
+    {
+        // Decay faster while the pool is far from full
+        double dHalfLife = MEMPOOL_ROLLING_FEE_HALFLIFE;
+        if (nTotalUsage < nSizeLimit / 4)
+            dHalfLife /= 4;
+        else if (nTotalUsage < nSizeLimit / 2)
+            dHalfLife /= 2;
+
+        dRollingMinFeePerKb /= pow(2.0, (nNow - nLastRollingFeeUpdate) / dHalfLife);
+        nLastRollingFeeUpdate = nNow;
+        if (dRollingMinFeePerKb < CTransaction::nMinRelayTxFee / 2)
+            dRollingMinFeePerKb = 0;
+    }
+    return dRollingMinFeePerKb;
+}
+
+size_t CTxMemPool::DynamicMemoryUsage() const
+{
+    LOCK(cs);
+    return nTotalUsage;
+}
+
 void CTxMemPool::clear()
 {
     LOCK(cs);
     mapTx.clear();
     mapNextTx.clear();
+    setAncestorFeeRate.clear();
+    setDescendantScore.clear();
+    nTotalUsage = 0;
     ++nTransactionsUpdated;
 }
 
@@ -144,6 +495,7 @@ void CTxMemPool::check(CCoinsViewCache *pcoins) const
     LogPrint("mempool", "Checking mempool with %u transactions and %u inputs\n", (unsigned int)mapTx.size(), (unsigned int)mapNextTx.size());
 
     LOCK(cs);
+    size_t nCheckUsage = 0;
     for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
         unsigned int i = 0;
         const CTransaction& tx = it->second.GetTx();
@@ -164,7 +516,33 @@ void CTxMemPool::check(CCoinsViewCache *pcoins) const
             assert(it3->second.n == i);
             i++;
         }
+
+        // Check the links and the package totals
+        BOOST_FOREACH(const uint256& hashParent, it->second.setParents)
+            assert(mapTx.find(hashParent)->second.setChildren.count(it->first));
+        BOOST_FOREACH(const uint256& hashChild, it->second.setChildren)
+            assert(mapTx.find(hashChild)->second.setParents.count(it->first));
+        std::set<uint256> setAncestors;
+        CalculateAncestors(it->first, setAncestors);
+        uint64_t nSizeWithAncestors = it->second.nTxSize;
+        BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
+            nSizeWithAncestors += mapTx.find(hashAncestor)->second.nTxSize;
+        assert(it->second.nCountWithAncestors == setAncestors.size() + 1);
+        assert(it->second.nSizeWithAncestors == nSizeWithAncestors);
+        assert(setAncestorFeeRate.count(CFeeRateKey(it->second.GetAncestorFeePerKb(), it->first)));
+        std::set<uint256> setDescendants;
+        CalculateDescendants(it->first, setDescendants);
+        uint64_t nSizeWithDescendants = it->second.nTxSize;
+        BOOST_FOREACH(const uint256& hashDescendant, setDescendants)
+            nSizeWithDescendants += mapTx.find(hashDescendant)->second.nTxSize;
+        assert(it->second.nCountWithDescendants == setDescendants.size() + 1);
+        assert(it->second.nSizeWithDescendants == nSizeWithDescendants);
+        assert(setDescendantScore.count(CFeeRateKey(it->second.GetDescendantScore(), it->first)));
+        nCheckUsage += it->second.nUsageSize;
     }
+    assert(setAncestorFeeRate.size() == mapTx.size());
+    assert(setDescendantScore.size() == mapTx.size());
+    assert(nCheckUsage == nTotalUsage);
     for (std::map<COutPoint, CInPoint>::const_iterator it = mapNextTx.begin(); it != mapNextTx.end(); it++) {
         uint256 hash = it->second.ptx->GetHash();
         map<uint256, CTxMemPoolEntry>::const_iterator it2 = mapTx.find(hash);
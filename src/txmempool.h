@@ -6,6 +6,7 @@
 #define GAPCOIN_TXMEMPOOL_H
 
 #include <list>
+#include <set>
 
 #include "coins.h"
 #include "core.h"
@@ -13,6 +14,18 @@
 
 /** Fake height value used in CCoins to signify they are only in the memory pool (since 0.8) */
 static const unsigned int MEMPOOL_HEIGHT = 0x7FFFFFFF;
+/** Default for -maxmempool, the memory budget of the pool in megabytes */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Half-life of the minimum fee rate raised by evictions, in seconds */
+static const int64_t MEMPOOL_ROLLING_FEE_HALFLIFE = 60 * 60 * 12;
+/** Default for -limitancestorcount, the most transactions in a package with all its mempool ancestors */
+static const unsigned int DEFAULT_ANCESTOR_LIMIT = 25;
+/** Default for -limitancestorsize, the largest such package in kilobytes */
+static const unsigned int DEFAULT_ANCESTOR_SIZE_LIMIT = 101;
+/** Default for -limitdescendantcount, the most transactions in a package with all its mempool descendants */
+static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
+/** Default for -limitdescendantsize, the largest such package in kilobytes */
+static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
 
 /*
  * CTxMemPool stores these:
@@ -26,21 +39,64 @@ private:
     int64_t nTime; // Local time when entering the mempool
     double dPriority; // Priority when entering the mempool
     unsigned int nHeight; // Chain height when entering the mempool
+    int64_t nInChainValue; // Value of the inputs in the chain, which gain priority with every block
+    unsigned int nModSize; // Size for the priority, see CTransaction::CalculateModifiedSize
+    unsigned int nSigOps; // Legacy and pay-to-script-hash sigops
+    double dFeePerKb; // Fee per 1000 bytes, not rounded up like GetMinFee
+
+    size_t nUsageSize; // Estimated heap usage of the entry in the pool
+
+    // Links to the other mempool transactions this one spends from and is
+    // spent by, and the totals of its package with all its mempool ancestors
+    // and with all its mempool descendants. Kept up to date by CTxMemPool.
+    std::set<uint256> setParents;
+    std::set<uint256> setChildren;
+    uint64_t nCountWithAncestors;
+    uint64_t nSizeWithAncestors;
+    int64_t nFeesWithAncestors;
+    unsigned int nSigOpsWithAncestors;
+    uint64_t nCountWithDescendants;
+    uint64_t nSizeWithDescendants;
+    int64_t nFeesWithDescendants;
+
+    friend class CTxMemPool;
 
 public:
     CTxMemPoolEntry(const CTransaction& _tx, int64_t _nFee,
-                    int64_t _nTime, double _dPriority, unsigned int _nHeight);
+                    int64_t _nTime, double _dPriority, unsigned int _nHeight,
+                    int64_t _nInChainValue = 0, unsigned int _nP2SHSigOps = 0);
     CTxMemPoolEntry();
     CTxMemPoolEntry(const CTxMemPoolEntry& other);
 
     const CTransaction& GetTx() const { return this->tx; }
     double GetPriority(unsigned int currentHeight) const;
     int64_t GetFee() const { return nFee; }
+    double GetFeePerKb() const { return dFeePerKb; }
+    unsigned int GetSigOpCount() const { return nSigOps; }
     size_t GetTxSize() const { return nTxSize; }
     int64_t GetTime() const { return nTime; }
     unsigned int GetHeight() const { return nHeight; }
+    size_t DynamicMemoryUsage() const { return nUsageSize; }
+
+    const std::set<uint256>& GetParents() const { return setParents; }
+    const std::set<uint256>& GetChildren() const { return setChildren; }
+    uint64_t GetCountWithAncestors() const { return nCountWithAncestors; }
+    uint64_t GetSizeWithAncestors() const { return nSizeWithAncestors; }
+    int64_t GetFeesWithAncestors() const { return nFeesWithAncestors; }
+    unsigned int GetSigOpsWithAncestors() const { return nSigOpsWithAncestors; }
+    double GetAncestorFeePerKb() const { return double(nFeesWithAncestors) / (double(nSizeWithAncestors) / 1000.0); }
+    uint64_t GetCountWithDescendants() const { return nCountWithDescendants; }
+    uint64_t GetSizeWithDescendants() const { return nSizeWithDescendants; }
+    int64_t GetFeesWithDescendants() const { return nFeesWithDescendants; }
+    double GetDescendantFeePerKb() const { return double(nFeesWithDescendants) / (double(nSizeWithDescendants) / 1000.0); }
+    // Eviction order: a transaction paying well is kept for its own sake,
+    // one paying little is kept if its descendants pay for it
+    double GetDescendantScore() const { return std::max(dFeePerKb, GetDescendantFeePerKb()); }
 };
 
+/** Key of CTxMemPool::setAncestorFeeRate and setDescendantScore */
+typedef std::pair<double, uint256> CFeeRateKey;
+
 /*
  * CTxMemPool stores valid-according-to-the-current-best-chain
  * transactions that may be included in the next block.
@@ -56,11 +112,34 @@ class CTxMemPool
 private:
     bool fSanityCheck; // Normally false, true if -checkmempool or -regtest
     unsigned int nTransactionsUpdated;
+    size_t nTotalUsage; // Sum of DynamicMemoryUsage() of all entries
+    size_t nSizeLimit; // -maxmempool in bytes, 0 for no limit
+
+    // Fee rate per kB below which transactions are not worth the memory they
+    // would take, raised by evictions and halving every
+    // MEMPOOL_ROLLING_FEE_HALFLIFE once a block was connected since
+    double dRollingMinFeePerKb;
+    int64_t nLastRollingFeeUpdate;
+    bool fBlockSinceLastRollingFeeBump;
+
+    // Recompute the ancestor totals of hash and move it in setAncestorFeeRate
+    void UpdateAncestorState(const uint256& hash);
+    // Recompute the descendant totals of hash and move it in setDescendantScore
+    void UpdateDescendantState(const uint256& hash);
+    // Evict the lowest scoring packages until the pool fits in nSizeLimit
+    void TrimToSize();
 
 public:
     mutable CCriticalSection cs;
     std::map<uint256, CTxMemPoolEntry> mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
+    // Transactions by the fee rate of their package with all their mempool
+    // ancestors, lowest first; block assembly takes them best first, so a
+    // child can pay for its parents
+    std::set<CFeeRateKey> setAncestorFeeRate;
+    // Transactions by GetDescendantScore(), lowest first; eviction removes
+    // the lowest one together with its descendants
+    std::set<CFeeRateKey> setDescendantScore;
 
     CTxMemPool();
 
@@ -72,15 +151,45 @@ public:
      */
     void check(CCoinsViewCache *pcoins) const;
     void setSanityCheck(bool _fSanityCheck) { fSanityCheck = _fSanityCheck; }
+    /** Limit the pool to nSizeLimitIn bytes of DynamicMemoryUsage(), 0 for no limit */
+    void SetSizeLimit(size_t nSizeLimitIn);
 
+    /**
+     * Add to the pool, then evict the lowest scoring packages while the pool
+     * is over its size limit; this may evict the new transaction again.
+     */
     bool addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry);
     void remove(const CTransaction &tx, std::list<CTransaction>& removed, bool fRecursive = false);
     void removeConflicts(const CTransaction &tx, std::list<CTransaction>& removed);
+    /** Remove the transactions of a connected block and their conflicts */
+    void removeForBlock(const std::vector<CTransaction>& vtx, std::list<CTransaction>& conflicts);
     void clear();
     void queryHashes(std::vector<uint256>& vtxid);
+    /** The mempool ancestors of the mempool transaction hash, not including itself */
+    void CalculateAncestors(const uint256& hash, std::set<uint256>& setAncestors) const;
+    /** The mempool descendants of the mempool transaction hash, not including itself */
+    void CalculateDescendants(const uint256& hash, std::set<uint256>& setDescendants) const;
+    /**
+     * Whether tx, of nTxSize bytes, would stay within the package limits:
+     * with its mempool ancestors at most nLimitAncestors transactions and
+     * nLimitAncestorSize bytes, and no ancestor getting more than
+     * nLimitDescendants transactions or nLimitDescendantSize bytes with its
+     * descendants. As adding and removing transactions walks their
+     * packages, these limits bound that work. Stops at the first limit
+     * hit, so long chains cost no more than short ones to turn away.
+     */
+    bool CheckPackageLimits(const CTransaction& tx, uint64_t nTxSize, uint64_t nLimitAncestors, uint64_t nLimitAncestorSize,
+                            uint64_t nLimitDescendants, uint64_t nLimitDescendantSize, std::string& strError) const;
     void pruneSpent(const uint256& hash, CCoins &coins);
     unsigned int GetTransactionsUpdated() const;
     void AddTransactionsUpdated(unsigned int n);
+    /** Estimated heap usage of the pool in bytes */
+    size_t DynamicMemoryUsage() const;
+    /**
+     * Fee per kB a transaction must pay to get into the pool, 0 unless
+     * evictions raised it recently.
+     */
+    double GetMinFeePerKb();
 
     unsigned long size()
     {